@@ -0,0 +1,117 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "drr.h"
+
+#define CLIENT_TABLE_SIZE 256
+
+/**
+ * Per-client and proxy-wide limits, 0 disables a limit.
+ * rate and burst: token bucket of requests per second a client may start.
+ * max_requests: requests one client may have in progress at once.
+ * max_fetches: origin fetches in progress at once, shared fairly between clients.
+ * bandwidth: bytes per second for streamed responses, shared fairly between clients.
+ */
+typedef struct {
+    double rate;
+    double burst;
+    int max_requests;
+    int max_fetches;
+    long bandwidth;
+} admission_config_t;
+
+/**
+ * Outcome of admit_request.
+ */
+typedef enum {
+    ADMIT_OK,
+    ADMIT_RATE_LIMITED,
+    ADMIT_TOO_MANY_REQUESTS,
+} admission_result_t;
+
+/**
+ * One client address with its token bucket, its requests in progress and its flows in
+ * the fetch and send schedulers. A slot is only reused once its requests have finished.
+ */
+typedef struct {
+    int valid;
+    char address[INET6_ADDRSTRLEN];
+    double tokens;
+    long long refilled_ms;
+    long long last_seen_ms;
+    int active;        // Admitted requests not finished yet
+    drr_flow_t fetches; // Connections waiting for an origin fetch slot
+    drr_flow_t sends;   // Connections waiting for send bandwidth
+} client_t;
+
+/**
+ * Fixed-size table of the clients seen recently.
+ */
+typedef struct {
+    client_t entries[CLIENT_TABLE_SIZE];
+} client_table_t;
+
+/**
+ * Counts of admission decisions since startup.
+ */
+typedef struct {
+    long admitted;
+    long rate_limited;
+    long too_many_requests;
+    long untracked;      // Admitted without limits because the client table was full
+    long fetches_queued; // Fetches that had to wait for a slot
+    long sends_deferred; // Times a streamed response waited for send bandwidth
+} admission_stats_t;
+
+/**
+ * Parses "rate=20,burst=40,requests=8,fetches=32,bandwidth=10", bandwidth in megabytes
+ * per second, fractions allowed. Limits not listed stay disabled; burst defaults to rate.
+ * @param spec The option value.
+ * @param config Limits to fill in.
+ * @return 0 on success, -1 on a malformed spec.
+ */
+int parse_admission(const char *spec, admission_config_t *config);
+
+/**
+ * Checks whether any limit is set, without one the proxy does not track clients.
+ * @param config The limits.
+ * @return 1 if a limit is set, 0 otherwise.
+ */
+int admission_enabled(const admission_config_t *config);
+
+/**
+ * Clears the client table.
+ * @param clients Pointer to the table.
+ */
+void init_client_table(client_table_t *clients);
+
+/**
+ * Finds the client with this address, taking the least recently seen idle slot for a new one.
+ * @param clients Pointer to the table.
+ * @param address Client address as text.
+ * @param config The limits, a new client starts with a full bucket.
+ * @param now_ms Current time from current_time_ms.
+ * @return The client, or NULL if every slot has requests in progress.
+ */
+client_t *find_client(client_table_t *clients, const char *address, const admission_config_t *config,
+                      long long now_ms);
+
+/**
+ * Decides whether a client may start a request, taking a token and counting it as in progress if so.
+ * @param client Pointer to the client.
+ * @param config The limits.
+ * @param now_ms Current time from current_time_ms.
+ * @return ADMIT_OK, or why the request is refused.
+ */
+admission_result_t admit_request(client_t *client, const admission_config_t *config, long long now_ms);
+
+/**
+ * Ends a request admitted by admit_request.
+ * @param client Pointer to the client.
+ */
+void finish_request(client_t *client);
+
+#endif
@@ -3,41 +3,169 @@
 
 #include <time.h>
 
+#include "iochain.h"
+#include "sketch.h"
+#include "negative.h"
+
 #define REQUEST_SIZE 2048
+#define VARY_SIZE 256
+#define VARIANT_SIZE 1024
 #define RESPONSE_SIZE 102400
+#define HEADER_BLOCK_SIZE SEGMENT_SIZE // A response's header block always fits its first segment
 #define CACHE_SIZE 10
 
+// W-TinyLFU segment sizes: a ~1% admission window, the rest split 20/80
+// between the probation and protected segments of the main SLRU
+#define WINDOW_SIZE (CACHE_SIZE / 100 > 0 ? CACHE_SIZE / 100 : 1)
+#define PROTECTED_SIZE ((CACHE_SIZE - WINDOW_SIZE) * 4 / 5)
+
+// Largest uncompressed response we will try to squeeze into a RESPONSE_SIZE slot
+#define MAX_UNCOMPRESSED_SIZE (RESPONSE_SIZE * 16)
+
+// Segments a response of up to MAX_UNCOMPRESSED_SIZE bytes can span
+#define MAX_RESPONSE_IOV (MAX_UNCOMPRESSED_SIZE / SEGMENT_SIZE + 1)
+
+/**
+ * Replacement policy used when the cache is full.
+ */
+typedef enum {
+    CACHE_POLICY_LRU,
+    CACHE_POLICY_WTINYLFU,
+} cache_policy_t;
+
+/**
+ * Segment an entry lives in under W-TinyLFU. LRU keeps everything in the window.
+ */
+typedef enum {
+    SEGMENT_WINDOW,
+    SEGMENT_PROBATION,
+    SEGMENT_PROTECTED,
+} cache_segment_t;
+
+/**
+ * How the body of a cached response is stored.
+ */
+typedef enum {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+} cache_encoding_t;
+
+typedef struct cache_reader cache_reader_t;
+
+/**
+ * A client being served a chunked entry. Chunks are queued as they arrive, and the
+ * callback runs whenever the fill adds some or ends.
+ */
+struct cache_reader {
+    int index;       // Entry being read, -1 if none
+    segment_t *last; // Last chunk queued, NULL before the first
+    void (*on_chunks)(cache_reader_t *reader);
+    void *data;
+    cache_reader_t *next; // Other readers waiting on the same fill
+    cache_reader_t *prev;
+};
+
+/**
+ * A stored body, found by a hash of its bytes so that every entry whose response
+ * carries the same bytes shares one copy.
+ */
+typedef struct {
+    int refs;        // Entries holding the body, including evicted ones still being sent
+    int valid_refs;  // Valid entries among them, the rest are only kept for their sends
+    int size;
+    unsigned long long hash;
+    char data[RESPONSE_SIZE];
+} cache_body_t;
+
 /**
  * Represents a single cache entry with request-response metadata.
+ * Entries are found by their normalized key; when the origin sent a Vary header,
+ * vary keeps the header names and variant the request's values for them.
+ * The entry keeps its own header block, the body lives in the cache's body table
+ * where entries with identical bodies share it. The stored block has no Age header:
+ * every send queues it in place followed by an Age line computed at that moment.
+ * Gzip entries hold the response exactly as a gzip-accepting client should see it,
+ * with Content-Length and Content-Encoding already rewritten.
+ * Responses too large for a body are held as a chain of chunks instead, which
+ * readers can start serving while the fill from the origin is still running.
  */
 typedef struct {
     int index;
     int valid;
-    char request[REQUEST_SIZE + 1];
-    char response[RESPONSE_SIZE];
-    int response_size;
+    char key[REQUEST_SIZE + 1];
+    char vary[VARY_SIZE];
+    char variant[VARIANT_SIZE];
+    char headers[HEADER_BLOCK_SIZE];
+    int body;          // Index into the cache's bodies, -1 for none
+    int response_size; // Header block plus stored body
+    int header_size;
+    int identity_size;
+    int identity_header_size; // Header block as the origin sent it, also where the body starts in the first chunk
+    cache_encoding_t encoding;
     unsigned long last_used;
     time_t cached_time;
     time_t max_age;
+    time_t initial_age; // Age the origin reported when the response was stored
+    cache_segment_t segment;
+    int pins; // Sends still reading the response, the slot and body are not reused until they finish
+    int chunked;              // The response lives in chunks, headers only keeps its header block
+    int filling;              // Chunks are still arriving from the origin
+    int fill_failed;          // The origin stopped before the whole response arrived
+    segment_chain_t chunks;   // Whole response, header block in the first chunk
+    cache_reader_t *readers;  // Readers waiting for more chunks while filling
 } cache_entry_t;
 
 /**
  * Represents the full cache containing multiple entries.
+ * Every entry holds at most one body, so there is always a free body for a free entry.
  */
 typedef struct {
     int valid_entries;
+    cache_policy_t policy;
+    int compress_bodies;
+    long max_chunked_size; // Largest response stored as chunks, 0 to never store chunks
+    long stored_bytes;     // Header blocks and bodies held for valid entries, shared bodies once
+    long identity_bytes;   // What the valid entries would take uncompressed and unshared
+    long deduped_bytes;    // Body bytes not stored again because another entry has them
+    negative_ttl_t negative_ttl;
+    frequency_sketch_t sketch;
     cache_entry_t entries[CACHE_SIZE];
+    cache_body_t bodies[CACHE_SIZE];
 } cache_t;
 
 /**
  * Initializes the cache data structure.
  * @param cache Pointer to the cache structure to initialize.
+ * @param policy Replacement policy to use once the cache is full.
  * @return NULL.
  */
-void *init_cache(cache_t *cache);
+void *init_cache(cache_t *cache, cache_policy_t policy);
 
 /**
- * Finds the index of the first invalid cache slot.
+ * Takes over a cache another process filled in shared memory. Its chunked entries point
+ * into that process's memory, so they are evicted; pins it still holds stay in place for
+ * the caller to drop once that process is gone.
+ * @param cache Pointer to the cache.
+ */
+void attach_cache(cache_t *cache);
+
+/**
+ * Parses a policy name given on the command line.
+ * @param name Either "lru" or "wtinylfu".
+ * @param policy Pointer to store the parsed policy.
+ * @return 0 on success, -1 if the name is unknown.
+ */
+int parse_cache_policy(const char *name, cache_policy_t *policy);
+
+/**
+ * Returns the command line name of a policy.
+ * @param policy The policy.
+ * @return Static string naming the policy.
+ */
+const char *cache_policy_name(cache_policy_t policy);
+
+/**
+ * Finds the index of the first invalid cache slot that no send still pins.
  * @param cache Pointer to the cache.
  * @return Index of invalid entry, or -1 if none available.
  */
@@ -46,9 +174,45 @@ int find_invalid_entry(cache_t *cache);
 /**
  * Evicts the least recently used entry from the cache.
  * @param cache Pointer to the cache.
- * @return Malloc'd copy of the evicted request string, or NULL on error.
+ * @param evicted_key Buffer of REQUEST_SIZE + 1 bytes for the evicted key, may be NULL.
+ * @return 0 on success, -1 if no entry could be evicted.
+ */
+int evict_lru_entry(cache_t *cache, char *evicted_key);
+
+/**
+ * Makes room for one new entry according to the cache's policy.
+ * Under W-TinyLFU the window's LRU entry competes against the main segment's
+ * victim and the one with the lower estimated frequency is evicted.
+ * @param cache Pointer to the cache.
+ * @param evicted_key Buffer of REQUEST_SIZE + 1 bytes for the evicted key, may be NULL.
+ * @return 0 on success, -1 if no entry could be evicted.
+ */
+int evict_cache_victim(cache_t *cache, char *evicted_key);
+
+/**
+ * Records a key in the frequency sketch, whether it hits or not.
+ * @param cache Pointer to the cache.
+ * @param key The normalized key being looked up.
+ */
+void record_cache_access(cache_t *cache, const char *key);
+
+/**
+ * Builds the cache key of a request: method, scheme, lowercased host:port and path+query.
+ * Header order, User-Agent, cookies and the like do not affect the key.
+ * @param request The full HTTP request.
+ * @param key Buffer for the key, such as "GET http://example.com:80/index.html".
+ * @param key_size Size of key.
+ * @return 0 on success, -1 if the request cannot be cached (not a GET, unparsable
+ *         target, key too long).
+ */
+int normalize_cache_key(const char *request, char *key, int key_size);
+
+/**
+ * Marks a cache entry as used, promoting it between segments if needed.
+ * @param cache Pointer to the cache.
+ * @param index Index of the entry that was hit.
  */
-char *evict_lru_entry(cache_t *cache);
+void promote_cache_entry(cache_t *cache, int index);
 
 /**
  * Updates the LRU timestamp of a cache entry.
@@ -59,45 +223,161 @@ char *evict_lru_entry(cache_t *cache);
 void update_last_used(cache_t *cache, int index, unsigned long *usage_counter);
 
 /**
- * Searches the cache for a matching request.
+ * Searches the cache for an entry with the key whose Vary-selected request headers
+ * match the given request.
  * @param cache Pointer to the cache.
- * @param request The request string to search for.
+ * @param key The normalized key to search for.
+ * @param request The full HTTP request, or NULL to match only entries without Vary.
  * @return Index of cache hit, or -1 if not found.
  */
-int search_cache_hit(cache_t *cache, const char *request);
+int search_cache_hit(cache_t *cache, const char *key, const char *request);
 
 /**
- * Adds a new entry to the cache.
+ * Adds a new entry to the cache. With compress_bodies set, text bodies are stored
+ * gzip-compressed, and the size limit applies to the compressed form.
+ * A body byte-identical to one already stored is shared instead of copied again.
  * @param cache Pointer to the cache.
- * @param request The request string to store.
- * @param response The response string to store.
+ * @param key The normalized key to store the entry under.
+ * @param request The full HTTP request, used to record the response's Vary variant. May be NULL.
+ * @param response The response as iovecs, the first holding the whole NUL-terminated header block.
+ * @param count Number of iovecs.
  * @param response_size Size of the response in bytes.
  * @return Index where entry was added, or -1 on failure.
  */
-int add_cache_entry(cache_t *cache, const char *request, const char *response, int response_size);
+int add_cache_entry(cache_t *cache, const char *key, const char *request, const struct iovec *response, int count,
+                    int response_size);
+
+/**
+ * Starts a chunked entry for a response too large for a slot, filled as it arrives.
+ * The entry is found and served right away; it is pinned until finish_chunked_entry.
+ * The caller makes room first, as for add_cache_entry.
+ * @param cache Pointer to the cache.
+ * @param key The normalized key to store the entry under.
+ * @param request The full HTTP request, used to record the response's Vary variant. May be NULL.
+ * @param headers The response's NUL-terminated header block.
+ * @return Index of the entry, or -1 on failure.
+ */
+int start_chunked_entry(cache_t *cache, const char *key, const char *request, const char *headers);
+
+/**
+ * Adds the next chunk of a filling entry and wakes its readers.
+ * @param cache Pointer to the cache.
+ * @param cache_index Index of the entry.
+ * @param chunk Segment holding the next bytes of the response, the caller's reference passes to the entry.
+ */
+void append_cache_chunk(cache_t *cache, int cache_index, segment_t *chunk);
 
 /**
- * Sends a cached response to the client.
- * @param client_fd Socket descriptor to the client.
+ * Ends a fill. An incomplete fill evicts the entry, its readers then fail.
  * @param cache Pointer to the cache.
- * @param cache_index Index of the cache entry to serve.
- * @return Number of bytes sent, or -1 on error.
+ * @param cache_index Index of the entry.
+ * @param complete Whether the whole response arrived.
+ */
+void finish_chunked_entry(cache_t *cache, int cache_index, int complete);
+
+/**
+ * Attaches a reader to a chunked entry, pinning it until remove_cache_reader.
+ * @param cache Pointer to the cache.
+ * @param cache_index Index of the entry.
+ * @param reader Reader with on_chunks and data set.
+ */
+void add_cache_reader(cache_t *cache, int cache_index, cache_reader_t *reader);
+
+/**
+ * Queues the chunks the reader has not been given yet, each holding a reference until sent.
+ * The first chunk goes out after the entry's header block and a fresh Age line, in place
+ * of the origin's header bytes at its start.
+ * @param out Chain the chunks are queued on.
+ * @param scratch Chain the Age line is written into, out holds a reference to it.
+ * @param cache Pointer to the cache.
+ * @param reader Pointer to the reader.
+ * @param max_bytes Stop once this many bytes are queued, -1 for no limit.
+ * @return 1 once the whole response is queued, 0 if more is still to come, -1 if the fill failed or on error.
+ */
+int serve_cache_chunks(iochain_t *out, segment_chain_t *scratch, cache_t *cache, cache_reader_t *reader,
+                       long max_bytes);
+
+/**
+ * Detaches a reader and drops its pin. Does nothing for a reader that is not attached.
+ * @param cache Pointer to the cache.
+ * @param reader Pointer to the reader.
+ */
+void remove_cache_reader(cache_t *cache, cache_reader_t *reader);
+
+/**
+ * Queues a cached response for the client.
+ * Compressed entries are sent as stored to gzip-accepting clients and inflated otherwise.
+ * The header block and body are queued in place around a fresh Age line, so that one
+ * sendmsg sends the hit without copying the body. On success the entry is pinned and
+ * the caller must unpin it once out has been sent or freed.
+ * @param out Chain the response is queued on.
+ * @param scratch Chain the Age line is written into, out holds a reference to it.
+ * @param cache Pointer to the cache.
+ * @param cache_index Index of the cache entry to serve, not a chunked one (see add_cache_reader).
+ * @param gzip_ok Whether the client accepts gzip content coding.
+ * @return 0 on success, -1 on error.
+ */
+int serve_from_cache(iochain_t *out, segment_chain_t *scratch, cache_t *cache, int cache_index, int gzip_ok);
+
+/**
+ * Answers a Range request from a cached full 200 response with a 206 or 416.
+ * Identity and chunked entries are sliced in place without copying the body, a chunked
+ * entry only once its fill is complete. On success the entry is pinned like in serve_from_cache.
+ * @param out Chain the answer is queued on.
+ * @param scratch Chain the answer's headers are written into, out holds references to them.
+ * @param cache Pointer to the cache.
+ * @param cache_index Index of the cache entry holding the full response.
+ * @param range_value The Range header value from the client.
+ * @return 0 on success, 1 if the range was ignored and nothing was queued, -1 on error.
+ */
+int serve_range_from_cache(iochain_t *out, segment_chain_t *scratch, cache_t *cache, int cache_index,
+                           const char *range_value);
+
+/**
+ * Keeps an entry's slot from being reused while its bytes are queued for sending.
+ * A pinned entry can still be evicted, it just stops being found.
+ * @param cache Pointer to the cache.
+ * @param cache_index Index of the entry.
+ */
+void pin_cache_entry(cache_t *cache, int cache_index);
+
+/**
+ * Releases a pin taken by serve_from_cache or serve_range_from_cache.
+ * @param cache Pointer to the cache.
+ * @param cache_index Index of the entry.
+ */
+void unpin_cache_entry(cache_t *cache, int cache_index);
+
+/**
+ * Checks whether a request's Accept-Encoding allows a gzip response.
+ * @param request The full HTTP request.
+ * @return 1 if gzip is acceptable, 0 otherwise.
+ */
+int accepts_gzip(const char *request);
+
+/**
+ * Checks the Cache-Control header for no-store or no-cache directives, and Vary for "*".
+ * @param response The full HTTP response.
+ * @return 1 if caching is disallowed, 0 otherwise.
  */
-int serve_from_cache(int client_fd, cache_t *cache, int cache_index);
+int check_no_cache(const char *response);
 
 /**
- * Checks the Cache-Control header for no-store or no-cache directives.
+ * Checks whether an error response may be stored: 4xx/5xx responses without an
+ * explicit max-age are only cached when their class has a negative TTL.
+ * @param cache Pointer to the cache holding the negative TTLs.
  * @param response The full HTTP response.
  * @return 1 if caching is disallowed, 0 otherwise.
  */
-int check_no_cache(char *response);
+int check_no_cache_error(cache_t *cache, const char *response);
 
 /**
- * Parses the Cache-Control line from the response.
+ * Finds the Cache-Control line of the response in place.
  * @param response The full HTTP response.
- * @return Malloced string of the Cache-Control header.
+ * @param length Pointer to store the value's length.
+ * @return Pointer to the value inside response, or NULL if not found.
  */
-char *parse_cache_control(const char *response);
+const char *parse_cache_control(const char *response, int *length);
 
 /**
  * Extracts the max-age value from a Cache-Control header.
@@ -107,7 +387,7 @@ char *parse_cache_control(const char *response);
 int get_max_age(const char *response);
 
 /**
- * Determines whether a cache entry is stale based on max-age.
+ * Determines whether a cache entry is stale, its current age having reached max-age.
  * @param cache Pointer to the cache.
  * @param index Index of the entry to check.
  * @return 1 if timed out, 0 otherwise.
@@ -0,0 +1,60 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+
+#define CAPTURE_LINE_SIZE 2200 // Longest capture line read back, a cache key plus the numbers before it
+
+/**
+ * One request as captured, written as a text line
+ *   <time-ms> <status> <body-bytes> <max-age> <no-store> <key>
+ * with the key last since it contains spaces. max_age is -1 without a max-age directive;
+ * no_store is 1 when Cache-Control or Vary forbade storing the response.
+ */
+typedef struct {
+    long long time_ms; // Wall clock time of the accept, milliseconds since the epoch
+    int status;
+    long size; // Body bytes as the origin sent them, before any compression in the cache
+    int max_age;
+    int no_store;
+    const char *key; // Normalized cache key, borrowed
+} capture_record_t;
+
+/**
+ * Open capture file, stdio buffers the lines until flush_capture_writer or a full buffer.
+ */
+typedef struct {
+    FILE *file; // NULL when capture is off
+    long written;
+} capture_writer_t;
+
+/**
+ * Opens the capture file for appending.
+ * @param writer Pointer to the writer.
+ * @param path File to append to, created if missing.
+ * @return 0 on success, -1 on error.
+ */
+int open_capture_writer(capture_writer_t *writer, const char *path);
+
+/**
+ * Queues one record's line.
+ * @param writer Pointer to the writer.
+ * @param record The record.
+ */
+void write_capture_record(capture_writer_t *writer, const capture_record_t *record);
+
+/**
+ * Writes out the buffered lines.
+ * @param writer Pointer to the writer.
+ */
+void flush_capture_writer(capture_writer_t *writer);
+
+/**
+ * Parses a capture line in place, the record's key points into it.
+ * @param line The line, its trailing newline is removed.
+ * @param record Record to fill.
+ * @return 0 on success, -1 on a malformed line.
+ */
+int parse_capture_record(char *line, capture_record_t *record);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <arpa/inet.h>
+
+#include "negative.h"
+
+#define CLUSTER_MAX_NODES 16
+#define CLUSTER_POINTS 64        // Ring points per node, so each one owns an even share of keys
+#define PEER_RETRY_SECONDS 10    // A peer that failed is skipped for this long
+#define PEER_HEADER "X-Htproxy-Peer:" // Marks a request forwarded by a peer, it is never forwarded again
+#define CLUSTER_NODE_ADDRESSES 4 // Addresses kept per node to recognize the requests it forwards
+
+/**
+ * A node's position on the hash ring.
+ */
+typedef struct {
+    unsigned long long hash;
+    int node;
+} ring_point_t;
+
+/**
+ * Proxies sharing one cache between them. Each normalized cache key is owned by one node,
+ * found on a consistent hash ring, so adding or removing a node only moves the keys next to its points.
+ */
+typedef struct {
+    char nodes[CLUSTER_MAX_NODES][HOST_NAME_SIZE]; // host:port of every node, this one included
+    int node_count;                                // 0 outside cluster mode
+    int self;                                      // Index of this proxy in nodes
+    ring_point_t ring[CLUSTER_MAX_NODES * CLUSTER_POINTS]; // Sorted by hash
+    int ring_size;
+    char peer_addresses[CLUSTER_MAX_NODES * CLUSTER_NODE_ADDRESSES][INET6_ADDRSTRLEN]; // Other nodes' addresses
+    int peer_address_count;
+} cluster_t;
+
+/**
+ * Parses "host:port,host:port,..." and builds the hash ring.
+ * Every node has to list the same nodes for them to agree on the owners.
+ * @param nodes The comma-separated node list, this proxy included.
+ * @param self This proxy's entry, exactly as it appears in nodes.
+ * @param cluster Pointer to the cluster to fill in.
+ * @return 0 on success, -1 on a malformed list or if self is not in it.
+ */
+int parse_cluster(const char *nodes, const char *self, cluster_t *cluster);
+
+/**
+ * Resolves the other nodes' names once at startup, so requests they forward can be told
+ * apart from clients sending PEER_HEADER themselves.
+ * @param cluster Pointer to a parsed cluster.
+ * @return 0 on success, -1 if a node does not resolve.
+ */
+int resolve_cluster_peers(cluster_t *cluster);
+
+/**
+ * Checks whether a client address is one of the other nodes'.
+ * @param cluster Pointer to the cluster.
+ * @param address Numeric address of the client, IPv4 without the IPv4-mapped prefix.
+ * @return 1 if a peer has that address, 0 otherwise.
+ */
+int is_cluster_peer(const cluster_t *cluster, const char *address);
+
+/**
+ * Finds the node that owns a key.
+ * @param cluster Pointer to the cluster, with at least one node.
+ * @param key The normalized cache key.
+ * @return Index of the owner in cluster->nodes.
+ */
+int cluster_owner(const cluster_t *cluster, const char *key);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef DRR_H
+#define DRR_H
+
+typedef struct drr_waiter drr_waiter_t;
+typedef struct drr_flow drr_flow_t;
+
+/**
+ * Something waiting for its flow's turn, such as a connection wanting an origin fetch
+ * or more bytes sent. The callback is handed the flow's current allowance and returns
+ * how much of it was used; it may use a little more, the flow then owes the difference.
+ */
+struct drr_waiter {
+    drr_waiter_t *next;
+    drr_flow_t *flow; // Flow the waiter is queued on, NULL when not waiting
+    long (*on_grant)(drr_waiter_t *waiter, long allowance);
+    void *data;
+};
+
+/**
+ * One party sharing the scheduled resource, e.g. all connections of one client.
+ * Its waiters are served in order whenever the flow has a positive deficit.
+ */
+struct drr_flow {
+    drr_flow_t *next; // Ring of flows with waiters
+    drr_flow_t *prev;
+    int backlogged;   // Linked into the ring
+    long deficit;
+    drr_waiter_t *head;
+    drr_waiter_t *tail;
+    int count;
+};
+
+/**
+ * Deficit round robin: each run hands out a budget of the resource, a quantum per flow
+ * per round, so a flow with many waiters gets no more than one with a single waiter.
+ */
+typedef struct {
+    drr_flow_t *current; // Flow whose turn is next, NULL if none is waiting
+    long quantum;
+} drr_scheduler_t;
+
+/**
+ * Initializes a scheduler with no waiting flows.
+ * @param scheduler Pointer to the scheduler.
+ * @param quantum Share a flow gets per round.
+ */
+void init_drr_scheduler(drr_scheduler_t *scheduler, long quantum);
+
+/**
+ * Initializes an idle flow.
+ * @param flow Pointer to the flow.
+ */
+void init_drr_flow(drr_flow_t *flow);
+
+/**
+ * Initializes a waiter that is not queued.
+ * @param waiter Pointer to the waiter.
+ * @param on_grant Called with the allowance once the flow's turn comes.
+ * @param data Owner pointer, available to the callback as waiter->data.
+ */
+void init_drr_waiter(drr_waiter_t *waiter, long (*on_grant)(drr_waiter_t *waiter, long allowance), void *data);
+
+/**
+ * Queues a waiter at the end of its flow, putting the flow in the ring if it was idle.
+ * Does nothing for a waiter that is already queued.
+ * @param scheduler Pointer to the scheduler.
+ * @param flow Flow the waiter belongs to.
+ * @param waiter Pointer to the waiter.
+ */
+void drr_wait(drr_scheduler_t *scheduler, drr_flow_t *flow, drr_waiter_t *waiter);
+
+/**
+ * Takes a waiter off its flow. Does nothing for a waiter that is not queued.
+ * @param scheduler Pointer to the scheduler.
+ * @param waiter Pointer to the waiter.
+ */
+void drr_cancel(drr_scheduler_t *scheduler, drr_waiter_t *waiter);
+
+/**
+ * Hands out up to budget in rounds, calling back the waiters whose turn comes. A flow left
+ * without waiters gives up its unused deficit, which goes back into the budget.
+ * Callbacks may queue and cancel waiters, but must not run the same scheduler.
+ * @param scheduler Pointer to the scheduler.
+ * @param budget Amount of the resource available now.
+ * @return The part of budget nobody used.
+ */
+long run_drr(drr_scheduler_t *scheduler, long budget);
+
+/**
+ * Checks whether any flow has waiters.
+ * @param scheduler Pointer to the scheduler.
+ * @return 1 if some waiter is queued, 0 otherwise.
+ */
+int drr_backlogged(const drr_scheduler_t *scheduler);
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <sys/socket.h>
+
+#include "iochain.h"
+#include "timer.h"
+
+#define MAX_EVENTS 64
+#define READ_BUFFER_SIZE 16384
+
+// Readiness reported to start_poll callbacks
+#define IO_READABLE 0x1
+#define IO_WRITABLE 0x2
+
+typedef struct event_loop event_loop_t;
+typedef struct io_watch io_watch_t;
+typedef struct uring uring_t;
+
+/**
+ * Kernel interface the loop is built on, chosen at startup.
+ */
+typedef enum {
+    EVENT_BACKEND_EPOLL, // Readiness with epoll, one system call per operation
+    EVENT_BACKEND_URING, // Completions with io_uring, operations batched per loop round
+} event_backend_t;
+
+/**
+ * One socket registered with the event loop. Operations are started on the watch and
+ * complete later through its callbacks, always called from the loop.
+ */
+struct io_watch {
+    int fd; // -1 once closed
+    void *data;
+    event_loop_t *loop;
+    unsigned int interest; // Events currently registered with epoll
+    int registered;
+    int accepting;
+    int reading;
+    int connecting;
+    unsigned int poll_events; // IO_READABLE/IO_WRITABLE wanted by start_poll, 0 if not polling
+    iochain_t *out; // Chain being written, NULL if no write is in progress
+    int uring_ops; // First in-flight io_uring operation, -1 if none
+    int uring_sends; // Linked sendmsg operations of the current write still in flight
+    int uring_send_failed;
+    unsigned int uring_poll; // Events of the armed io_uring poll, 0 if none
+    segment_chain_t uring_held; // Data received after stop_read, replayed by the next start_read
+    void (*on_accept)(io_watch_t *watch, int fd);
+    void (*on_read)(io_watch_t *watch, const char *buffer, long length);
+    void (*on_write)(io_watch_t *watch, int status);
+    void (*on_connect)(io_watch_t *watch, int status);
+    void (*on_ready)(io_watch_t *watch, unsigned int events);
+};
+
+/**
+ * Something to release once the current round of callbacks is over.
+ */
+typedef struct {
+    void (*release)(void *data);
+    void *data;
+} deferred_release_t;
+
+/**
+ * Single-threaded epoll or io_uring loop with a timer wheel for deadlines.
+ */
+struct event_loop {
+    int epoll_fd;   // -1 on io_uring
+    uring_t *uring; // NULL on epoll
+    timer_wheel_t timers;
+    char read_buffer[READ_BUFFER_SIZE]; // Shared by every read callback, valid only during the call
+    deferred_release_t *deferred;
+    int deferred_count;
+    int deferred_capacity;
+};
+
+/**
+ * Creates the epoll instance or io_uring ring and an empty timer wheel. If io_uring is
+ * unavailable the loop falls back to epoll.
+ * @param loop Pointer to the loop.
+ * @param backend Backend to try first.
+ * @return 0 on success, -1 on error.
+ */
+int init_event_loop(event_loop_t *loop, event_backend_t backend);
+
+/**
+ * Parses a backend name given on the command line.
+ * @param name Either "epoll" or "uring".
+ * @param backend Pointer to store the parsed backend.
+ * @return 0 on success, -1 if the name is unknown.
+ */
+int parse_event_backend(const char *name, event_backend_t *backend);
+
+/**
+ * Initializes a watch for a non-blocking socket. Nothing is registered until an operation starts.
+ * @param watch Pointer to the watch.
+ * @param loop Pointer to the loop.
+ * @param fd Non-blocking socket descriptor, or -1 if not created yet.
+ * @param data Owner pointer, available to callbacks as watch->data.
+ */
+void init_io_watch(io_watch_t *watch, event_loop_t *loop, int fd, void *data);
+
+/**
+ * Accepts connections on a listening socket until stopped by close_io_watch.
+ * @param watch Watch of the listening socket.
+ * @param on_accept Called with each new non-blocking client socket.
+ * @return 0 on success, -1 on error.
+ */
+int start_accept(io_watch_t *watch, void (*on_accept)(io_watch_t *watch, int fd));
+
+/**
+ * Delivers incoming data until stop_read. The callback gets the bytes read, 0 at end of
+ * stream or a negative errno on error.
+ * @param watch Pointer to the watch.
+ * @param on_read Called with each chunk read.
+ * @return 0 on success, -1 on error.
+ */
+int start_read(io_watch_t *watch, void (*on_read)(io_watch_t *watch, const char *buffer, long length));
+
+/**
+ * Stops delivering incoming data. Nothing already read is lost, a later start_read
+ * carries on where this stopped.
+ * @param watch Pointer to the watch.
+ */
+void stop_read(io_watch_t *watch);
+
+/**
+ * Writes a whole chain. The callback gets 0 once the chain is empty or -1 on error.
+ * @param watch Pointer to the watch.
+ * @param chain Chain to send, must stay valid and not be appended to until the callback.
+ * @param on_write Called when the write completes.
+ * @return 0 on success, -1 on error.
+ */
+int start_write(io_watch_t *watch, iochain_t *chain, void (*on_write)(io_watch_t *watch, int status));
+
+/**
+ * Starts a non-blocking connect on the watch's socket. The callback gets 0 once
+ * connected or a negative errno.
+ * @param watch Pointer to the watch.
+ * @param address Address to connect to.
+ * @param address_length Length of address.
+ * @param on_connect Called when the connect completes.
+ * @return 0 if the connect is under way, -1 if it failed at once (errno is set).
+ */
+int start_connect(io_watch_t *watch, const struct sockaddr *address, socklen_t address_length,
+                  void (*on_connect)(io_watch_t *watch, int status));
+
+/**
+ * Reports readiness instead of doing the I/O, for callers that move data themselves
+ * (e.g. with splice). Readiness is level-triggered, errors report both directions ready.
+ * @param watch Pointer to the watch.
+ * @param events IO_READABLE and/or IO_WRITABLE, 0 stops polling.
+ * @param on_ready Called with the events that are ready.
+ * @return 0 on success, -1 on error.
+ */
+int start_poll(io_watch_t *watch, unsigned int events, void (*on_ready)(io_watch_t *watch, unsigned int events));
+
+/**
+ * Unregisters and closes the watch's socket. No callback runs for it afterwards.
+ * @param watch Pointer to the watch.
+ */
+void close_io_watch(io_watch_t *watch);
+
+/**
+ * Unregisters the watch's socket without closing it, so another watch can take it over.
+ * Only valid while no operation is pending on the watch.
+ * @param watch Pointer to the watch.
+ * @return The socket descriptor, or -1 if the watch was closed.
+ */
+int detach_io_watch(io_watch_t *watch);
+
+/**
+ * Releases data after the current round of callbacks, so events already fetched
+ * for its watches never see freed memory.
+ * @param loop Pointer to the loop.
+ * @param release Function that frees data.
+ * @param data Pointer passed to release.
+ */
+void defer_release(event_loop_t *loop, void (*release)(void *data), void *data);
+
+/**
+ * Runs the loop forever, dispatching socket events and expired timers.
+ * @param loop Pointer to the loop.
+ */
+void run_event_loop(event_loop_t *loop);
+
+#endif
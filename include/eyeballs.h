@@ -0,0 +1,77 @@
+#ifndef EYEBALLS_H
+#define EYEBALLS_H
+
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define MAX_CONNECT_ATTEMPTS 8     // Addresses raced per origin connect
+#define ADDRESS_FAILURE_SIZE 64
+#define ADDRESS_FAILURE_TTL 60     // Seconds a failed address stays at the back of the line
+#define DEFAULT_ATTEMPT_DELAY_MS 250 // RFC 8305 recommended Connection Attempt Delay
+
+/**
+ * An address a connect attempt recently failed on.
+ */
+typedef struct {
+    int valid;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    time_t failed_at;
+} address_failure_t;
+
+/**
+ * Fixed-size table of recent per-address connect failures, shared by every host.
+ */
+typedef struct {
+    address_failure_t entries[ADDRESS_FAILURE_SIZE];
+} address_failure_cache_t;
+
+/**
+ * Clears the address failure table.
+ * @param failures Pointer to the table.
+ */
+void init_address_failures(address_failure_cache_t *failures);
+
+/**
+ * Remembers that a connect to an address failed, replacing the oldest record if full.
+ * @param failures Pointer to the table.
+ * @param address The address that failed.
+ * @param address_length Length of address.
+ */
+void record_address_failure(address_failure_cache_t *failures, const struct sockaddr *address,
+                            socklen_t address_length);
+
+/**
+ * Checks whether an address failed within ADDRESS_FAILURE_TTL.
+ * @param failures Pointer to the table.
+ * @param address The address to look up.
+ * @param address_length Length of address.
+ * @return 1 if a fresh failure is recorded, 0 otherwise.
+ */
+int search_address_failure(address_failure_cache_t *failures, const struct sockaddr *address,
+                           socklen_t address_length);
+
+/**
+ * Forgets any failure recorded for an address, e.g. after a successful connect.
+ * @param failures Pointer to the table.
+ * @param address The address that connected.
+ * @param address_length Length of address.
+ */
+void clear_address_failure(address_failure_cache_t *failures, const struct sockaddr *address,
+                           socklen_t address_length);
+
+/**
+ * Orders resolved addresses for racing as in RFC 8305 section 4: families alternate,
+ * starting with the family getaddrinfo ranked first, and addresses that failed recently
+ * move to the back.
+ * @param list Result of getaddrinfo.
+ * @param failures Pointer to the address failure table.
+ * @param ordered Array to fill.
+ * @param max_count Capacity of ordered.
+ * @return Number of addresses written to ordered.
+ */
+int order_addresses(struct addrinfo *list, address_failure_cache_t *failures, struct addrinfo **ordered,
+                    int max_count);
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "iochain.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL // Starting value of a 64-bit FNV-1a hash
+
+/**
+ * Finds the value of a named header in place, without copying it.
+ * @param message The full HTTP request or response, null-terminated.
+ * @param name Header name including the colon, e.g. "Content-Type:".
+ * @param length Pointer to store the value's length, up to the end of its line.
+ * @return Pointer to the value inside message, or NULL if not found.
+ */
+const char *find_header(const char *message, const char *name, int *length);
+
+/**
+ * Parses the value of a named header from a request or response.
+ * @param message The full HTTP request or response.
+ * @param name Header name including the colon, e.g. "Content-Type:".
+ * @return Malloced string of the header value, or NULL if not found.
+ */
+char *parse_header(const char *message, const char *name);
+
+/**
+ * Steps through a comma-separated header value such as Cache-Control.
+ * @param cursor Position in the value, advanced past the item returned.
+ * @param end End of the value.
+ * @param length Pointer to store the item's length, without surrounding blanks.
+ * @return Pointer to the next item, or NULL once the value is exhausted.
+ */
+const char *next_list_item(const char **cursor, const char *end, int *length);
+
+/**
+ * Parses the status code from a response's status line.
+ * @param response The full HTTP response.
+ * @return The status code, or -1 if the status line is malformed.
+ */
+int parse_status_code(const char *response);
+
+/**
+ * Copies the start line and header lines, leaving out the named headers and the
+ * blank line that ends the header block.
+ * @param headers Start of the message.
+ * @param header_size Length of the header block including the final \r\n\r\n.
+ * @param skip Header names to leave out, including the colon.
+ * @param skip_count Number of names in skip.
+ * @param out Buffer to write to.
+ * @param out_size Size of out.
+ * @return Number of bytes written, or -1 if out is too small.
+ */
+int copy_headers_except(const char *headers, int header_size, const char **skip, int skip_count, char *out,
+                        int out_size);
+
+/**
+ * Copies a request with the named headers removed.
+ * @param message The full HTTP request, null-terminated.
+ * @param names Header names to remove, including the colon.
+ * @param count Number of names.
+ * @param stripped Buffer for the null-terminated copy.
+ * @param out_size Size of stripped, at least strlen(message) + 1.
+ * @return Length of the copy, or -1 on error.
+ */
+int strip_headers(const char *message, const char **names, int count, char *stripped, int out_size);
+
+/**
+ * Copies a request with its Host header, if any, replaced by the given value.
+ * The new Host line comes right after the request line.
+ * @param request The full HTTP request, null-terminated.
+ * @param host The Host value to send.
+ * @param host_length Length of host.
+ * @param out Buffer for the null-terminated copy.
+ * @param out_size Size of out, at least strlen(request) + host_length + 9.
+ * @return Length of the copy, or -1 on error.
+ */
+int replace_host_header(const char *request, const char *host, int host_length, char *out, int out_size);
+
+/**
+ * Splits a Host header value into the name to resolve and the port to dial.
+ * @param host Host value, e.g. "example.com", "example.com:8080" or "[::1]:8080".
+ * @param name Buffer for the name, IPv6 literals without their brackets.
+ * @param name_size Size of name.
+ * @param port Buffer for the port, "80" when none is given.
+ * @param port_size Size of port.
+ * @return 0 on success, -1 if the value is malformed or does not fit.
+ */
+int split_host_port(const char *host, char *name, int name_size, char *port, int port_size);
+
+/**
+ * Folds bytes into a 64-bit FNV-1a hash, so bytes held in pieces hash as if they were one block.
+ * @param hash FNV_OFFSET_BASIS to start a hash, or the hash of the bytes before these.
+ * @param data Bytes to hash.
+ * @param length Number of bytes.
+ * @return The updated hash.
+ */
+unsigned long long hash_bytes(unsigned long long hash, const void *data, long length);
+
+/**
+ * Queues a bodyless error response generated by the proxy itself.
+ * @param out Chain to the client.
+ * @param status Status code, e.g. 502.
+ * @param reason Reason phrase, e.g. "Bad Gateway".
+ * @return 0 on success, -1 on error.
+ */
+int append_error_response(iochain_t *out, int status, const char *reason);
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef IOCHAIN_H
+#define IOCHAIN_H
+
+#include <sys/uio.h>
+
+#include "segment.h"
+
+#define IOCHAIN_INIT_SIZE 8
+#define IOCHAIN_SEND_MAX 64 // iovecs handed to one sendmsg call
+
+/**
+ * Queue of buffers waiting to go out on a socket, sent with sendmsg without
+ * first being copied into one block. Each buffer is either owned by the chain
+ * and freed once sent, held through a segment reference, or borrowed and left to its owner.
+ */
+typedef struct {
+    struct iovec *iov;
+    char **owned; // owned[i] is freed after iov[i] is sent, NULL for borrowed buffers
+    segment_t **segments; // segments[i] is released after iov[i] is sent, NULL if not held
+    int head;     // First buffer not fully sent
+    int count;
+    int capacity;
+    long pending_bytes;
+} iochain_t;
+
+/**
+ * Initializes an empty chain.
+ * @param chain Pointer to the chain.
+ */
+void init_iochain(iochain_t *chain);
+
+/**
+ * Queues a borrowed buffer. It must stay valid until the chain is sent or freed.
+ * @param chain Pointer to the chain.
+ * @param data Bytes to send.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 on error.
+ */
+int append_iochain(iochain_t *chain, const void *data, long length);
+
+/**
+ * Queues a malloc'd buffer, which the chain frees once it is sent. It is also freed on error.
+ * @param chain Pointer to the chain.
+ * @param data Malloc'd bytes to send.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 on error.
+ */
+int append_iochain_owned(iochain_t *chain, char *data, long length);
+
+/**
+ * Queues a private copy of a buffer.
+ * @param chain Pointer to the chain.
+ * @param data Bytes to send.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 on error.
+ */
+int append_iochain_copy(iochain_t *chain, const void *data, long length);
+
+/**
+ * Queues bytes inside a segment, holding a reference until they are sent.
+ * @param chain Pointer to the chain.
+ * @param segment Segment the bytes live in.
+ * @param data First byte to send, inside segment.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 on error.
+ */
+int append_iochain_segment(iochain_t *chain, segment_t *segment, const char *data, long length);
+
+/**
+ * Hands a malloc'd buffer to the chain without sending it, freed once everything queued
+ * before it has been sent. Used for buffers that earlier borrowed slices point into.
+ * @param chain Pointer to the chain.
+ * @param data Malloc'd buffer.
+ * @return 0 on success, -1 on error (data is freed).
+ */
+int append_iochain_release(iochain_t *chain, char *data);
+
+/**
+ * Sends as much of the chain as the socket takes without blocking.
+ * @param chain Pointer to the chain.
+ * @param fd Non-blocking socket descriptor.
+ * @return 1 once the chain is empty, 0 if the socket is full, -1 on error.
+ */
+int send_iochain(iochain_t *chain, int fd);
+
+/**
+ * Retires bytes sent by someone else, e.g. a sendmsg completed by io_uring.
+ * @param chain Pointer to the chain.
+ * @param bytes Number of bytes sent from the front of the chain.
+ */
+void advance_iochain(iochain_t *chain, long bytes);
+
+/**
+ * Checks whether everything queued has been sent.
+ * @param chain Pointer to the chain.
+ * @return 1 if empty, 0 otherwise.
+ */
+int iochain_empty(const iochain_t *chain);
+
+/**
+ * Drops everything still queued but keeps the chain's arrays for reuse.
+ * @param chain Pointer to the chain.
+ */
+void reset_iochain(iochain_t *chain);
+
+/**
+ * Frees the owned buffers still queued and the chain's arrays. The chain can be reused after init_iochain.
+ * @param chain Pointer to the chain.
+ */
+void free_iochain(iochain_t *chain);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef NEGATIVE_H
+#define NEGATIVE_H
+
+#include <time.h>
+
+#define HOST_FAILURE_SIZE 64
+#define HOST_NAME_SIZE 256
+
+/**
+ * How long errors are remembered, in seconds. -1 means the class is not negatively cached.
+ * status_ttl is indexed by status class (status / 100), only 4 and 5 are used.
+ */
+typedef struct {
+    int status_ttl[6];
+    int connect_ttl;
+} negative_ttl_t;
+
+/**
+ * A host that recently failed to resolve or accept a connection.
+ */
+typedef struct {
+    int valid;
+    char host[HOST_NAME_SIZE];
+    time_t failed_at;
+    int ttl;
+} host_failure_t;
+
+/**
+ * Fixed-size table of recent per-host connect/resolve failures.
+ */
+typedef struct {
+    host_failure_t entries[HOST_FAILURE_SIZE];
+} host_failure_cache_t;
+
+/**
+ * Disables negative caching for every class.
+ * @param ttl Pointer to the TTLs to initialize.
+ */
+void init_negative_ttls(negative_ttl_t *ttl);
+
+/**
+ * Parses a comma-separated list such as "4xx=30,5xx=5,connect=10".
+ * @param spec The list given on the command line.
+ * @param ttl Pointer to the TTLs to fill in.
+ * @return 0 on success, -1 if an item is not understood.
+ */
+int parse_negative_ttls(const char *spec, negative_ttl_t *ttl);
+
+/**
+ * Looks up the negative TTL for an error response that has no explicit freshness.
+ * Only 4xx codes that RFC 9111 lets caches store heuristically qualify for the 4xx TTL,
+ * all 5xx codes qualify for the 5xx TTL.
+ * @param ttl The configured TTLs.
+ * @param status The response status code.
+ * @return TTL in seconds, or -1 if the response must not be cached.
+ */
+int negative_status_ttl(const negative_ttl_t *ttl, int status);
+
+/**
+ * Clears the host failure table.
+ * @param failures Pointer to the table.
+ */
+void init_host_failures(host_failure_cache_t *failures);
+
+/**
+ * Remembers that a host could not be reached, replacing the oldest record if full.
+ * @param failures Pointer to the table.
+ * @param host Host name as given in the request.
+ * @param ttl Seconds to remember the failure for.
+ */
+void record_host_failure(host_failure_cache_t *failures, const char *host, int ttl);
+
+/**
+ * Checks whether a host failed recently enough that it should not be dialed again.
+ * @param failures Pointer to the table.
+ * @param host Host name as given in the request.
+ * @return 1 if a fresh failure is recorded, 0 otherwise.
+ */
+int search_host_failure(host_failure_cache_t *failures, const char *host);
+
+/**
+ * Forgets any failure recorded for a host, e.g. after a successful connect.
+ * @param failures Pointer to the table.
+ * @param host Host name as given in the request.
+ */
+void clear_host_failure(host_failure_cache_t *failures, const char *host);
+
+#endif
@@ -1,68 +1,236 @@
 #ifndef PROXY_H
 #define PROXY_H
 
+#include <netdb.h>
+
+#include "admission.h"
+#include "cache.h"
+#include "capture.h"
+#include "cluster.h"
+#include "event.h"
+#include "eyeballs.h"
+#include "negative.h"
+#include "resolver.h"
+#include "trace.h"
+#include "tunnel.h"
+
 #define BACKLOG 10           
-#define INIT_BUF_SIZE 2048
 #define BUF_SIZE 8192
+#define CONNECTION_POOL_MAX 256 // Closed connections kept for reuse instead of freed
+#define STREAM_WINDOW (16 * SEGMENT_SIZE) // Streamed bytes buffered for a slow client before the origin is paused
+#define SEND_TICK_MS 10            // Interval the send bandwidth limit is handed out in
+#define SEND_QUANTUM SEGMENT_SIZE  // Bytes a client may send per round of the send scheduler
+#define ADMISSION_REPORT_MS 10000  // Interval between admission summaries in the log
+#define RECORD_FLUSH_MS 1000       // Longest a finished trace or capture record waits in the buffer
 
 /**
- * Starts the proxy servr on the given port
- * @param port The port number to bind the proxy server to
- * @param enable_cache Flag to enable or disable caching mechanism
+ * Per-connection time limits in milliseconds, 0 disables a limit.
+ * header: accept until the full request header block has arrived.
+ * connect: start until the origin connection is established.
+ * first_byte: request sent until the first response byte.
+ * idle: longest gap without progress on either socket.
+ * total: accept until the connection is closed.
+ * attempt_delay: wait before racing the next origin address while earlier ones are pending.
  */
-void start_proxy(int port, int enable_cache);
+typedef struct {
+    long header_ms;
+    long connect_ms;
+    long first_byte_ms;
+    long idle_ms;
+    long total_ms;
+    long attempt_delay_ms;
+} deadline_config_t;
 
 /**
- * Connects to a given host on port 80
- * @param host The hostname to connect to
- * @return A connected socket file descriptor
+ * Startup options parsed from the command line.
  */
-int connect_to_host(const char *host);
+typedef struct {
+    int port;
+    int enable_cache;
+    cache_policy_t cache_policy;
+    int compress_cache;
+    int range_fill;
+    long max_chunked_size; // Largest streamed response cached as chunks, 0 to cache none
+    negative_ttl_t negative_ttl;
+    deadline_config_t deadlines;
+    cluster_t cluster; // Peers sharing the cache, node_count is 0 outside cluster mode
+    const char *upgrade_path; // Unix socket a new process takes over through, NULL if none
+    admission_config_t admission;
+    trace_config_t trace; // Sampled request trace file, path NULL if none
+    const char *capture_path; // File requests are captured to for replay, NULL if none
+    event_backend_t backend;
+} proxy_config_t;
 
 /**
- * Reads the full HTTP response from a server socket.
- * @param sockfd The socket file descriptor connected to the server.
- * @param data_length Pointer to store the total number of bytes read.
- * @return A malloc'd buffer containing the full response.
+ * Where a connection is in its single request/response exchange.
  */
-char* read_from_server(int sockfd, int *data_length);
+typedef enum {
+    CONN_READING_REQUEST,
+    CONN_QUEUED, // Waiting for an origin fetch slot
+    CONN_CONNECTING,
+    CONN_SENDING_REQUEST,
+    CONN_READING_RESPONSE,
+    CONN_SENDING_RESPONSE,
+    CONN_TUNNELLING,
+} connection_state_t;
+
+typedef struct proxy proxy_t;
 
 /**
- * Reads a complete HTTP request from the client socket.
- * @param sockfd The client socket file descriptor.
- * @return A malloc'd buffer containing the complete HTTP request.
+ * One client connection and, once it reaches the origin, its server connection.
+ * A CONNECT turns the pair into a tunnel that relays bytes both ways until both sides finish.
+ * A single timer is armed at the nearest of the deadlines that apply to the current state.
+ * Request, response and the strings parsed out of them live in pooled segments.
+ * A response too large to buffer is streamed: relayed to the client within STREAM_WINDOW,
+ * or filled into a chunked cache entry that the client reads like any other reader.
+ * With admission limits, a connection counts against its client once its request is in,
+ * and waits in the client's flows for fetch slots and send bandwidth.
+ * A sampled connection stamps its stages into a trace record, written out when it closes.
+ * With capture on, what the request got back is noted as well and written at the same point.
  */
-char* read_http_request(int sockfd);
+typedef struct connection connection_t;
+struct connection {
+    proxy_t *proxy;
+    connection_t *next_free; // Next closed connection in the proxy's pool
+    connection_state_t state;
+    int closed;
+    io_watch_t client;
+    io_watch_t server;
+    iochain_t client_out;
+    iochain_t server_out;
+    segment_chain_t request_in; // Request as read, the header block must fit the first segment
+    char *request;              // Data of request_in's first segment, NULL until the first read
+    segment_chain_t response;   // Response as read, the header block must fit the first segment
+    int response_header_size;   // 0 until the header block is complete
+    long content_length;        // -1 until known
+    long response_bytes;        // Response bytes read so far, including those already handed on
+    int streaming;              // Too large to buffer, handed on as it arrives
+    int fill_index;             // Chunked cache entry this connection fills, -1 if none
+    cache_reader_t reader;      // Place in the chunked cache entry being sent, index -1 if none
+    segment_chain_t scratch;    // Holds the strings below, and the Age lines and range headers queued on client_out
+    char *host;
+    char *uri;
+    char *range;
+    char *if_range;
+    char *full_request;
+    char *cache_key;
+    const char *peer;   // Cluster node a miss is fetched from, NULL when going to the origin
+    char *peer_request; // The request marked with PEER_HEADER, sent instead of request to the peer
+    int from_peer;      // The request came marked from another cluster node, the marker already removed
+    int pinned_index; // Cache entry this connection is sending from, -1 if none
+    client_t *client_entry; // Client the request was admitted for, NULL without admission limits
+    int fetching;          // Holds one of the proxy's origin fetch slots
+    drr_waiter_t fetch_wait;
+    drr_waiter_t send_wait;
+    long send_credit;      // Bytes the streamed response may still queue in this turn
+    unsigned long long request_id; // Passed to the USDT probes, and the trace record's id
+    int traced;                    // Sampled into the trace file
+    long long trace_started_us;    // Monotonic time of the accept, stage times count from it
+    trace_record_t trace;
+    capture_record_t capture; // Key set once the request is parsed, NULL if it has none
+    int captured;             // The response's status and size are in capture
+    resolve_request_t *resolving; // Lookup of the origin or peer still running, NULL if none
+    struct addrinfo *addresses;
+    struct addrinfo *candidates[MAX_CONNECT_ATTEMPTS]; // Addresses in racing order
+    int candidate_count;
+    int next_candidate;
+    io_watch_t attempts[MAX_CONNECT_ATTEMPTS]; // attempts[i] connects to candidates[i]
+    int attempts_in_flight;
+    timer_node_t attempt_timer; // Starts the next attempt if the pending ones are slow
+    timer_node_t timer;
+    int tunnel;                   // CONNECT request, host and uri hold the target authority
+    tunnel_direction_t upstream;  // Client to origin
+    tunnel_direction_t downstream; // Origin to client
+    long long tunnel_started_ms;
+    long long accepted_ms;
+    long long phase_started_ms; // Start of the connect or first-byte wait
+    long long last_activity_ms;
+};
 
 /**
- * Extracts the last header line from a full HTTP request.
- * @param request The full HTTP request string.
- * @return A malloc'd string containing the last header line.
+ * Proxy-wide state shared by every connection.
+ * The cache lives in a shared-memory segment. On an upgrade the new process receives the
+ * listener and the segment; the old one carries on with a private copy of the cache for
+ * its open connections and exits once they have all closed.
+ */
+struct proxy {
+    const proxy_config_t *config;
+    event_loop_t loop;
+    io_watch_t listener;
+    io_watch_t upgrade_listener; // A new process connects here to take over
+    io_watch_t previous;         // Connection to the process this one took over from, ends when it exits
+    cache_t *cache;              // NULL when caching is disabled
+    cache_t *shared_cache;       // The shared segment, the same as cache until a handoff
+    int cache_fd;                // Descriptor of the shared segment, -1 without a cache
+    int inherited_pins[CACHE_SIZE]; // Pins the previous process held, dropped once it exits
+    int active_connections;
+    int draining;                // Handed over, exits once the last connection closes
+    host_failure_cache_t host_failures;
+    address_failure_cache_t address_failures;
+    resolver_t resolver;
+    connection_t *free_connections; // Closed connections kept with their iochain arrays
+    int free_connection_count;
+    client_table_t clients;
+    admission_stats_t admission_stats;
+    admission_stats_t reported_stats; // As of the last summary, which is skipped if nothing changed
+    drr_scheduler_t fetch_scheduler;
+    drr_scheduler_t send_scheduler;
+    int active_fetches;
+    int scheduling_fetches;
+    int fetch_released; // A slot was freed while fetches were being scheduled
+    timer_node_t send_timer;
+    long long last_send_tick_ms;
+    timer_node_t report_timer;
+    unsigned long long next_request_id;
+    trace_writer_t tracer; // fd is -1 when tracing is off
+    capture_writer_t capture; // file is NULL when capture is off
+    timer_node_t flush_timer;
+};
+
+/**
+ * Sets the default deadlines.
+ * @param deadlines Pointer to the deadlines to initialize.
  */
-char* extract_last_header_line(char *request);
+void init_deadlines(deadline_config_t *deadlines);
 
 /**
- * Extracts the Host field from the HTTP request headers.
+ * Parses "header=10,connect=5,first-byte=30,idle=60,total=300,attempt-delay=0.25" in seconds,
+ * fractions allowed.
+ * Limits not listed keep their current value, 0 disables one.
+ * @param spec The option value.
+ * @param deadlines Deadlines to update.
+ * @return 0 on success, -1 on a malformed spec.
+ */
+int parse_deadlines(const char *spec, deadline_config_t *deadlines);
+
+/**
+ * Starts the proxy servr on the given port and runs its event loop forever
+ * @param config Startup options: listening port, whether to cache and the cache policy
+ */
+void start_proxy(const proxy_config_t *config);
+
+/**
+ * Finds the last header line of a full HTTP request in place.
  * @param request The full HTTP request string.
- * @return A malloc'd string containing the hostname.
+ * @param length Pointer to store the line's length.
+ * @return Pointer to the line inside request, or NULL if not found.
  */
-char* extract_host(char *request);
+const char *extract_last_header_line(const char *request, int *length);
 
 /**
- * Extracts the URI from the HTTP request line.
+ * Finds the Host field of the HTTP request headers in place.
  * @param request The full HTTP request string.
- * @return A malloc'd string containing the request URI.
+ * @param length Pointer to store the hostname's length.
+ * @return Pointer to the hostname inside request, or NULL if not found.
  */
-char* extract_request_uri(char *request);
+const char *extract_host(const char *request, int *length);
 
 /**
- * Forwards the HTTP request to the server and returns the response.
- * @param client_fd The client socket descriptor to send back the response.
- * @param server_fd The server socket descriptor to forward the request.
- * @param request The HTTP request string.
- * @param response_length Pointer to store the response length.
- * @return A malloc'd buffer containing the full response.
+ * Finds the URI of the HTTP request line in place.
+ * @param request The full HTTP request string.
+ * @param length Pointer to store the URI's length.
+ * @return Pointer to the URI inside request.
  */
-char *forward_request(int client_fd, int server_fd, char *request, int *response_length);
+const char *extract_request_uri(const char *request, int *length);
 
-#endif
\ No newline at end of file
+#endif
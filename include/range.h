@@ -0,0 +1,55 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include "iochain.h"
+
+#define MAX_RANGES 16
+#define RANGE_BOUNDARY "htproxy_byteranges"
+
+/**
+ * One satisfiable byte range, both ends inclusive.
+ */
+typedef struct {
+    long first;
+    long last;
+} byte_range_t;
+
+/**
+ * Parses a Range header value such as "bytes=0-99,200-,-50".
+ * @param range_value The Range header value.
+ * @param length Length of the full representation.
+ * @param ranges Array to fill with the satisfiable ranges.
+ * @param max_ranges Capacity of ranges.
+ * @return Number of satisfiable ranges, 0 if none are satisfiable,
+ *         or -1 if the header should be ignored (bad syntax, other unit, too many ranges).
+ */
+int parse_byte_ranges(const char *range_value, long length, byte_range_t *ranges, int max_ranges);
+
+/**
+ * Checks an If-Range validator against a stored 200 response.
+ * @param response The full response the ranges would be cut from.
+ * @param if_range The If-Range header value.
+ * @return 1 if the validator matches the stored ETag or Last-Modified, 0 otherwise.
+ */
+int if_range_matches(const char *response, const char *if_range);
+
+/**
+ * Answers a Range request from a full 200 response held in memory.
+ * Slices are queued straight from body without copying, a single range as a plain 206
+ * and several as multipart/byteranges. body must stay valid until out is sent.
+ * The status line and framing are written into scratch, so answering allocates nothing.
+ * @param out Chain the answer is queued on.
+ * @param scratch Chain the headers are written into, out holds references to what it queues.
+ * @param headers Header block of the full response.
+ * @param header_size Length of the header block including the final \r\n\r\n.
+ * @param body Body of the full response, in as many pieces as it is stored.
+ * @param body_count Number of iovecs in body.
+ * @param body_size Length of the body.
+ * @param range_value The Range header value from the client.
+ * @return 0 if a 206 or 416 was queued, 1 if the range was ignored and the caller
+ *         should send the full response, or -1 on error.
+ */
+int serve_byte_ranges(iochain_t *out, segment_chain_t *scratch, const char *headers, int header_size,
+                      const struct iovec *body, int body_count, long body_size, const char *range_value);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <pthread.h>
+#include <netdb.h>
+#include "event.h"
+#include "negative.h"
+
+#define RESOLVER_THREADS 4 // Lookups in flight at once, more wait in line
+
+typedef struct resolve_request resolve_request_t;
+
+/**
+ * One name lookup. Owned by the resolver from start_resolve until its callback
+ * has run, or until it is dropped after cancel_resolve.
+ */
+struct resolve_request {
+    resolve_request_t *next;
+    char name[HOST_NAME_SIZE];
+    char port[8];
+    struct addrinfo *addresses; // Result, NULL if the lookup failed
+    int cancelled;              // The callback must not run, the result is thrown away
+    void (*on_resolved)(void *data, struct addrinfo *addresses);
+    void *data;
+};
+
+/**
+ * Runs getaddrinfo on a few threads so a slow DNS server never stalls the event loop.
+ * Finished lookups are queued for the loop, which is woken through an eventfd and
+ * runs their callbacks on its own thread.
+ */
+typedef struct {
+    pthread_t threads[RESOLVER_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    resolve_request_t *pending_head; // Waiting for a thread
+    resolve_request_t *pending_tail;
+    resolve_request_t *done;         // Finished, waiting for the loop
+    io_watch_t notify;               // Readable eventfd while done is not empty
+} resolver_t;
+
+/**
+ * Starts the resolver threads and watches for their results on a loop.
+ * @param resolver Pointer to the resolver.
+ * @param loop Loop the callbacks run on.
+ * @return 0 on success, -1 on failure.
+ */
+int init_resolver(resolver_t *resolver, event_loop_t *loop);
+
+/**
+ * Looks up both IPv6 and IPv4 addresses of a Host value in the background.
+ * @param resolver Pointer to the resolver.
+ * @param host Host value, e.g. "example.com:8080", split with split_host_port.
+ * @param on_resolved Called on the loop with the addresses, which the callback
+ *                    owns and frees with freeaddrinfo, or NULL if the lookup failed.
+ * @param data Passed to on_resolved.
+ * @return The request, to cancel it, or NULL if it could not be started, e.g. for a malformed host.
+ */
+resolve_request_t *start_resolve(resolver_t *resolver, const char *host,
+                                 void (*on_resolved)(void *data, struct addrinfo *addresses), void *data);
+
+/**
+ * Makes sure a lookup's callback never runs, e.g. because its connection closed.
+ * A lookup already running finishes on its thread and its result is freed.
+ * @param resolver Pointer to the resolver.
+ * @param request Request returned by start_resolve whose callback has not run yet.
+ */
+void cancel_resolve(resolver_t *resolver, resolve_request_t *request);
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <sys/uio.h>
+
+#define SEGMENT_SIZE 16384      // Payload bytes per segment, one read buffer's worth
+#define SEGMENT_POOL_MAX 1024   // Free segments a thread keeps, the rest go back to malloc
+
+typedef struct segment segment_t;
+
+/**
+ * Fixed-size, reference counted I/O buffer. Segments come from a per-thread pool and
+ * return to it when the last reference is released, so steady-state traffic reuses
+ * the same memory instead of calling malloc.
+ */
+struct segment {
+    segment_t *next; // Next segment of a chain, or of the free pool
+    int refs;
+    int length;
+    char data[SEGMENT_SIZE + 1]; // +1 keeps room for a terminating NUL
+};
+
+/**
+ * Bytes held in a list of segments, filled one segment at a time.
+ */
+typedef struct {
+    segment_t *head;
+    segment_t *tail;
+    int count;
+    long length;
+} segment_chain_t;
+
+/**
+ * Takes an empty segment with one reference, from the pool if it has one.
+ * @return The segment, or NULL on error.
+ */
+segment_t *alloc_segment(void);
+
+/**
+ * Adds a reference to a segment.
+ * @param segment Pointer to the segment.
+ */
+void hold_segment(segment_t *segment);
+
+/**
+ * Drops a reference, returning the segment to the pool after the last one.
+ * @param segment Pointer to the segment, may be NULL.
+ */
+void release_segment(segment_t *segment);
+
+/**
+ * Initializes an empty chain.
+ * @param chain Pointer to the chain.
+ */
+void init_segment_chain(segment_chain_t *chain);
+
+/**
+ * Copies bytes to the end of the chain, taking new segments as the tail fills up.
+ * Every segment stays NUL-terminated.
+ * @param chain Pointer to the chain.
+ * @param data Bytes to copy.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 on error.
+ */
+int append_segment_chain(segment_chain_t *chain, const char *data, long length);
+
+/**
+ * Copies a string into contiguous space at the end of the chain, for strings that
+ * live as long as the chain.
+ * @param chain Pointer to the chain.
+ * @param data Bytes to copy.
+ * @param length Number of bytes, less than SEGMENT_SIZE.
+ * @return The NUL-terminated copy, or NULL on error.
+ */
+char *copy_to_segment_chain(segment_chain_t *chain, const char *data, int length);
+
+/**
+ * Reserves contiguous space at the end of the chain, for callers that write into it directly.
+ * @param chain Pointer to the chain.
+ * @param length Number of bytes, at most SEGMENT_SIZE.
+ * @return Pointer to the space, or NULL on error.
+ */
+char *reserve_segment_chain(segment_chain_t *chain, int length);
+
+/**
+ * Formats a string, as snprintf would, into contiguous space at the end of the chain.
+ * The string lives in the chain's tail segment at the time of the call.
+ * @param chain Pointer to the chain.
+ * @param length Pointer to store the string's length, without the terminating NUL.
+ * @param format printf-style format.
+ * @return The NUL-terminated string, or NULL on error or if it does not fit one segment.
+ */
+char *format_segment_chain(segment_chain_t *chain, int *length, const char *format, ...);
+
+/**
+ * Takes the first segment off the chain, the chain's reference passes to the caller.
+ * @param chain Pointer to the chain.
+ * @return The segment, or NULL if the chain is empty.
+ */
+segment_t *pop_segment_chain(segment_chain_t *chain);
+
+/**
+ * Links a segment at the end of the chain, the caller's reference passes to the chain.
+ * The segment must not be linked into another chain.
+ * @param chain Pointer to the chain.
+ * @param segment Pointer to the segment.
+ */
+void push_segment_chain(segment_chain_t *chain, segment_t *segment);
+
+/**
+ * Describes the chain's bytes as iovecs.
+ * @param chain Pointer to the chain.
+ * @param iov Array to fill.
+ * @param max Size of iov.
+ * @return Number of iovecs, or -1 if the chain has more than max segments.
+ */
+int segment_chain_iov(const segment_chain_t *chain, struct iovec *iov, int max);
+
+/**
+ * Releases every segment of the chain and empties it.
+ * @param chain Pointer to the chain.
+ */
+void free_segment_chain(segment_chain_t *chain);
+
+#endif
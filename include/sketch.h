@@ -0,0 +1,41 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024        // Must be a power of two
+#define SKETCH_MAX_COUNT 15      // Counters saturate like 4-bit counters
+#define SKETCH_SAMPLE_FACTOR 10  // Age after this many additions per cache slot
+
+/**
+ * Count-min sketch estimating how often each key has been requested recently.
+ * Counters are halved every sample period so old popularity fades out.
+ */
+typedef struct {
+    unsigned char counters[SKETCH_DEPTH][SKETCH_WIDTH];
+    unsigned int additions;
+    unsigned int sample_size;
+} frequency_sketch_t;
+
+/**
+ * Initializes an empty sketch.
+ * @param sketch Pointer to the sketch to initialize.
+ * @param capacity Number of entries in the cache the sketch is guarding.
+ */
+void init_sketch(frequency_sketch_t *sketch, int capacity);
+
+/**
+ * Records one access of a key, aging the sketch when the sample period ends.
+ * @param sketch Pointer to the sketch.
+ * @param key The key that was accessed.
+ */
+void increment_sketch(frequency_sketch_t *sketch, const char *key);
+
+/**
+ * Estimates how often a key has been accessed within the recent history.
+ * @param sketch Pointer to the sketch.
+ * @param key The key to look up.
+ * @return Estimated access count, between 0 and SKETCH_MAX_COUNT.
+ */
+int estimate_frequency(const frequency_sketch_t *sketch, const char *key);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_TICK_MS 10 // Level 0 covers 640ms, level 3 about 46 hours
+
+/**
+ * A timer embedded in its owner. Arming and cancelling only link or unlink the node,
+ * so both are O(1) no matter how many timers are armed.
+ */
+typedef struct timer_node {
+    struct timer_node *next;
+    struct timer_node *prev;
+    unsigned long long expires; // In ticks
+    void (*callback)(struct timer_node *timer);
+    void *data;
+} timer_node_t;
+
+/**
+ * Hierarchical timer wheel: level 0 has one slot per tick, each higher level has one
+ * slot per full turn of the level below. Timers cascade down as their time approaches.
+ */
+typedef struct {
+    unsigned long long current_tick;
+    int armed_count;
+    timer_node_t slots[WHEEL_LEVELS][WHEEL_SLOTS]; // List heads
+} timer_wheel_t;
+
+/**
+ * Reads the monotonic clock.
+ * @return Milliseconds since an arbitrary fixed point.
+ */
+long long current_time_ms(void);
+
+/**
+ * Initializes an empty wheel starting at the given time.
+ * @param wheel Pointer to the wheel.
+ * @param now_ms Current time from current_time_ms.
+ */
+void init_timer_wheel(timer_wheel_t *wheel, long long now_ms);
+
+/**
+ * Initializes a timer so it can be armed and safely cancelled.
+ * @param timer Pointer to the timer.
+ * @param callback Function called when the timer fires.
+ * @param data Owner pointer, available to the callback as timer->data.
+ */
+void init_timer(timer_node_t *timer, void (*callback)(timer_node_t *timer), void *data);
+
+/**
+ * Arms (or re-arms) a timer to fire at an absolute time.
+ * @param wheel Pointer to the wheel.
+ * @param timer Pointer to the timer.
+ * @param expires_ms Absolute time in milliseconds from current_time_ms.
+ */
+void arm_timer(timer_wheel_t *wheel, timer_node_t *timer, long long expires_ms);
+
+/**
+ * Cancels a timer. Cancelling a timer that is not armed does nothing.
+ * @param wheel Pointer to the wheel.
+ * @param timer Pointer to the timer.
+ */
+void cancel_timer(timer_wheel_t *wheel, timer_node_t *timer);
+
+/**
+ * Checks whether a timer is armed.
+ * @param timer Pointer to the timer.
+ * @return 1 if armed, 0 otherwise.
+ */
+int timer_armed(const timer_node_t *timer);
+
+/**
+ * Advances the wheel to the given time, firing every timer that expired on the way.
+ * Callbacks may arm and cancel timers, including their own.
+ * @param wheel Pointer to the wheel.
+ * @param now_ms Current time from current_time_ms.
+ */
+void advance_timer_wheel(timer_wheel_t *wheel, long long now_ms);
+
+/**
+ * Computes how long the event loop may sleep before the wheel needs advancing.
+ * @param wheel Pointer to the wheel.
+ * @param now_ms Current time from current_time_ms.
+ * @return Milliseconds to sleep, or -1 if no timer is armed.
+ */
+int next_timer_timeout(timer_wheel_t *wheel, long long now_ms);
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/**
+ * Static USDT probes under the provider "htproxy", for example
+ *   bpftrace -e 'usdt:./htproxy:htproxy:origin__connected { @[arg0] = nsecs; }'
+ * With sys/sdt.h each probe is a single nop plus a note in the binary, and its arguments
+ * are only read by an attached tracer. Without the header the probes compile away.
+ * Arguments must be cheap to evaluate, they are evaluated whether or not anyone listens.
+ */
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_USDT_PROBES
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(htproxy, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(htproxy, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(htproxy, name, a, b, c)
+#else
+#define TRACE_PROBE1(name, a) ((void) (a))
+#define TRACE_PROBE2(name, a, b) ((void) (a), (void) (b))
+#define TRACE_PROBE3(name, a, b, c) ((void) (a), (void) (b), (void) (c))
+#endif
+
+#define TRACE_MAGIC "HTPTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_RECORDS 64      // Records collected before they are written out
+#define TRACE_NOT_REACHED UINT32_MAX // Stage time of a stage the request never got to
+
+/**
+ * Points in a request's life a trace record stamps, in the order a miss passes them.
+ * A hit goes from TRACE_REQUEST_READ straight to TRACE_CLOSED.
+ */
+typedef enum {
+    TRACE_ACCEPTED,      // Connection accepted
+    TRACE_REQUEST_READ,  // Request header block complete
+    TRACE_FETCH_STARTED, // Fetch slot granted, resolving the origin
+    TRACE_RESOLVED,      // Origin addresses resolved
+    TRACE_CONNECTED,     // Connect race won
+    TRACE_REQUEST_SENT,  // Request written to the origin
+    TRACE_FIRST_BYTE,    // First response byte from the origin
+    TRACE_RESPONSE_READ, // Last response byte from the origin
+    TRACE_CLOSED,        // Response sent, or the connection failed
+    TRACE_STAGE_COUNT,
+} trace_stage_t;
+
+/**
+ * What the cache made of the request.
+ */
+typedef enum {
+    TRACE_CACHE_NONE, // Not looked up: caching off, not a GET, or a tunnel
+    TRACE_CACHE_HIT,
+    TRACE_CACHE_MISS,
+    TRACE_CACHE_STALE,
+} trace_cache_result_t;
+
+/**
+ * One sampled request as written to the trace file, 64 bytes in host byte order.
+ * stage_us holds microseconds since TRACE_ACCEPTED, TRACE_NOT_REACHED for skipped stages.
+ */
+typedef struct {
+    uint64_t request_id;
+    int64_t accepted_us; // Wall clock time of the accept, microseconds since the epoch
+    int64_t bytes;       // Response bytes read from the origin or stored in the cache
+    uint32_t stage_us[TRACE_STAGE_COUNT];
+    uint16_t status;      // Status sent to the client, 0 if none was
+    uint8_t cache_result; // A trace_cache_result_t
+    uint8_t tunnel;
+} trace_record_t;
+
+/**
+ * Start of a trace file, followed by records until the end of the file.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} trace_file_header_t;
+
+/**
+ * Options for the trace file, path NULL when tracing is off.
+ * sample: one request in this many is traced.
+ */
+typedef struct {
+    const char *path;
+    int sample;
+} trace_config_t;
+
+/**
+ * Open trace file with the records not written yet.
+ */
+typedef struct {
+    int fd;
+    int sample;
+    unsigned long seen; // Requests considered for sampling
+    long written;       // Records written so far
+    trace_record_t buffer[TRACE_BUFFER_RECORDS];
+    int count;
+} trace_writer_t;
+
+/**
+ * Parses "file=/var/tmp/htproxy.trace,sample=100". The file is required, sample defaults to 1.
+ * @param spec The option value.
+ * @param config Options to fill in.
+ * @return 0 on success, -1 on a malformed spec.
+ */
+int parse_trace_config(const char *spec, trace_config_t *config);
+
+/**
+ * Opens the trace file for appending, writing its header if the file is new.
+ * An existing file must be a trace of the same version.
+ * @param writer Pointer to the writer.
+ * @param config Path and sampling rate.
+ * @return 0 on success, -1 on error.
+ */
+int open_trace_writer(trace_writer_t *writer, const trace_config_t *config);
+
+/**
+ * Decides whether the next request is traced.
+ * @param writer Pointer to the writer, or one whose fd is -1 if tracing is off.
+ * @return 1 if the request should be traced, 0 otherwise.
+ */
+int trace_sampled(trace_writer_t *writer);
+
+/**
+ * Starts a record with every stage unreached.
+ * @param record Pointer to the record.
+ * @param request_id Id of the request.
+ */
+void init_trace_record(trace_record_t *record, uint64_t request_id);
+
+/**
+ * Queues a finished record, writing the buffer out once it is full.
+ * @param writer Pointer to the writer.
+ * @param record The record.
+ */
+void write_trace_record(trace_writer_t *writer, const trace_record_t *record);
+
+/**
+ * Writes out the queued records.
+ * @param writer Pointer to the writer.
+ * @return 0 on success, -1 on error.
+ */
+int flush_trace_writer(trace_writer_t *writer);
+
+/**
+ * Reads and checks a trace file's header.
+ * @param fd Descriptor of the file, read from its current offset.
+ * @return 0 if the file is a trace of this version, -1 otherwise.
+ */
+int read_trace_header(int fd);
+
+/**
+ * Monotonic clock in microseconds, for stage times.
+ * @return Current time.
+ */
+long long trace_time_us(void);
+
+/**
+ * Wall clock in microseconds since the epoch.
+ * @return Current time.
+ */
+long long trace_wall_time_us(void);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#define TUNNEL_CHUNK 65536 // Bytes moved into the pipe per splice, one default pipe's worth
+
+/**
+ * One direction of a CONNECT tunnel. Bytes move from the source socket into a pipe
+ * and from the pipe into the destination socket with splice, so they never pass
+ * through user space.
+ */
+typedef struct {
+    int pipe_fds[2]; // -1 until opened
+    long pending;    // Bytes sitting in the pipe
+    int eof;         // Source has finished sending
+    int shut;        // Destination's write side has been shut down
+    long bytes;      // Bytes delivered to the destination
+} tunnel_direction_t;
+
+/**
+ * Initializes a direction without opening its pipe, so it can always be freed.
+ * @param direction Pointer to the direction.
+ */
+void init_tunnel_direction(tunnel_direction_t *direction);
+
+/**
+ * Opens the pipe a direction splices through.
+ * @param direction Pointer to the direction.
+ * @return 0 on success, -1 on error.
+ */
+int open_tunnel_direction(tunnel_direction_t *direction);
+
+/**
+ * Queues bytes that were already read from the source, e.g. sent right after the CONNECT.
+ * @param direction Pointer to the direction.
+ * @param data Bytes to relay.
+ * @param length Number of bytes, at most one pipe's capacity.
+ * @return 0 on success, -1 on error.
+ */
+int prime_tunnel_direction(tunnel_direction_t *direction, const char *data, long length);
+
+/**
+ * Moves as many bytes as both sockets allow without blocking. Once the source has
+ * finished and the pipe is drained, the destination's write side is shut down so
+ * the half-close reaches the other peer.
+ * @param direction Pointer to the direction.
+ * @param source_fd Non-blocking socket to read from.
+ * @param destination_fd Non-blocking socket to write to.
+ * @param want_read Set to 1 if the direction is waiting for the source to be readable.
+ * @param want_write Set to 1 if the direction is waiting for the destination to be writable.
+ * @return 1 if any bytes moved, 0 if none did, -1 on error.
+ */
+int pump_tunnel_direction(tunnel_direction_t *direction, int source_fd, int destination_fd, int *want_read,
+                          int *want_write);
+
+/**
+ * Closes a direction's pipe.
+ * @param direction Pointer to the direction.
+ */
+void free_tunnel_direction(tunnel_direction_t *direction);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stddef.h>
+
+#define HANDOFF_MAGIC 0x68747075 // "htpu"
+
+/**
+ * What the running proxy sends a new one along with its descriptors.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int cache_size; // Size of the shared cache segment, 0 if no segment is passed
+} handoff_header_t;
+
+/**
+ * Creates an anonymous shared-memory segment, which can be passed to another process.
+ * @param size Size of the segment.
+ * @param fd Pointer to store the segment's descriptor.
+ * @return The segment mapped read-write, or NULL on error.
+ */
+void *create_shared_segment(size_t size, int *fd);
+
+/**
+ * Maps a segment received from another process.
+ * @param fd The segment's descriptor.
+ * @param size Size of the segment.
+ * @return The mapping, or NULL on error.
+ */
+void *map_shared_segment(int fd, size_t size);
+
+/**
+ * Binds the Unix socket a later proxy connects to for the handoff, replacing a stale one.
+ * @param path Path of the socket.
+ * @return Non-blocking listening descriptor, or -1 on error.
+ */
+int open_upgrade_socket(const char *path);
+
+/**
+ * Asks the proxy listening on path to hand over its listener and cache. Blocks until it answers.
+ * @param path Path of the running proxy's upgrade socket.
+ * @param listen_fd Pointer to store the received listening socket.
+ * @param cache_fd Pointer to store the received cache segment, -1 if none was sent.
+ * @param cache_size Pointer to store the segment's size.
+ * @param control_fd Pointer to store the connection to the old proxy, which ends when it exits.
+ * @return 0 on a handoff, 1 if no proxy is listening on path, -1 on error.
+ */
+int request_handoff(const char *path, int *listen_fd, int *cache_fd, size_t *cache_size, int *control_fd);
+
+/**
+ * Sends the listening socket and the cache segment to a new proxy.
+ * @param control_fd Connection accepted on the upgrade socket.
+ * @param listen_fd The listening socket.
+ * @param cache_fd The cache segment, -1 for none.
+ * @param cache_size Size of the segment.
+ * @return 0 on success, -1 on error.
+ */
+int send_handoff(int control_fd, int listen_fd, int cache_fd, size_t cache_size);
+
+#endif
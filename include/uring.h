@@ -0,0 +1,134 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "event.h"
+
+#define URING_ENTRIES 1024      // Submission queue size, the completion queue gets four times that
+#define URING_BUFFER_COUNT 256  // Provided receive buffers of READ_BUFFER_SIZE, a power of two
+#define URING_BUFFER_GROUP 0    // Group id of the provided buffer ring
+#define URING_MAX_FILES 4096    // Registered file table, indexed by descriptor number
+#define URING_SEND_LINKS 4      // Linked sendmsg operations per write, IOCHAIN_SEND_MAX iovecs each
+#define URING_INIT_OPS 1024
+
+/**
+ * One operation submitted to the ring. Its index is the completion's user_data, so
+ * completions that arrive after its watch is closed find no watch and are dropped.
+ */
+typedef struct {
+    io_watch_t *watch; // NULL once the watch is closed or for operations without one
+    int type;
+    int cancelled;      // Cancel submitted, completions still arriving are ignored
+    int next;           // Next operation of the same watch, or next free operation
+    int prev;
+    int file;           // Descriptor value for IORING_OP_FILES_UPDATE
+    struct msghdr message;
+    struct sockaddr_storage address;
+} uring_op_t;
+
+/**
+ * io_uring instance driven with raw system calls: the mapped submission and completion
+ * rings, the provided buffer ring for receives and the operation table.
+ */
+struct uring {
+    int ring_fd;
+    int enter_fd;       // Registered ring index when enter_flags has IORING_ENTER_REGISTERED_RING
+    unsigned int enter_flags;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;       // Same as sq_map with IORING_FEAT_SINGLE_MMAP
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sqe_tail; // Local tail, published on submit
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buffer_ring;
+    size_t buffer_ring_size;
+    char *buffers;
+    int multishot_recv; // Cleared if the kernel turns multishot receives down
+    unsigned char *files; // files[fd] is set while fd is in the registered table, NULL if not used
+    uring_op_t *ops;
+    int op_capacity;
+    int free_ops;
+};
+
+/**
+ * Sets up the ring, the provided buffer ring and the registered file table, checking that
+ * the kernel supports every operation the backend uses.
+ * @param ring Pointer to the ring.
+ * @return 0 on success, -1 if io_uring is unavailable (everything is released).
+ */
+int init_uring(uring_t *ring);
+
+/**
+ * Releases the ring and everything mapped for it.
+ * @param ring Pointer to the ring.
+ */
+void free_uring(uring_t *ring);
+
+/**
+ * Starts a multishot accept, re-armed whenever the kernel ends it.
+ * @param watch Watch of the listening socket.
+ * @return 0 on success, -1 on error.
+ */
+int uring_start_accept(io_watch_t *watch);
+
+/**
+ * Starts a multishot receive into provided buffers, unless one is already running.
+ * @param watch Pointer to the watch.
+ * @return 0 on success, -1 on error.
+ */
+int uring_start_read(io_watch_t *watch);
+
+/**
+ * Cancels the watch's receive. Data it still completes with is held for the next start_read.
+ * @param watch Pointer to the watch.
+ */
+void uring_stop_read(io_watch_t *watch);
+
+/**
+ * Queues watch->out as linked sendmsg operations.
+ * @param watch Pointer to the watch.
+ * @return 0 on success, -1 on error.
+ */
+int uring_start_write(io_watch_t *watch);
+
+/**
+ * Queues a connect.
+ * @param watch Pointer to the watch.
+ * @param address Address to connect to, copied.
+ * @param address_length Length of address.
+ * @return 0 on success, -1 on error.
+ */
+int uring_start_connect(io_watch_t *watch, const struct sockaddr *address, socklen_t address_length);
+
+/**
+ * Arms a one-shot poll for watch->poll_events, replacing one armed for other events.
+ * @param watch Pointer to the watch.
+ * @return 0 on success, -1 on error.
+ */
+int uring_update_poll(io_watch_t *watch);
+
+/**
+ * Cancels the watch's operations and drops its registered file before the socket is closed.
+ * @param watch Pointer to the watch.
+ */
+void uring_close_watch(io_watch_t *watch);
+
+/**
+ * Submits queued operations, waits up to timeout for completions and dispatches them.
+ * @param ring Pointer to the ring.
+ * @param timeout Milliseconds to wait, -1 for no limit.
+ */
+void uring_wait(uring_t *ring, int timeout);
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "admission.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Tokens a full bucket holds, at least one so that slow rates still admit requests
+static double bucket_size(const admission_config_t *config) {
+    double burst = config->burst > 0 ? config->burst : config->rate;
+    return burst > 1 ? burst : 1;
+}
+
+// Adds the tokens earned since the last refill, up to the burst size
+static void refill_tokens(client_t *client, const admission_config_t *config, long long now_ms) {
+    double burst = bucket_size(config);
+
+    client->tokens += (now_ms - client->refilled_ms) * config->rate / 1000.0;
+    if (client->tokens > burst) {
+        client->tokens = burst;
+    }
+    client->refilled_ms = now_ms;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+// Parses "rate=20,burst=40,requests=8,fetches=32,bandwidth=10", limits not listed stay disabled
+int parse_admission(const char *spec, admission_config_t *config) {
+    char *spec_copy = strdup(spec);
+    if (!spec_copy) {
+        perror("strdup");
+        return -1;
+    }
+
+    char *item = strtok(spec_copy, ",");
+    while (item) {
+        char *value = strchr(item, '=');
+        char *end;
+        if (!value) {
+            free(spec_copy);
+            return -1;
+        }
+        *value++ = '\0';
+
+        double number = strtod(value, &end);
+        if (end == value || *end != '\0' || number < 0) {
+            free(spec_copy);
+            return -1;
+        }
+
+        if (strcasecmp(item, "rate") == 0) {
+            config->rate = number;
+        } else if (strcasecmp(item, "burst") == 0) {
+            config->burst = number;
+        } else if (strcasecmp(item, "requests") == 0) {
+            config->max_requests = (int) number;
+        } else if (strcasecmp(item, "fetches") == 0) {
+            config->max_fetches = (int) number;
+        } else if (strcasecmp(item, "bandwidth") == 0) {
+            config->bandwidth = (long) (number * 1024 * 1024);
+        } else {
+            free(spec_copy);
+            return -1;
+        }
+
+        item = strtok(NULL, ",");
+    }
+
+    free(spec_copy);
+    return 0;
+}
+
+int admission_enabled(const admission_config_t *config) {
+    return config->rate > 0 || config->max_requests > 0 || config->max_fetches > 0 || config->bandwidth > 0;
+}
+
+void init_client_table(client_table_t *clients) {
+    for (int i = 0; i < CLIENT_TABLE_SIZE; i++) {
+        clients->entries[i].valid = 0;
+        clients->entries[i].address[0] = '\0';
+        clients->entries[i].active = 0;
+        init_drr_flow(&clients->entries[i].fetches);
+        init_drr_flow(&clients->entries[i].sends);
+    }
+}
+
+// A client with requests in progress keeps its slot, its connections point into it
+client_t *find_client(client_table_t *clients, const char *address, const admission_config_t *config,
+                      long long now_ms) {
+    int index = -1;
+
+    for (int i = 0; i < CLIENT_TABLE_SIZE; i++) {
+        client_t *client = &clients->entries[i];
+        if (client->valid && strcmp(client->address, address) == 0) {
+            client->last_seen_ms = now_ms;
+            return client;
+        }
+        if (client->active > 0) {
+            continue;
+        }
+        if (index == -1 || !client->valid ||
+            (clients->entries[index].valid && client->last_seen_ms < clients->entries[index].last_seen_ms)) {
+            index = i;
+        }
+    }
+
+    if (index == -1) {
+        return NULL;
+    }
+
+    client_t *client = &clients->entries[index];
+    client->valid = 1;
+    strncpy(client->address, address, INET6_ADDRSTRLEN - 1);
+    client->address[INET6_ADDRSTRLEN - 1] = '\0';
+    client->tokens = bucket_size(config);
+    client->refilled_ms = now_ms;
+    client->last_seen_ms = now_ms;
+    client->active = 0;
+    init_drr_flow(&client->fetches);
+    init_drr_flow(&client->sends);
+    return client;
+}
+
+admission_result_t admit_request(client_t *client, const admission_config_t *config, long long now_ms) {
+    if (config->max_requests > 0 && client->active >= config->max_requests) {
+        return ADMIT_TOO_MANY_REQUESTS;
+    }
+
+    if (config->rate > 0) {
+        refill_tokens(client, config, now_ms);
+        if (client->tokens < 1) {
+            return ADMIT_RATE_LIMITED;
+        }
+        client->tokens -= 1;
+    }
+
+    client->active++;
+    return ADMIT_OK;
+}
+
+void finish_request(client_t *client) {
+    client->active--;
+}
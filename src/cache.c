@@ -3,10 +3,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <ctype.h>
 #include <time.h>
 #include <sys/socket.h>
+#include <zlib.h>
 
 #include "cache.h"
+#include "http.h"
+#include "range.h"
+#include "trace.h"
+
+#define CHUNK_IOV_MAX (SEGMENT_SIZE / (int) sizeof(struct iovec)) // Chunks one pooled segment can describe
 
 unsigned long usage_counter = 0;
 const char *cache_control_keywords[] = {
@@ -18,11 +25,579 @@ const char *cache_control_keywords[] = {
     "proxy-revalidate",
 };
 
+// Content types worth compressing; anything else (images, video, archives) is stored as-is
+const char *compressible_types[] = {
+    "text/",
+    "application/json",
+    "application/javascript",
+    "application/xml",
+    "application/xhtml+xml",
+    "image/svg+xml",
+};
+
+// Scratch space for deflate output before it is copied into a body
+static char compress_buffer[RESPONSE_SIZE];
+
+// zlib streams are set up once and reset per use, their state is sizeable to allocate per response
+static z_stream deflater;
+static int deflater_ready = 0;
+static z_stream inflater;
+static int inflater_ready = 0;
+
+const char *cache_policy_names[] = {
+    [CACHE_POLICY_LRU] = "lru",
+    [CACHE_POLICY_WTINYLFU] = "wtinylfu",
+};
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Counts the valid entries currently in the given segment
+static int count_segment(cache_t *cache, cache_segment_t segment) {
+    int count = 0;
+
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cache->entries[i].valid == 1 && cache->entries[i].segment == segment) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// Returns the index of the least recently used unpinned entry in the segment, or -1 if none
+static int find_segment_lru(cache_t *cache, cache_segment_t segment) {
+    int lru_index = -1;
+    unsigned long lru_time = (unsigned long) -1;
+
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cache->entries[i].valid == 1 && cache->entries[i].pins == 0 && cache->entries[i].segment == segment &&
+            cache->entries[i].last_used < lru_time) {
+            lru_index = i;
+            lru_time = cache->entries[i].last_used;
+        }
+    }
+
+    return lru_index;
+}
+
+// Moves an entry to the most recently used end of another segment
+static void move_to_segment(cache_t *cache, int index, cache_segment_t segment) {
+    cache->entries[index].segment = segment;
+    update_last_used(cache, index, &usage_counter);
+}
+
+// Evicts the entry at index, copying its key into evicted_key unless that is NULL
+static int take_cache_entry(cache_t *cache, int index, char *evicted_key) {
+    if (evicted_key) {
+        strncpy(evicted_key, cache->entries[index].key, REQUEST_SIZE);
+        evicted_key[REQUEST_SIZE] = '\0';
+    }
+
+    evict_cache_entry(cache, index);
+    return 0;
+}
+
+// Copies a Vary header value as a lowercased, comma-separated list of names without spaces
+// Returns 0 on success, -1 if it does not fit
+static int normalize_vary(const char *vary_value, int vary_length, char *out, int out_size) {
+    int written = 0;
+
+    for (const char *p = vary_value; p < vary_value + vary_length; p++) {
+        if (*p == ' ' || *p == '\t') {
+            continue;
+        }
+        if (written + 1 >= out_size) {
+            return -1;
+        }
+        out[written++] = tolower((unsigned char) *p);
+    }
+
+    out[written] = '\0';
+    return 0;
+}
+
+// Serializes the request's values of the headers listed in vary as "name=value\n" pairs.
+// Accept-Encoding is reduced to whether gzip is accepted, and skipped entirely for entries
+// we compressed ourselves since those can be served to either kind of client.
+// Returns 0 on success, -1 if it does not fit
+static int build_variant(const char *request, const char *vary, int skip_accept_encoding, char *out, int out_size) {
+    char names[VARY_SIZE];
+    int written = 0;
+
+    out[0] = '\0';
+    if (!request || vary[0] == '\0') {
+        return 0;
+    }
+
+    strncpy(names, vary, VARY_SIZE - 1);
+    names[VARY_SIZE - 1] = '\0';
+
+    char *saveptr;
+    char *name = strtok_r(names, ",", &saveptr);
+    while (name) {
+        char header_name[VARY_SIZE + 1];
+        snprintf(header_name, sizeof(header_name), "%s:", name);
+
+        const char *normalized = "";
+        int normalized_length = 0;
+        if (strcmp(name, "accept-encoding") == 0) {
+            if (skip_accept_encoding) {
+                name = strtok_r(NULL, ",", &saveptr);
+                continue;
+            }
+            normalized = accepts_gzip(request) ? "gzip" : "identity";
+            normalized_length = strlen(normalized);
+        } else {
+            const char *value = find_header(request, header_name, &normalized_length);
+            if (value) {
+                normalized = value;
+            } else {
+                normalized_length = 0;
+            }
+        }
+
+        int size = snprintf(out + written, out_size - written, "%s=%.*s\n", name, normalized_length, normalized);
+        if (size >= out_size - written) {
+            return -1;
+        }
+        written += size;
+
+        name = strtok_r(NULL, ",", &saveptr);
+    }
+
+    return 0;
+}
+
+// Checks whether the response has an unencoded body of a text-like content type
+static int is_compressible(const char *response) {
+    int length;
+    if (find_header(response, "Content-Encoding:", &length)) {
+        return 0;
+    }
+
+    const char *content_type = find_header(response, "Content-Type:", &length);
+    if (!content_type) {
+        return 0;
+    }
+
+    int type_count = sizeof(compressible_types) / sizeof(compressible_types[0]);
+    for (int i = 0; i < type_count; i++) {
+        int type_length = strlen(compressible_types[i]);
+        if (length >= type_length && strncasecmp(content_type, compressible_types[i], type_length) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Returns the shared deflater ready for a new gzip stream, or NULL on error
+static z_stream *reset_deflater(void) {
+    if (deflater_ready) {
+        return deflateReset(&deflater) == Z_OK ? &deflater : NULL;
+    }
+
+    // 16 + MAX_WBITS asks zlib for a gzip wrapper instead of a raw zlib stream
+    memset(&deflater, 0, sizeof(deflater));
+    if (deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        return NULL;
+    }
+    deflater_ready = 1;
+    return &deflater;
+}
+
+// Returns the shared inflater ready for a new gzip stream, or NULL on error
+static z_stream *reset_inflater(void) {
+    if (inflater_ready) {
+        return inflateReset(&inflater) == Z_OK ? &inflater : NULL;
+    }
+
+    memset(&inflater, 0, sizeof(inflater));
+    if (inflateInit2(&inflater, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "inflateInit2 failed\n");
+        return NULL;
+    }
+    inflater_ready = 1;
+    return &inflater;
+}
+
+// Gzips the body, spread over iovecs, into out. Returns the compressed size or -1 if it does not fit
+static int gzip_body(const struct iovec *body, int count, char *out, int out_size) {
+    z_stream *stream = reset_deflater();
+    if (!stream) {
+        return -1;
+    }
+
+    stream->next_out = (unsigned char *) out;
+    stream->avail_out = out_size;
+
+    int rv = Z_OK;
+    for (int i = 0; i < count && rv == Z_OK; i++) {
+        // zlib reports an empty input as an error unless it is the final one
+        if (body[i].iov_len == 0 && i < count - 1) {
+            continue;
+        }
+        stream->next_in = body[i].iov_base;
+        stream->avail_in = body[i].iov_len;
+        rv = deflate(stream, i == count - 1 ? Z_FINISH : Z_NO_FLUSH);
+        if (rv == Z_OK && stream->avail_in > 0) {
+            return -1; // Output buffer full
+        }
+    }
+    if (count == 0) {
+        stream->avail_in = 0;
+        rv = deflate(stream, Z_FINISH);
+    }
+
+    return rv == Z_STREAM_END ? (int) stream->total_out : -1;
+}
+
+// Seconds since the origin generated the response, as RFC 9111 section 4.2.3 has it without Date:
+// the age the origin reported plus the time the entry has spent in the cache
+static long current_age(const cache_entry_t *entry) {
+    long resident = time(NULL) - entry->cached_time;
+    return entry->initial_age + (resident > 0 ? resident : 0);
+}
+
+// Age header of a response from the origin or a peer, 0 if it has none or it is malformed
+static time_t get_initial_age(const char *response) {
+    int length;
+    const char *value = find_header(response, "Age:", &length);
+    if (!value) {
+        return 0;
+    }
+
+    long age = strtol(value, NULL, 10);
+    return age > 0 ? age : 0;
+}
+
+// Copies a response's header block without its Age header, which every send generates afresh
+// Returns the size of the block written to out, ending in the blank line, or -1 if it does not fit
+static int copy_headers_without_age(const char *response, int header_size, char *out, int out_size) {
+    const char *skip[] = {"Age:"};
+    int written = copy_headers_except(response, header_size, skip, 1, out, out_size - 2);
+    if (written == -1) {
+        return -1;
+    }
+
+    memcpy(out + written, "\r\n", 2);
+    return written + 2;
+}
+
+// Queues an entry's stored header block in place, its blank line replaced by a fresh Age line
+// The Age line is written into scratch, so a hit takes no allocation of its own
+static int append_aged_headers(iochain_t *out, segment_chain_t *scratch, const cache_entry_t *entry) {
+    // A block without its blank line cannot take an Age line, never queue a negative length
+    if (entry->header_size < 2) {
+        return -1;
+    }
+
+    int length;
+    char *age = format_segment_chain(scratch, &length, "Age: %ld\r\n\r\n", current_age(entry));
+    if (!age) {
+        return -1;
+    }
+
+    if (append_iochain(out, entry->headers, entry->header_size - 2) == -1) {
+        return -1;
+    }
+    return append_iochain_segment(out, scratch->tail, age, length);
+}
+
+// Writes an entry's header block with a fresh Age line into out, for answers built from it
+// Returns the size of the block written to out, or -1 if it does not fit
+static int build_aged_headers(const cache_entry_t *entry, char *out, int out_size) {
+    if (entry->header_size < 2) {
+        return -1;
+    }
+
+    int length = snprintf(out, out_size, "%.*sAge: %ld\r\n\r\n", entry->header_size - 2, entry->headers,
+                          current_age(entry));
+    return length < out_size ? length : -1;
+}
+
+// Writes the headers a gzip-accepting client gets for a compressed body of body_size bytes
+static int build_gzip_headers(const char *response, int header_size, int body_size, char *out, int out_size) {
+    const char *skip[] = {"Content-Length:", "Age:"};
+    int written = copy_headers_except(response, header_size, skip, 2, out, out_size);
+    if (written == -1) {
+        return -1;
+    }
+
+    int extra = snprintf(out + written, out_size - written,
+                         "Content-Length: %d\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n", body_size);
+    if (extra >= out_size - written) {
+        return -1;
+    }
+
+    return written + extra;
+}
+
+// Rebuilds the identity header block of a compressed entry, undoing build_gzip_headers, with a fresh Age
+// Returns the size of the block written to out, ending in the blank line, or -1 if it does not fit
+static int build_identity_headers(cache_entry_t *entry, char *out, int out_size) {
+    const char *skip[] = {"Content-Length:", "Content-Encoding:"};
+    int written = copy_headers_except(entry->headers, entry->header_size, skip, 2, out, out_size);
+    if (written == -1) {
+        return -1;
+    }
+
+    int extra = snprintf(out + written, out_size - written, "Content-Length: %d\r\nAge: %ld\r\n\r\n",
+                         entry->identity_size - entry->identity_header_size, current_age(entry));
+    if (extra >= out_size - written) {
+        return -1;
+    }
+
+    return written + extra;
+}
+
+// Inflates the whole body of a compressed entry, returns a malloc'd buffer or NULL on error
+static char *inflate_entry_body(cache_t *cache, cache_entry_t *entry, int *body_size) {
+    int identity_body_size = entry->identity_size - entry->identity_header_size;
+    z_stream *stream = reset_inflater();
+    if (!stream) {
+        return NULL;
+    }
+
+    char *body = malloc(identity_body_size > 0 ? identity_body_size : 1);
+    if (!body) {
+        perror("malloc");
+        return NULL;
+    }
+
+    cache_body_t *stored = &cache->bodies[entry->body];
+    stream->next_in = (unsigned char *) stored->data;
+    stream->avail_in = stored->size;
+    stream->next_out = (unsigned char *) body;
+    stream->avail_out = identity_body_size;
+
+    int rv = inflate(stream, Z_FINISH);
+    if (rv != Z_STREAM_END) {
+        fprintf(stderr, "inflate failed: %d\n", rv);
+        free(body);
+        return NULL;
+    }
+
+    *body_size = identity_body_size;
+    return body;
+}
+
+// Queues a segment the chain now holds, dropping the caller's reference either way
+static int append_filled_segment(iochain_t *out, segment_t *segment) {
+    int rv = append_iochain_segment(out, segment, segment->data, segment->length);
+    release_segment(segment);
+    return rv;
+}
+
+// Queues a compressed entry for a client that does not accept gzip, inflating it into pooled segments
+static int serve_inflated(iochain_t *out, cache_t *cache, cache_entry_t *entry) {
+    segment_t *headers = alloc_segment();
+    if (!headers) {
+        return -1;
+    }
+    headers->length = build_identity_headers(entry, headers->data, SEGMENT_SIZE);
+    if (headers->length == -1 || append_filled_segment(out, headers) == -1) {
+        if (headers->length == -1) {
+            release_segment(headers);
+        }
+        return -1;
+    }
+
+    z_stream *stream = reset_inflater();
+    if (!stream) {
+        return -1;
+    }
+    cache_body_t *stored = &cache->bodies[entry->body];
+    stream->next_in = (unsigned char *) stored->data;
+    stream->avail_in = stored->size;
+
+    // Inflate one segment at a time so no buffer ever has to hold the identity body whole
+    int rv;
+    do {
+        segment_t *chunk = alloc_segment();
+        if (!chunk) {
+            return -1;
+        }
+        stream->next_out = (unsigned char *) chunk->data;
+        stream->avail_out = SEGMENT_SIZE;
+
+        rv = inflate(stream, Z_NO_FLUSH);
+        if (rv != Z_OK && rv != Z_STREAM_END) {
+            fprintf(stderr, "inflate failed: %d\n", rv);
+            release_segment(chunk);
+            return -1;
+        }
+
+        chunk->length = SEGMENT_SIZE - stream->avail_out;
+        if (append_filled_segment(out, chunk) == -1) {
+            return -1;
+        }
+    } while (rv != Z_STREAM_END);
+
+    return 0;
+}
+
+// 64-bit FNV-1a hash of a body spread over iovecs
+static unsigned long long hash_body(const struct iovec *body, int count) {
+    unsigned long long hash = FNV_OFFSET_BASIS;
+
+    for (int i = 0; i < count; i++) {
+        hash = hash_bytes(hash, body[i].iov_base, body[i].iov_len);
+    }
+
+    return hash;
+}
+
+// Checks a stored body against one spread over iovecs, a hash match alone could be a collision
+static int body_matches(const cache_body_t *stored, const struct iovec *body, int count) {
+    int offset = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (memcmp(stored->data + offset, body[i].iov_base, body[i].iov_len) != 0) {
+            return 0;
+        }
+        offset += body[i].iov_len;
+    }
+
+    return 1;
+}
+
+// Returns the index of a body holding these bytes, copying them into a free one if none does
+// Sets shared when an existing body was found, returns -1 if the body does not fit
+static int store_body(cache_t *cache, const struct iovec *body, int count, int size, int *shared) {
+    if (size > RESPONSE_SIZE) {
+        return -1;
+    }
+    unsigned long long hash = hash_body(body, count);
+    int free_index = -1;
+
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        cache_body_t *stored = &cache->bodies[i];
+        if (stored->refs == 0) {
+            if (free_index == -1) {
+                free_index = i;
+            }
+            continue;
+        }
+
+        // Only a body valid entries still hold is shared, one kept for a send is on its way out
+        if (stored->valid_refs > 0 && stored->hash == hash && stored->size == size &&
+            body_matches(stored, body, count)) {
+            stored->refs++;
+            stored->valid_refs++;
+            *shared = 1;
+            return i;
+        }
+    }
+
+    if (free_index == -1) {
+        return -1;
+    }
+
+    cache_body_t *stored = &cache->bodies[free_index];
+    int copied = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(stored->data + copied, body[i].iov_base, body[i].iov_len);
+        copied += body[i].iov_len;
+    }
+    stored->refs = 1;
+    stored->valid_refs = 1;
+    stored->size = size;
+    stored->hash = hash;
+    *shared = 0;
+    return free_index;
+}
+
+// Drops an entry's reference to its body, which becomes free after the last one
+static void release_body(cache_t *cache, cache_entry_t *entry) {
+    if (entry->body == -1) {
+        return;
+    }
+
+    cache->bodies[entry->body].refs--;
+    entry->body = -1;
+}
+
+// Wakes every reader waiting on the entry's fill; a reader's callback may detach it
+static void notify_readers(cache_entry_t *entry) {
+    cache_reader_t *reader = entry->readers;
+    while (reader) {
+        cache_reader_t *next = reader->next;
+        reader->on_chunks(reader);
+        reader = next;
+    }
+}
+
+// Drops the chunks of an entry nobody reads any more
+static void release_chunks(cache_entry_t *entry) {
+    free_segment_chain(&entry->chunks);
+    entry->chunked = 0;
+    entry->fill_failed = 0;
+    entry->readers = NULL;
+}
+
+// Frees the response of an evicted entry once no send reads it; until then its header block,
+// sizes and encoding stay as they were, since queued sends and readers still go by them
+static void release_response(cache_t *cache, cache_entry_t *entry) {
+    entry->headers[0] = '\0';
+    if (entry->chunked) {
+        release_chunks(entry);
+    }
+    release_body(cache, entry);
+
+    entry->response_size = -1;
+    entry->header_size = 0;
+    entry->identity_size = 0;
+    entry->identity_header_size = 0;
+    entry->encoding = ENCODING_IDENTITY;
+}
+
+// Marks a filled slot as found, fresh and most recently used
+static void admit_entry(cache_t *cache, int index, const char *headers) {
+    cache->entries[index].valid = 1;
+    cache->entries[index].segment = SEGMENT_WINDOW;
+
+    // Set the last used time and cached time
+    update_last_used(cache, index, &usage_counter);
+    cache->entries[index].cached_time = time(NULL);
+    cache->entries[index].max_age = get_max_age(headers);
+    cache->entries[index].initial_age = get_initial_age(headers);
+
+    // Errors without explicit freshness expire after their class's negative TTL
+    int status = parse_status_code(headers);
+    if (cache->entries[index].max_age == -1 && status >= 400) {
+        cache->entries[index].max_age = negative_status_ttl(&cache->negative_ttl, status);
+    }
+
+    // Update valid entries count
+    if (cache->valid_entries < CACHE_SIZE) {
+        cache->valid_entries++;
+    }
+
+    // While the cache is still filling, overflow from the window goes straight to probation
+    // If every window entry is pinned the window stays over capacity until one is released
+    if (cache->policy == CACHE_POLICY_WTINYLFU && count_segment(cache, SEGMENT_WINDOW) > WINDOW_SIZE) {
+        int overflow = find_segment_lru(cache, SEGMENT_WINDOW);
+        if (overflow != -1) {
+            move_to_segment(cache, overflow, SEGMENT_PROBATION);
+        }
+    }
+}
+
 // ============================== FUNCTION IMPLEMENTATIONS ==============================
 
 // Initializes the given cache
-void *init_cache(cache_t *cache) {
+void *init_cache(cache_t *cache, cache_policy_t policy) {
     cache->valid_entries = 0;
+    cache->policy = policy;
+    cache->compress_bodies = 0;
+    cache->max_chunked_size = 0;
+    cache->stored_bytes = 0;
+    cache->identity_bytes = 0;
+    cache->deduped_bytes = 0;
+    init_negative_ttls(&cache->negative_ttl);
+    init_sketch(&cache->sketch, CACHE_SIZE);
 
     for (int i = 0; i < CACHE_SIZE; i++) {
         cache->entries[i].valid = 0;
@@ -30,19 +605,79 @@ void *init_cache(cache_t *cache) {
         cache->entries[i].last_used = 0;
         cache->entries[i].cached_time = 0;
         cache->entries[i].max_age = -1;
+        cache->entries[i].initial_age = 0;
+        cache->entries[i].segment = SEGMENT_WINDOW;
 
-        cache->entries[i].request[0] = '\0'; // Initialize request string
-        cache->entries[i].response[0] = '\0'; // Initialize response string
+        cache->entries[i].key[0] = '\0'; // Initialize key string
+        cache->entries[i].vary[0] = '\0';
+        cache->entries[i].variant[0] = '\0';
+        cache->entries[i].headers[0] = '\0'; // Initialize header block
+        cache->entries[i].body = -1;
         cache->entries[i].response_size = -1;
+        cache->entries[i].header_size = 0;
+        cache->entries[i].identity_size = 0;
+        cache->entries[i].identity_header_size = 0;
+        cache->entries[i].encoding = ENCODING_IDENTITY;
+        cache->entries[i].pins = 0;
+        cache->entries[i].chunked = 0;
+        cache->entries[i].filling = 0;
+        cache->entries[i].fill_failed = 0;
+        init_segment_chain(&cache->entries[i].chunks);
+        cache->entries[i].readers = NULL;
+
+        cache->bodies[i].refs = 0;
+        cache->bodies[i].valid_refs = 0;
+        cache->bodies[i].size = 0;
+        cache->bodies[i].hash = 0;
     }
 
     return 0;
 }
 
+// The usage clock carries on after the newest entry, so LRU order survives the takeover
+void attach_cache(cache_t *cache) {
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        cache_entry_t *entry = &cache->entries[i];
+
+        if (entry->last_used > usage_counter) {
+            usage_counter = entry->last_used;
+        }
+
+        // Forget the other process's chunks without touching them, then evict as usual
+        if (entry->chunked) {
+            init_segment_chain(&entry->chunks);
+            entry->readers = NULL;
+            entry->filling = 0;
+            if (entry->valid) {
+                evict_cache_entry(cache, i);
+            }
+        }
+    }
+}
+
+// Parses "lru" or "wtinylfu", returns -1 for anything else
+int parse_cache_policy(const char *name, cache_policy_t *policy) {
+    int policy_count = sizeof(cache_policy_names) / sizeof(cache_policy_names[0]);
+
+    for (int i = 0; i < policy_count; i++) {
+        if (strcasecmp(name, cache_policy_names[i]) == 0) {
+            *policy = (cache_policy_t) i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Returns the name of the policy as accepted by parse_cache_policy
+const char *cache_policy_name(cache_policy_t policy) {
+    return cache_policy_names[policy];
+}
+
 // Finds the index of an invalid entry in the cache, or -1 if none found
 int find_invalid_entry(cache_t *cache) {
     for (int i = 0; i < CACHE_SIZE; i++) {
-        if (cache->entries[i].valid == 0) {
+        if (cache->entries[i].valid == 0 && cache->entries[i].pins == 0) {
             return i;
         }
     }
@@ -51,41 +686,166 @@ int find_invalid_entry(cache_t *cache) {
 }
 
 
-// Evicts the LRU entry, returns a copy of the request string, or NULL if no valid entry found
-// Assumes at least one valid entry exists
-char *evict_lru_entry(cache_t *cache) {
+// Evicts the LRU entry, copying its key into evicted_key, returns -1 if no valid entry found
+// Pinned entries are skipped, their slots cannot be reused until the sends finish
+int evict_lru_entry(cache_t *cache, char *evicted_key) {
     int lru_index = -1;
     unsigned long lru_time = (unsigned long) -1;
 
     // Find the LRU entry
     for (int i = 0; i < CACHE_SIZE; i++) {
-        if (cache->entries[i].valid == 1 && cache->entries[i].last_used < lru_time) {
+        if (cache->entries[i].valid == 1 && cache->entries[i].pins == 0 && cache->entries[i].last_used < lru_time) {
             lru_index = i;
             lru_time = cache->entries[i].last_used;
         }
     }
 
     if (lru_index == -1) {
-        return NULL; // No valid entry found
+        return -1; // No valid entry found
     }
 
-    // Create a copy of the request string to return
-    char *request_copy = malloc(REQUEST_SIZE + 1);
-    if (!request_copy) {
-        perror("malloc");
-        return NULL;
+    return take_cache_entry(cache, lru_index, evicted_key);
+}
+
+// Evicts one entry according to the policy, copying the evicted key into evicted_key
+int evict_cache_victim(cache_t *cache, char *evicted_key) {
+    if (cache->policy == CACHE_POLICY_LRU) {
+        return evict_lru_entry(cache, evicted_key);
     }
-    strncpy(request_copy, cache->entries[lru_index].request, REQUEST_SIZE);
 
-    // Evict the LRU entry
-    cache->entries[lru_index].valid = 0;
-    cache->entries[lru_index].last_used = 0;
-    cache->entries[lru_index].response_size = -1;
-    cache->entries[lru_index].request[0] = '\0'; // Clear request string
-    cache->entries[lru_index].response[0] = '\0'; // Clear response string
+    // The window's oldest entry is the candidate for admission into the main segment
+    int candidate = find_segment_lru(cache, SEGMENT_WINDOW);
 
-    cache->valid_entries--;
-    return request_copy;
+    // The main segment gives up its probation LRU first, protected only if probation is empty
+    int victim = find_segment_lru(cache, SEGMENT_PROBATION);
+    if (victim == -1) {
+        victim = find_segment_lru(cache, SEGMENT_PROTECTED);
+    }
+
+    if (candidate == -1 && victim == -1) {
+        return -1; // No valid entry found
+    }
+    if (candidate == -1) {
+        return take_cache_entry(cache, victim, evicted_key);
+    }
+    if (victim == -1) {
+        return take_cache_entry(cache, candidate, evicted_key);
+    }
+
+    // Admit the candidate only if it has been requested more often than the victim,
+    // so a one-off scan cannot push out the frequently used entries
+    int candidate_frequency = estimate_frequency(&cache->sketch, cache->entries[candidate].key);
+    int victim_frequency = estimate_frequency(&cache->sketch, cache->entries[victim].key);
+
+    if (candidate_frequency > victim_frequency) {
+        take_cache_entry(cache, victim, evicted_key);
+        move_to_segment(cache, candidate, SEGMENT_PROBATION);
+        return 0;
+    }
+
+    return take_cache_entry(cache, candidate, evicted_key);
+}
+
+// Records the access in the frequency sketch used for W-TinyLFU admission
+void record_cache_access(cache_t *cache, const char *key) {
+    if (cache->policy == CACHE_POLICY_WTINYLFU) {
+        increment_sketch(&cache->sketch, key);
+    }
+}
+
+// Builds "GET http://host:port/path?query" from the request line and, for origin-form
+// targets, the Host header, into key. Returns 0 on success, -1 if the request is not cacheable
+int normalize_cache_key(const char *request, char *key, int key_size) {
+    // Only GETs are cached
+    if (strncmp(request, "GET ", 4) != 0) {
+        return -1;
+    }
+
+    const char *target = request + 4;
+    while (*target == ' ' || *target == '\t') {
+        target++;
+    }
+    int target_length = strcspn(target, " \t\r\n");
+
+    // Split the target into authority and path, falling back to Host for origin-form targets
+    const char *scheme = "http://";
+    const char *authority, *path;
+    int authority_length, path_length;
+
+    if (strncasecmp(target, scheme, strlen(scheme)) == 0) {
+        authority = target + strlen(scheme);
+        authority_length = strcspn(authority, "/?# \t\r\n");
+        path = authority + authority_length;
+        path_length = target + target_length - path;
+    } else if (target[0] == '/') {
+        int host_header_length;
+        const char *host_header = find_header(request, "Host:", &host_header_length);
+        if (!host_header) {
+            return -1;
+        }
+        authority = host_header;
+        authority_length = 0;
+        while (authority_length < host_header_length && host_header[authority_length] != ' ' &&
+               host_header[authority_length] != '\t') {
+            authority_length++;
+        }
+        path = target;
+        path_length = target_length;
+    } else {
+        return -1;
+    }
+
+    // Fragments never reach the origin, so they must not split the cache
+    path_length = strcspn(path, "#") < (size_t) path_length ? (int) strcspn(path, "#") : path_length;
+
+    // Separate host and port, minding bracketed IPv6 literals
+    int host_length = authority_length;
+    const char *port = "80";
+    int port_length = 2;
+    const char *bracket = memchr(authority, ']', authority_length);
+    const char *colon = memchr(bracket ? bracket : authority, ':', authority + authority_length - (bracket ? bracket : authority));
+    if (colon && colon + 1 < authority + authority_length) {
+        host_length = colon - authority;
+        port = colon + 1;
+        port_length = authority + authority_length - port;
+    } else if (colon) {
+        host_length = colon - authority;
+    }
+
+    // An empty path is the same resource as "/" (RFC 9110 section 4.2.3)
+    const char *slash = path_length > 0 && path[0] == '/' ? "" : "/";
+    int written = snprintf(key, key_size, "GET http://%.*s:%.*s%s%.*s", host_length, authority, port_length, port,
+                           slash, path_length, path);
+    if (host_length == 0 || written >= key_size || written >= REQUEST_SIZE) {
+        return -1;
+    }
+
+    // Host names are case-insensitive
+    for (int i = strlen("GET http://"); i < (int) strlen("GET http://") + host_length; i++) {
+        key[i] = tolower((unsigned char) key[i]);
+    }
+
+    return 0;
+}
+
+// Updates recency, promoting a probation entry into the protected segment on a hit
+void promote_cache_entry(cache_t *cache, int index) {
+    update_last_used(cache, index, &usage_counter);
+
+    if (cache->policy != CACHE_POLICY_WTINYLFU || cache->entries[index].segment != SEGMENT_PROBATION) {
+        return;
+    }
+
+    cache->entries[index].segment = SEGMENT_PROTECTED;
+
+    // Demote the protected LRU back to probation if the segment is over capacity,
+    // unless every protected entry is pinned, then the next promotion catches up
+    if (count_segment(cache, SEGMENT_PROTECTED) > PROTECTED_SIZE) {
+        int demoted = find_segment_lru(cache, SEGMENT_PROTECTED);
+        if (demoted != -1) {
+            move_to_segment(cache, demoted, SEGMENT_PROBATION);
+        }
+    }
 }
 
 // Updates the last used time of the entry
@@ -93,10 +853,20 @@ void update_last_used(cache_t *cache, int index, unsigned long *usage_counter) {
     cache->entries[index].last_used = ++(*usage_counter);
 }
 
-// Returns the index of the specified request, or -1 if not found
-int search_cache_hit(cache_t *cache, const char *request) {
+// Returns the index of the entry with this key whose variant matches the request, or -1 if not found
+int search_cache_hit(cache_t *cache, const char *key, const char *request) {
+    char variant[VARIANT_SIZE];
+
     for (int i = 0; i < CACHE_SIZE; i++) {
-        if (cache->entries[i].valid == 1 && strcmp(cache->entries[i].request, request) == 0) {
+        cache_entry_t *entry = &cache->entries[i];
+        if (entry->valid != 1 || strcmp(entry->key, key) != 0) {
+            continue;
+        }
+
+        // Secondary key: the request headers named by the stored response's Vary
+        int skip_accept_encoding = entry->encoding == ENCODING_GZIP;
+        if (build_variant(request, entry->vary, skip_accept_encoding, variant, VARIANT_SIZE) == 0 &&
+            strcmp(variant, entry->variant) == 0) {
             return i;
         }
     }
@@ -105,187 +875,503 @@ int search_cache_hit(cache_t *cache, const char *request) {
 }
 
 // Adds an entry to the cache, returns the index of the entry, or -1 if cache is full
-int add_cache_entry(cache_t *cache, const char *request, const char *response, int response_size) {
-    // Check if strings are too large to cache
-    if (strlen(request) >= REQUEST_SIZE || response_size > RESPONSE_SIZE) {
+// The response arrives as iovecs, the first of which holds the whole header block
+int add_cache_entry(cache_t *cache, const char *key, const char *request, const struct iovec *response, int count,
+                    int response_size) {
+    // Check if the key is too large to cache
+    if (count == 0 || strlen(key) >= REQUEST_SIZE) {
         return -1;
     }
-    
+    const char *headers = response[0].iov_base;
+
+    // Remember which request headers select this variant
+    char vary[VARY_SIZE] = "";
+    int vary_length;
+    const char *vary_value = find_header(headers, "Vary:", &vary_length);
+    if (vary_value && normalize_vary(vary_value, vary_length, vary, VARY_SIZE) == -1) {
+        return -1;
+    }
+
     // Find an invalid entry in the cache to write to
     int index = find_invalid_entry(cache);
-    cache->entries[index].valid = 1;
+    if (index == -1) {
+        return -1;
+    }
+    cache_entry_t *entry = &cache->entries[index];
 
-    // Copy request and response to the cache
-    strncpy(cache->entries[index].request, request, REQUEST_SIZE);
-    memcpy(cache->entries[index].response, response, response_size);
-    cache->entries[index].response_size = response_size;
+    char *headers_end = strstr(headers, "\r\n\r\n");
+    int header_size = headers_end ? headers_end + 4 - headers : (int) response[0].iov_len;
+    if (header_size >= HEADER_BLOCK_SIZE || count > MAX_RESPONSE_IOV) {
+        return -1;
+    }
+    entry->encoding = ENCODING_IDENTITY;
+    entry->chunked = 0;
 
-    // Set the last used time and cached time
-    update_last_used(cache, index, &usage_counter);
-    cache->entries[index].cached_time = time(NULL);
-    cache->entries[index].max_age = get_max_age(response);
+    // The body starts part way into the first iovec
+    struct iovec body[MAX_RESPONSE_IOV];
+    memcpy(body, response, count * sizeof(struct iovec));
+    body[0].iov_base = (char *) headers + header_size;
+    body[0].iov_len -= header_size;
+    int body_count = count;
+    int body_size = response_size - header_size;
 
-    // Update valid entries count
-    if (cache->valid_entries < CACHE_SIZE) {
-        cache->valid_entries++;
+    // Try to store text bodies gzip-compressed, only the compressed size has to fit a body
+    if (cache->compress_bodies && headers_end && response_size <= MAX_UNCOMPRESSED_SIZE && is_compressible(headers)) {
+        int compressed_size = gzip_body(body, count, compress_buffer, RESPONSE_SIZE);
+
+        if (compressed_size != -1 && compressed_size < body_size) {
+            int gzip_header_size =
+                build_gzip_headers(headers, header_size, compressed_size, entry->headers, HEADER_BLOCK_SIZE);
+
+            if (gzip_header_size != -1) {
+                entry->encoding = ENCODING_GZIP;
+                entry->header_size = gzip_header_size;
+                body[0].iov_base = compress_buffer;
+                body[0].iov_len = compressed_size;
+                body_count = 1;
+                body_size = compressed_size;
+            }
+        }
+    }
+
+    if (entry->encoding == ENCODING_IDENTITY) {
+        // Check if the response is too large to cache
+        if (body_size > RESPONSE_SIZE) {
+            return -1;
+        }
+        entry->header_size = copy_headers_without_age(headers, header_size, entry->headers, HEADER_BLOCK_SIZE);
+        if (entry->header_size == -1) {
+            return -1;
+        }
     }
+    entry->headers[entry->header_size] = '\0';
 
+    // Copy key and variant to the cache
+    if (build_variant(request, vary, entry->encoding == ENCODING_GZIP, entry->variant, VARIANT_SIZE) == -1) {
+        return -1;
+    }
+
+    // Share the body with any entry that already holds the same bytes
+    int shared = 0;
+    entry->body = store_body(cache, body, body_count, body_size, &shared);
+    if (entry->body == -1) {
+        return -1;
+    }
+    strncpy(entry->key, key, REQUEST_SIZE);
+    strcpy(entry->vary, vary);
+
+    entry->response_size = entry->header_size + body_size;
+    entry->identity_size = response_size;
+    entry->identity_header_size = header_size;
+
+    // Account for the bytes actually held in memory, a shared body only once
+    cache->stored_bytes += shared ? entry->header_size : entry->response_size;
+    cache->identity_bytes += entry->identity_size;
+    if (shared) {
+        cache->deduped_bytes += body_size;
+    }
+
+    TRACE_PROBE2(cache__insert, entry->key, entry->response_size);
+    admit_entry(cache, index, headers);
     return index;
 }
 
-int serve_from_cache(int client_fd, cache_t *cache, int cache_index) {
-    int sent_bytes = 0;
+// Starts an entry whose response arrives chunk by chunk, see append_cache_chunk
+// The header block is also copied into the entry, so it can be read before the first chunk
+int start_chunked_entry(cache_t *cache, const char *key, const char *request, const char *headers) {
+    const char *headers_end = strstr(headers, "\r\n\r\n");
+    if (!headers_end || headers_end + 4 - headers >= HEADER_BLOCK_SIZE || strlen(key) >= REQUEST_SIZE) {
+        return -1;
+    }
 
-    // Fetch the response from the cache
-    int response_length = cache->entries[cache_index].response_size;
-    char *response = cache->entries[cache_index].response;
-    update_last_used(cache, cache_index, &usage_counter);
+    char vary[VARY_SIZE] = "";
+    int vary_length;
+    const char *vary_value = find_header(headers, "Vary:", &vary_length);
+    if (vary_value && normalize_vary(vary_value, vary_length, vary, VARY_SIZE) == -1) {
+        return -1;
+    }
 
-    // Send the cached resopnse to the client
-    while (sent_bytes < response_length) {
-        int bytes = send(client_fd, response + sent_bytes, response_length - sent_bytes, 0);
-        if (bytes == -1) {
-            perror("send to client from cache");
+    int index = find_invalid_entry(cache);
+    if (index == -1) {
+        return -1;
+    }
+    cache_entry_t *entry = &cache->entries[index];
+
+    if (build_variant(request, vary, 0, entry->variant, VARIANT_SIZE) == -1) {
+        return -1;
+    }
+    strncpy(entry->key, key, REQUEST_SIZE);
+    strcpy(entry->vary, vary);
+
+    entry->encoding = ENCODING_IDENTITY;
+    entry->chunked = 1;
+    entry->filling = 1;
+    entry->fill_failed = 0;
+    entry->readers = NULL;
+    init_segment_chain(&entry->chunks);
+    entry->identity_header_size = headers_end + 4 - headers;
+    entry->header_size =
+        copy_headers_without_age(headers, entry->identity_header_size, entry->headers, HEADER_BLOCK_SIZE);
+    entry->body = -1;
+    entry->headers[entry->header_size] = '\0';
+    entry->response_size = 0;
+    entry->identity_size = 0;
+
+    // The filler's pin keeps the chunks in place until the fill ends
+    entry->pins++;
+    TRACE_PROBE2(cache__insert, entry->key, entry->header_size);
+    admit_entry(cache, index, headers);
+    return index;
+}
+
+// Chunks are counted as they arrive, an entry evicted mid-fill keeps its size for its readers
+// but no longer counts towards what the cache holds
+void append_cache_chunk(cache_t *cache, int cache_index, segment_t *chunk) {
+    cache_entry_t *entry = &cache->entries[cache_index];
+    push_segment_chain(&entry->chunks, chunk);
+    entry->response_size += chunk->length;
+    entry->identity_size += chunk->length;
+
+    if (entry->valid) {
+        cache->stored_bytes += chunk->length;
+        cache->identity_bytes += chunk->length;
+    }
+
+    notify_readers(entry);
+}
+
+void finish_chunked_entry(cache_t *cache, int cache_index, int complete) {
+    cache_entry_t *entry = &cache->entries[cache_index];
+    entry->filling = 0;
+
+    // A truncated response must never be served, readers still attached see the fill fail
+    if (!complete) {
+        entry->fill_failed = 1;
+        if (entry->valid) {
+            evict_cache_entry(cache, cache_index);
+        }
+    }
+
+    notify_readers(entry);
+    unpin_cache_entry(cache, cache_index);
+}
+
+void add_cache_reader(cache_t *cache, int cache_index, cache_reader_t *reader) {
+    cache_entry_t *entry = &cache->entries[cache_index];
+    reader->index = cache_index;
+    reader->last = NULL;
+    reader->prev = NULL;
+    reader->next = entry->readers;
+    if (entry->readers) {
+        entry->readers->prev = reader;
+    }
+    entry->readers = reader;
+
+    promote_cache_entry(cache, cache_index);
+    pin_cache_entry(cache, cache_index);
+}
+
+// Whole chunks are queued, so the last one may take the reader past max_bytes
+int serve_cache_chunks(iochain_t *out, segment_chain_t *scratch, cache_t *cache, cache_reader_t *reader,
+                       long max_bytes) {
+    cache_entry_t *entry = &cache->entries[reader->index];
+    if (entry->fill_failed) {
+        return -1;
+    }
+
+    long queued = 0;
+    segment_t *chunk = reader->last ? reader->last->next : entry->chunks.head;
+    for (; chunk && (max_bytes < 0 || queued < max_bytes); chunk = chunk->next) {
+        // The origin's header block opening the first chunk gives way to the stored one and its Age
+        int skip = 0;
+        if (!reader->last) {
+            if (append_aged_headers(out, scratch, entry) == -1) {
+                return -1;
+            }
+            skip = entry->identity_header_size;
+        }
+        if (chunk->length > skip && append_iochain_segment(out, chunk, chunk->data + skip, chunk->length - skip) == -1) {
             return -1;
         }
-        sent_bytes += bytes;
+        reader->last = chunk;
+        queued += chunk->length;
     }
 
-    return 0;
+    return entry->filling || chunk ? 0 : 1;
 }
 
-// Parses out the cache_control header from the response and checks for no-cache keywords
-// Returns 1 if no-cache is found, 0 otherwise
-int check_no_cache(char *response) {
-    char *cache_control_header = parse_cache_control(response);
+void remove_cache_reader(cache_t *cache, cache_reader_t *reader) {
+    if (reader->index == -1) {
+        return;
+    }
+    cache_entry_t *entry = &cache->entries[reader->index];
 
-    // If no Cache-Control header is found, return 0
-    if (!cache_control_header) {
+    if (reader->prev) {
+        reader->prev->next = reader->next;
+    } else {
+        entry->readers = reader->next;
+    }
+    if (reader->next) {
+        reader->next->prev = reader->prev;
+    }
+
+    unpin_cache_entry(cache, reader->index);
+    reader->index = -1;
+    reader->next = NULL;
+    reader->prev = NULL;
+}
+
+// Queues the cached response, inflating compressed bodies for clients without gzip support
+int serve_from_cache(iochain_t *out, segment_chain_t *scratch, cache_t *cache, int cache_index, int gzip_ok) {
+    cache_entry_t *entry = &cache->entries[cache_index];
+    promote_cache_entry(cache, cache_index);
+
+    // Identity entries, and gzip entries for gzip clients, go out as stored with only the Age line copied
+    int rv;
+    if (entry->encoding == ENCODING_IDENTITY || gzip_ok) {
+        cache_body_t *body = &cache->bodies[entry->body];
+        rv = append_aged_headers(out, scratch, entry);
+        if (rv == 0) {
+            rv = append_iochain(out, body->data, body->size);
+        }
+    } else {
+        rv = serve_inflated(out, cache, entry);
+    }
+
+    if (rv == 0) {
+        pin_cache_entry(cache, cache_index);
+    }
+    return rv;
+}
+
+// Answers a Range request by slicing the cached full response
+// Returns 1 without queueing anything if the range should be ignored
+int serve_range_from_cache(iochain_t *out, segment_chain_t *scratch, cache_t *cache, int cache_index,
+                           const char *range_value) {
+    cache_entry_t *entry = &cache->entries[cache_index];
+
+    // Only complete 200 responses can be sliced, a chunked entry still filling is not complete yet
+    if (parse_status_code(entry->headers) != 200 || (entry->chunked && entry->filling)) {
+        return 1;
+    }
+
+    // Every answer starts from the header block with a fresh Age line, the 206 rewrites it further
+    // The block is only read while the answer is built, so a pooled segment holds it meanwhile
+    segment_t *headers = alloc_segment();
+    if (!headers) {
+        return -1;
+    }
+    if (entry->chunked || entry->encoding == ENCODING_IDENTITY) {
+        headers->length = build_aged_headers(entry, headers->data, SEGMENT_SIZE);
+    } else {
+        headers->length = build_identity_headers(entry, headers->data, SEGMENT_SIZE);
+    }
+    if (headers->length == -1) {
+        release_segment(headers);
+        return -1;
+    }
+
+    int rv;
+    if (entry->chunked) {
+        // Slices are queued straight out of the chunks, the first one starts with the origin's header block
+        // The chunks are described in a pooled segment too, only an entry with more than fit falls back to malloc
+        segment_t *iov_segment = NULL;
+        struct iovec *body;
+        if (entry->chunks.count <= CHUNK_IOV_MAX) {
+            iov_segment = alloc_segment();
+            body = iov_segment ? (struct iovec *) iov_segment->data : NULL;
+        } else if (!(body = malloc(entry->chunks.count * sizeof(struct iovec)))) {
+            perror("malloc");
+        }
+        if (!body) {
+            release_segment(headers);
+            return -1;
+        }
+        int count = segment_chain_iov(&entry->chunks, body, entry->chunks.count);
+        body[0].iov_base = (char *) body[0].iov_base + entry->identity_header_size;
+        body[0].iov_len -= entry->identity_header_size;
+
+        rv = serve_byte_ranges(out, scratch, headers->data, headers->length, body, count,
+                               entry->response_size - entry->identity_header_size, range_value);
+        if (iov_segment) {
+            release_segment(iov_segment);
+        } else {
+            free(body);
+        }
+
+    } else if (entry->encoding == ENCODING_IDENTITY) {
+        // Slices are queued straight out of the stored body
+        cache_body_t *stored = &cache->bodies[entry->body];
+        struct iovec body = {stored->data, stored->size};
+        rv = serve_byte_ranges(out, scratch, headers->data, headers->length, &body, 1, body.iov_len, range_value);
+
+    } else {
+        // Ranges refer to the identity body, so a compressed entry has to be inflated first
+        int body_size = 0;
+        char *body = inflate_entry_body(cache, entry, &body_size);
+
+        struct iovec body_iov = {body, body_size};
+        rv = body ? serve_byte_ranges(out, scratch, headers->data, headers->length, &body_iov, 1, body_size,
+                                      range_value)
+                  : -1;
+
+        // The queued slices point into the inflated body, so the chain frees it after sending them
+        if (body && append_iochain_release(out, body) == -1) {
+            rv = -1;
+        }
+    }
+    release_segment(headers);
+
+    // A range fill may slice an entry evicted while it was filling, which must not be promoted
+    if (rv == 0) {
+        if (entry->valid) {
+            promote_cache_entry(cache, cache_index);
+        }
+        pin_cache_entry(cache, cache_index);
+    }
+    return rv;
+}
+
+void pin_cache_entry(cache_t *cache, int cache_index) {
+    cache->entries[cache_index].pins++;
+}
+
+// The last pin on an evicted entry frees its chunks or its reference to the body
+void unpin_cache_entry(cache_t *cache, int cache_index) {
+    cache_entry_t *entry = &cache->entries[cache_index];
+    entry->pins--;
+    if (entry->pins == 0 && !entry->valid) {
+        release_response(cache, entry);
+    }
+}
+
+// Returns 1 if Accept-Encoding lists gzip (or *) with a non-zero quality value
+int accepts_gzip(const char *request) {
+    int length;
+    const char *accept_encoding = find_header(request, "Accept-Encoding:", &length);
+    if (!accept_encoding) {
         return 0;
     }
 
-    int keyword_count = sizeof(cache_control_keywords) / sizeof(cache_control_keywords[0]);
+    int gzip_ok = -1;
+    int wildcard_ok = 0;
 
-    // Tokenize the Cache-Control header
-    char *token = strtok(cache_control_header, ",");
-    
-    // Search for no-cache keyword match per token
-    while (token) {
-        // Skip spaces and tabs at the front
-        while (*token == ' ' || *token == '\t') {
-            token++;
+    const char *cursor = accept_encoding;
+    const char *end = accept_encoding + length;
+    int token_length;
+    const char *token;
+    while ((token = next_list_item(&cursor, end, &token_length))) {
+        // A q=0 parameter means the coding is explicitly refused
+        const char *quality = memmem(token, token_length, "q=", 2);
+        int allowed = !quality || strtod(quality + 2, NULL) > 0;
+        int name_length = 0;
+        while (name_length < token_length && !strchr(" \t;", token[name_length])) {
+            name_length++;
         }
 
-        // Skip spaces and tabs at the end
-        char *end = token + strlen(token) - 1;
-        while (end > token && (*end == ' ' || *end == '\t')) {
-            end--;
+        if (name_length == 4 && strncasecmp(token, "gzip", 4) == 0) {
+            gzip_ok = allowed;
+        } else if (name_length == 1 && token[0] == '*') {
+            wildcard_ok = allowed;
         }
+    }
 
-        // Null-terminate the token
-        *(end + 1) = '\0';
+    return gzip_ok != -1 ? gzip_ok : wildcard_ok;
+}
 
-        // Check if the token matches any no-cache keywords
-        for (int i = 0; i < keyword_count; i++) {
-            if (strcasecmp(token, cache_control_keywords[i]) == 0) {
+// Parses out the cache_control header from the response and checks for no-cache keywords
+// Returns 1 if no-cache is found, 0 otherwise
+int check_no_cache(const char *response) {
+    // Vary: * means no later request can ever be known to match
+    int vary_length;
+    const char *vary = find_header(response, "Vary:", &vary_length);
+    if (vary && memchr(vary, '*', vary_length)) {
+        return 1;
+    }
+
+    int length;
+    const char *cache_control_header = parse_cache_control(response, &length);
+
+    // If no Cache-Control header is found, return 0
+    if (!cache_control_header) {
+        return 0;
+    }
 
-                // Found a no-cache keyword
-                free(cache_control_header);
-                return 1;
+    int keyword_count = sizeof(cache_control_keywords) / sizeof(cache_control_keywords[0]);
+
+    // Search for no-cache keyword match per directive
+    const char *cursor = cache_control_header;
+    const char *end = cache_control_header + length;
+    int token_length;
+    const char *token;
+    while ((token = next_list_item(&cursor, end, &token_length))) {
+        for (int i = 0; i < keyword_count; i++) {
+            if ((int) strlen(cache_control_keywords[i]) == token_length &&
+                strncasecmp(token, cache_control_keywords[i], token_length) == 0) {
+                return 1; // Found a no-cache keyword
             }
         }
-        
-        token = strtok(NULL, ",");
     }
-    
 
     // No no-cache keywords found
-    free(cache_control_header);
     return 0;
 }
 
-// Parses out the cache control header from the response
-// Returns a malloced string, or NULL if not found/failed.
-char *parse_cache_control(const char *response) {
-    // For sanity, create a copy of the headers section
-    char *headers_end = strstr(response, "\r\n\r\n");
-    if (!headers_end) {
-        return NULL;
-    }
-    size_t headers_length = headers_end - response;
-    char *headers_copy = malloc(headers_length + 1); // +1 for \0
-    if (!headers_copy) {
-        perror("malloc");
-        return NULL;
+// Returns 1 if the response is an error that has neither a max-age nor a negative TTL
+int check_no_cache_error(cache_t *cache, const char *response) {
+    int status = parse_status_code(response);
+    if (status < 400) {
+        return 0;
     }
-    memcpy(headers_copy, response, headers_length);
-    headers_copy[headers_length] = '\0';
-
-    // Tokenize the headers to find the Cache-Control header
-    char *line = strtok(headers_copy, "\r\n");
-    while (line) {
-        int prefix_len = strlen("Cache-Control:");
-        if (strncasecmp(line, "Cache-Control:", prefix_len) == 0) {
-            // Skip whitespace after colon
-            char *value = line + prefix_len;
-            while (*value == ' ' || *value == '\t') value++;
 
-            // Return a copy of the Cache-Control value
-            char *result = strdup(value);
-            free(headers_copy);
-            return result;
-        }
-        line = strtok(NULL, "\r\n");
+    if (get_max_age(response) != -1) {
+        return 0;
     }
 
-    free(headers_copy);
-    return NULL;
+    return negative_status_ttl(&cache->negative_ttl, status) == -1;
+}
+
+// Finds the cache control header of the response in place
+// Returns a pointer into response, or NULL if not found
+const char *parse_cache_control(const char *response, int *length) {
+    return find_header(response, "Cache-Control:", length);
 }
 
 // Returns the max-age from the Cache-Control header
 // Returns -1 if not found or invalid
 int get_max_age(const char *response) {
-    // Get a copy of the Cache-Control header
-    char *cache_control_header = parse_cache_control(response);
+    int length;
+    const char *cache_control_header = parse_cache_control(response, &length);
     if (!cache_control_header) {
         return -1;
     }
 
     // Find the max-age field
-    char *field = strtok(cache_control_header, ",");
-    while (field) {
-        // Skip spaces and tabs at the front
-        while (*field == ' ' || *field == '\t') field++;
-
-        // Check for max-age directive
-        int prefix_len = strlen("max-age=");
-        if (strncasecmp(field, "max-age=", prefix_len) == 0) {
-            // Extract the value
-            field += prefix_len;
-            int max_age = atoi(field);
-            free(cache_control_header);
-            return max_age;
+    const char *cursor = cache_control_header;
+    const char *end = cache_control_header + length;
+    int prefix_len = strlen("max-age=");
+    int field_length;
+    const char *field;
+    while ((field = next_list_item(&cursor, end, &field_length))) {
+        if (field_length > prefix_len && strncasecmp(field, "max-age=", prefix_len) == 0) {
+            // The value ends at the comma or line end, where atoi stops anyway
+            return atoi(field + prefix_len);
         }
-
-        field = strtok(NULL, ",");
     }
 
     // No max-age field found
-    free(cache_control_header);
     return -1;
 }
 
 // Checks whether the cache entry is timed out
 int is_timed_out(cache_t *cache, int index) {
-    time_t current_time = time(NULL);
-
     // If the entry doesn't have a max-age, it's not timed out
     if (cache->entries[index].max_age == -1) {
         return 0;
     }
 
     // Check if the entry has timed out
-    if (current_time - cache->entries[index].cached_time >= cache->entries[index].max_age) {
+    if (current_age(&cache->entries[index]) >= cache->entries[index].max_age) {
         return 1;
     }
 
@@ -295,14 +1381,35 @@ int is_timed_out(cache_t *cache, int index) {
 
 // Evicts the cache entry at the specified index
 void evict_cache_entry(cache_t *cache, int index) {
+    cache_entry_t *entry = &cache->entries[index];
+    TRACE_PROBE2(cache__evict, entry->key, entry->response_size);
+    cache->stored_bytes -= entry->response_size;
+    cache->identity_bytes -= entry->identity_size;
+
+    // A body other entries still share stays stored, this entry just stops counting it
+    if (entry->body != -1) {
+        cache_body_t *body = &cache->bodies[entry->body];
+        body->valid_refs--;
+        if (body->valid_refs > 0) {
+            cache->stored_bytes += body->size;
+            cache->deduped_bytes -= body->size;
+        }
+    }
+
     cache->entries[index].valid = 0;
     cache->entries[index].last_used = 0;
     cache->entries[index].cached_time = 0;
     cache->entries[index].max_age = -1;
+    cache->entries[index].initial_age = 0;
+    cache->entries[index].segment = SEGMENT_WINDOW;
+    cache->entries[index].key[0] = '\0'; // Clear key string
+    cache->entries[index].vary[0] = '\0';
+    cache->entries[index].variant[0] = '\0';
 
-    cache->entries[index].response_size = -1;
-    cache->entries[index].request[0] = '\0'; // Clear request string
-    cache->entries[index].response[0] = '\0'; // Clear response string
+    // A pinned response is still being sent, so its bytes and their layout have to stay intact
+    if (cache->entries[index].pins == 0) {
+        release_response(cache, entry);
+    }
 
     cache->valid_entries--;
 }
\ No newline at end of file
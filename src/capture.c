@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+// Appends, so a process taking over through an upgrade carries on the same capture
+int open_capture_writer(capture_writer_t *writer, const char *path) {
+    writer->written = 0;
+    writer->file = fopen(path, "ae");
+    if (!writer->file) {
+        perror("open capture file");
+        return -1;
+    }
+    return 0;
+}
+
+void write_capture_record(capture_writer_t *writer, const capture_record_t *record) {
+    if (!writer->file) {
+        return;
+    }
+
+    fprintf(writer->file, "%lld %d %ld %d %d %s\n", record->time_ms, record->status, record->size, record->max_age,
+            record->no_store, record->key);
+    writer->written++;
+}
+
+void flush_capture_writer(capture_writer_t *writer) {
+    if (writer->file && fflush(writer->file) == EOF) {
+        perror("write capture file");
+    }
+}
+
+int parse_capture_record(char *line, capture_record_t *record) {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    int key_offset = -1;
+    if (sscanf(line, "%lld %d %ld %d %d %n", &record->time_ms, &record->status, &record->size, &record->max_age,
+               &record->no_store, &key_offset) != 5 ||
+        key_offset == -1 || line[key_offset] == '\0' || record->size < 0) {
+        return -1;
+    }
+
+    record->key = line + key_offset;
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "cluster.h"
+#include "http.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// 64-bit FNV-1a hash, finished with a mixing step so names that differ in one
+// character still land far apart on the ring
+static unsigned long long hash_ring_key(const char *key) {
+    unsigned long long hash = hash_bytes(FNV_OFFSET_BASIS, key, strlen(key));
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int compare_ring_points(const void *a, const void *b) {
+    const ring_point_t *left = a;
+    const ring_point_t *right = b;
+
+    if (left->hash != right->hash) {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    return left->node - right->node;
+}
+
+// Places every node's points on the ring, the same on every node given the same list
+static void build_ring(cluster_t *cluster) {
+    char point_name[HOST_NAME_SIZE + 16];
+    cluster->ring_size = 0;
+
+    for (int node = 0; node < cluster->node_count; node++) {
+        for (int i = 0; i < CLUSTER_POINTS; i++) {
+            snprintf(point_name, sizeof(point_name), "%s#%d", cluster->nodes[node], i);
+            cluster->ring[cluster->ring_size].hash = hash_ring_key(point_name);
+            cluster->ring[cluster->ring_size].node = node;
+            cluster->ring_size++;
+        }
+    }
+
+    qsort(cluster->ring, cluster->ring_size, sizeof(ring_point_t), compare_ring_points);
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+// Parses "127.0.0.1:8001,127.0.0.1:8002", self must be one of the nodes
+int parse_cluster(const char *nodes, const char *self, cluster_t *cluster) {
+    char *nodes_copy = strdup(nodes);
+    if (!nodes_copy) {
+        perror("strdup");
+        return -1;
+    }
+
+    cluster->node_count = 0;
+    cluster->self = -1;
+    cluster->peer_address_count = 0;
+
+    char *item = strtok(nodes_copy, ",");
+    while (item) {
+        if (cluster->node_count == CLUSTER_MAX_NODES || !strchr(item, ':') || strlen(item) >= HOST_NAME_SIZE) {
+            free(nodes_copy);
+            return -1;
+        }
+
+        strcpy(cluster->nodes[cluster->node_count], item);
+        if (strcmp(item, self) == 0) {
+            cluster->self = cluster->node_count;
+        }
+        cluster->node_count++;
+
+        item = strtok(NULL, ",");
+    }
+
+    free(nodes_copy);
+    if (cluster->self == -1) {
+        return -1;
+    }
+
+    build_ring(cluster);
+    return 0;
+}
+
+// Blocking lookups are fine here, this runs before the event loop starts
+int resolve_cluster_peers(cluster_t *cluster) {
+    cluster->peer_address_count = 0;
+
+    for (int node = 0; node < cluster->node_count; node++) {
+        if (node == cluster->self) {
+            continue;
+        }
+
+        char name[HOST_NAME_SIZE];
+        char port[16];
+        if (split_host_port(cluster->nodes[node], name, sizeof(name), port, sizeof(port)) == -1) {
+            return -1;
+        }
+
+        struct addrinfo hints, *addresses;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int rv = getaddrinfo(name, port, &hints, &addresses);
+        if (rv != 0) {
+            fprintf(stderr, "getaddrinfo (peer=%s): %s\n", cluster->nodes[node], gai_strerror(rv));
+            return -1;
+        }
+
+        int kept = 0;
+        for (struct addrinfo *address = addresses; address && kept < CLUSTER_NODE_ADDRESSES; address = address->ai_next) {
+            char *out = cluster->peer_addresses[cluster->peer_address_count];
+            const void *raw = address->ai_family == AF_INET6
+                                  ? (const void *) &((struct sockaddr_in6 *) address->ai_addr)->sin6_addr
+                                  : (const void *) &((struct sockaddr_in *) address->ai_addr)->sin_addr;
+            if (inet_ntop(address->ai_family, raw, out, INET6_ADDRSTRLEN)) {
+                cluster->peer_address_count++;
+                kept++;
+            }
+        }
+        freeaddrinfo(addresses);
+    }
+
+    return 0;
+}
+
+int is_cluster_peer(const cluster_t *cluster, const char *address) {
+    for (int i = 0; i < cluster->peer_address_count; i++) {
+        if (strcmp(cluster->peer_addresses[i], address) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The owner is the node of the first point at or after the key's hash, wrapping around
+int cluster_owner(const cluster_t *cluster, const char *key) {
+    unsigned long long hash = hash_ring_key(key);
+    int low = 0;
+    int high = cluster->ring_size;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (cluster->ring[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return cluster->ring[low == cluster->ring_size ? 0 : low].node;
+}
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+
+#include "drr.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Puts a flow at the end of the current round
+static void link_flow(drr_scheduler_t *scheduler, drr_flow_t *flow) {
+    drr_flow_t *current = scheduler->current;
+
+    if (!current) {
+        flow->next = flow;
+        flow->prev = flow;
+        scheduler->current = flow;
+    } else {
+        flow->next = current;
+        flow->prev = current->prev;
+        current->prev->next = flow;
+        current->prev = flow;
+    }
+    flow->backlogged = 1;
+}
+
+// Takes a flow out of the ring, as classic DRR it forgets any credit it had left
+static void unlink_flow(drr_scheduler_t *scheduler, drr_flow_t *flow) {
+    if (!flow->backlogged) {
+        return;
+    }
+
+    if (flow->next == flow) {
+        scheduler->current = NULL;
+    } else {
+        flow->prev->next = flow->next;
+        flow->next->prev = flow->prev;
+        if (scheduler->current == flow) {
+            scheduler->current = flow->next;
+        }
+    }
+    flow->next = NULL;
+    flow->prev = NULL;
+    flow->backlogged = 0;
+}
+
+static drr_waiter_t *pop_waiter(drr_flow_t *flow) {
+    drr_waiter_t *waiter = flow->head;
+
+    flow->head = waiter->next;
+    if (!flow->head) {
+        flow->tail = NULL;
+    }
+    flow->count--;
+    waiter->next = NULL;
+    waiter->flow = NULL;
+    return waiter;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+void init_drr_scheduler(drr_scheduler_t *scheduler, long quantum) {
+    scheduler->current = NULL;
+    scheduler->quantum = quantum;
+}
+
+void init_drr_flow(drr_flow_t *flow) {
+    flow->next = NULL;
+    flow->prev = NULL;
+    flow->backlogged = 0;
+    flow->deficit = 0;
+    flow->head = NULL;
+    flow->tail = NULL;
+    flow->count = 0;
+}
+
+void init_drr_waiter(drr_waiter_t *waiter, long (*on_grant)(drr_waiter_t *waiter, long allowance), void *data) {
+    waiter->next = NULL;
+    waiter->flow = NULL;
+    waiter->on_grant = on_grant;
+    waiter->data = data;
+}
+
+void drr_wait(drr_scheduler_t *scheduler, drr_flow_t *flow, drr_waiter_t *waiter) {
+    if (waiter->flow) {
+        return;
+    }
+
+    waiter->flow = flow;
+    waiter->next = NULL;
+    if (flow->tail) {
+        flow->tail->next = waiter;
+    } else {
+        flow->head = waiter;
+    }
+    flow->tail = waiter;
+    flow->count++;
+
+    if (!flow->backlogged) {
+        link_flow(scheduler, flow);
+    }
+}
+
+void drr_cancel(drr_scheduler_t *scheduler, drr_waiter_t *waiter) {
+    drr_flow_t *flow = waiter->flow;
+    if (!flow) {
+        return;
+    }
+
+    drr_waiter_t *prev = NULL;
+    for (drr_waiter_t *cursor = flow->head; cursor != waiter; cursor = cursor->next) {
+        prev = cursor;
+    }
+    if (prev) {
+        prev->next = waiter->next;
+    } else {
+        flow->head = waiter->next;
+    }
+    if (flow->tail == waiter) {
+        flow->tail = prev;
+    }
+    flow->count--;
+    waiter->next = NULL;
+    waiter->flow = NULL;
+
+    if (!flow->head) {
+        flow->deficit = flow->deficit < 0 ? flow->deficit : 0;
+        unlink_flow(scheduler, flow);
+    }
+}
+
+// Every visit costs at least one unit of budget, so the loop ends even if flows keep overspending
+long run_drr(drr_scheduler_t *scheduler, long budget) {
+    while (budget > 0 && scheduler->current) {
+        drr_flow_t *flow = scheduler->current;
+        scheduler->current = flow->next;
+
+        long share = budget < scheduler->quantum ? budget : scheduler->quantum;
+        flow->deficit += share;
+        budget -= share;
+
+        // Only the waiters already queued are served, one that queues again waits for the next round
+        int count = flow->count;
+        while (count-- > 0 && flow->deficit > 0 && flow->head) {
+            drr_waiter_t *waiter = pop_waiter(flow);
+            flow->deficit -= waiter->on_grant(waiter, flow->deficit);
+        }
+
+        if (!flow->head) {
+            if (flow->deficit > 0) {
+                budget += flow->deficit;
+                flow->deficit = 0;
+            }
+            unlink_flow(scheduler, flow);
+        }
+    }
+
+    return budget;
+}
+
+int drr_backlogged(const drr_scheduler_t *scheduler) {
+    return scheduler->current != NULL;
+}
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "event.h"
+#include "uring.h"
+
+// Indexed by event_backend_t
+static const char *event_backend_names[] = {"epoll", "uring"};
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Registers exactly the events the watch's pending operations need
+static int update_interest(io_watch_t *watch) {
+    unsigned int interest = 0;
+    if (watch->accepting || watch->reading) {
+        interest |= EPOLLIN;
+    }
+    if (watch->connecting || watch->out) {
+        interest |= EPOLLOUT;
+    }
+    if (watch->poll_events & IO_READABLE) {
+        interest |= EPOLLIN;
+    }
+    if (watch->poll_events & IO_WRITABLE) {
+        interest |= EPOLLOUT;
+    }
+
+    if (watch->registered && interest == watch->interest) {
+        return 0;
+    }
+
+    // epoll reports errors and hangups even with no events requested, so an idle
+    // watch leaves the set instead of waking the loop over and over
+    if (interest == 0) {
+        if (watch->registered && epoll_ctl(watch->loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        watch->registered = 0;
+        watch->interest = 0;
+        return 0;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = interest;
+    event.data.ptr = watch;
+
+    int op = watch->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(watch->loop->epoll_fd, op, watch->fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    watch->registered = 1;
+    watch->interest = interest;
+    return 0;
+}
+
+// Drains the accept queue, a burst of clients costs one wakeup
+static void handle_accept(io_watch_t *watch) {
+    while (watch->fd != -1 && watch->accepting) {
+        int fd = accept4(watch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        watch->on_accept(watch, fd);
+    }
+}
+
+static void handle_connect(io_watch_t *watch) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(watch->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1) {
+        error = errno;
+    }
+
+    watch->connecting = 0;
+    update_interest(watch);
+    watch->on_connect(watch, -error);
+}
+
+static void handle_write(io_watch_t *watch) {
+    int rv = send_iochain(watch->out, watch->fd);
+    if (rv == 0) {
+        return;
+    }
+
+    watch->out = NULL;
+    update_interest(watch);
+    watch->on_write(watch, rv == 1 ? 0 : -1);
+}
+
+// One recv per wakeup keeps a fast sender from starving the other connections
+static void handle_read(io_watch_t *watch) {
+    event_loop_t *loop = watch->loop;
+    ssize_t bytes = recv(watch->fd, loop->read_buffer, sizeof(loop->read_buffer), 0);
+    if (bytes == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        bytes = -errno;
+    }
+
+    // End of stream is reported once, the watch stops reading
+    if (bytes <= 0) {
+        watch->reading = 0;
+        update_interest(watch);
+    }
+    watch->on_read(watch, loop->read_buffer, bytes);
+}
+
+static void dispatch_event(io_watch_t *watch, unsigned int events) {
+    int failed = events & (EPOLLERR | EPOLLHUP);
+
+    if (watch->fd != -1 && watch->accepting && (events & EPOLLIN)) {
+        handle_accept(watch);
+    }
+    if (watch->fd != -1 && watch->connecting && ((events & EPOLLOUT) || failed)) {
+        handle_connect(watch);
+    }
+    if (watch->fd != -1 && watch->out && ((events & EPOLLOUT) || failed)) {
+        handle_write(watch);
+    }
+    if (watch->fd != -1 && watch->reading && ((events & EPOLLIN) || failed)) {
+        handle_read(watch);
+    }
+    if (watch->fd != -1 && watch->poll_events) {
+        unsigned int ready = 0;
+        if ((events & EPOLLIN) || failed) {
+            ready |= IO_READABLE;
+        }
+        if ((events & EPOLLOUT) || failed) {
+            ready |= IO_WRITABLE;
+        }
+        if (ready & watch->poll_events) {
+            watch->on_ready(watch, ready & watch->poll_events);
+        }
+    }
+}
+
+static void run_deferred(event_loop_t *loop) {
+    for (int i = 0; i < loop->deferred_count; i++) {
+        loop->deferred[i].release(loop->deferred[i].data);
+    }
+    loop->deferred_count = 0;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+int init_event_loop(event_loop_t *loop, event_backend_t backend) {
+    init_timer_wheel(&loop->timers, current_time_ms());
+    loop->deferred = NULL;
+    loop->deferred_count = 0;
+    loop->deferred_capacity = 0;
+    loop->epoll_fd = -1;
+    loop->uring = NULL;
+
+    if (backend == EVENT_BACKEND_URING) {
+        uring_t *ring = malloc(sizeof(uring_t));
+        if (ring && init_uring(ring) == 0) {
+            loop->uring = ring;
+            return 0;
+        }
+        free(ring);
+        fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    return 0;
+}
+
+int parse_event_backend(const char *name, event_backend_t *backend) {
+    int backend_count = sizeof(event_backend_names) / sizeof(event_backend_names[0]);
+
+    for (int i = 0; i < backend_count; i++) {
+        if (strcasecmp(name, event_backend_names[i]) == 0) {
+            *backend = (event_backend_t) i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void init_io_watch(io_watch_t *watch, event_loop_t *loop, int fd, void *data) {
+    memset(watch, 0, sizeof(*watch));
+    watch->fd = fd;
+    watch->data = data;
+    watch->loop = loop;
+    watch->uring_ops = -1;
+}
+
+int start_accept(io_watch_t *watch, void (*on_accept)(io_watch_t *watch, int fd)) {
+    watch->on_accept = on_accept;
+    watch->accepting = 1;
+    return watch->loop->uring ? uring_start_accept(watch) : update_interest(watch);
+}
+
+int start_read(io_watch_t *watch, void (*on_read)(io_watch_t *watch, const char *buffer, long length)) {
+    watch->on_read = on_read;
+    watch->reading = 1;
+    return watch->loop->uring ? uring_start_read(watch) : update_interest(watch);
+}
+
+void stop_read(io_watch_t *watch) {
+    if (watch->reading) {
+        watch->reading = 0;
+        if (watch->loop->uring) {
+            uring_stop_read(watch);
+        } else {
+            update_interest(watch);
+        }
+    }
+}
+
+int start_write(io_watch_t *watch, iochain_t *chain, void (*on_write)(io_watch_t *watch, int status)) {
+    watch->on_write = on_write;
+    watch->out = chain;
+    if (watch->loop->uring && uring_start_write(watch) == -1) {
+        watch->out = NULL;
+        return -1;
+    }
+    return watch->loop->uring ? 0 : update_interest(watch);
+}
+
+int start_connect(io_watch_t *watch, const struct sockaddr *address, socklen_t address_length,
+                  void (*on_connect)(io_watch_t *watch, int status)) {
+    if (watch->loop->uring) {
+        if (uring_start_connect(watch, address, address_length) == -1) {
+            return -1;
+        }
+        watch->on_connect = on_connect;
+        watch->connecting = 1;
+        return 0;
+    }
+
+    // An immediate success is still reported through the callback once the socket is writable
+    if (connect(watch->fd, address, address_length) == -1 && errno != EINPROGRESS) {
+        return -1;
+    }
+
+    watch->on_connect = on_connect;
+    watch->connecting = 1;
+    return update_interest(watch);
+}
+
+int start_poll(io_watch_t *watch, unsigned int events, void (*on_ready)(io_watch_t *watch, unsigned int events)) {
+    watch->on_ready = on_ready;
+    watch->poll_events = events;
+    return watch->loop->uring ? uring_update_poll(watch) : update_interest(watch);
+}
+
+void close_io_watch(io_watch_t *watch) {
+    if (watch->fd == -1) {
+        return;
+    }
+
+    // Closing the descriptor also drops it from the epoll set, io_uring needs its operations cancelled
+    if (watch->loop->uring) {
+        uring_close_watch(watch);
+    }
+    close(watch->fd);
+    watch->fd = -1;
+    watch->registered = 0;
+    watch->accepting = 0;
+    watch->reading = 0;
+    watch->connecting = 0;
+    watch->poll_events = 0;
+    watch->out = NULL;
+}
+
+int detach_io_watch(io_watch_t *watch) {
+    int fd = watch->fd;
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (watch->registered && epoll_ctl(watch->loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+    watch->fd = -1;
+    watch->registered = 0;
+    watch->accepting = 0;
+    watch->reading = 0;
+    watch->connecting = 0;
+    watch->poll_events = 0;
+    watch->out = NULL;
+
+    return fd;
+}
+
+void defer_release(event_loop_t *loop, void (*release)(void *data), void *data) {
+    if (loop->deferred_count == loop->deferred_capacity) {
+        int capacity = loop->deferred_capacity ? loop->deferred_capacity * 2 : MAX_EVENTS;
+        deferred_release_t *deferred = realloc(loop->deferred, capacity * sizeof(deferred_release_t));
+        if (!deferred) {
+            // Leaking is safer than freeing memory a pending event may still point at
+            perror("realloc");
+            return;
+        }
+        loop->deferred = deferred;
+        loop->deferred_capacity = capacity;
+    }
+
+    loop->deferred[loop->deferred_count].release = release;
+    loop->deferred[loop->deferred_count].data = data;
+    loop->deferred_count++;
+}
+
+void run_event_loop(event_loop_t *loop) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int timeout = next_timer_timeout(&loop->timers, current_time_ms());
+        if (loop->uring) {
+            uring_wait(loop->uring, timeout);
+            advance_timer_wheel(&loop->timers, current_time_ms());
+            run_deferred(loop);
+            continue;
+        }
+
+        int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (count == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            count = 0;
+        }
+
+        for (int i = 0; i < count; i++) {
+            dispatch_event(events[i].data.ptr, events[i].events);
+        }
+        advance_timer_wheel(&loop->timers, current_time_ms());
+
+        run_deferred(loop);
+    }
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "eyeballs.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Returns the index of the record for address, or -1 if none
+static int find_address_failure(address_failure_cache_t *failures, const struct sockaddr *address,
+                                socklen_t address_length) {
+    for (int i = 0; i < ADDRESS_FAILURE_SIZE; i++) {
+        address_failure_t *entry = &failures->entries[i];
+        if (entry->valid == 1 && entry->address_length == address_length &&
+            memcmp(&entry->address, address, address_length) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Appends the addresses of one failure state, alternating families
+static int interleave_addresses(struct addrinfo *list, address_failure_cache_t *failures, int failed,
+                                struct addrinfo **ordered, int count, int max_count) {
+    struct addrinfo *families[2][MAX_CONNECT_ATTEMPTS];
+    int family_counts[2] = {0, 0};
+    int first_family = list->ai_family;
+
+    // Split by family, keeping getaddrinfo's order within each
+    for (struct addrinfo *p = list; p != NULL; p = p->ai_next) {
+        if (search_address_failure(failures, p->ai_addr, p->ai_addrlen) != failed) {
+            continue;
+        }
+        int family = p->ai_family == first_family ? 0 : 1;
+        if (family_counts[family] < MAX_CONNECT_ATTEMPTS) {
+            families[family][family_counts[family]++] = p;
+        }
+    }
+
+    for (int i = 0; i < MAX_CONNECT_ATTEMPTS && count < max_count; i++) {
+        for (int family = 0; family < 2 && count < max_count; family++) {
+            if (i < family_counts[family]) {
+                ordered[count++] = families[family][i];
+            }
+        }
+    }
+
+    return count;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+void init_address_failures(address_failure_cache_t *failures) {
+    memset(failures, 0, sizeof(*failures));
+}
+
+void record_address_failure(address_failure_cache_t *failures, const struct sockaddr *address,
+                            socklen_t address_length) {
+    if (address_length > sizeof(struct sockaddr_storage)) {
+        return;
+    }
+
+    int index = find_address_failure(failures, address, address_length);
+
+    // Reuse a free slot, or the oldest failure if the table is full
+    for (int i = 0; index == -1 && i < ADDRESS_FAILURE_SIZE; i++) {
+        if (failures->entries[i].valid == 0) {
+            index = i;
+        }
+    }
+    if (index == -1) {
+        index = 0;
+        for (int i = 1; i < ADDRESS_FAILURE_SIZE; i++) {
+            if (failures->entries[i].failed_at < failures->entries[index].failed_at) {
+                index = i;
+            }
+        }
+    }
+
+    address_failure_t *entry = &failures->entries[index];
+    entry->valid = 1;
+    memcpy(&entry->address, address, address_length);
+    entry->address_length = address_length;
+    entry->failed_at = time(NULL);
+}
+
+int search_address_failure(address_failure_cache_t *failures, const struct sockaddr *address,
+                           socklen_t address_length) {
+    int index = find_address_failure(failures, address, address_length);
+    if (index == -1) {
+        return 0;
+    }
+
+    // Expired failures are dropped as they are found
+    if (time(NULL) - failures->entries[index].failed_at >= ADDRESS_FAILURE_TTL) {
+        failures->entries[index].valid = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+void clear_address_failure(address_failure_cache_t *failures, const struct sockaddr *address,
+                           socklen_t address_length) {
+    int index = find_address_failure(failures, address, address_length);
+    if (index != -1) {
+        failures->entries[index].valid = 0;
+    }
+}
+
+// Healthy addresses are interleaved first, then the recently failed ones the same way
+int order_addresses(struct addrinfo *list, address_failure_cache_t *failures, struct addrinfo **ordered,
+                    int max_count) {
+    if (!list) {
+        return 0;
+    }
+
+    int count = interleave_addresses(list, failures, 0, ordered, 0, max_count);
+    return interleave_addresses(list, failures, 1, ordered, count, max_count);
+}
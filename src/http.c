@@ -0,0 +1,248 @@
+#define _GNU_SOURCE // https://stackoverflow.com/questions/9935642/how-do-i-use-strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+// Finds the value of the first header with the given name, e.g. "Content-Type:", in place
+// Returns a pointer into message, or NULL if not found
+const char *find_header(const char *message, const char *name, int *length) {
+    const char *headers_end = strstr(message, "\r\n\r\n");
+    if (!headers_end) {
+        return NULL;
+    }
+
+    // Walk the lines of the header block, the value runs to the end of its line
+    int name_length = strlen(name);
+    const char *line = message;
+    while (line < headers_end) {
+        const char *line_end = strstr(line, "\r\n");
+        if (line_end - line >= name_length && strncasecmp(line, name, name_length) == 0) {
+            // Skip whitespace after colon
+            const char *value = line + name_length;
+            while (*value == ' ' || *value == '\t') value++;
+
+            *length = line_end - value;
+            return value;
+        }
+        line = line_end + 2;
+    }
+
+    return NULL;
+}
+
+// Parses out the value of the first header with the given name, e.g. "Content-Type:"
+// Returns a malloced string, or NULL if not found/failed.
+char *parse_header(const char *message, const char *name) {
+    int length;
+    const char *value = find_header(message, name, &length);
+    if (!value) {
+        return NULL;
+    }
+
+    char *result = malloc(length + 1);
+    if (!result) {
+        perror("malloc");
+        return NULL;
+    }
+    memcpy(result, value, length);
+    result[length] = '\0';
+
+    return result;
+}
+
+// Steps to the next item of a comma-separated header value, trimming blanks around it
+const char *next_list_item(const char **cursor, const char *end, int *length) {
+    const char *item = *cursor;
+    while (item < end && (*item == ' ' || *item == '\t' || *item == ',')) {
+        item++;
+    }
+    if (item >= end) {
+        *cursor = end;
+        return NULL;
+    }
+
+    const char *item_end = memchr(item, ',', end - item);
+    if (!item_end) {
+        item_end = end;
+    }
+    *cursor = item_end;
+
+    while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t')) {
+        item_end--;
+    }
+    *length = item_end - item;
+    return item;
+}
+
+// Parses "HTTP/1.1 200 OK" into 200
+int parse_status_code(const char *response) {
+    const char *code = strchr(response, ' ');
+    if (!code || code[1] < '1' || code[1] > '5') {
+        return -1;
+    }
+
+    return atoi(code + 1);
+}
+
+// Copies the status line and header lines into out, leaving out the named headers
+// and the terminating blank line. Returns the bytes written, or -1 if out is too small
+int copy_headers_except(const char *headers, int header_size, const char **skip, int skip_count, char *out,
+                        int out_size) {
+    const char *line = headers;
+    const char *headers_end = headers + header_size - 2; // Stop before the blank line
+    int written = 0;
+
+    while (line < headers_end) {
+        const char *line_end = strstr(line, "\r\n") + 2;
+        int keep = 1;
+
+        for (int i = 0; i < skip_count; i++) {
+            if (strncasecmp(line, skip[i], strlen(skip[i])) == 0) {
+                keep = 0;
+                break;
+            }
+        }
+
+        if (keep) {
+            if (written + (line_end - line) > out_size) {
+                return -1;
+            }
+            memcpy(out + written, line, line_end - line);
+            written += line_end - line;
+        }
+
+        line = line_end;
+    }
+
+    return written;
+}
+
+// Removes whole header lines, keeping the request line and anything after the header block
+int strip_headers(const char *message, const char **names, int count, char *stripped, int out_size) {
+    char *headers_end = strstr(message, "\r\n\r\n");
+    if (!headers_end) {
+        return -1;
+    }
+    int header_size = headers_end + 4 - message;
+    int message_length = strlen(message);
+    if (out_size < message_length + 1) {
+        return -1;
+    }
+
+    // Stripping only shrinks the header block, so the copy always fits
+    int written = copy_headers_except(message, header_size, names, count, stripped, message_length);
+    memcpy(stripped + written, "\r\n", 2);
+    written += 2;
+
+    // Keep anything that arrived after the header block
+    memcpy(stripped + written, message + header_size, message_length - header_size);
+    written += message_length - header_size;
+    stripped[written] = '\0';
+
+    return written;
+}
+
+// Writes the request line, the new Host, then the other headers and anything after the header block
+int replace_host_header(const char *request, const char *host, int host_length, char *out, int out_size) {
+    const char *line_end = strstr(request, "\r\n");
+    const char *headers_end = strstr(request, "\r\n\r\n");
+    if (!line_end || !headers_end) {
+        return -1;
+    }
+    const char *headers = line_end + 2;
+
+    int written = snprintf(out, out_size, "%.*sHost: %.*s\r\n", (int) (headers - request), request, host_length, host);
+    if (written >= out_size) {
+        return -1;
+    }
+
+    // Without any header lines the block is just the blank line, and nothing is copied
+    const char *host_headers[] = {"Host:"};
+    int copied = copy_headers_except(headers, headers_end + 4 - headers, host_headers, 1, out + written,
+                                     out_size - written);
+    if (copied == -1) {
+        return -1;
+    }
+    written += copied;
+
+    // The blank line and any body
+    const char *rest = headers_end + 2;
+    int rest_length = strlen(rest);
+    if (written + rest_length >= out_size) {
+        return -1;
+    }
+    memcpy(out + written, rest, rest_length + 1);
+
+    return written + rest_length;
+}
+
+// Splits "name", "name:port", "[v6]" or "[v6]:port" into a bare name and a port, defaulting to 80
+int split_host_port(const char *host, char *name, int name_size, char *port, int port_size) {
+    const char *name_start = host;
+    const char *name_end;
+    const char *port_start = NULL;
+
+    if (host[0] == '[') {
+        // Bracketed IPv6 literal, the colons inside belong to the address
+        name_start = host + 1;
+        name_end = strchr(name_start, ']');
+        if (!name_end) {
+            return -1;
+        }
+        if (name_end[1] == ':') {
+            port_start = name_end + 2;
+        } else if (name_end[1] != '\0') {
+            return -1;
+        }
+    } else {
+        name_end = strchr(host, ':');
+        if (name_end) {
+            port_start = name_end + 1;
+        } else {
+            name_end = host + strlen(host);
+        }
+    }
+
+    int name_length = name_end - name_start;
+    if (name_length == 0 || name_length >= name_size) {
+        return -1;
+    }
+    memcpy(name, name_start, name_length);
+    name[name_length] = '\0';
+
+    // An empty port ("host:") means the default, anything else must be all digits
+    if (!port_start || *port_start == '\0') {
+        port_start = "80";
+    }
+    if ((int) strlen(port_start) >= port_size || strspn(port_start, "0123456789") != strlen(port_start)) {
+        return -1;
+    }
+    strcpy(port, port_start);
+
+    return 0;
+}
+
+// XORs each byte in, then multiplies by the 64-bit FNV prime
+unsigned long long hash_bytes(unsigned long long hash, const void *data, long length) {
+    const unsigned char *bytes = data;
+
+    for (long i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Queues "HTTP/1.1 <status> <reason>" with an empty body, the connection closes after it
+int append_error_response(iochain_t *out, int status, const char *reason) {
+    char response[128];
+    int length = snprintf(response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                          status, reason);
+
+    return append_iochain_copy(out, response, length);
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "iochain.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Makes room for one more buffer, compacting away sent ones before growing
+static int reserve_iochain(iochain_t *chain) {
+    if (chain->head > 0) {
+        int live = chain->count - chain->head;
+        memmove(chain->iov, chain->iov + chain->head, live * sizeof(struct iovec));
+        memmove(chain->owned, chain->owned + chain->head, live * sizeof(char *));
+        memmove(chain->segments, chain->segments + chain->head, live * sizeof(segment_t *));
+        chain->count = live;
+        chain->head = 0;
+    }
+
+    if (chain->count < chain->capacity) {
+        return 0;
+    }
+
+    int capacity = chain->capacity ? chain->capacity * 2 : IOCHAIN_INIT_SIZE;
+    struct iovec *iov = realloc(chain->iov, capacity * sizeof(struct iovec));
+    if (!iov) {
+        perror("realloc");
+        return -1;
+    }
+    chain->iov = iov;
+
+    char **owned = realloc(chain->owned, capacity * sizeof(char *));
+    if (!owned) {
+        perror("realloc");
+        return -1;
+    }
+    chain->owned = owned;
+
+    segment_t **segments = realloc(chain->segments, capacity * sizeof(segment_t *));
+    if (!segments) {
+        perror("realloc");
+        return -1;
+    }
+    chain->segments = segments;
+    chain->capacity = capacity;
+
+    return 0;
+}
+
+// Frees or releases whatever keeps buffer i alive
+static void retire_buffer(iochain_t *chain, int i) {
+    free(chain->owned[i]);
+    release_segment(chain->segments[i]);
+}
+
+static int push_iochain(iochain_t *chain, char *data, long length, char *owned, segment_t *segment) {
+    if (reserve_iochain(chain) == -1) {
+        return -1;
+    }
+
+    chain->iov[chain->count].iov_base = data;
+    chain->iov[chain->count].iov_len = length;
+    chain->owned[chain->count] = owned;
+    chain->segments[chain->count] = segment;
+    chain->count++;
+    chain->pending_bytes += length;
+
+    return 0;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+void init_iochain(iochain_t *chain) {
+    memset(chain, 0, sizeof(*chain));
+}
+
+int append_iochain(iochain_t *chain, const void *data, long length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    return push_iochain(chain, (char *) data, length, NULL, NULL);
+}
+
+int append_iochain_owned(iochain_t *chain, char *data, long length) {
+    if (length == 0) {
+        free(data);
+        return 0;
+    }
+
+    if (push_iochain(chain, data, length, data, NULL) == -1) {
+        free(data);
+        return -1;
+    }
+
+    return 0;
+}
+
+int append_iochain_copy(iochain_t *chain, const void *data, long length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    char *copy = malloc(length);
+    if (!copy) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(copy, data, length);
+
+    return append_iochain_owned(chain, copy, length);
+}
+
+int append_iochain_segment(iochain_t *chain, segment_t *segment, const char *data, long length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    if (push_iochain(chain, (char *) data, length, NULL, segment) == -1) {
+        return -1;
+    }
+    hold_segment(segment);
+
+    return 0;
+}
+
+// A zero-length entry is retired, and its buffer freed, as soon as the send reaches it
+int append_iochain_release(iochain_t *chain, char *data) {
+    if (push_iochain(chain, data, 0, data, NULL) == -1) {
+        free(data);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Sends up to IOCHAIN_SEND_MAX buffers per sendmsg until drained or the socket is full
+int send_iochain(iochain_t *chain, int fd) {
+    while (chain->head < chain->count) {
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = chain->iov + chain->head;
+        message.msg_iovlen = chain->count - chain->head;
+        if (message.msg_iovlen > IOCHAIN_SEND_MAX) {
+            message.msg_iovlen = IOCHAIN_SEND_MAX;
+        }
+
+        // MSG_NOSIGNAL turns a vanished client into EPIPE instead of killing the proxy
+        ssize_t bytes = sendmsg(fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        advance_iochain(chain, bytes);
+    }
+
+    return 1;
+}
+
+// Retires fully sent buffers, then steps into the partially sent one
+void advance_iochain(iochain_t *chain, long bytes) {
+    chain->pending_bytes -= bytes;
+
+    while (chain->head < chain->count && (size_t) bytes >= chain->iov[chain->head].iov_len) {
+        bytes -= chain->iov[chain->head].iov_len;
+        retire_buffer(chain, chain->head);
+        chain->head++;
+    }
+    if (chain->head < chain->count) {
+        chain->iov[chain->head].iov_base = (char *) chain->iov[chain->head].iov_base + bytes;
+        chain->iov[chain->head].iov_len -= bytes;
+    } else {
+        chain->head = 0;
+        chain->count = 0;
+    }
+}
+
+int iochain_empty(const iochain_t *chain) {
+    return chain->head == chain->count;
+}
+
+void reset_iochain(iochain_t *chain) {
+    for (int i = chain->head; i < chain->count; i++) {
+        retire_buffer(chain, i);
+    }
+    chain->head = 0;
+    chain->count = 0;
+    chain->pending_bytes = 0;
+}
+
+void free_iochain(iochain_t *chain) {
+    reset_iochain(chain);
+    free(chain->iov);
+    free(chain->owned);
+    free(chain->segments);
+    init_iochain(chain);
+}
@@ -1,20 +1,142 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "proxy.h"
 #include "cache.h"
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -p listen-port [-c] [-e lru|wtinylfu] [-z] [-r] [-l chunked-MB] [-n 4xx=secs,5xx=secs,connect=secs]\n"
+                    "       [-t header=secs,connect=secs,first-byte=secs,idle=secs,total=secs] [-b epoll|uring]\n"
+                    "       [-g host:port,host:port,... -s host:port] [-u upgrade-socket]\n"
+                    "       [-a rate=per-sec,burst=n,requests=n,fetches=n,bandwidth=MB-per-sec]\n"
+                    "       [-x file=trace-file,sample=n] [-w capture-file]\n", prog);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3 || argc > 4 || strcmp(argv[1], "-p") != 0) {
-        fprintf(stderr, "Usage: %s -p listen-port [-c]\n", argv[0]);
+    proxy_config_t config = {
+        .port = -1,
+        .enable_cache = 0,
+        .cache_policy = CACHE_POLICY_LRU,
+        .compress_cache = 0,
+        .range_fill = 0,
+        .max_chunked_size = 0,
+        .upgrade_path = NULL,
+        .trace = {NULL, 1},
+        .capture_path = NULL,
+        .backend = EVENT_BACKEND_EPOLL,
+    };
+    init_negative_ttls(&config.negative_ttl);
+    init_deadlines(&config.deadlines);
+    memset(&config.admission, 0, sizeof(config.admission));
+    const char *cluster_nodes = NULL;
+    const char *cluster_self = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:ce:zrl:n:t:b:g:s:u:a:x:w:")) != -1) {
+        switch (opt) {
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'c':
+            // Enable cache to be used in stage 2
+            config.enable_cache = 1;
+            break;
+        case 'e':
+            if (parse_cache_policy(optarg, &config.cache_policy) == -1) {
+                fprintf(stderr, "Unknown cache policy: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'z':
+            config.compress_cache = 1;
+            break;
+        case 'r':
+            config.range_fill = 1;
+            break;
+        case 'l':
+            // Streamed responses up to this many megabytes are cached as chunks
+            config.max_chunked_size = atol(optarg) * 1024 * 1024;
+            if (config.max_chunked_size <= 0) {
+                fprintf(stderr, "Bad chunked cache limit: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            if (parse_negative_ttls(optarg, &config.negative_ttl) == -1) {
+                fprintf(stderr, "Bad negative cache TTLs: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            if (parse_deadlines(optarg, &config.deadlines) == -1) {
+                fprintf(stderr, "Bad deadlines: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (parse_event_backend(optarg, &config.backend) == -1) {
+                fprintf(stderr, "Unknown event backend: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'g':
+            cluster_nodes = optarg;
+            break;
+        case 's':
+            cluster_self = optarg;
+            break;
+        case 'u':
+            config.upgrade_path = optarg;
+            break;
+        case 'a':
+            if (parse_admission(optarg, &config.admission) == -1) {
+                fprintf(stderr, "Bad admission limits: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'x':
+            if (parse_trace_config(optarg, &config.trace) == -1) {
+                fprintf(stderr, "Bad trace options: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            config.capture_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.port <= 0 || optind != argc) {
+        usage(argv[0]);
         return 1;
     }
 
-    int port = atoi(argv[2]);
-    int enable_cache = (argc == 4 && strcmp(argv[3], "-c") == 0);
+    // Cluster mode needs the node list and which of the nodes this proxy is
+    if (cluster_nodes || cluster_self) {
+        if (!cluster_nodes || !cluster_self || !config.enable_cache ||
+            parse_cluster(cluster_nodes, cluster_self, &config.cluster) == -1) {
+            fprintf(stderr, "Bad cluster: -g lists every node, -s the one among them this is, and -c is needed\n");
+            usage(argv[0]);
+            return 1;
+        }
+        if (resolve_cluster_peers(&config.cluster) == -1) {
+            fprintf(stderr, "Cannot resolve the cluster's nodes\n");
+            return 1;
+        }
+    }
 
-    // Enable cache to be used in stage 2
-    start_proxy(port, enable_cache);
+    start_proxy(&config);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "negative.h"
+
+// 4xx codes RFC 9111 section 4.2.2 allows caching with heuristic freshness
+const int heuristic_4xx[] = {404, 405, 410, 414};
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Returns the index of the record for host, or -1 if none
+static int find_host_failure(host_failure_cache_t *failures, const char *host) {
+    for (int i = 0; i < HOST_FAILURE_SIZE; i++) {
+        if (failures->entries[i].valid == 1 && strcasecmp(failures->entries[i].host, host) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+void init_negative_ttls(negative_ttl_t *ttl) {
+    for (int i = 0; i < 6; i++) {
+        ttl->status_ttl[i] = -1;
+    }
+    ttl->connect_ttl = -1;
+}
+
+// Parses "4xx=30,5xx=5,connect=10", classes not listed stay disabled
+int parse_negative_ttls(const char *spec, negative_ttl_t *ttl) {
+    char *spec_copy = strdup(spec);
+    if (!spec_copy) {
+        perror("strdup");
+        return -1;
+    }
+
+    char *item = strtok(spec_copy, ",");
+    while (item) {
+        char *value = strchr(item, '=');
+        if (!value || value[1] < '0' || value[1] > '9') {
+            free(spec_copy);
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (strcasecmp(item, "4xx") == 0) {
+            ttl->status_ttl[4] = atoi(value);
+        } else if (strcasecmp(item, "5xx") == 0) {
+            ttl->status_ttl[5] = atoi(value);
+        } else if (strcasecmp(item, "connect") == 0) {
+            ttl->connect_ttl = atoi(value);
+        } else {
+            free(spec_copy);
+            return -1;
+        }
+
+        item = strtok(NULL, ",");
+    }
+
+    free(spec_copy);
+    return 0;
+}
+
+// Returns the TTL for an error without explicit freshness, or -1 if it must not be cached
+int negative_status_ttl(const negative_ttl_t *ttl, int status) {
+    if (status >= 500 && status <= 599) {
+        return ttl->status_ttl[5];
+    }
+
+    // Other 4xx (401, 403, 429, ...) depend on the client, so never cache them heuristically
+    int heuristic_count = sizeof(heuristic_4xx) / sizeof(heuristic_4xx[0]);
+    for (int i = 0; i < heuristic_count; i++) {
+        if (status == heuristic_4xx[i]) {
+            return ttl->status_ttl[4];
+        }
+    }
+
+    return -1;
+}
+
+void init_host_failures(host_failure_cache_t *failures) {
+    for (int i = 0; i < HOST_FAILURE_SIZE; i++) {
+        failures->entries[i].valid = 0;
+        failures->entries[i].host[0] = '\0';
+        failures->entries[i].failed_at = 0;
+        failures->entries[i].ttl = 0;
+    }
+}
+
+// Records or refreshes the failure, reusing the oldest record when the table is full
+void record_host_failure(host_failure_cache_t *failures, const char *host, int ttl) {
+    int index = find_host_failure(failures, host);
+
+    if (index == -1) {
+        time_t oldest = 0;
+        for (int i = 0; i < HOST_FAILURE_SIZE; i++) {
+            if (failures->entries[i].valid == 0) {
+                index = i;
+                break;
+            }
+            if (index == -1 || failures->entries[i].failed_at < oldest) {
+                index = i;
+                oldest = failures->entries[i].failed_at;
+            }
+        }
+    }
+
+    host_failure_t *failure = &failures->entries[index];
+    failure->valid = 1;
+    strncpy(failure->host, host, HOST_NAME_SIZE - 1);
+    failure->host[HOST_NAME_SIZE - 1] = '\0';
+    failure->failed_at = time(NULL);
+    failure->ttl = ttl;
+}
+
+// Returns 1 if the host failed within its TTL, dropping expired records on the way
+int search_host_failure(host_failure_cache_t *failures, const char *host) {
+    int index = find_host_failure(failures, host);
+    if (index == -1) {
+        return 0;
+    }
+
+    host_failure_t *failure = &failures->entries[index];
+    if (time(NULL) - failure->failed_at >= failure->ttl) {
+        failure->valid = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+void clear_host_failure(host_failure_cache_t *failures, const char *host) {
+    int index = find_host_failure(failures, host);
+    if (index != -1) {
+        failures->entries[index].valid = 0;
+    }
+}
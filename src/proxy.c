@@ -2,9 +2,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -12,552 +15,2062 @@
 #include <time.h>
 #include "proxy.h"
 #include "cache.h"
+#include "http.h"
+#include "range.h"
+#include "upgrade.h"
+
+// The proxy's shared state; the cache holds full response slots and lives in shared memory
+static proxy_t proxy;
+
+static void start_origin_fetch(connection_t *conn);
+static void on_client_read(io_watch_t *watch, const char *buffer, long length);
+static void on_attempt_connect(io_watch_t *watch, int status);
+static void on_request_sent(io_watch_t *watch, int status);
+static void on_server_read(io_watch_t *watch, const char *buffer, long length);
+static void on_response_sent(io_watch_t *watch, int status);
+static void on_stream_sent(io_watch_t *watch, int status);
+static void on_chunks_sent(io_watch_t *watch, int status);
+static void on_cache_chunks(cache_reader_t *reader);
+static void on_tunnel_reply_sent(io_watch_t *watch, int status);
+static void on_tunnel_ready(io_watch_t *watch, unsigned int events);
+static void on_upgrade_accept(io_watch_t *watch, int fd);
+static void on_previous_read(io_watch_t *watch, const char *buffer, long length);
+static long on_fetch_granted(drr_waiter_t *waiter, long allowance);
+static long on_send_granted(drr_waiter_t *waiter, long allowance);
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Keeps the earliest of the enabled deadlines and remembers which phase it belongs to
+static void consider_deadline(long long *earliest, const char **phase, long long start, long limit,
+                              const char *name) {
+    if (limit <= 0) {
+        return;
+    }
 
-// Helper functions
-int connect_to_host(const char *host) {
-    struct addrinfo hints, *res, *p;
-    int sockfd;
+    long long deadline = start + limit;
+    if (*earliest == 0 || deadline < *earliest) {
+        *earliest = deadline;
+        *phase = name;
+    }
+}
 
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET6;      // Set to IPv6 according to ED
-    hints.ai_socktype = SOCK_STREAM;
+// Returns the nearest deadline for the connection's current state, or 0 if none applies
+static long long next_deadline(connection_t *conn, const char **phase) {
+    const deadline_config_t *deadlines = &conn->proxy->config->deadlines;
+    long long earliest = 0;
+    const char *name = NULL;
 
-    // Adapted from Beej's guide to network programming
-    // https://beej.us/guide/bgnet/html/
-    int rv = getaddrinfo(host, "80", &hints, &res);
-    if (rv != 0) {
-        fprintf(stderr, "getaddrinfo (host=%s): %s\n", host, gai_strerror(rv));
-        return -1;
+    // Tunnels carry long-lived sessions, so only the idle limit ends them
+    if (conn->state != CONN_TUNNELLING) {
+        consider_deadline(&earliest, &name, conn->accepted_ms, deadlines->total_ms, "total");
     }
+    consider_deadline(&earliest, &name, conn->last_activity_ms, deadlines->idle_ms, "idle");
 
-    for (p = res; p != NULL; p = p->ai_next) {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            continue;
+    switch (conn->state) {
+    case CONN_READING_REQUEST:
+        consider_deadline(&earliest, &name, conn->accepted_ms, deadlines->header_ms, "header");
+        break;
+    case CONN_QUEUED:
+        break;
+    case CONN_CONNECTING:
+        consider_deadline(&earliest, &name, conn->phase_started_ms, deadlines->connect_ms, "connect");
+        break;
+    case CONN_SENDING_REQUEST:
+    case CONN_READING_RESPONSE:
+        if (conn->response_bytes == 0) {
+            consider_deadline(&earliest, &name, conn->phase_started_ms, deadlines->first_byte_ms, "first-byte");
         }
+        break;
+    case CONN_SENDING_RESPONSE:
+    case CONN_TUNNELLING:
+        break;
+    }
 
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            continue;
-        }
+    if (phase) {
+        *phase = name;
+    }
+    return earliest;
+}
 
-        break;
+// Re-arms the connection's timer after a state change; plain activity only moves the idle
+// deadline later, so the timer is left alone and re-armed lazily when it fires
+static void arm_deadline(connection_t *conn) {
+    timer_wheel_t *timers = &conn->proxy->loop.timers;
+    long long deadline = next_deadline(conn, NULL);
+
+    if (deadline == 0) {
+        cancel_timer(timers, &conn->timer);
+    } else {
+        arm_timer(timers, &conn->timer, deadline);
     }
+}
 
-    freeaddrinfo(res);
+// Stamps the first time a sampled request reaches a stage, tunnels past the record's range are clamped
+static void trace_stage(connection_t *conn, trace_stage_t stage) {
+    if (!conn->traced || conn->trace.stage_us[stage] != TRACE_NOT_REACHED) {
+        return;
+    }
 
-    // Error handling
-    if (!p) {
-        fprintf(stderr, "Could not connect to host %s\n", host);
-        return -1;
+    long long elapsed = trace_time_us() - conn->trace_started_us;
+    conn->trace.stage_us[stage] = elapsed < TRACE_NOT_REACHED ? elapsed : TRACE_NOT_REACHED - 1;
+}
+
+// Notes what a captured request got back, for a replay's stand-in origin to reproduce
+static void capture_response(connection_t *conn, const char *headers, long size) {
+    if (!conn->capture.key) {
+        return;
     }
 
-    return sockfd;
+    conn->capture.status = parse_status_code(headers);
+    conn->capture.size = size > 0 ? size : 0;
+    conn->capture.max_age = get_max_age(headers);
+    conn->capture.no_store = check_no_cache(headers);
+    conn->captured = 1;
 }
 
-// Dynamically reads until recv ends
-// Doesn't have a null terminator, so only good for data, not requests
-char* read_from_server(int sockfd, int *data_length) {
-    // Initialize buffer
-    int bufsize = INIT_BUF_SIZE;
-    char *buffer = malloc(bufsize);
-    if (!buffer) {
-        perror("malloc");
-        return NULL;
+// Body size the origin sent for a cached entry, before any compression in the cache
+static long cached_body_size(const cache_entry_t *entry) {
+    if (!entry->chunked) {
+        return entry->identity_size - entry->identity_header_size;
     }
 
-    // Initialize variables for recv
-    int total_read = 0;
-    char *cl = NULL;
-    int content_length = 0;
-    char *body_start;
-
-    while (1) {
-        // Realloc more space for buffer if needed
-        if (total_read + 1 >= bufsize) { // +1 for null terminator
-            bufsize *= 2;
-            char *new_buffer = realloc(buffer, bufsize);
-            if (!new_buffer) {
-                free(buffer);
-                perror("realloc");
-                return NULL;
-            }
-            buffer = new_buffer;
-        }
+    int length;
+    const char *content_length = find_header(entry->headers, "Content-Length:", &length);
+    return content_length ? atol(content_length) : 0;
+}
 
-        // Read from socket
-        int bytes_read = recv(sockfd, buffer + total_read, bufsize - (total_read + 1), 0); // +1 for null terminator
-        if (bytes_read == -1) {
-            perror("recv from server");
-            free(buffer);
-            return NULL;
-        }
-        total_read += bytes_read;
-        buffer[total_read] = '\0'; // Null-terminate to make strstr work
+// Frees everything the connection owns, run by the loop once no event can refer to it
+// The connection itself goes back to the proxy's pool, keeping its iochain arrays
+static void free_connection(void *data) {
+    connection_t *conn = data;
+    proxy_t *proxy = conn->proxy;
 
-        // Check for end of headers
-        if ((body_start = strstr(buffer, "\r\n\r\n"))) {
-            body_start += 4; // Move past the \r\n\r\n
+    if (conn->pinned_index != -1) {
+        unpin_cache_entry(conn->proxy->cache, conn->pinned_index);
+    }
+    if (conn->addresses) {
+        freeaddrinfo(conn->addresses);
+    }
+    free_tunnel_direction(&conn->upstream);
+    free_tunnel_direction(&conn->downstream);
+    free_segment_chain(&conn->request_in);
+    free_segment_chain(&conn->response);
+    free_segment_chain(&conn->scratch);
+    if (conn->client_entry) {
+        finish_request(conn->client_entry);
+    }
 
-            // Look for Content-Length header
-            cl = strcasestr(buffer, "Content-Length:");
+    // After a handoff the process is done once its last connection has gone
+    proxy->active_connections--;
+    if (proxy->draining && proxy->active_connections == 0) {
+        flush_trace_writer(&proxy->tracer);
+        flush_capture_writer(&proxy->capture);
+        printf("Drained, exiting\n");
+        fflush(stdout);
+        exit(0);
+    }
 
-            if (cl) {
-                // Skip until at the start of the length integer
-                cl += strlen("Content-Length:");
-                while (*cl == ' ' || *cl == '\t') {
-                    cl++;
-                }
+    if (proxy->free_connection_count < CONNECTION_POOL_MAX) {
+        reset_iochain(&conn->client_out);
+        reset_iochain(&conn->server_out);
+        conn->next_free = proxy->free_connections;
+        proxy->free_connections = conn;
+        proxy->free_connection_count++;
+        return;
+    }
 
-                // Parse the length
-                content_length = atoi(cl);
-            }
-        }
+    free_iochain(&conn->client_out);
+    free_iochain(&conn->server_out);
+    free(conn);
+}
 
-        // Check if we have received all data
-        if (cl && total_read - (body_start - buffer) >= content_length) {
-            break;
+// Takes a zeroed connection from the pool, or a new one if it is empty
+static connection_t *take_connection(proxy_t *proxy) {
+    connection_t *conn = proxy->free_connections;
+    if (!conn) {
+        conn = calloc(1, sizeof(connection_t));
+        if (!conn) {
+            perror("calloc");
+            return NULL;
         }
+        proxy->active_connections++;
+        return conn;
+    }
+    proxy->free_connections = conn->next_free;
+    proxy->free_connection_count--;
+    proxy->active_connections++;
+
+    // The emptied chains keep their arrays, so queueing on a reused connection does not allocate
+    iochain_t client_out = conn->client_out;
+    iochain_t server_out = conn->server_out;
+    memset(conn, 0, sizeof(*conn));
+    conn->client_out = client_out;
+    conn->server_out = server_out;
+    return conn;
+}
+
+// Starts queued fetches, in fair turns between clients, while fetch slots are free
+// A slot freed by a fetch this starts (one that fails at once) is picked up by the same loop
+static void schedule_fetches(proxy_t *proxy) {
+    if (proxy->scheduling_fetches) {
+        proxy->fetch_released = 1;
+        return;
     }
 
-    *data_length = total_read;
-    return buffer;
+    proxy->scheduling_fetches = 1;
+    do {
+        proxy->fetch_released = 0;
+        int free_slots = proxy->config->admission.max_fetches - proxy->active_fetches;
+        run_drr(&proxy->fetch_scheduler, free_slots > 0 ? free_slots : 0);
+    } while (proxy->fetch_released);
+    proxy->scheduling_fetches = 0;
 }
 
-// Dynamically reads until (end of headers), returns a NULL-terminated string
-char* read_http_request(int sockfd) {
-    // Initialize buffer
-    int bufsize = INIT_BUF_SIZE;
-    char *buffer = malloc(bufsize);
-    if (!buffer) {
-        perror("malloc");
-        return NULL;
+// Gives the connection's fetch slot to the next client in line
+static void finish_origin_fetch(connection_t *conn) {
+    if (!conn->fetching) {
+        return;
     }
 
-    int total_read = 0;
-    int found = 0;
+    conn->fetching = 0;
+    conn->proxy->active_fetches--;
+    schedule_fetches(conn->proxy);
+}
 
-    while (!found) {
-        // Realloc for more space if needed
-        if (total_read > bufsize - 5) { // keep room for \r\n\r\n\0
-            bufsize *= 2;
-            char *new_buffer = realloc(buffer, bufsize);
-            if (!new_buffer) {
-                free(buffer);
-                perror("realloc");
-                return NULL;
-            }
-            buffer = new_buffer;
-        }
+// Abandons the lookup and every connect attempt still racing
+static void cancel_attempts(connection_t *conn) {
+    if (conn->resolving) {
+        cancel_resolve(&conn->proxy->resolver, conn->resolving);
+        conn->resolving = NULL;
+    }
+    cancel_timer(&conn->proxy->loop.timers, &conn->attempt_timer);
 
-        // Read from socket
-        int bytes_read = recv(sockfd, buffer + total_read, bufsize - total_read - 1, 0);
-        if (bytes_read <= 0) {
-            free(buffer);
-            return NULL;
-        }
+    for (int i = 0; i < conn->next_candidate; i++) {
+        close_io_watch(&conn->attempts[i]);
+    }
+    conn->attempts_in_flight = 0;
+}
 
-        total_read += bytes_read;
-        buffer[total_read] = '\0';
+static void close_connection(connection_t *conn) {
+    if (conn->closed) {
+        return;
+    }
+    conn->closed = 1;
+
+    if (conn->response_bytes > 0) {
+        conn->trace.bytes = conn->response_bytes;
+    }
+    TRACE_PROBE3(request__done, conn->request_id, conn->trace.status, conn->trace.bytes);
+    if (conn->traced) {
+        trace_stage(conn, TRACE_CLOSED);
+        write_trace_record(&conn->proxy->tracer, &conn->trace);
+    }
+    if (conn->captured) {
+        write_capture_record(&conn->proxy->capture, &conn->capture);
+    }
+
+    cancel_timer(&conn->proxy->loop.timers, &conn->timer);
+    cancel_attempts(conn);
 
-        // Check for end of header
-        if (strstr(buffer, "\r\n\r\n")) {
-            found = 1;
-        } 
+    // Readers of a fill cut short see it fail instead of waiting for chunks that never come
+    if (conn->reader.index != -1) {
+        remove_cache_reader(conn->proxy->cache, &conn->reader);
     }
-    return buffer;
+    if (conn->fill_index != -1) {
+        int fill_index = conn->fill_index;
+        conn->fill_index = -1;
+        finish_chunked_entry(conn->proxy->cache, fill_index, 0);
+    }
+
+    close_io_watch(&conn->client);
+    close_io_watch(&conn->server);
+    defer_release(&conn->proxy->loop, free_connection, conn);
+
+    // A fetch slot it held or waited for goes to the next client in line
+    drr_cancel(&conn->proxy->fetch_scheduler, &conn->fetch_wait);
+    drr_cancel(&conn->proxy->send_scheduler, &conn->send_wait);
+    finish_origin_fetch(conn);
 }
 
-// Returns pointer to last line before the \r\n\r\n
-// Make sure to free the returned string
-char* extract_last_header_line(char *request) {
-    char *end = strstr(request, "\r\n\r\n");
-    if (!end) return NULL;
+// Logs the tunnel's accounting and closes both sides
+static void finish_tunnel(connection_t *conn) {
+    double seconds = (current_time_ms() - conn->tunnel_started_ms) / 1000.0;
+    printf("Tunnel to %s closed after %.3f seconds, %ld bytes up, %ld bytes down\n", conn->host, seconds,
+           conn->upstream.bytes, conn->downstream.bytes);
+    fflush(stdout);
 
-    *end = '\0'; // Temporarily null-terminate at the blank line
+    close_connection(conn);
+}
 
-    char *last_line = strrchr(request, '\n');
-    if (!last_line) {
-        *end = '\r'; // change back the \0 to \r
-        return NULL;
+// Hands everything queued for the client to the loop, the connection closes once it is sent
+static void send_to_client(connection_t *conn) {
+    conn->state = CONN_SENDING_RESPONSE;
+    conn->last_activity_ms = current_time_ms();
+    stop_read(&conn->client);
+
+    if (start_write(&conn->client, &conn->client_out, on_response_sent) == -1) {
+        close_connection(conn);
+        return;
     }
-    last_line++; // Move past the \n
+    arm_deadline(conn);
+}
 
-    // change back the \0 to \r
-    *end = '\r';
+// Answers with a proxy-generated error, unless part of a response is already on its way
+static void respond_error(connection_t *conn, int status, const char *reason) {
+    cancel_attempts(conn);
+    close_io_watch(&conn->server);
 
-    // find length of the last line
-    int len = end - last_line; 
+    if (conn->state == CONN_SENDING_RESPONSE || append_error_response(&conn->client_out, status, reason) == -1) {
+        close_connection(conn);
+        return;
+    }
+    conn->trace.status = status;
+    send_to_client(conn);
+}
 
-    // copy string
-    char *last_line_copy = malloc(len + 1); // +1 for \0
-    if (!last_line_copy) {
-        perror("malloc");
-        return NULL;
+// The owner could not answer a miss, so it goes to the origin after all and the peer
+// is skipped for a while. Only called before anything was sent to the client
+static void peer_failed(connection_t *conn) {
+    printf("Peer %s failed for %s %s, fetching from origin\n", conn->peer, conn->host, conn->uri);
+    fflush(stdout);
+    record_host_failure(&conn->proxy->host_failures, conn->peer, PEER_RETRY_SECONDS);
+
+    cancel_attempts(conn);
+    close_io_watch(&conn->server);
+    reset_iochain(&conn->server_out);
+    free_segment_chain(&conn->response);
+    if (conn->addresses) {
+        freeaddrinfo(conn->addresses);
+        conn->addresses = NULL;
     }
-    
-    memcpy(last_line_copy, last_line, len);
-    last_line_copy[len] = '\0'; // null-terminate
+    conn->peer = NULL;
+    conn->response_header_size = 0;
+    conn->content_length = -1;
+    conn->response_bytes = 0;
 
-    return last_line_copy;
+    start_origin_fetch(conn);
 }
 
-// Extract Host from headers
-// Make sure to free the returned string
-char* extract_host(char *request) {
-    // Find the start of the Host header
-    const char *host_prefix = "\r\nHost:";
-    char *host_line = strcasestr(request, host_prefix);
-    if (!host_line) {
-        return NULL;
+static void on_deadline(timer_node_t *timer) {
+    connection_t *conn = timer->data;
+    const char *phase = NULL;
+    long long now = current_time_ms();
+    long long deadline = next_deadline(conn, &phase);
+
+    // Activity since the timer was armed may have pushed the deadline back
+    if (deadline == 0) {
+        return;
+    }
+    if (deadline > now) {
+        arm_timer(&conn->proxy->loop.timers, timer, deadline);
+        return;
     }
 
-    // This is adapted from Ahmed's tip in ED #563
-    host_line += strlen(host_prefix);
+    if (conn->host && conn->uri) {
+        printf("Timed out (%s) for %s %s\n", phase, conn->host, conn->uri);
+    } else {
+        printf("Timed out (%s) reading request\n", phase);
+    }
+    fflush(stdout);
 
-    // Skip spaces or tabs until the start of the host
-    while (*host_line == ' ' || *host_line == '\t') {
-        host_line++;
+    if (conn->state == CONN_TUNNELLING) {
+        finish_tunnel(conn);
+        return;
     }
 
-    // Find the end of the host line
-    char *end = strstr(host_line, "\r\n");
-    if (!end) {
-        return NULL;
+    // Nothing more is owed once the overall limit is spent, or the response is already going out
+    if (strcmp(phase, "total") == 0 || conn->state == CONN_SENDING_RESPONSE) {
+        close_connection(conn);
+        return;
     }
 
-    // Create a new string to hold the host
-    size_t len = end - host_line;
-    char *host = malloc(len + 1); // +1 for \0
-    if (!host) {
-        perror("malloc");
-        return NULL;
+    if (conn->state == CONN_READING_REQUEST) {
+        respond_error(conn, 408, "Request Timeout");
+        return;
+    }
+
+    // A peer that is too slow is given up on like one that refused
+    if (conn->peer) {
+        peer_failed(conn);
+        return;
     }
-    memcpy(host, host_line, len);
-    host[len] = '\0';
 
-    return host;
+    // An origin that never answered the connect counts as unreachable
+    const negative_ttl_t *negative_ttl = &conn->proxy->config->negative_ttl;
+    if (conn->state == CONN_CONNECTING && negative_ttl->connect_ttl >= 0) {
+        record_host_failure(&conn->proxy->host_failures, conn->host, negative_ttl->connect_ttl);
+    }
+    respond_error(conn, 504, "Gateway Timeout");
 }
 
-// Extract URI from request line
-// Make sure to free the returned string
-char* extract_request_uri(char *request) {
-    // Skip the "GET" or any other method
-    char *path_start = request;
-    while (*path_start != ' ' && *path_start != '\t') {
-        path_start++;
+// Logs the failed origin and answers 502, remembering the failure if negative caching is on
+static void origin_unreachable(connection_t *conn) {
+    if (conn->peer) {
+        peer_failed(conn);
+        return;
     }
+    fprintf(stderr, "Could not connect to host %s\n", conn->host);
 
-    // Skip spaces or tabs until the start of the path
-    while (*path_start == ' ' || *path_start == '\t') {
-        path_start++;
+    const negative_ttl_t *negative_ttl = &conn->proxy->config->negative_ttl;
+    if (negative_ttl->connect_ttl >= 0) {
+        record_host_failure(&conn->proxy->host_failures, conn->host, negative_ttl->connect_ttl);
     }
+    respond_error(conn, 502, "Bad Gateway");
+}
 
-    // Find the location of the first space or tab
-    char *path_end = path_start;
-    while (*path_end != ' ' && *path_end != '\t') {
-        path_end++;
+// Starts a non-blocking connect to the next candidate address, returns -1 once none are left
+// While candidates remain, the attempt timer starts another one if this one is slow
+static int start_next_attempt(connection_t *conn) {
+    proxy_t *proxy = conn->proxy;
+
+    while (conn->next_candidate < conn->candidate_count) {
+        int i = conn->next_candidate++;
+        struct addrinfo *p = conn->candidates[i];
+
+        int fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+
+        init_io_watch(&conn->attempts[i], &proxy->loop, fd, conn);
+        if (start_connect(&conn->attempts[i], p->ai_addr, p->ai_addrlen, on_attempt_connect) == -1) {
+            record_address_failure(&proxy->address_failures, p->ai_addr, p->ai_addrlen);
+            close_io_watch(&conn->attempts[i]);
+            continue;
+        }
+        conn->attempts_in_flight++;
+
+        if (conn->next_candidate < conn->candidate_count && proxy->config->deadlines.attempt_delay_ms > 0) {
+            arm_timer(&proxy->loop.timers, &conn->attempt_timer,
+                      current_time_ms() + proxy->config->deadlines.attempt_delay_ms);
+        }
+        return 0;
     }
 
-    // Calculate the length of the path
-    int len = path_end - path_start;
+    return -1;
+}
+
+// The pending attempts are slow, race the next candidate alongside them
+static void on_attempt_delay(timer_node_t *timer) {
+    connection_t *conn = timer->data;
 
-    // Create a new string to hold the URI
-    char *uri = malloc(len + 1); // +1 for \0
-    if (!uri) {
-        perror("malloc");
-        return NULL;
+    if (start_next_attempt(conn) == -1 && conn->attempts_in_flight == 0) {
+        origin_unreachable(conn);
     }
-    memcpy(uri, path_start, len);
-    uri[len] = '\0';
+}
 
-    return uri;
+// The addresses are in, races them in order
+static void on_origin_resolved(void *data, struct addrinfo *addresses) {
+    connection_t *conn = data;
+    proxy_t *proxy = conn->proxy;
+    conn->resolving = NULL;
+
+    conn->addresses = addresses;
+    conn->candidate_count =
+        order_addresses(conn->addresses, &proxy->address_failures, conn->candidates, MAX_CONNECT_ATTEMPTS);
+    TRACE_PROBE2(origin__resolved, conn->request_id, conn->candidate_count);
+    trace_stage(conn, TRACE_RESOLVED);
+    conn->next_candidate = 0;
+    if (start_next_attempt(conn) == -1) {
+        origin_unreachable(conn);
+    }
 }
 
-char *forward_request(int client_fd, int server_fd, char *request, int *response_length) {
-    // Send the request to origin server
-    int sent_bytes = 0;
-    int request_length = strlen(request);
-    while (sent_bytes < request_length) {
-        int bytes = send(server_fd, request + sent_bytes, request_length - sent_bytes, 0);
-        if (bytes == -1) {
-            perror("send to server");
-            return NULL;
-        }
-        sent_bytes += bytes;
+// Looks up the origin (or peer) off the loop, the connect deadline covers the lookup too
+static void start_origin_fetch(connection_t *conn) {
+    proxy_t *proxy = conn->proxy;
+    conn->state = CONN_CONNECTING;
+    conn->phase_started_ms = current_time_ms();
+
+    TRACE_PROBE2(fetch__start, conn->request_id, conn->peer ? conn->peer : conn->host);
+    trace_stage(conn, TRACE_FETCH_STARTED);
+
+    conn->resolving = start_resolve(&proxy->resolver, conn->peer ? conn->peer : conn->host, on_origin_resolved, conn);
+    if (!conn->resolving) {
+        origin_unreachable(conn);
+        return;
+    }
+
+    arm_deadline(conn);
+}
+
+// With a fetch limit, waits for a slot in the client's turn; otherwise fetches right away
+static void queue_origin_fetch(connection_t *conn) {
+    proxy_t *proxy = conn->proxy;
+    if (!conn->client_entry || proxy->config->admission.max_fetches <= 0) {
+        start_origin_fetch(conn);
+        return;
+    }
+
+    conn->state = CONN_QUEUED;
+    drr_wait(&proxy->fetch_scheduler, &conn->client_entry->fetches, &conn->fetch_wait);
+    schedule_fetches(proxy);
+
+    if (conn->fetch_wait.flow) {
+        proxy->admission_stats.fetches_queued++;
+        printf("Queued fetch of %s %s for %s, %d fetches in progress\n", conn->host, conn->uri,
+               conn->client_entry->address, proxy->active_fetches);
+        fflush(stdout);
+        arm_deadline(conn);
+    }
+}
+
+// Whether the connection's streamed response waits for its client's share of the bandwidth limit
+static int send_metered(connection_t *conn) {
+    return conn->client_entry && conn->proxy->config->admission.bandwidth > 0;
+}
+
+// Queues the connection for its client's next turn at the send bandwidth
+static void wait_for_send_turn(connection_t *conn) {
+    proxy_t *proxy = conn->proxy;
+
+    if (!conn->send_wait.flow) {
+        proxy->admission_stats.sends_deferred++;
     }
+    drr_wait(&proxy->send_scheduler, &conn->client_entry->sends, &conn->send_wait);
+
+    // The first tick after an idle spell hands out one tick's worth, not the whole gap
+    if (!timer_armed(&proxy->send_timer)) {
+        proxy->last_send_tick_ms = current_time_ms();
+        arm_timer(&proxy->loop.timers, &proxy->send_timer, proxy->last_send_tick_ms + SEND_TICK_MS);
+    }
+}
+
+// Writes the numeric address the connection comes from into name, without the IPv4-mapped prefix
+// Returns name, or NULL if the address is unknown
+static const char *client_address(connection_t *conn, char *name, int name_size) {
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    name[0] = '\0';
 
-    // Read the response from the server
-    int data_length = 0;
-    char *response = read_from_server(server_fd, &data_length);
-    if (!response) {
-        perror("read from server");
+    if (getpeername(conn->client.fd, (struct sockaddr *) &address, &address_length) == -1) {
+        perror("getpeername");
         return NULL;
     }
+    if (address.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &address)->sin6_addr, name, name_size);
+    } else if (address.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *) &address)->sin_addr, name, name_size);
+    }
+    return strncmp(name, "::ffff:", 7) == 0 && strchr(name, '.') ? name + 7 : name;
+}
 
-    // Find content length header from the response
-    char *cl = strcasestr(response, "Content-Length:");
-    if (!cl) {
-        fprintf(stderr, "No Content-Length header found\n");
-        free(response);
+// Finds or adds the client the connection comes from, keyed by its address
+static client_t *lookup_client(connection_t *conn) {
+    char name[INET6_ADDRSTRLEN];
+    const char *client_name = client_address(conn, name, sizeof(name));
+    if (!client_name) {
         return NULL;
     }
 
-    // Skip until at the start of the length
-    cl += strlen("Content-Length:");
-    while (*cl == ' ' || *cl == '\t') {
-        cl++;
+    return find_client(&conn->proxy->clients, client_name, &conn->proxy->config->admission, current_time_ms());
+}
+
+// Applies the client's rate limit and request cap once its request is in
+// Returns 0 if the request may go ahead, -1 if it was answered with 429
+static int admit_connection(connection_t *conn) {
+    proxy_t *proxy = conn->proxy;
+    const admission_config_t *admission = &proxy->config->admission;
+    if (!admission_enabled(admission)) {
+        return 0;
+    }
+
+    // A full table of busy clients should not lock anyone out, the request just goes unlimited
+    client_t *client = lookup_client(conn);
+    if (!client) {
+        proxy->admission_stats.untracked++;
+        return 0;
+    }
+
+    admission_result_t result = admit_request(client, admission, current_time_ms());
+    if (result == ADMIT_OK) {
+        conn->client_entry = client;
+        proxy->admission_stats.admitted++;
+        return 0;
     }
 
-    // Find and log the content length
-    int len = atoi(cl);
-    printf("Response body length %d\n", len);
+    if (result == ADMIT_RATE_LIMITED) {
+        proxy->admission_stats.rate_limited++;
+        printf("Rate limited %s\n", client->address);
+    } else {
+        proxy->admission_stats.too_many_requests++;
+        printf("Too many requests in progress for %s\n", client->address);
+    }
     fflush(stdout);
+    respond_error(conn, 429, "Too Many Requests");
+    return -1;
+}
 
-    // Send the response back to the client
-    sent_bytes = 0;
-    while (sent_bytes < data_length) {
-        int bytes = send(client_fd, response + sent_bytes, data_length - sent_bytes, 0);
-        if (bytes == -1) {
-            perror("send to client");
-            free(response);
-            return NULL;
+// Queues the chunks the client has not been sent yet, the connection closes after the last one
+static void pump_cache_reader(connection_t *conn) {
+    // A write in progress comes back here once it is done
+    if (conn->client.out) {
+        return;
+    }
+
+    // Under a bandwidth limit only the bytes granted in this turn are queued
+    int metered = send_metered(conn);
+    if (metered && conn->send_credit <= 0) {
+        wait_for_send_turn(conn);
+        return;
+    }
+    long pending_bytes = conn->client_out.pending_bytes;
+    int rv = serve_cache_chunks(&conn->client_out, &conn->scratch, conn->proxy->cache, &conn->reader,
+                                metered ? conn->send_credit : -1);
+    if (metered) {
+        conn->send_credit -= conn->client_out.pending_bytes - pending_bytes;
+    }
+    if (rv == -1) {
+        close_connection(conn);
+        return;
+    }
+    if (!iochain_empty(&conn->client_out)) {
+        if (start_write(&conn->client, &conn->client_out, on_chunks_sent) == -1) {
+            close_connection(conn);
         }
-        sent_bytes += bytes;
+        return;
+    }
+    if (rv == 1) {
+        close_connection(conn);
     }
+}
+
+// Sends a chunked cache entry, following its fill while the origin is still sending it
+static void start_cache_reader(connection_t *conn, int cache_index) {
+    conn->state = CONN_SENDING_RESPONSE;
+    conn->last_activity_ms = current_time_ms();
+    stop_read(&conn->client);
 
-    *response_length = data_length;
-    return response;
+    conn->reader.on_chunks = on_cache_chunks;
+    conn->reader.data = conn;
+    add_cache_reader(conn->proxy->cache, cache_index, &conn->reader);
+
+    pump_cache_reader(conn);
+    if (!conn->closed) {
+        arm_deadline(conn);
+    }
 }
 
-void start_proxy(int port, int enable_cache) {
-    int sockfd, new_fd;
-    struct addrinfo hints, *servinfo, *p;
-    int yes = 1;
-    char port_str[6];
-    snprintf(port_str, sizeof(port_str), "%d", port);
-    int rv;
+// Removes PEER_HEADER from the request, which no origin should see, remembering whether a peer
+// sent it; the marker only counts from the other nodes' addresses, so clients cannot bypass routing
+// Returns 0 on success, -1 if the request could not be rewritten
+static int take_peer_marker(connection_t *conn) {
+    const cluster_t *cluster = &conn->proxy->config->cluster;
+    int length;
+    if (!find_header(conn->request, PEER_HEADER, &length)) {
+        return 0;
+    }
 
-    // Initialise cache if enabled (stage 2)
-    cache_t cache;
-    if (enable_cache) {
-        init_cache(&cache);
+    char name[INET6_ADDRSTRLEN];
+    const char *address = client_address(conn, name, sizeof(name));
+    conn->from_peer = cluster->node_count > 0 && address && is_cluster_peer(cluster, address);
+    if (!conn->from_peer) {
+        printf("Ignoring %s from %s, not a cluster node\n", PEER_HEADER, address ? address : "unknown client");
+        fflush(stdout);
     }
 
-    // Set up hints for IPv6 and allow AI_PASSIVE
-    // Based on Ahmed's tip in #685
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET6; // Use IPv6 (allows IPv4-mapped)
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE; // Use my IP
+    const char *peer_headers[] = {PEER_HEADER};
+    int request_size = strlen(conn->request) + 1;
+    char *stripped = reserve_segment_chain(&conn->scratch, request_size);
+    if (!stripped || strip_headers(conn->request, peer_headers, 1, stripped, request_size) == -1) {
+        return -1;
+    }
+    conn->request = stripped;
+    return 0;
+}
 
-    // Get address info for binding
-    if ((rv = getaddrinfo(NULL, port_str, &hints, &servinfo)) != 0)
-    {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        exit(1);
+// In a cluster, picks the node that owns the request's key; a miss owned by another node is
+// fetched from it, unless the request already came from a peer or the owner failed recently
+// Returns 1 with peer and peer_request set if the miss goes to a peer, 0 if it goes to the origin
+static int route_to_peer(connection_t *conn) {
+    proxy_t *proxy = conn->proxy;
+    const cluster_t *cluster = &proxy->config->cluster;
+
+    if (cluster->node_count == 0 || conn->from_peer) {
+        return 0;
+    }
+    int owner = cluster_owner(cluster, conn->cache_key);
+    if (owner == cluster->self || search_host_failure(&proxy->host_failures, cluster->nodes[owner])) {
+        return 0;
     }
 
-    // Loop through results and bind to first valid one
-    for (p = servinfo; p != NULL; p = p->ai_next)
-    {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-        {
-            perror("socket");
-            continue;
-        }
+    // The marker goes last in the header block, any body bytes read with it follow unchanged
+    char marker[HOST_NAME_SIZE + 32];
+    int marker_length = snprintf(marker, sizeof(marker), "%s %s\r\n", PEER_HEADER, cluster->nodes[cluster->self]);
+    const char *body = strstr(conn->request, "\r\n\r\n") + 2;
+    int request_length = strlen(conn->request);
+    int head_length = body - conn->request;
 
-        // Code given from SPEC to allow reuse of port in time_wait state
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
-        {
-            perror("setsockopt");
-            exit(1);
-        }
+    conn->peer_request = reserve_segment_chain(&conn->scratch, request_length + marker_length + 1);
+    if (!conn->peer_request) {
+        return 0;
+    }
+    memcpy(conn->peer_request, conn->request, head_length);
+    memcpy(conn->peer_request + head_length, marker, marker_length);
+    strcpy(conn->peer_request + head_length + marker_length, body);
 
-        // Bind the socket
-        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1)
-        {
-            close(sockfd);
-            perror("bind");
-            continue;
-        }
+    conn->peer = cluster->nodes[owner];
+    return 1;
+}
 
-        break;
+// An absolute-form target names the origin itself (RFC 9112 section 3.2.2): the dial host is taken
+// from the target, like the cache key, and a Host header naming anything else is replaced with it
+// Returns 0 with host set, or -1 if the request could not be rewritten
+static int use_target_authority(connection_t *conn) {
+    const char *scheme = "http://";
+    const char *authority = conn->uri + strlen(scheme);
+    int authority_length = strcspn(authority, "/?#");
+    if (authority_length == 0) {
+        return -1;
+    }
+    conn->host = copy_to_segment_chain(&conn->scratch, authority, authority_length);
+    if (!conn->host) {
+        return -1;
     }
 
-    if (p == NULL)
-    {
-        fprintf(stderr, "failed to bind socket\n");
-        exit(2);
+    int length;
+    const char *host = extract_host(conn->request, &length);
+    if (host && length == authority_length && strncasecmp(host, authority, length) == 0) {
+        return 0;
     }
 
-    freeaddrinfo(servinfo); // Done with address info
+    int rewritten_size = strlen(conn->request) + authority_length + strlen("Host: \r\n") + 1;
+    char *rewritten = reserve_segment_chain(&conn->scratch, rewritten_size);
+    if (!rewritten || replace_host_header(conn->request, conn->host, authority_length, rewritten, rewritten_size) == -1) {
+        return -1;
+    }
 
-    if (listen(sockfd, BACKLOG) == -1)
-    {
-        perror("listen");
-        exit(1);
+    conn->request = rewritten;
+    return 0;
+}
+
+// Looks the request up in the cache and either answers from it or starts the origin fetch
+static void handle_request(connection_t *conn) {
+    proxy_t *proxy = conn->proxy;
+    char *request = conn->request;
+    stop_read(&conn->client);
+
+    // Log last header line
+    int length;
+    const char *last_line = extract_last_header_line(request, &length);
+    if (last_line) {
+        printf("Request tail %.*s\n", length, last_line);
+        fflush(stdout);
     }
+    TRACE_PROBE2(request__read, conn->request_id, request);
+    trace_stage(conn, TRACE_REQUEST_READ);
 
-    while (1)
-    {
-        // MAIN CODE OF THE FUNCTION
-        struct sockaddr_storage client_addr;
-        socklen_t sin_size = sizeof client_addr;
-        new_fd = accept(sockfd, (struct sockaddr *)&client_addr, &sin_size);
-        if (new_fd == -1)
-        {
-            perror("accept");
-            continue;
+    if (admit_connection(conn) == -1) {
+        return;
+    }
+
+    // A CONNECT names its target in the request line, there is nothing to cache
+    if (strncmp(request, "CONNECT ", strlen("CONNECT ")) == 0) {
+        conn->tunnel = 1;
+        conn->trace.tunnel = 1;
+        const char *target = extract_request_uri(request, &length);
+        conn->uri = copy_to_segment_chain(&conn->scratch, target, length);
+        conn->host = conn->uri;
+        if (!conn->host) {
+            close_connection(conn);
+            return;
         }
 
-        printf("Accepted\n");
+        printf("Tunnelling to %s\n", conn->host);
         fflush(stdout);
 
-        // Read the request
-        char *request = read_http_request(new_fd);
-        if (!request) {
-            close(new_fd);
-            continue;
+        if (proxy->config->negative_ttl.connect_ttl >= 0 && search_host_failure(&proxy->host_failures, conn->host)) {
+            printf("Negative cache hit for %s, not connecting\n", conn->host);
+            fflush(stdout);
+            respond_error(conn, 502, "Bad Gateway");
+            return;
         }
-        int request_length = strlen(request);
 
-        // Log last header line
-        char *last_line = extract_last_header_line(request);
-        if (last_line) {
-            printf("Request tail %s\n", last_line);
-            fflush(stdout);
+        start_origin_fetch(conn);
+        return;
+    }
+
+    if (take_peer_marker(conn) == -1) {
+        respond_error(conn, 431, "Request Header Fields Too Large");
+        return;
+    }
+    request = conn->request;
+
+    // Extract URI and Host, an absolute-form target overriding the Host header
+    const char *uri = extract_request_uri(request, &length);
+    conn->uri = copy_to_segment_chain(&conn->scratch, uri, length);
+    if (conn->uri && strncasecmp(conn->uri, "http://", strlen("http://")) == 0) {
+        if (use_target_authority(conn) == -1) {
+            respond_error(conn, 400, "Bad Request");
+            return;
         }
-        free(last_line);
+        request = conn->request;
+    } else {
+        const char *host = extract_host(request, &length);
+        conn->host = host ? copy_to_segment_chain(&conn->scratch, host, length) : NULL;
+    }
+
+    if (!conn->host || !conn->uri) {
+        fprintf(stderr, "Request without Host or URI\n");
+        close_connection(conn);
+        return;
+    }
 
-        // Extract Host and URI
-        char *host = extract_host(request);
-        char *uri = extract_request_uri(request);
+    // The cache key ignores headers, so a Range request finds the full object;
+    // range fill forwards the request without its Range headers
+    const char *range_headers[] = {"Range:", "If-Range:"};
+    const char *range = find_header(request, "Range:", &length);
+    conn->range = range ? copy_to_segment_chain(&conn->scratch, range, length) : NULL;
+    const char *if_range = find_header(request, "If-Range:", &length);
+    conn->if_range = if_range ? copy_to_segment_chain(&conn->scratch, if_range, length) : NULL;
+
+    if (conn->range) {
+        int request_size = strlen(request) + 1;
+        conn->full_request = reserve_segment_chain(&conn->scratch, request_size);
+        if (!conn->full_request || strip_headers(request, range_headers, 2, conn->full_request, request_size) == -1) {
+            respond_error(conn, 431, "Request Header Fields Too Large");
+            return;
+        }
+    }
 
-        if (!host || !uri) {
-            perror("extract_host or extract_request_uri");
-            free(request);
-            close(new_fd);
-            continue;
+    if (proxy->cache) {
+        conn->cache_key = reserve_segment_chain(&conn->scratch, REQUEST_SIZE + 1);
+        if (conn->cache_key && normalize_cache_key(request, conn->cache_key, REQUEST_SIZE + 1) == -1) {
+            conn->cache_key = NULL;
         }
+    }
 
-        int cache_index = -1;
+    // Capture keys requests the same way whether or not this proxy caches
+    if (proxy->capture.file) {
+        conn->capture.key = conn->cache_key;
+        char *key = conn->capture.key ? NULL : reserve_segment_chain(&conn->scratch, REQUEST_SIZE + 1);
+        if (key && normalize_cache_key(request, key, REQUEST_SIZE + 1) == 0) {
+            conn->capture.key = key;
+        }
+        conn->capture.time_ms = trace_wall_time_us() / 1000;
+    }
 
-        // Check if the request is in the cache
-        if (enable_cache && request_length < REQUEST_SIZE) {
-            if ((cache_index = search_cache_hit(&cache, request)) != -1) {
+    int cache_index = -1;
 
-                // Cache hit, check it it's timed out
-                if (is_timed_out(&cache, cache_index)) {
-                    printf("Stale entry for %s %s\n", host, uri);
-                    fflush(stdout);
+    // Check if the request is in the cache
+    if (conn->cache_key) {
+        record_cache_access(proxy->cache, conn->cache_key);
+        if ((cache_index = search_cache_hit(proxy->cache, conn->cache_key, request)) != -1) {
 
-                // Else, not timed out. Serve from cache.
-                } else {
-                    printf("Serving %s %s from cache\n", host, uri);
-                    fflush(stdout);
+            // Cache hit, check it it's timed out
+            if (is_timed_out(proxy->cache, cache_index)) {
+                printf("Stale entry for %s %s\n", conn->host, conn->uri);
+                fflush(stdout);
+                TRACE_PROBE2(cache__stale, conn->request_id, conn->cache_key);
+                conn->trace.cache_result = TRACE_CACHE_STALE;
 
-                    serve_from_cache(new_fd, &cache, cache_index);
+            // Else, not timed out. Serve from cache.
+            } else {
+                printf("Serving %s %s from cache\n", conn->host, conn->uri);
+                fflush(stdout);
+
+                // Slice ranges out of the full object unless If-Range says it has changed
+                int rv = 1;
+                const char *stored = proxy->cache->entries[cache_index].headers;
+                TRACE_PROBE2(cache__hit, conn->request_id, conn->cache_key);
+                conn->trace.cache_result = TRACE_CACHE_HIT;
+                conn->trace.status = parse_status_code(stored);
+                conn->trace.bytes = proxy->cache->entries[cache_index].response_size;
+                capture_response(conn, stored, cached_body_size(&proxy->cache->entries[cache_index]));
+                if (conn->range && (!conn->if_range || if_range_matches(stored, conn->if_range))) {
+                    rv = serve_range_from_cache(&conn->client_out, &conn->scratch, proxy->cache, cache_index,
+                                                conn->range);
+                }
+                if (rv == 1 && proxy->cache->entries[cache_index].chunked) {
+                    start_cache_reader(conn, cache_index);
+                    return;
+                }
+                if (rv == 1) {
+                    rv = serve_from_cache(&conn->client_out, &conn->scratch, proxy->cache, cache_index,
+                                          accepts_gzip(request));
+                }
 
-                    free(request);
-                    free(host);
-                    free(uri);
-                    close(new_fd);
-                    continue;
+                if (rv == -1) {
+                    close_connection(conn);
+                    return;
                 }
+                conn->pinned_index = cache_index;
+                send_to_client(conn);
+                return;
             }
+        } else {
+            TRACE_PROBE2(cache__miss, conn->request_id, conn->cache_key);
+            conn->trace.cache_result = TRACE_CACHE_MISS;
         }
+    }
 
-        // If cache is full, evict the LRU entry from the cache 
-        if (enable_cache && cache_index == -1 && cache.valid_entries == CACHE_SIZE) {
-            // Evict the LRU entry
-            char *evicted_request = evict_lru_entry(&cache);
-            if (evicted_request) {
-                // Extract host and URI from the evicted request for logging
-                char *evict_host = extract_host(evicted_request);
-                char *evict_uri = extract_request_uri(evicted_request);
-                free(evicted_request);
-
-                // If extraction successful, log the eviction
-                if (evict_host && evict_uri) {
-                    printf("Evicting %s %s from cache\n", evict_host, evict_uri);
-                    fflush(stdout);
-                    free(evict_host);
-                    free(evict_uri);
-
-                } else {
-                    fprintf(stderr, "LRU eviction successful but the logging has failed.\n");
-                    free(evict_host);
-                    free(evict_uri);
-                }
+    // The owner peer fetches and keeps the object, so no local slot is needed for it
+    if (conn->cache_key && route_to_peer(conn)) {
+        printf("Fetching %s %s from peer %s\n", conn->host, conn->uri, conn->peer);
+        fflush(stdout);
+        queue_origin_fetch(conn);
+        return;
+    }
 
-            } else {
-                perror("evict_lru_entry");
+    // If cache is full, evict an entry according to the replacement policy
+    if (conn->cache_key && cache_index == -1 && find_invalid_entry(proxy->cache) == -1) {
+        // Evict the policy's victim
+        char evicted_key[REQUEST_SIZE + 1];
+        if (evict_cache_victim(proxy->cache, evicted_key) == 0) {
+            printf("Evicting %s from cache\n", evicted_key);
+            fflush(stdout);
+        }
+    }
+
+    // Log the request before forwarding
+    printf("GETting %s %s\n", conn->host, conn->uri);
+    fflush(stdout);
+
+    // Fail fast if the origin was unreachable moments ago, instead of paying the
+    // full resolve and connect timeout again
+    if (proxy->config->negative_ttl.connect_ttl >= 0 && search_host_failure(&proxy->host_failures, conn->host)) {
+        printf("Negative cache hit for %s, not connecting\n", conn->host);
+        fflush(stdout);
+        respond_error(conn, 502, "Bad Gateway");
+        return;
+    }
+
+    queue_origin_fetch(conn);
+}
+
+// Slices the requested ranges out of a full 200 fetched for range fill
+// Returns 1 without queueing anything if the range should be ignored
+static int serve_filled_range(connection_t *conn, int cache_index) {
+    cache_t *cache = conn->proxy->cache;
+    segment_t *head = conn->response.head;
+    int header_size = conn->response_header_size;
+
+    // The cached copy can be sliced in place
+    if (cache_index != -1) {
+        int rv = serve_range_from_cache(&conn->client_out, &conn->scratch, cache, cache_index, conn->range);
+        if (rv == 0) {
+            conn->pinned_index = cache_index;
+        }
+        return rv;
+    }
+
+    // Otherwise the ranges are sliced out of the segments where they lie, the connection keeps them alive
+    // Only responses within MAX_UNCOMPRESSED_SIZE are buffered, so the segments fit the array
+    struct iovec body[MAX_RESPONSE_IOV];
+    int count = segment_chain_iov(&conn->response, body, MAX_RESPONSE_IOV);
+    if (count == -1) {
+        return 1;
+    }
+    body[0].iov_base = head->data + header_size;
+    body[0].iov_len -= header_size;
+
+    return serve_byte_ranges(&conn->client_out, &conn->scratch, head->data, header_size, body, count,
+                             conn->response.length - header_size, conn->range);
+}
+
+// Decides whether the response goes into the cache, complete or, when chunked, as it arrives
+// Returns the index of the entry now holding it, or -1 if it was not stored
+static int cache_response(connection_t *conn, int chunked) {
+    cache_t *cache = conn->proxy->cache;
+    const char *response = conn->response.head->data;
+    long response_length = conn->response.length;
+
+    // Other connections may have changed the cache since the request was looked up
+    int cache_index = search_cache_hit(cache, conn->cache_key, conn->request);
+
+    // An entry still filling from another fetch is left alone, that fill settles what is stored
+    if (cache_index != -1 && cache->entries[cache_index].chunked && cache->entries[cache_index].filling) {
+        printf("Not caching %s %s, another fetch is still filling it\n", conn->host, conn->uri);
+        fflush(stdout);
+        return -1;
+    }
+
+    // Check if the response doesn't want to be cached, or is an error we don't keep
+    int no_cache = check_no_cache(response) || check_no_cache_error(cache, response);
+
+    if (no_cache) {
+        printf("Not caching %s %s\n", conn->host, conn->uri);
+        fflush(stdout);
+    }
+
+    // If request and response are within size limits, add to cache
+    // Compressed storage only has to fit the compressed body, so let the cache decide
+    // Partial responses are never stored, only full objects can be sliced later
+    // A streamed response is stored as chunks, up to its own limit
+    struct iovec iov[MAX_RESPONSE_IOV];
+    int count = chunked ? 0 : segment_chain_iov(&conn->response, iov, MAX_RESPONSE_IOV);
+    int fits = count != -1 && (response_length <= RESPONSE_SIZE || cache->compress_bodies);
+    if (chunked) {
+        long total = conn->response_header_size + conn->content_length;
+        fits = cache->max_chunked_size > 0 && total <= cache->max_chunked_size;
+    }
+    int partial = parse_status_code(response) == 206;
+    if (!no_cache && !partial && fits) {
+        // Evict the older stale entry if it exists, before adding a new version to the cache
+        if (cache_index != -1) {
+            evict_cache_entry(cache, cache_index);
+            cache_index = -1; // Reset cache index
+        }
+
+        // Concurrent misses can fill the slots freed before the fetch
+        if (find_invalid_entry(cache) == -1) {
+            char evicted_key[REQUEST_SIZE + 1];
+            if (evict_cache_victim(cache, evicted_key) == 0) {
+                printf("Evicting %s from cache\n", evicted_key);
+                fflush(stdout);
             }
         }
 
-        // Log the request before forwarding
-        if (host && uri) {
-            printf("GETting %s %s\n", host, uri);
+        // Add to cache
+        if (chunked) {
+            cache_index = start_chunked_entry(cache, conn->cache_key, conn->request, response);
+        } else {
+            cache_index = add_cache_entry(cache, conn->cache_key, conn->request, iov, count, response_length);
+        }
+        if (cache_index == -1) {
+            // Oversized bodies that did not compress small enough are simply not cached
+            if (chunked || response_length <= RESPONSE_SIZE) {
+                fprintf(stderr, "Failed to add to cache\n");
+            }
+
+        } else if (cache->entries[cache_index].encoding == ENCODING_GZIP) {
+            printf("Compressed %s %s from %ld to %d bytes (cache holds %ld bytes for %ld)\n", conn->host, conn->uri,
+                   response_length, cache->entries[cache_index].response_size, cache->stored_bytes,
+                   cache->identity_bytes);
             fflush(stdout);
         }
 
-        // Forward request and retrieve response from the server
-        int server_fd = connect_to_host(host);
-        char *response = NULL;
-        int response_length = 0;
-        if (server_fd != -1) {
-            response = forward_request(new_fd, server_fd, request, &response_length);
-            if (!response) {
-                fprintf(stderr, "Failed to forward request to %s %s\n", host, uri);
-                close(server_fd);
-                free(request);
-                free(host);
-                free(uri);
-                close(new_fd);
-                continue;
+        // Dedup savings are reported whenever another entry turns out to share the body
+        if (cache_index != -1 && !chunked) {
+            int sharing = cache->bodies[cache->entries[cache_index].body].valid_refs - 1;
+            if (sharing > 0) {
+                printf("Sharing the body of %s %s with %d other entries (cache holds %ld bytes for %ld, %ld deduped)\n",
+                       conn->host, conn->uri, sharing, cache->stored_bytes, cache->identity_bytes,
+                       cache->deduped_bytes);
+                fflush(stdout);
             }
+        }
 
-            // Check if the response doesn't want to be cached
-            int no_cache = check_no_cache(response);
-            
-            if (no_cache) {
-                printf("Not caching %s %s\n", host, uri);
-                fflush(stdout);              
-            }
-            
-
-            // If request and response are within size limits, add to cache
-            if (enable_cache && !no_cache && response && request_length <= REQUEST_SIZE && response_length <= RESPONSE_SIZE) {
-                // Evict the older stale entry if it exists, before adding a new version to the cache
-                if (cache_index != -1) {
-                    evict_cache_entry(&cache, cache_index);
-                    cache_index = -1; // Reset cache index
-                }
+    } else {
+        // If the request is not cacheable, evict the stale entry if it exists
+        if (cache_index != -1) {
+            printf("Evicting %s %s from cache\n", conn->host, conn->uri);
+            fflush(stdout);
+            evict_cache_entry(cache, cache_index);
+            cache_index = -1; // Reset cache index
+        }
+    }
 
-                // Add to cache
-                cache_index = add_cache_entry(&cache, request, response, response_length);
-                if (cache_index == -1) {
-                    fprintf(stderr, "Failed to add to cache\n");
-                }
+    return cache_index;
+}
 
-            } else {
-                // If the request is not cacheable, evict the stale entry if it exists
-                if (cache_index != -1) {
-                    printf("Evicting %s %s from cache\n", host, uri);
-                    fflush(stdout);
-                    evict_cache_entry(&cache, cache_index);
-                    cache_index = -1; // Reset cache index
-                }
+// Decides whether the complete response goes into the cache, then relays it
+static void handle_response(connection_t *conn) {
+    proxy_t *proxy = conn->proxy;
+    close_io_watch(&conn->server);
+    finish_origin_fetch(conn);
+    TRACE_PROBE2(response__read, conn->request_id, conn->response_bytes);
+    trace_stage(conn, TRACE_RESPONSE_READ);
+
+    printf("Response body length %ld\n", conn->content_length);
+    fflush(stdout);
+
+    // The owner peer already keeps what it answers with
+    int cache_index = conn->cache_key && !conn->peer ? cache_response(conn, 0) : -1;
+
+    // With range fill, a Range miss fetched the whole object once so later ranges hit.
+    // Slice the ranges out of a full 200, anything else is relayed unchanged
+    int rv = 1;
+    if (conn->full_request && !conn->peer && proxy->config->range_fill && parse_status_code(conn->response.head->data) == 200) {
+        rv = serve_filled_range(conn, cache_index);
+    }
+
+    // The segments go out as they are, each holding a reference until it is sent
+    for (segment_t *segment = conn->response.head; rv == 1 && segment; segment = segment->next) {
+        if (append_iochain_segment(&conn->client_out, segment, segment->data, segment->length) == -1) {
+            rv = -1;
+        }
+    }
+    if (rv == -1) {
+        close_connection(conn);
+        return;
+    }
+
+    send_to_client(conn);
+}
+
+// The origin closed or failed before a complete response arrived
+static void origin_response_failed(connection_t *conn) {
+    if (conn->response_header_size > 0 && conn->content_length == -1) {
+        fprintf(stderr, "No Content-Length header found\n");
+    }
+    if (conn->peer && conn->state != CONN_SENDING_RESPONSE) {
+        peer_failed(conn);
+        return;
+    }
+    fprintf(stderr, "Failed to forward request to %s %s\n", conn->host, conn->uri);
+    respond_error(conn, 502, "Bad Gateway");
+}
+
+// Queues the response's finished segments for the client, pausing the origin while the
+// client is a window behind and closing once everything is sent
+static void flush_stream(connection_t *conn) {
+    int complete = conn->server.fd == -1; // Closed once the last byte arrived
+
+    // A write in progress comes back here once it is done
+    if (conn->client.out) {
+        return;
+    }
+
+    // Under a bandwidth limit only the bytes granted in this turn are queued
+    int metered = send_metered(conn);
+    while (conn->response.head && (complete || conn->response.head->length == SEGMENT_SIZE) &&
+           (!metered || conn->send_credit > 0)) {
+        segment_t *segment = pop_segment_chain(&conn->response);
+        if (metered) {
+            conn->send_credit -= segment->length;
+        }
+        int rv = append_iochain_segment(&conn->client_out, segment, segment->data, segment->length);
+        release_segment(segment);
+        if (rv == -1) {
+            close_connection(conn);
+            return;
+        }
+    }
+
+    if (!iochain_empty(&conn->client_out)) {
+        if (start_write(&conn->client, &conn->client_out, on_stream_sent) == -1) {
+            close_connection(conn);
+            return;
+        }
+    } else if (complete && !conn->response.head) {
+        close_connection(conn);
+        return;
+    } else if (conn->response.head && (complete || conn->response.head->length == SEGMENT_SIZE)) {
+        wait_for_send_turn(conn);
+    }
+
+    if (complete) {
+        return;
+    }
+    if (conn->response.length + conn->client_out.pending_bytes >= STREAM_WINDOW) {
+        stop_read(&conn->server);
+    } else if (!conn->server.reading && start_read(&conn->server, on_server_read) == -1) {
+        close_connection(conn);
+    }
+}
+
+// Moves the response's finished segments into its chunked entry, all of them once it is complete
+static void fill_chunked_entry(connection_t *conn) {
+    cache_t *cache = conn->proxy->cache;
+    int complete = conn->server.fd == -1; // Closed once the last byte arrived
+    int fill_index = conn->fill_index;
+
+    // Each chunk wakes the readers, the connection's own client among them may fail and close it
+    while (conn->response.head && (complete || conn->response.head->length == SEGMENT_SIZE)) {
+        append_cache_chunk(cache, fill_index, pop_segment_chain(&conn->response));
+        if (conn->closed) {
+            return;
+        }
+    }
+    if (!complete) {
+        return;
+    }
+    conn->fill_index = -1;
+
+    if (conn->reader.index != -1) {
+        finish_chunked_entry(cache, fill_index, 1);
+        return;
+    }
+
+    // A range fill waited for the whole object; its own pin keeps the chunks, header block and
+    // sizes while the ranges are sliced, even if the entry was evicted during the fill
+    pin_cache_entry(cache, fill_index);
+    finish_chunked_entry(cache, fill_index, 1);
+
+    int rv = serve_filled_range(conn, fill_index);
+    if (rv == 1) {
+        start_cache_reader(conn, fill_index);
+    } else if (rv == 0) {
+        send_to_client(conn);
+    } else {
+        close_connection(conn);
+    }
+    unpin_cache_entry(cache, fill_index);
+}
+
+// Switches a response too large to buffer to streaming, through a chunked cache entry if it can be kept
+static void start_streaming(connection_t *conn) {
+    proxy_t *proxy = conn->proxy;
+    conn->streaming = 1;
+
+    printf("Streaming %s %s, body length %ld\n", conn->host, conn->uri, conn->content_length);
+    fflush(stdout);
+
+    conn->fill_index = conn->cache_key && !conn->peer ? cache_response(conn, 1) : -1;
+    if (conn->fill_index == -1) {
+        conn->state = CONN_SENDING_RESPONSE;
+        arm_deadline(conn);
+        return;
+    }
+
+    // A range fill answers once the whole object is in, everyone else reads the chunks as they arrive
+    if (!conn->full_request || !proxy->config->range_fill) {
+        start_cache_reader(conn, conn->fill_index);
+    }
+}
+
+// Answers the CONNECT once the origin is reached; the relay starts after the reply is sent
+static void start_tunnel(connection_t *conn) {
+    const char *reply = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    conn->state = CONN_TUNNELLING;
+    conn->tunnel_started_ms = current_time_ms();
+    conn->trace.status = 200;
+    conn->last_activity_ms = conn->tunnel_started_ms;
+
+    if (open_tunnel_direction(&conn->upstream) == -1 || open_tunnel_direction(&conn->downstream) == -1) {
+        respond_error(conn, 502, "Bad Gateway");
+        return;
+    }
+
+    // Clients may send their first bytes (e.g. a TLS ClientHello) right behind the CONNECT
+    segment_t *head = conn->request_in.head;
+    char *headers_end = strstr(conn->request, "\r\n\r\n") + 4;
+    if (prime_tunnel_direction(&conn->upstream, headers_end, head->data + head->length - headers_end) == -1) {
+        close_connection(conn);
+        return;
+    }
+    for (segment_t *segment = head->next; segment; segment = segment->next) {
+        if (prime_tunnel_direction(&conn->upstream, segment->data, segment->length) == -1) {
+            close_connection(conn);
+            return;
+        }
+    }
+
+    if (append_iochain(&conn->client_out, reply, strlen(reply)) == -1 ||
+        start_write(&conn->client, &conn->client_out, on_tunnel_reply_sent) == -1) {
+        close_connection(conn);
+        return;
+    }
+    arm_deadline(conn);
+}
+
+// Moves what it can in both directions, then waits for whichever socket holds each one up
+static void pump_tunnel(connection_t *conn) {
+    int up_read, up_write, down_read, down_write;
+    int up = pump_tunnel_direction(&conn->upstream, conn->client.fd, conn->server.fd, &up_read, &up_write);
+    int down = pump_tunnel_direction(&conn->downstream, conn->server.fd, conn->client.fd, &down_read, &down_write);
+
+    if (up == -1 || down == -1 || (conn->upstream.shut && conn->downstream.shut)) {
+        finish_tunnel(conn);
+        return;
+    }
+    if (up || down) {
+        conn->last_activity_ms = current_time_ms();
+    }
+
+    unsigned int client_events = (up_read ? IO_READABLE : 0) | (down_write ? IO_WRITABLE : 0);
+    unsigned int server_events = (down_read ? IO_READABLE : 0) | (up_write ? IO_WRITABLE : 0);
+    if (start_poll(&conn->client, client_events, on_tunnel_ready) == -1 ||
+        start_poll(&conn->server, server_events, on_tunnel_ready) == -1) {
+        finish_tunnel(conn);
+    }
+}
+
+// Binds the listening socket on every address, IPv4 mapped into IPv6
+static int open_listener(int port) {
+    int sockfd;
+    struct addrinfo hints, *servinfo, *p;
+    int yes = 1;
+    char port_str[6];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    int rv;
+
+    // Set up hints for IPv6 and allow AI_PASSIVE
+    // Based on Ahmed's tip in #685
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET6; // Use IPv6 (allows IPv4-mapped)
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE; // Use my IP
+
+    // Get address info for binding
+    if ((rv = getaddrinfo(NULL, port_str, &hints, &servinfo)) != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        exit(1);
+    }
+
+    // Loop through results and bind to first valid one
+    for (p = servinfo; p != NULL; p = p->ai_next)
+    {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+        {
+            perror("socket");
+            continue;
+        }
+
+        // Code given from SPEC to allow reuse of port in time_wait state
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+        {
+            perror("setsockopt");
+            exit(1);
+        }
+
+        // Bind the socket
+        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1)
+        {
+            close(sockfd);
+            perror("bind");
+            continue;
+        }
+
+        break;
+    }
+
+    if (p == NULL)
+    {
+        fprintf(stderr, "failed to bind socket\n");
+        exit(2);
+    }
+
+    freeaddrinfo(servinfo); // Done with address info
+
+    if (listen(sockfd, BACKLOG) == -1)
+    {
+        perror("listen");
+        exit(1);
+    }
+
+    return sockfd;
+}
+
+// Puts the cache in shared memory so a later process can take it over; a segment handed
+// over by the previous process is attached instead, unless this build or policy cannot read it
+static cache_t *open_cache(proxy_t *proxy, int cache_fd, size_t cache_size) {
+    const proxy_config_t *config = proxy->config;
+    cache_t *shared = NULL;
+
+    if (cache_fd != -1 && cache_size == sizeof(cache_t)) {
+        shared = map_shared_segment(cache_fd, sizeof(cache_t));
+        if (shared && shared->policy != config->cache_policy) {
+            munmap(shared, sizeof(cache_t));
+            shared = NULL;
+        }
+    }
+
+    if (shared) {
+        attach_cache(shared);
+        for (int i = 0; i < CACHE_SIZE; i++) {
+            proxy->inherited_pins[i] = shared->entries[i].pins;
+        }
+        proxy->cache_fd = cache_fd;
+        printf("Attached the previous process's cache, %d entries\n", shared->valid_entries);
+        fflush(stdout);
+
+    } else {
+        if (cache_fd != -1) {
+            fprintf(stderr, "Cache handed over does not fit this build or policy, starting empty\n");
+            close(cache_fd);
+        }
+        shared = create_shared_segment(sizeof(cache_t), &proxy->cache_fd);
+        if (!shared) {
+            exit(1);
+        }
+        init_cache(shared, config->cache_policy);
+    }
+
+    shared->compress_bodies = config->compress_cache;
+    shared->max_chunked_size = config->max_chunked_size;
+    shared->negative_ttl = config->negative_ttl;
+    return shared;
+}
+
+// ============================== EVENT CALLBACKS ==============================
+
+static void on_accept(io_watch_t *watch, int fd) {
+    proxy_t *proxy = watch->data;
+    connection_t *conn = take_connection(proxy);
+    if (!conn) {
+        close(fd);
+        return;
+    }
+
+    printf("Accepted\n");
+    fflush(stdout);
+
+    conn->proxy = proxy;
+    conn->state = CONN_READING_REQUEST;
+    conn->pinned_index = -1;
+    conn->content_length = -1;
+    conn->fill_index = -1;
+    conn->reader.index = -1;
+    conn->accepted_ms = current_time_ms();
+    conn->last_activity_ms = conn->accepted_ms;
+    conn->request_id = ++proxy->next_request_id;
+    conn->traced = trace_sampled(&proxy->tracer);
+    init_trace_record(&conn->trace, conn->request_id);
+    if (conn->traced) {
+        conn->trace_started_us = trace_time_us();
+        conn->trace.accepted_us = trace_wall_time_us();
+        conn->trace.stage_us[TRACE_ACCEPTED] = 0;
+    }
+    TRACE_PROBE1(request__accepted, conn->request_id);
+    init_io_watch(&conn->client, &proxy->loop, fd, conn);
+    init_io_watch(&conn->server, &proxy->loop, -1, conn);
+    init_timer(&conn->timer, on_deadline, conn);
+    init_timer(&conn->attempt_timer, on_attempt_delay, conn);
+    init_drr_waiter(&conn->fetch_wait, on_fetch_granted, conn);
+    init_drr_waiter(&conn->send_wait, on_send_granted, conn);
+    init_tunnel_direction(&conn->upstream);
+    init_tunnel_direction(&conn->downstream);
+    for (int i = 0; i < MAX_CONNECT_ATTEMPTS; i++) {
+        init_io_watch(&conn->attempts[i], &proxy->loop, -1, conn);
+    }
+
+    if (start_read(&conn->client, on_client_read) == -1) {
+        close_connection(conn);
+        return;
+    }
+    arm_deadline(conn);
+}
+
+// Collects the request until the end of its header block
+static void on_client_read(io_watch_t *watch, const char *buffer, long length) {
+    connection_t *conn = watch->data;
+    if (length <= 0) {
+        close_connection(conn);
+        return;
+    }
+    conn->last_activity_ms = current_time_ms();
+
+    // Once the first segment is full the header block can no longer fit, and bytes past
+    // it are only kept for a tunnel's early data
+    segment_t *head = conn->request_in.head;
+    int searched = head && head->length > 3 ? head->length - 3 : 0;
+    if (head && head->length == SEGMENT_SIZE) {
+        respond_error(conn, 431, "Request Header Fields Too Large");
+        return;
+    }
+    if (append_segment_chain(&conn->request_in, buffer, length) == -1) {
+        close_connection(conn);
+        return;
+    }
+    conn->request = conn->request_in.head->data;
+
+    // Check for end of header, only in the bytes that could complete it
+    if (strstr(conn->request + searched, "\r\n\r\n")) {
+        handle_request(conn);
+    } else if (conn->request_in.count > 1) {
+        respond_error(conn, 431, "Request Header Fields Too Large");
+    }
+}
+
+// First attempt to connect wins, the others are abandoned
+static void on_attempt_connect(io_watch_t *watch, int status) {
+    connection_t *conn = watch->data;
+    proxy_t *proxy = conn->proxy;
+    struct addrinfo *address = conn->candidates[watch - conn->attempts];
+    conn->attempts_in_flight--;
+
+    // A failed attempt hands over to the next candidate at once, without waiting for the delay
+    if (status != 0) {
+        record_address_failure(&proxy->address_failures, address->ai_addr, address->ai_addrlen);
+        close_io_watch(watch);
+        if (start_next_attempt(conn) == -1 && conn->attempts_in_flight == 0) {
+            origin_unreachable(conn);
+        }
+        return;
+    }
+    clear_address_failure(&proxy->address_failures, address->ai_addr, address->ai_addrlen);
+    clear_host_failure(&proxy->host_failures, conn->peer ? conn->peer : conn->host);
+
+    // Attempts started before the winner and still pending are likely black holes,
+    // so they go to the back of the line next time
+    for (int i = 0; i < watch - conn->attempts; i++) {
+        if (conn->attempts[i].fd != -1) {
+            record_address_failure(&proxy->address_failures, conn->candidates[i]->ai_addr,
+                                   conn->candidates[i]->ai_addrlen);
+        }
+    }
+
+    int fd = detach_io_watch(watch);
+    cancel_attempts(conn);
+    init_io_watch(&conn->server, &proxy->loop, fd, conn);
+    TRACE_PROBE1(origin__connected, conn->request_id);
+    trace_stage(conn, TRACE_CONNECTED);
+
+    if (conn->tunnel) {
+        start_tunnel(conn);
+        return;
+    }
+
+    // The first-byte deadline runs from here
+    conn->state = CONN_SENDING_REQUEST;
+    conn->phase_started_ms = current_time_ms();
+    conn->last_activity_ms = conn->phase_started_ms;
+
+    // With range fill the origin gets the request without its Range headers
+    // Bytes read past the first segment follow it
+    // A peer gets the marked request as the client sent it, Range included, and does any range fill itself
+    const char *request = conn->full_request && proxy->config->range_fill ? conn->full_request : conn->request;
+    if (conn->peer) {
+        request = conn->peer_request;
+    }
+    int rv = append_iochain(&conn->server_out, request, strlen(request));
+    for (segment_t *segment = conn->request_in.head->next; rv == 0 && segment; segment = segment->next) {
+        rv = append_iochain_segment(&conn->server_out, segment, segment->data, segment->length);
+    }
+    if (rv == -1 || start_write(&conn->server, &conn->server_out, on_request_sent) == -1 ||
+        start_read(&conn->server, on_server_read) == -1) {
+        respond_error(conn, 502, "Bad Gateway");
+        return;
+    }
+    arm_deadline(conn);
+}
+
+static void on_request_sent(io_watch_t *watch, int status) {
+    connection_t *conn = watch->data;
+
+    if (status == -1) {
+        perror("send to server");
+        origin_response_failed(conn);
+        return;
+    }
+
+    conn->last_activity_ms = current_time_ms();
+    TRACE_PROBE1(request__sent, conn->request_id);
+    trace_stage(conn, TRACE_REQUEST_SENT);
+    if (conn->state == CONN_SENDING_REQUEST) {
+        conn->state = CONN_READING_RESPONSE;
+    }
+}
+
+// Buffers the response until Content-Length says it is complete, or hands on one too large to buffer
+static void on_server_read(io_watch_t *watch, const char *buffer, long length) {
+    connection_t *conn = watch->data;
+
+    if (length < 0) {
+        fprintf(stderr, "recv from server: %s\n", strerror(-length));
+    }
+    if (length <= 0) {
+        origin_response_failed(conn);
+        return;
+    }
+    conn->last_activity_ms = current_time_ms();
+    if (conn->response_bytes == 0) {
+        TRACE_PROBE1(response__first__byte, conn->request_id);
+        trace_stage(conn, TRACE_FIRST_BYTE);
+    }
+
+    if (append_segment_chain(&conn->response, buffer, length) == -1) {
+        respond_error(conn, 502, "Bad Gateway");
+        return;
+    }
+    conn->response_bytes += length;
+
+    // Check for end of headers, then look for the Content-Length header
+    if (conn->response_header_size == 0) {
+        const char *headers = conn->response.head->data;
+        char *body_start = strstr(headers, "\r\n\r\n");
+        if (!body_start) {
+            // The header block has to fit the first segment
+            if (conn->response.count > 1) {
+                fprintf(stderr, "Response headers from %s too large\n", conn->host);
+                respond_error(conn, 502, "Bad Gateway");
+            }
+            return;
+        }
+        conn->response_header_size = body_start + 4 - headers;
+        conn->trace.status = parse_status_code(headers);
+
+        // The value runs to the \r ending its line, where atol stops
+        int value_length;
+        const char *content_length = find_header(headers, "Content-Length:", &value_length);
+        if (content_length) {
+            conn->content_length = atol(content_length);
+        }
+        capture_response(conn, headers, conn->content_length);
+
+        // Compressed storage may keep bodies up to MAX_UNCOMPRESSED_SIZE, past the limit the response streams
+        long limit = conn->cache_key && conn->proxy->cache->compress_bodies ? MAX_UNCOMPRESSED_SIZE : RESPONSE_SIZE;
+        if (conn->content_length != -1 && conn->response_header_size + conn->content_length > limit) {
+            start_streaming(conn);
+            if (conn->closed) {
+                return;
             }
         }
-        
-        // Clean up
-        close(server_fd);
-        close(new_fd);
-        free(request);
-        free(host);
-        free(uri);
-        free(response);
     }
+
+    // Check if we have received all data
+    int complete = conn->content_length != -1 &&
+                   conn->response_bytes - conn->response_header_size >= conn->content_length;
+    if (!conn->streaming) {
+        if (complete) {
+            handle_response(conn);
+        }
+        return;
+    }
+
+    if (complete) {
+        printf("Streamed %s %s, %ld bytes\n", conn->host, conn->uri, conn->response_bytes);
+        fflush(stdout);
+        TRACE_PROBE2(response__read, conn->request_id, conn->response_bytes);
+        trace_stage(conn, TRACE_RESPONSE_READ);
+        close_io_watch(&conn->server);
+        finish_origin_fetch(conn);
+    }
+    if (conn->fill_index != -1) {
+        fill_chunked_entry(conn);
+    } else {
+        flush_stream(conn);
+    }
+}
+
+static void on_tunnel_reply_sent(io_watch_t *watch, int status) {
+    connection_t *conn = watch->data;
+
+    if (status == -1) {
+        perror("send to client");
+        close_connection(conn);
+        return;
+    }
+
+    pump_tunnel(conn);
+}
+
+static void on_tunnel_ready(io_watch_t *watch, unsigned int events) {
+    pump_tunnel(watch->data);
+}
+
+static void on_response_sent(io_watch_t *watch, int status) {
+    connection_t *conn = watch->data;
+
+    if (status == -1) {
+        perror("send to client");
+    }
+    close_connection(conn);
+}
+
+static void on_stream_sent(io_watch_t *watch, int status) {
+    connection_t *conn = watch->data;
+
+    if (status == -1) {
+        perror("send to client");
+        close_connection(conn);
+        return;
+    }
+
+    conn->last_activity_ms = current_time_ms();
+    TRACE_PROBE1(client__sent, conn->request_id);
+    flush_stream(conn);
+}
+
+static void on_chunks_sent(io_watch_t *watch, int status) {
+    connection_t *conn = watch->data;
+
+    if (status == -1) {
+        perror("send to client");
+        close_connection(conn);
+        return;
+    }
+
+    conn->last_activity_ms = current_time_ms();
+    TRACE_PROBE1(client__sent, conn->request_id);
+    pump_cache_reader(conn);
+}
+
+// The entry the connection reads gained chunks or finished filling
+static void on_cache_chunks(cache_reader_t *reader) {
+    pump_cache_reader(reader->data);
+}
+
+// A new process asks to take over. It gets the listener and the cache segment; this process
+// stops accepting, carries on with a private copy of the cache and exits once drained
+static void on_upgrade_accept(io_watch_t *watch, int fd) {
+    proxy_t *proxy = watch->data;
+
+    // From here on only the new process writes to the shared segment
+    if (proxy->cache) {
+        proxy->cache = malloc(sizeof(cache_t));
+        if (!proxy->cache) {
+            perror("malloc");
+            proxy->cache = proxy->shared_cache;
+            close(fd);
+            return;
+        }
+        memcpy(proxy->cache, proxy->shared_cache, sizeof(cache_t));
+    }
+
+    if (send_handoff(fd, proxy->listener.fd, proxy->cache_fd, sizeof(cache_t)) == -1) {
+        if (proxy->cache) {
+            memcpy(proxy->shared_cache, proxy->cache, sizeof(cache_t));
+            free(proxy->cache);
+            proxy->cache = proxy->shared_cache;
+        }
+        close(fd);
+        return;
+    }
+
+    // fd stays open until exit, which is how the new process learns this one is gone
+    close_io_watch(&proxy->listener);
+    close_io_watch(&proxy->upgrade_listener);
+    proxy->draining = 1;
+    printf("Handed over to a new process, draining %d connections\n", proxy->active_connections);
+    fflush(stdout);
+
+    if (proxy->active_connections == 0) {
+        exit(0);
+    }
+}
+
+// The previous process has exited, so the slots its last connections were sending from are free
+static void on_previous_read(io_watch_t *watch, const char *buffer, long length) {
+    proxy_t *proxy = watch->data;
+    if (length > 0) {
+        return;
+    }
+
+    for (int i = 0; proxy->cache && i < CACHE_SIZE; i++) {
+        while (proxy->inherited_pins[i] > 0) {
+            unpin_cache_entry(proxy->cache, i);
+            proxy->inherited_pins[i]--;
+        }
+    }
+    close_io_watch(watch);
+
+    printf("Previous process exited\n");
+    fflush(stdout);
+}
+
+// The client's turn for a fetch slot has come
+static long on_fetch_granted(drr_waiter_t *waiter, long allowance) {
+    connection_t *conn = waiter->data;
+
+    conn->fetching = 1;
+    conn->proxy->active_fetches++;
+    start_origin_fetch(conn);
+    return 1;
+}
+
+// The client's turn at the send bandwidth has come, the connection queues what the allowance covers
+static long on_send_granted(drr_waiter_t *waiter, long allowance) {
+    connection_t *conn = waiter->data;
+    proxy_t *proxy = conn->proxy;
+
+    // Still writing the last grant, the connection keeps its place but holds at most a quantum,
+    // the rest of a stalled client's share is forfeited rather than saved up for a burst
+    if (conn->client.out) {
+        drr_wait(&proxy->send_scheduler, &conn->client_entry->sends, &conn->send_wait);
+        return allowance > SEND_QUANTUM ? allowance - SEND_QUANTUM : 0;
+    }
+
+    conn->send_credit = allowance;
+    if (conn->reader.index != -1) {
+        pump_cache_reader(conn);
+    } else {
+        flush_stream(conn);
+    }
+
+    // A client whose only connection is mid-write would otherwise leave the rounds until the
+    // write completes and lose its turns to clients with more connections
+    if (!conn->closed && conn->client.out) {
+        drr_wait(&proxy->send_scheduler, &conn->client_entry->sends, &conn->send_wait);
+    }
+
+    // Whatever was not used goes back, an overdraft is carried by the client's flow
+    long used = allowance - conn->send_credit;
+    conn->send_credit = 0;
+    return used;
+}
+
+// Hands out the bandwidth that accrued since the last tick, ticking on while anyone waits
+static void on_send_tick(timer_node_t *timer) {
+    proxy_t *proxy = timer->data;
+    long long now = current_time_ms();
+    long long elapsed = now - proxy->last_send_tick_ms;
+
+    // A late tick does not make up for the whole gap, so a stall is not followed by a burst
+    if (elapsed <= 0 || elapsed > 10 * SEND_TICK_MS) {
+        elapsed = SEND_TICK_MS;
+    }
+    proxy->last_send_tick_ms = now;
+
+    run_drr(&proxy->send_scheduler, proxy->config->admission.bandwidth * elapsed / 1000);
+    if (drr_backlogged(&proxy->send_scheduler) && !timer_armed(timer)) {
+        arm_timer(&proxy->loop.timers, timer, now + SEND_TICK_MS);
+    }
+}
+
+// Logs the admission counters when they changed since the last summary
+static void on_admission_report(timer_node_t *timer) {
+    proxy_t *proxy = timer->data;
+    admission_stats_t *stats = &proxy->admission_stats;
+
+    if (memcmp(stats, &proxy->reported_stats, sizeof(*stats)) != 0) {
+        printf("Admission: %ld admitted, %ld rate limited, %ld over the request cap, %ld untracked, "
+               "%ld fetches queued, %ld sends deferred, %d fetches in progress\n",
+               stats->admitted, stats->rate_limited, stats->too_many_requests, stats->untracked,
+               stats->fetches_queued, stats->sends_deferred, proxy->active_fetches);
+        fflush(stdout);
+        proxy->reported_stats = *stats;
+    }
+
+    arm_timer(&proxy->loop.timers, timer, current_time_ms() + ADMISSION_REPORT_MS);
+}
+
+// Writes out the trace and capture records of the last second, so a quiet proxy's files stay current
+static void on_flush_records(timer_node_t *timer) {
+    proxy_t *proxy = timer->data;
+
+    flush_trace_writer(&proxy->tracer);
+    flush_capture_writer(&proxy->capture);
+    arm_timer(&proxy->loop.timers, timer, current_time_ms() + RECORD_FLUSH_MS);
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+void init_deadlines(deadline_config_t *deadlines) {
+    deadlines->header_ms = 10000;
+    deadlines->connect_ms = 10000;
+    deadlines->first_byte_ms = 30000;
+    deadlines->idle_ms = 60000;
+    deadlines->total_ms = 300000;
+    deadlines->attempt_delay_ms = DEFAULT_ATTEMPT_DELAY_MS;
+}
+
+// Parses "header=10,connect=5,first-byte=30,idle=60,total=300,attempt-delay=0.25",
+// limits not listed keep their value
+int parse_deadlines(const char *spec, deadline_config_t *deadlines) {
+    char *spec_copy = strdup(spec);
+    if (!spec_copy) {
+        perror("strdup");
+        return -1;
+    }
+
+    char *item = strtok(spec_copy, ",");
+    while (item) {
+        char *value = strchr(item, '=');
+        char *end;
+        if (!value) {
+            free(spec_copy);
+            return -1;
+        }
+        *value++ = '\0';
+
+        double seconds = strtod(value, &end);
+        if (end == value || *end != '\0' || seconds < 0) {
+            free(spec_copy);
+            return -1;
+        }
+        long milliseconds = (long) (seconds * 1000);
+
+        if (strcasecmp(item, "header") == 0) {
+            deadlines->header_ms = milliseconds;
+        } else if (strcasecmp(item, "connect") == 0) {
+            deadlines->connect_ms = milliseconds;
+        } else if (strcasecmp(item, "first-byte") == 0) {
+            deadlines->first_byte_ms = milliseconds;
+        } else if (strcasecmp(item, "idle") == 0) {
+            deadlines->idle_ms = milliseconds;
+        } else if (strcasecmp(item, "total") == 0) {
+            deadlines->total_ms = milliseconds;
+        } else if (strcasecmp(item, "attempt-delay") == 0) {
+            deadlines->attempt_delay_ms = milliseconds;
+        } else {
+            free(spec_copy);
+            return -1;
+        }
+
+        item = strtok(NULL, ",");
+    }
+
+    free(spec_copy);
+    return 0;
+}
+
+// Returns pointer to last line before the \r\n\r\n
+const char *extract_last_header_line(const char *request, int *length) {
+    const char *end = strstr(request, "\r\n\r\n");
+    if (!end) return NULL;
+
+    // Step back to the \n that ends the line before it
+    const char *last_line = end;
+    while (last_line > request && last_line[-1] != '\n') {
+        last_line--;
+    }
+    if (last_line == request) {
+        return NULL;
+    }
+
+    *length = end - last_line;
+    return last_line;
+}
+
+// Extract Host from headers
+const char *extract_host(const char *request, int *length) {
+    // Find the start of the Host header
+    const char *host_prefix = "\r\nHost:";
+    const char *host_line = strcasestr(request, host_prefix);
+    if (!host_line) {
+        return NULL;
+    }
+
+    // This is adapted from Ahmed's tip in ED #563
+    host_line += strlen(host_prefix);
+
+    // Skip spaces or tabs until the start of the host
+    while (*host_line == ' ' || *host_line == '\t') {
+        host_line++;
+    }
+
+    // Find the end of the host line
+    const char *end = strstr(host_line, "\r\n");
+    if (!end) {
+        return NULL;
+    }
+
+    *length = end - host_line;
+    return host_line;
+}
+
+// Extract URI from request line
+const char *extract_request_uri(const char *request, int *length) {
+    // Skip the "GET" or any other method
+    const char *path_start = request;
+    while (*path_start != ' ' && *path_start != '\t') {
+        path_start++;
+    }
+
+    // Skip spaces or tabs until the start of the path
+    while (*path_start == ' ' || *path_start == '\t') {
+        path_start++;
+    }
+
+    // Find the location of the first space or tab
+    const char *path_end = path_start;
+    while (*path_end != ' ' && *path_end != '\t') {
+        path_end++;
+    }
+
+    *length = path_end - path_start;
+    return path_start;
+}
+
+void start_proxy(const proxy_config_t *config) {
+    int port = config->port;
+
+    proxy.config = config;
+    proxy.cache = NULL;
+    proxy.shared_cache = NULL;
+    proxy.cache_fd = -1;
+    proxy.free_connections = NULL;
+    proxy.free_connection_count = 0;
+    proxy.active_connections = 0;
+    proxy.draining = 0;
+
+    // Hosts that recently failed to resolve or connect, and addresses that refused a connect
+    init_host_failures(&proxy.host_failures);
+    init_address_failures(&proxy.address_failures);
+
+    // Clients seen recently, with their turns at the fetch slots and the send bandwidth
+    init_client_table(&proxy.clients);
+    memset(&proxy.admission_stats, 0, sizeof(proxy.admission_stats));
+    memset(&proxy.reported_stats, 0, sizeof(proxy.reported_stats));
+    init_drr_scheduler(&proxy.fetch_scheduler, 1);
+    init_drr_scheduler(&proxy.send_scheduler, SEND_QUANTUM);
+    proxy.active_fetches = 0;
+    proxy.scheduling_fetches = 0;
+    proxy.fetch_released = 0;
+    init_timer(&proxy.send_timer, on_send_tick, &proxy);
+    init_timer(&proxy.report_timer, on_admission_report, &proxy);
+
+    // One request in every sample is traced into the file, the rest only pass the probes
+    proxy.next_request_id = 0;
+    proxy.tracer.fd = -1;
+    proxy.capture.file = NULL;
+    init_timer(&proxy.flush_timer, on_flush_records, &proxy);
+    if (config->trace.path) {
+        if (open_trace_writer(&proxy.tracer, &config->trace) == -1) {
+            exit(1);
+        }
+        printf("Tracing one request in %d to %s\n", config->trace.sample, config->trace.path);
+        fflush(stdout);
+    }
+    if (config->capture_path) {
+        if (open_capture_writer(&proxy.capture, config->capture_path) == -1) {
+            exit(1);
+        }
+        printf("Capturing requests to %s\n", config->capture_path);
+        fflush(stdout);
+    }
+
+    // A new process takes over the running one's listener and cache, if there is one
+    int sockfd = -1;
+    int cache_fd = -1;
+    int control_fd = -1;
+    size_t cache_size = 0;
+    if (config->upgrade_path) {
+        int rv = request_handoff(config->upgrade_path, &sockfd, &cache_fd, &cache_size, &control_fd);
+        if (rv == -1) {
+            exit(1);
+        }
+        if (rv == 0) {
+            printf("Took over the listener from the running process\n");
+            fflush(stdout);
+        }
+    }
+
+    // Initialise cache if enabled (stage 2)
+    if (config->enable_cache) {
+        proxy.cache = open_cache(&proxy, cache_fd, cache_size);
+        proxy.shared_cache = proxy.cache;
+    }
+
+    if (sockfd == -1) {
+        sockfd = open_listener(port);
+    }
+
+    // Every socket is non-blocking, the event loop waits on all of them at once
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
+
+    if (init_event_loop(&proxy.loop, config->backend) == -1) {
+        exit(1);
+    }
+    if (init_resolver(&proxy.resolver, &proxy.loop) == -1) {
+        exit(1);
+    }
+    printf("Using %s\n", proxy.loop.uring ? "io_uring" : "epoll");
+    fflush(stdout);
+
+    if (admission_enabled(&config->admission)) {
+        arm_timer(&proxy.loop.timers, &proxy.report_timer, current_time_ms() + ADMISSION_REPORT_MS);
+    }
+    if (config->trace.path || config->capture_path) {
+        arm_timer(&proxy.loop.timers, &proxy.flush_timer, current_time_ms() + RECORD_FLUSH_MS);
+    }
+
+    init_io_watch(&proxy.listener, &proxy.loop, sockfd, &proxy);
+    if (start_accept(&proxy.listener, on_accept) == -1) {
+        exit(1);
+    }
+
+    // The next upgrade comes in through the same path, the previous process is watched until it exits
+    init_io_watch(&proxy.upgrade_listener, &proxy.loop, -1, &proxy);
+    init_io_watch(&proxy.previous, &proxy.loop, control_fd, &proxy);
+    if (config->upgrade_path) {
+        int upgrade_fd = open_upgrade_socket(config->upgrade_path);
+        init_io_watch(&proxy.upgrade_listener, &proxy.loop, upgrade_fd, &proxy);
+        if (upgrade_fd == -1 || start_accept(&proxy.upgrade_listener, on_upgrade_accept) == -1) {
+            exit(1);
+        }
+    }
+    if (control_fd != -1 && start_read(&proxy.previous, on_previous_read) == -1) {
+        exit(1);
+    }
+
+    run_event_loop(&proxy.loop);
     close(sockfd);
-}
\ No newline at end of file
+}
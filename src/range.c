@@ -0,0 +1,269 @@
+#define _GNU_SOURCE // https://stackoverflow.com/questions/9935642/how-do-i-use-strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "http.h"
+#include "range.h"
+
+#define STATUS_206 "HTTP/1.1 206 Partial Content\r\n"
+#define FRAMING_SIZE 128 // Room for the Content-Range or multipart framing lines and the blank line
+
+// Headers of the full response that no longer describe a partial one
+const char *full_response_headers[] = {
+    "Content-Length:",
+    "Content-Range:",
+    "Content-Type:",
+};
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Skips spaces and tabs
+static const char *skip_whitespace(const char *p) {
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+// Writes the 206 status line and the full response's headers minus the framing ones into scratch,
+// keeping Content-Type only for single ranges, then leaves room for framing_room more bytes
+// Returns the block without the blank line, or NULL if it does not fit one segment
+static char *build_partial_headers(segment_chain_t *scratch, const char *headers, int header_size, int keep_type,
+                                   int framing_room, int *written) {
+    const char *status_end = strstr(headers, "\r\n") + 2;
+    int status_size = status_end - headers;
+    int out_size = strlen(STATUS_206) + header_size - status_size + framing_room;
+
+    char *out = reserve_segment_chain(scratch, out_size);
+    if (!out) {
+        return NULL;
+    }
+
+    memcpy(out, STATUS_206, strlen(STATUS_206));
+    int skip_count = keep_type ? 2 : 3;
+    int copied = copy_headers_except(status_end, header_size - status_size, full_response_headers, skip_count,
+                                     out + strlen(STATUS_206), out_size - framing_room - strlen(STATUS_206));
+    if (copied == -1) {
+        return NULL;
+    }
+    *written = strlen(STATUS_206) + copied;
+    return out;
+}
+
+// Queues a 416 pointing the client at the real length
+static int send_range_not_satisfiable(iochain_t *out, segment_chain_t *scratch, long body_size) {
+    int length;
+    char *response = format_segment_chain(scratch, &length,
+                                          "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%ld\r\n"
+                                          "Content-Length: 0\r\n\r\n",
+                                          body_size);
+    if (!response) {
+        return -1;
+    }
+
+    return append_iochain_segment(out, scratch->tail, response, length);
+}
+
+// Queues the bytes [first, first + size) of a body spread over iovecs, borrowing them in place
+static int append_body_slice(iochain_t *out, const struct iovec *body, int count, long first, long size) {
+    for (int i = 0; i < count && size > 0; i++) {
+        long length = body[i].iov_len;
+        if (first >= length) {
+            first -= length;
+            continue;
+        }
+
+        long taken = length - first < size ? length - first : size;
+        if (append_iochain(out, (const char *) body[i].iov_base + first, taken) == -1) {
+            return -1;
+        }
+        first = 0;
+        size -= taken;
+    }
+
+    return 0;
+}
+
+// Queues one range as a plain 206, the body slice goes straight from the caller's bytes
+static int send_single_range(iochain_t *out, segment_chain_t *scratch, const char *headers, int header_size,
+                             const struct iovec *body, int body_count, long body_size, const byte_range_t *range) {
+    int written = 0;
+    char *partial_headers = build_partial_headers(scratch, headers, header_size, 1, FRAMING_SIZE, &written);
+    if (!partial_headers) {
+        return -1;
+    }
+
+    // The framing goes right after the headers, so the whole block is queued as one buffer
+    long range_size = range->last - range->first + 1;
+    written += snprintf(partial_headers + written, FRAMING_SIZE,
+                        "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\n\r\n", range->first, range->last,
+                        body_size, range_size);
+
+    if (append_iochain_segment(out, scratch->tail, partial_headers, written) == -1 ||
+        append_body_slice(out, body, body_count, range->first, range_size) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Queues several ranges as multipart/byteranges, one buffer per part header and per slice
+static int send_multipart_ranges(iochain_t *out, segment_chain_t *scratch, const char *headers, int header_size,
+                                 const struct iovec *body, int body_count, long body_size, const byte_range_t *ranges,
+                                 int count) {
+    int type_length;
+    const char *part_type = find_header(headers, "Content-Type:", &type_length);
+    if (!part_type) {
+        part_type = "application/octet-stream";
+        type_length = strlen(part_type);
+    }
+
+    // The framing needs the total length, so write every part header before queueing anything
+    const char *closing = "\r\n--" RANGE_BOUNDARY "--\r\n";
+    long content_length = strlen(closing);
+    char *part_headers[MAX_RANGES];
+    segment_t *part_segments[MAX_RANGES];
+    int part_sizes[MAX_RANGES];
+
+    for (int i = 0; i < count; i++) {
+        part_headers[i] = format_segment_chain(scratch, &part_sizes[i],
+                                               "%s--" RANGE_BOUNDARY "\r\nContent-Type: %.*s\r\n"
+                                               "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                                               i == 0 ? "" : "\r\n", type_length, part_type, ranges[i].first,
+                                               ranges[i].last, body_size);
+        if (!part_headers[i]) {
+            return -1;
+        }
+        part_segments[i] = scratch->tail;
+        content_length += part_sizes[i] + ranges[i].last - ranges[i].first + 1;
+    }
+
+    int written = 0;
+    char *partial_headers = build_partial_headers(scratch, headers, header_size, 0, FRAMING_SIZE, &written);
+    if (!partial_headers) {
+        return -1;
+    }
+    written += snprintf(partial_headers + written, FRAMING_SIZE,
+                        "Content-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY
+                        "\r\nContent-Length: %ld\r\n\r\n",
+                        content_length);
+
+    // Layout: response headers and framing, then (part header, slice) per range, then the closing delimiter
+    int rv = append_iochain_segment(out, scratch->tail, partial_headers, written);
+    for (int i = 0; i < count && rv != -1; i++) {
+        rv = append_iochain_segment(out, part_segments[i], part_headers[i], part_sizes[i]);
+        rv = rv == -1 ? -1
+                      : append_body_slice(out, body, body_count, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+    }
+    rv = rv == -1 ? -1 : append_iochain(out, closing, strlen(closing));
+
+    return rv;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+// Parses the byte-range-set, dropping unsatisfiable ranges and clamping the rest to the length
+int parse_byte_ranges(const char *range_value, long length, byte_range_t *ranges, int max_ranges) {
+    const char *unit = "bytes=";
+    const char *p = skip_whitespace(range_value);
+    if (strncasecmp(p, unit, strlen(unit)) != 0) {
+        return -1;
+    }
+    p += strlen(unit);
+
+    int count = 0;
+    while (1) {
+        char *end;
+        long first, last;
+        p = skip_whitespace(p);
+
+        if (*p == '-') {
+            // Suffix range: the last N bytes
+            long suffix = strtol(p + 1, &end, 10);
+            if (end == p + 1 || suffix < 0) {
+                return -1;
+            }
+            first = suffix >= length ? 0 : length - suffix;
+            last = suffix == 0 ? -1 : length - 1;
+
+        } else {
+            if (!isdigit((unsigned char) *p)) {
+                return -1;
+            }
+            first = strtol(p, &end, 10);
+            if (*end != '-') {
+                return -1;
+            }
+            p = end + 1;
+
+            // An open-ended range runs to the end of the representation
+            if (isdigit((unsigned char) *p)) {
+                last = strtol(p, &end, 10);
+                if (last < first) {
+                    return -1;
+                }
+            } else {
+                last = length - 1;
+                end = (char *) p;
+            }
+            if (last >= length) {
+                last = length - 1;
+            }
+        }
+
+        // Keep only satisfiable ranges
+        if (first < length && first <= last) {
+            if (count == max_ranges) {
+                return -1;
+            }
+            ranges[count].first = first;
+            ranges[count].last = last;
+            count++;
+        }
+
+        p = skip_whitespace(end);
+        if (*p == '\0') {
+            break;
+        }
+        if (*p != ',') {
+            return -1;
+        }
+        p++;
+    }
+
+    return count;
+}
+
+// Strong comparison against ETag, or exact match against Last-Modified
+int if_range_matches(const char *response, const char *if_range) {
+    // Weak validators can never be used with If-Range
+    if (strncmp(if_range, "W/", 2) == 0) {
+        return 0;
+    }
+
+    const char *validator_name = if_range[0] == '"' ? "ETag:" : "Last-Modified:";
+    int length;
+    const char *validator = find_header(response, validator_name, &length);
+
+    return validator && (int) strlen(if_range) == length && strncmp(validator, if_range, length) == 0;
+}
+
+// Picks between 206, multipart 206 and 416 for the requested ranges
+int serve_byte_ranges(iochain_t *out, segment_chain_t *scratch, const char *headers, int header_size,
+                      const struct iovec *body, int body_count, long body_size, const char *range_value) {
+    byte_range_t ranges[MAX_RANGES];
+    int count = parse_byte_ranges(range_value, body_size, ranges, MAX_RANGES);
+
+    if (count == -1) {
+        return 1;
+    }
+    if (count == 0) {
+        return send_range_not_satisfiable(out, scratch, body_size);
+    }
+    if (count == 1) {
+        return send_single_range(out, scratch, headers, header_size, body, body_count, body_size, &ranges[0]);
+    }
+
+    return send_multipart_ranges(out, scratch, headers, header_size, body, body_count, body_size, ranges, count);
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "resolver.h"
+#include "http.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Resolves one request, both families, the connect race decides which one answers first
+static void run_lookup(resolve_request_t *request) {
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // Adapted from Beej's guide to network programming
+    // https://beej.us/guide/bgnet/html/
+    int rv = getaddrinfo(request->name, request->port, &hints, &request->addresses);
+    if (rv != 0) {
+        fprintf(stderr, "getaddrinfo (host=%s): %s\n", request->name, gai_strerror(rv));
+        request->addresses = NULL;
+    }
+}
+
+// Takes the next lookup off the queue and runs it, forever
+static void *resolver_thread(void *arg) {
+    resolver_t *resolver = arg;
+    uint64_t one = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&resolver->lock);
+        while (!resolver->pending_head) {
+            pthread_cond_wait(&resolver->wakeup, &resolver->lock);
+        }
+        resolve_request_t *request = resolver->pending_head;
+        resolver->pending_head = request->next;
+        if (!resolver->pending_head) {
+            resolver->pending_tail = NULL;
+        }
+        int cancelled = request->cancelled;
+        pthread_mutex_unlock(&resolver->lock);
+
+        // A lookup cancelled while it waited is only handed back to be freed
+        if (!cancelled) {
+            run_lookup(request);
+        }
+
+        pthread_mutex_lock(&resolver->lock);
+        request->next = resolver->done;
+        resolver->done = request;
+        pthread_mutex_unlock(&resolver->lock);
+
+        if (write(resolver->notify.fd, &one, sizeof one) != sizeof one) {
+            perror("write resolver eventfd");
+        }
+    }
+
+    return NULL;
+}
+
+// ============================== EVENT CALLBACKS ==============================
+
+// Hands finished lookups to their callbacks, in the order they were started
+static void on_resolver_ready(io_watch_t *watch, unsigned int events) {
+    resolver_t *resolver = watch->data;
+    uint64_t count;
+
+    if (read(watch->fd, &count, sizeof count) == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&resolver->lock);
+    resolve_request_t *done = resolver->done;
+    resolver->done = NULL;
+    pthread_mutex_unlock(&resolver->lock);
+
+    resolve_request_t *ordered = NULL;
+    while (done) {
+        resolve_request_t *next = done->next;
+        done->next = ordered;
+        ordered = done;
+        done = next;
+    }
+
+    // cancelled is only ever set on this thread, so it cannot change from here on
+    while (ordered) {
+        resolve_request_t *request = ordered;
+        ordered = request->next;
+
+        if (request->cancelled) {
+            if (request->addresses) {
+                freeaddrinfo(request->addresses);
+            }
+        } else {
+            request->on_resolved(request->data, request->addresses);
+        }
+        free(request);
+    }
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+int init_resolver(resolver_t *resolver, event_loop_t *loop) {
+    memset(resolver, 0, sizeof *resolver);
+    pthread_mutex_init(&resolver->lock, NULL);
+    pthread_cond_init(&resolver->wakeup, NULL);
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    init_io_watch(&resolver->notify, loop, fd, resolver);
+    if (start_poll(&resolver->notify, IO_READABLE, on_resolver_ready) == -1) {
+        return -1;
+    }
+
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        int rv = pthread_create(&resolver->threads[i], NULL, resolver_thread, resolver);
+        if (rv != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+            return -1;
+        }
+        pthread_detach(resolver->threads[i]);
+    }
+
+    return 0;
+}
+
+resolve_request_t *start_resolve(resolver_t *resolver, const char *host,
+                                 void (*on_resolved)(void *data, struct addrinfo *addresses), void *data) {
+    resolve_request_t *request = calloc(1, sizeof(resolve_request_t));
+    if (!request) {
+        perror("calloc");
+        return NULL;
+    }
+
+    if (split_host_port(host, request->name, sizeof(request->name), request->port, sizeof(request->port)) == -1) {
+        fprintf(stderr, "Bad host %s\n", host);
+        free(request);
+        return NULL;
+    }
+    request->on_resolved = on_resolved;
+    request->data = data;
+
+    pthread_mutex_lock(&resolver->lock);
+    if (resolver->pending_tail) {
+        resolver->pending_tail->next = request;
+    } else {
+        resolver->pending_head = request;
+    }
+    resolver->pending_tail = request;
+    pthread_cond_signal(&resolver->wakeup);
+    pthread_mutex_unlock(&resolver->lock);
+
+    return request;
+}
+
+void cancel_resolve(resolver_t *resolver, resolve_request_t *request) {
+    // Freed by on_resolver_ready once its thread is done with it
+    pthread_mutex_lock(&resolver->lock);
+    request->cancelled = 1;
+    pthread_mutex_unlock(&resolver->lock);
+}
@@ -0,0 +1,204 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "segment.h"
+
+// Each thread recycles its own segments, so the pool needs no locking
+static _Thread_local segment_t *free_segments = NULL;
+static _Thread_local int free_count = 0;
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Takes a fresh tail segment for the chain
+static segment_t *extend_segment_chain(segment_chain_t *chain) {
+    segment_t *segment = alloc_segment();
+    if (!segment) {
+        return NULL;
+    }
+
+    if (chain->tail) {
+        chain->tail->next = segment;
+    } else {
+        chain->head = segment;
+    }
+    chain->tail = segment;
+    chain->count++;
+
+    return segment;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+segment_t *alloc_segment(void) {
+    segment_t *segment = free_segments;
+
+    if (segment) {
+        free_segments = segment->next;
+        free_count--;
+    } else {
+        segment = malloc(sizeof(segment_t));
+        if (!segment) {
+            perror("malloc");
+            return NULL;
+        }
+    }
+
+    segment->next = NULL;
+    segment->refs = 1;
+    segment->length = 0;
+    segment->data[0] = '\0';
+    return segment;
+}
+
+void hold_segment(segment_t *segment) {
+    segment->refs++;
+}
+
+void release_segment(segment_t *segment) {
+    if (!segment || --segment->refs > 0) {
+        return;
+    }
+
+    // Past the cap the memory goes back to malloc, a burst does not stay resident forever
+    if (free_count >= SEGMENT_POOL_MAX) {
+        free(segment);
+        return;
+    }
+    segment->next = free_segments;
+    free_segments = segment;
+    free_count++;
+}
+
+void init_segment_chain(segment_chain_t *chain) {
+    memset(chain, 0, sizeof(*chain));
+}
+
+int append_segment_chain(segment_chain_t *chain, const char *data, long length) {
+    while (length > 0) {
+        segment_t *tail = chain->tail;
+        if (!tail || tail->length == SEGMENT_SIZE) {
+            if (!(tail = extend_segment_chain(chain))) {
+                return -1;
+            }
+        }
+
+        long room = SEGMENT_SIZE - tail->length;
+        long copied = length < room ? length : room;
+        memcpy(tail->data + tail->length, data, copied);
+        tail->length += copied;
+        tail->data[tail->length] = '\0';
+        chain->length += copied;
+
+        data += copied;
+        length -= copied;
+    }
+
+    return 0;
+}
+
+char *copy_to_segment_chain(segment_chain_t *chain, const char *data, int length) {
+    char *copy = reserve_segment_chain(chain, length + 1);
+    if (!copy) {
+        return NULL;
+    }
+
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+char *reserve_segment_chain(segment_chain_t *chain, int length) {
+    if (length > SEGMENT_SIZE) {
+        return NULL;
+    }
+
+    segment_t *tail = chain->tail;
+    if (!tail || SEGMENT_SIZE - tail->length < length) {
+        if (!(tail = extend_segment_chain(chain))) {
+            return NULL;
+        }
+    }
+
+    char *space = tail->data + tail->length;
+    tail->length += length;
+    chain->length += length;
+    return space;
+}
+
+// Measures the string first, so it takes exactly the space it needs
+char *format_segment_chain(segment_chain_t *chain, int *length, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (needed < 0) {
+        return NULL;
+    }
+
+    char *space = reserve_segment_chain(chain, needed + 1);
+    if (!space) {
+        return NULL;
+    }
+
+    va_start(args, format);
+    vsnprintf(space, needed + 1, format, args);
+    va_end(args);
+    *length = needed;
+    return space;
+}
+
+segment_t *pop_segment_chain(segment_chain_t *chain) {
+    segment_t *segment = chain->head;
+    if (!segment) {
+        return NULL;
+    }
+
+    chain->head = segment->next;
+    if (!chain->head) {
+        chain->tail = NULL;
+    }
+    chain->count--;
+    chain->length -= segment->length;
+    segment->next = NULL;
+    return segment;
+}
+
+void push_segment_chain(segment_chain_t *chain, segment_t *segment) {
+    segment->next = NULL;
+    if (chain->tail) {
+        chain->tail->next = segment;
+    } else {
+        chain->head = segment;
+    }
+    chain->tail = segment;
+    chain->count++;
+    chain->length += segment->length;
+}
+
+int segment_chain_iov(const segment_chain_t *chain, struct iovec *iov, int max) {
+    if (chain->count > max) {
+        return -1;
+    }
+
+    int count = 0;
+    for (segment_t *segment = chain->head; segment; segment = segment->next) {
+        iov[count].iov_base = segment->data;
+        iov[count].iov_len = segment->length;
+        count++;
+    }
+
+    return count;
+}
+
+void free_segment_chain(segment_chain_t *chain) {
+    segment_t *segment = chain->head;
+    while (segment) {
+        segment_t *next = segment->next;
+        release_segment(segment);
+        segment = next;
+    }
+
+    init_segment_chain(chain);
+}
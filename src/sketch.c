@@ -0,0 +1,77 @@
+#include <string.h>
+
+#include "http.h"
+#include "sketch.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// 64-bit FNV-1a hash of a null-terminated key
+static unsigned long long hash_key(const char *key) {
+    return hash_bytes(FNV_OFFSET_BASIS, key, strlen(key));
+}
+
+// Picks the counter column for the given row using double hashing
+static int sketch_column(unsigned long long hash, int row) {
+    unsigned int low = (unsigned int) hash;
+    unsigned int high = (unsigned int) (hash >> 32);
+
+    return (low + row * (high | 1)) & (SKETCH_WIDTH - 1);
+}
+
+// Halves every counter so that old popularity decays
+static void age_sketch(frequency_sketch_t *sketch) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        for (int col = 0; col < SKETCH_WIDTH; col++) {
+            sketch->counters[row][col] >>= 1;
+        }
+    }
+
+    sketch->additions /= 2;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+// Clears all counters and sets the aging period from the cache capacity
+void init_sketch(frequency_sketch_t *sketch, int capacity) {
+    memset(sketch->counters, 0, sizeof(sketch->counters));
+    sketch->additions = 0;
+    sketch->sample_size = capacity * SKETCH_SAMPLE_FACTOR;
+}
+
+// Conservative update: only the smallest counters are incremented,
+// which keeps over-estimation from hash collisions low
+void increment_sketch(frequency_sketch_t *sketch, const char *key) {
+    unsigned long long hash = hash_key(key);
+    int min_count = estimate_frequency(sketch, key);
+
+    if (min_count >= SKETCH_MAX_COUNT) {
+        return;
+    }
+
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned char *counter = &sketch->counters[row][sketch_column(hash, row)];
+        if (*counter == min_count) {
+            (*counter)++;
+        }
+    }
+
+    // Age the sketch once the sample period is over
+    if (++sketch->additions >= sketch->sample_size) {
+        age_sketch(sketch);
+    }
+}
+
+// Returns the minimum counter across all rows
+int estimate_frequency(const frequency_sketch_t *sketch, const char *key) {
+    unsigned long long hash = hash_key(key);
+    int min_count = SKETCH_MAX_COUNT;
+
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int count = sketch->counters[row][sketch_column(hash, row)];
+        if (count < min_count) {
+            min_count = count;
+        }
+    }
+
+    return min_count;
+}
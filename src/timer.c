@@ -0,0 +1,178 @@
+#include <stddef.h>
+#include <time.h>
+
+#include "timer.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+static void init_list(timer_node_t *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void unlink_timer(timer_node_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+static void link_timer(timer_node_t *head, timer_node_t *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+// Picks the level and slot for a timer from how far away it expires
+static void place_timer(timer_wheel_t *wheel, timer_node_t *timer) {
+    unsigned long long expires = timer->expires;
+    unsigned long long delta = expires > wheel->current_tick ? expires - wheel->current_tick : 0;
+
+    // Already due timers go in the current slot and fire on the next advance
+    if (delta == 0) {
+        expires = wheel->current_tick;
+    }
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (delta < (1ULL << (WHEEL_BITS * (level + 1))) || level == WHEEL_LEVELS - 1) {
+            // Clamp timers beyond the last level to its furthest slot
+            if (level == WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS))) {
+                expires = wheel->current_tick + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+            }
+            int slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            link_timer(&wheel->slots[level][slot], timer);
+            return;
+        }
+    }
+}
+
+// Moves every timer of a higher-level slot down to where it now belongs
+static void cascade(timer_wheel_t *wheel, int level, int slot) {
+    timer_node_t pending;
+    timer_node_t *head = &wheel->slots[level][slot];
+
+    // Detach the whole slot first since placing may link back into this level
+    init_list(&pending);
+    if (head->next != head) {
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        init_list(head);
+    }
+
+    while (pending.next != &pending) {
+        timer_node_t *timer = pending.next;
+        unlink_timer(timer);
+        place_timer(wheel, timer);
+    }
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+long long current_time_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void init_timer_wheel(timer_wheel_t *wheel, long long now_ms) {
+    wheel->current_tick = now_ms / WHEEL_TICK_MS;
+    wheel->armed_count = 0;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            init_list(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+void init_timer(timer_node_t *timer, void (*callback)(timer_node_t *timer), void *data) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+// Rounds up to the next tick so a timer never fires early
+void arm_timer(timer_wheel_t *wheel, timer_node_t *timer, long long expires_ms) {
+    cancel_timer(wheel, timer);
+
+    timer->expires = (expires_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    place_timer(wheel, timer);
+    wheel->armed_count++;
+}
+
+void cancel_timer(timer_wheel_t *wheel, timer_node_t *timer) {
+    if (timer->next) {
+        unlink_timer(timer);
+        wheel->armed_count--;
+    }
+}
+
+int timer_armed(const timer_node_t *timer) {
+    return timer->next != NULL;
+}
+
+void advance_timer_wheel(timer_wheel_t *wheel, long long now_ms) {
+    unsigned long long now_tick = now_ms / WHEEL_TICK_MS;
+
+    // Nothing to fire, so skip the intermediate ticks entirely
+    if (wheel->armed_count == 0) {
+        if (now_tick > wheel->current_tick) {
+            wheel->current_tick = now_tick;
+        }
+        return;
+    }
+
+    // Due timers placed in the current slot by arm_timer fire first
+    do {
+        int slot = wheel->current_tick & WHEEL_MASK;
+
+        // Each time a level wraps, pull the matching slot of the level above down
+        if (slot == 0) {
+            for (int level = 1; level < WHEEL_LEVELS; level++) {
+                int upper_slot = (wheel->current_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+                cascade(wheel, level, upper_slot);
+                if (upper_slot != 0) {
+                    break;
+                }
+            }
+        }
+
+        // Fire one timer at a time so callbacks can arm or cancel any timer safely
+        timer_node_t *head = &wheel->slots[0][slot];
+        while (head->next != head) {
+            timer_node_t *timer = head->next;
+            unlink_timer(timer);
+            wheel->armed_count--;
+            timer->callback(timer);
+        }
+
+        if (wheel->current_tick >= now_tick) {
+            break;
+        }
+        wheel->current_tick++;
+    } while (1);
+}
+
+// Scans level 0 for the nearest non-empty slot, or the next cascade if that comes first
+int next_timer_timeout(timer_wheel_t *wheel, long long now_ms) {
+    if (wheel->armed_count == 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        unsigned long long tick = wheel->current_tick + i;
+        timer_node_t *head = &wheel->slots[0][tick & WHEEL_MASK];
+
+        if (head->next != head || (i > 0 && (tick & WHEEL_MASK) == 0)) {
+            long long delay = (long long) tick * WHEEL_TICK_MS - now_ms;
+            return delay > 0 ? (int) delay : 0;
+        }
+    }
+
+    return WHEEL_SLOTS * WHEEL_TICK_MS;
+}
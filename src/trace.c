@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Writes the whole buffer, retrying short writes
+static int write_fully(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+// Parses "file=/var/tmp/htproxy.trace,sample=100", the file is kept for the life of the process
+int parse_trace_config(const char *spec, trace_config_t *config) {
+    char *spec_copy = strdup(spec);
+    if (!spec_copy) {
+        perror("strdup");
+        return -1;
+    }
+
+    config->path = NULL;
+    config->sample = 1;
+
+    char *item = strtok(spec_copy, ",");
+    while (item) {
+        char *value = strchr(item, '=');
+        if (!value || value[1] == '\0') {
+            free(spec_copy);
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (strcasecmp(item, "file") == 0) {
+            config->path = strdup(value);
+            if (!config->path) {
+                perror("strdup");
+                free(spec_copy);
+                return -1;
+            }
+        } else if (strcasecmp(item, "sample") == 0) {
+            char *end;
+            long sample = strtol(value, &end, 10);
+            if (*end != '\0' || sample < 1) {
+                free(spec_copy);
+                return -1;
+            }
+            config->sample = (int) sample;
+        } else {
+            free(spec_copy);
+            return -1;
+        }
+
+        item = strtok(NULL, ",");
+    }
+
+    free(spec_copy);
+    return config->path ? 0 : -1;
+}
+
+// Appends, so a process taking over through an upgrade carries on the same file
+int open_trace_writer(trace_writer_t *writer, const trace_config_t *config) {
+    writer->sample = config->sample;
+    writer->seen = 0;
+    writer->written = 0;
+    writer->count = 0;
+
+    writer->fd = open(config->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (writer->fd == -1) {
+        perror("open trace file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(writer->fd, &st) == -1) {
+        perror("fstat trace file");
+        close(writer->fd);
+        writer->fd = -1;
+        return -1;
+    }
+
+    // An existing file has to be a trace of the same layout
+    if (st.st_size > 0) {
+        if (read_trace_header(writer->fd) == -1) {
+            close(writer->fd);
+            writer->fd = -1;
+            return -1;
+        }
+        return 0;
+    }
+
+    trace_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record_t);
+    if (write_fully(writer->fd, &header, sizeof(header)) == -1) {
+        perror("write trace file");
+        close(writer->fd);
+        writer->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Every sample-th request, so the traced share is exact whatever the traffic pattern
+int trace_sampled(trace_writer_t *writer) {
+    if (writer->fd == -1) {
+        return 0;
+    }
+    return writer->seen++ % writer->sample == 0;
+}
+
+void init_trace_record(trace_record_t *record, uint64_t request_id) {
+    memset(record, 0, sizeof(*record));
+    record->request_id = request_id;
+    for (int i = 0; i < TRACE_STAGE_COUNT; i++) {
+        record->stage_us[i] = TRACE_NOT_REACHED;
+    }
+}
+
+void write_trace_record(trace_writer_t *writer, const trace_record_t *record) {
+    if (writer->fd == -1) {
+        return;
+    }
+
+    writer->buffer[writer->count++] = *record;
+    if (writer->count == TRACE_BUFFER_RECORDS) {
+        flush_trace_writer(writer);
+    }
+}
+
+// A failed write drops the buffered records rather than stalling the loop on them
+int flush_trace_writer(trace_writer_t *writer) {
+    if (writer->fd == -1 || writer->count == 0) {
+        return 0;
+    }
+
+    int rv = write_fully(writer->fd, writer->buffer, writer->count * sizeof(trace_record_t));
+    if (rv == -1) {
+        perror("write trace file");
+    } else {
+        writer->written += writer->count;
+    }
+    writer->count = 0;
+    return rv;
+}
+
+int read_trace_header(int fd) {
+    trace_file_header_t header;
+
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "Not an htproxy trace file\n");
+        return -1;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "Trace file version %u with %u-byte records, expected version %d with %zu\n",
+                header.version, header.record_size, TRACE_VERSION, sizeof(trace_record_t));
+        return -1;
+    }
+    return 0;
+}
+
+long long trace_time_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+long long trace_wall_time_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE // splice, pipe2
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "tunnel.h"
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+void init_tunnel_direction(tunnel_direction_t *direction) {
+    direction->pipe_fds[0] = -1;
+    direction->pipe_fds[1] = -1;
+    direction->pending = 0;
+    direction->eof = 0;
+    direction->shut = 0;
+    direction->bytes = 0;
+}
+
+int open_tunnel_direction(tunnel_direction_t *direction) {
+    if (pipe2(direction->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+
+    return 0;
+}
+
+int prime_tunnel_direction(tunnel_direction_t *direction, const char *data, long length) {
+    while (length > 0) {
+        ssize_t written = write(direction->pipe_fds[1], data, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write to pipe");
+            return -1;
+        }
+        direction->pending += written;
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// Drains the pipe before refilling it, so a refill only ever waits on the source
+int pump_tunnel_direction(tunnel_direction_t *direction, int source_fd, int destination_fd, int *want_read,
+                          int *want_write) {
+    int moved = 0;
+    *want_read = 0;
+    *want_write = 0;
+
+    while (1) {
+        if (direction->pending > 0) {
+            ssize_t bytes = splice(direction->pipe_fds[0], NULL, destination_fd, NULL, direction->pending,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    *want_write = 1;
+                    break;
+                }
+                return -1;
+            }
+            direction->pending -= bytes;
+            direction->bytes += bytes;
+            moved = 1;
+            continue;
+        }
+
+        if (direction->eof) {
+            break;
+        }
+
+        ssize_t bytes = splice(source_fd, NULL, direction->pipe_fds[1], NULL, TUNNEL_CHUNK,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                *want_read = 1;
+                break;
+            }
+            return -1;
+        }
+        if (bytes == 0) {
+            direction->eof = 1;
+            break;
+        }
+        direction->pending += bytes;
+        moved = 1;
+    }
+
+    // Pass the half-close on once everything before it has been delivered
+    if (direction->eof && direction->pending == 0 && !direction->shut) {
+        if (shutdown(destination_fd, SHUT_WR) == -1 && errno != ENOTCONN) {
+            return -1;
+        }
+        direction->shut = 1;
+    }
+
+    return moved;
+}
+
+void free_tunnel_direction(tunnel_direction_t *direction) {
+    for (int i = 0; i < 2; i++) {
+        if (direction->pipe_fds[i] != -1) {
+            close(direction->pipe_fds[i]);
+            direction->pipe_fds[i] = -1;
+        }
+    }
+}
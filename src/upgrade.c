@@ -0,0 +1,159 @@
+#define _GNU_SOURCE // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "upgrade.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Fills in the address of a Unix socket path, returns -1 if the path is too long
+static int upgrade_address(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Upgrade socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+void *create_shared_segment(size_t size, int *fd) {
+    *fd = memfd_create("htproxy-cache", MFD_CLOEXEC);
+    if (*fd == -1) {
+        perror("memfd_create");
+        return NULL;
+    }
+    if (ftruncate(*fd, size) == -1) {
+        perror("ftruncate");
+        close(*fd);
+        return NULL;
+    }
+
+    void *segment = map_shared_segment(*fd, size);
+    if (!segment) {
+        close(*fd);
+    }
+    return segment;
+}
+
+void *map_shared_segment(int fd, size_t size) {
+    void *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return segment;
+}
+
+int open_upgrade_socket(const char *path) {
+    struct sockaddr_un address;
+    if (upgrade_address(path, &address) == -1) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    // Whoever held the path before has either handed over already or is gone
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(fd, 1) == -1) {
+        perror("bind upgrade socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int request_handoff(const char *path, int *listen_fd, int *cache_fd, size_t *cache_size, int *control_fd) {
+    struct sockaddr_un address;
+    if (upgrade_address(path, &address) == -1) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        int rv = errno == ENOENT || errno == ECONNREFUSED ? 1 : -1;
+        if (rv == -1) {
+            perror("connect upgrade socket");
+        }
+        close(fd);
+        return rv;
+    }
+
+    // The header travels with up to two descriptors: the listener, then the cache segment
+    handoff_header_t header;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t bytes;
+    while ((bytes = recvmsg(fd, &message, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    }
+    struct cmsghdr *cmsg = bytes == sizeof(header) ? CMSG_FIRSTHDR(&message) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || header.magic != HANDOFF_MAGIC) {
+        fprintf(stderr, "Bad handoff from %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    int fds[2] = {-1, -1};
+    int fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), (fd_count < 2 ? fd_count : 2) * sizeof(int));
+
+    *listen_fd = fds[0];
+    *cache_fd = header.cache_size > 0 ? fds[1] : -1;
+    *cache_size = header.cache_size;
+    *control_fd = fd;
+    return fds[0] == -1 ? -1 : 0;
+}
+
+int send_handoff(int control_fd, int listen_fd, int cache_fd, size_t cache_size) {
+    int fds[2] = {listen_fd, cache_fd};
+    int fd_count = cache_fd == -1 ? 1 : 2;
+
+    handoff_header_t header = {HANDOFF_MAGIC, cache_fd == -1 ? 0 : cache_size};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+
+    // The accepted socket is non-blocking, but a fresh one has room for this small message
+    if (sendmsg(control_fd, &message, MSG_NOSIGNAL) != sizeof(header)) {
+        perror("sendmsg handoff");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,837 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/time_types.h>
+
+#include "uring.h"
+
+// Operation kinds, kept in uring_op_t.type
+enum {
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CONNECT,
+    URING_OP_POLL,
+    URING_OP_FILES_UPDATE,
+    URING_OP_REPLAY, // No-op whose completion hands held data back to a resumed read
+};
+
+#define URING_IGNORE UINT64_MAX // user_data of cancels, whose completions need no handling
+
+// Operations the backend submits, checked against the kernel's probe at startup
+static const unsigned char required_ops[] = {
+    IORING_OP_ACCEPT,   IORING_OP_RECV,         IORING_OP_SENDMSG,      IORING_OP_CONNECT,
+    IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_FILES_UPDATE,
+};
+
+// ============================== HELPER FUNCTIONS ==============================
+
+static int setup_ring(unsigned int entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int register_ring(int fd, unsigned int opcode, void *arg, unsigned int count) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Publishes the queued entries and submits them, optionally waiting for completions
+static int enter_ring(uring_t *ring, unsigned int min_complete, unsigned int flags, void *arg, size_t arg_size) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned int to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    return (int) syscall(__NR_io_uring_enter, ring->enter_fd, to_submit, min_complete, flags | ring->enter_flags, arg,
+                         arg_size);
+}
+
+static int submit_queued(uring_t *ring) {
+    if (ring->sqe_tail == __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    while (enter_ring(ring, 0, 0, NULL, 0) == -1) {
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Makes sure count entries can be queued back to back, submitting what is queued if not
+static int reserve_sqes(uring_t *ring, unsigned int count) {
+    unsigned int queued = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (queued + count <= ring->sq_entries) {
+        return 0;
+    }
+
+    submit_queued(ring);
+    queued = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (queued + count > ring->sq_entries) {
+        fprintf(stderr, "io_uring submission queue is full\n");
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *get_sqe(uring_t *ring) {
+    if (reserve_sqes(ring, 1) == -1) {
+        return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static int grow_ops(uring_t *ring) {
+    // Queued entries may point at messages and addresses inside the table, so they go out first
+    if (submit_queued(ring) == -1) {
+        return -1;
+    }
+
+    int capacity = ring->op_capacity ? ring->op_capacity * 2 : URING_INIT_OPS;
+    uring_op_t *ops = realloc(ring->ops, capacity * sizeof(uring_op_t));
+    if (!ops) {
+        perror("realloc");
+        return -1;
+    }
+
+    for (int i = ring->op_capacity; i < capacity; i++) {
+        ops[i].next = i + 1 < capacity ? i + 1 : ring->free_ops;
+    }
+    ring->free_ops = ring->op_capacity;
+    ring->ops = ops;
+    ring->op_capacity = capacity;
+
+    return 0;
+}
+
+// Takes a free operation and links it to the watch, so closing the watch can cancel it
+static int alloc_op(uring_t *ring, io_watch_t *watch, int type) {
+    if (ring->free_ops == -1 && grow_ops(ring) == -1) {
+        return -1;
+    }
+
+    int index = ring->free_ops;
+    uring_op_t *op = &ring->ops[index];
+    ring->free_ops = op->next;
+
+    op->watch = watch;
+    op->type = type;
+    op->cancelled = 0;
+    op->prev = -1;
+    op->next = -1;
+    if (watch) {
+        op->next = watch->uring_ops;
+        if (watch->uring_ops != -1) {
+            ring->ops[watch->uring_ops].prev = index;
+        }
+        watch->uring_ops = index;
+    }
+
+    return index;
+}
+
+static void free_op(uring_t *ring, int index) {
+    uring_op_t *op = &ring->ops[index];
+
+    if (op->watch) {
+        if (op->prev != -1) {
+            ring->ops[op->prev].next = op->next;
+        } else {
+            op->watch->uring_ops = op->next;
+        }
+        if (op->next != -1) {
+            ring->ops[op->next].prev = op->prev;
+        }
+    }
+
+    op->watch = NULL;
+    op->next = ring->free_ops;
+    ring->free_ops = index;
+}
+
+// Finds the watch's live operation of a type, ignoring ones already being cancelled
+static int find_op(uring_t *ring, io_watch_t *watch, int type) {
+    for (int index = watch->uring_ops; index != -1; index = ring->ops[index].next) {
+        if (ring->ops[index].type == type && !ring->ops[index].cancelled) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+static void cancel_op(uring_t *ring, int index) {
+    ring->ops[index].cancelled = 1;
+
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) index;
+    sqe->user_data = URING_IGNORE;
+}
+
+// Points slot fd of the registered file table at the descriptor, or empties it for -1
+static void update_file(uring_t *ring, int fd, int value) {
+    int index = alloc_op(ring, NULL, URING_OP_FILES_UPDATE);
+    if (index == -1) {
+        return;
+    }
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        free_op(ring, index);
+        return;
+    }
+
+    ring->ops[index].file = value;
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) &ring->ops[index].file;
+    sqe->len = 1;
+    sqe->off = fd;
+    sqe->user_data = index;
+    ring->files[fd] = value != -1;
+}
+
+// Registers a socket on first use. Entries are issued in queue order, so the update
+// always lands before the operations queued after it.
+static void register_file(uring_t *ring, int fd) {
+    if (ring->files && fd < URING_MAX_FILES && !ring->files[fd]) {
+        update_file(ring, fd, fd);
+    }
+}
+
+static void set_target(uring_t *ring, struct io_uring_sqe *sqe, int fd) {
+    sqe->fd = fd;
+    if (ring->files && fd < URING_MAX_FILES && ring->files[fd]) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+// Queues one operation on the watch's socket, returning its entry for the caller to fill in
+static struct io_uring_sqe *queue_op(uring_t *ring, io_watch_t *watch, int type, unsigned char opcode, int *index) {
+    register_file(ring, watch->fd);
+
+    *index = alloc_op(ring, watch, type);
+    if (*index == -1) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        free_op(ring, *index);
+        return NULL;
+    }
+
+    sqe->opcode = opcode;
+    set_target(ring, sqe, watch->fd);
+    sqe->user_data = *index;
+    return sqe;
+}
+
+// Hands a receive buffer back to the kernel
+static void recycle_buffer(uring_t *ring, unsigned int id) {
+    struct io_uring_buf_ring *buffer_ring = ring->buffer_ring;
+    unsigned short tail = buffer_ring->tail;
+    struct io_uring_buf *buffer = &buffer_ring->bufs[tail & (URING_BUFFER_COUNT - 1)];
+
+    buffer->addr = (uintptr_t) (ring->buffers + (size_t) id * READ_BUFFER_SIZE);
+    buffer->len = READ_BUFFER_SIZE;
+    buffer->bid = id;
+    __atomic_store_n(&buffer_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+static void handle_accept(io_watch_t *watch, int result, int more) {
+    if (result >= 0) {
+        watch->on_accept(watch, result);
+    } else if (result != -ECANCELED) {
+        errno = -result;
+        perror("accept");
+    }
+
+    // The kernel ends a multishot accept on errors, start another
+    if (!more && watch->fd != -1 && watch->accepting) {
+        uring_start_accept(watch);
+    }
+}
+
+// Data a receive delivered after stop_read is kept for the next start_read, in order
+static void hold_recv(io_watch_t *watch, int result, char *buffer) {
+    if (result <= 0) {
+        return; // End of stream and errors are reported again by the next receive
+    }
+    if (watch->reading && watch->uring_held.length == 0) {
+        watch->on_read(watch, buffer, result);
+        return;
+    }
+    if (append_segment_chain(&watch->uring_held, buffer, result) == -1) {
+        fprintf(stderr, "Dropped %d received bytes\n", result);
+    }
+}
+
+// Replays held data through the read callback, then resumes receiving if it is still wanted
+static void handle_replay(io_watch_t *watch) {
+    while (watch->fd != -1 && watch->reading && watch->uring_held.head) {
+        segment_t *segment = pop_segment_chain(&watch->uring_held);
+        watch->on_read(watch, segment->data, segment->length);
+        release_segment(segment);
+    }
+
+    if (watch->fd != -1 && watch->reading) {
+        uring_start_read(watch);
+    }
+}
+
+static void handle_recv(uring_t *ring, io_watch_t *watch, int result, int more, char *buffer) {
+    // Kernels without multishot receives reject the flag, fall back to one receive per operation
+    if (result == -EINVAL && ring->multishot_recv) {
+        ring->multishot_recv = 0;
+        result = -ENOBUFS;
+    }
+
+    // Every provided buffer is in use, ask again once they are handed back
+    if (result == -ENOBUFS) {
+        if (!more && watch->reading) {
+            uring_start_read(watch);
+        }
+        return;
+    }
+
+    if (result <= 0) {
+        watch->reading = 0;
+        watch->on_read(watch, watch->loop->read_buffer, result);
+        return;
+    }
+
+    watch->on_read(watch, buffer, result);
+    if (!more && watch->fd != -1 && watch->reading) {
+        uring_start_read(watch);
+    }
+}
+
+// Called once per linked sendmsg, the write finishes when the last one of the batch is in
+static void handle_send(io_watch_t *watch, int result) {
+    iochain_t *chain = watch->out;
+
+    watch->uring_sends--;
+    if (result > 0 || (result == 0 && chain->pending_bytes == 0)) {
+        advance_iochain(chain, result);
+    } else if (result != -ECANCELED) {
+        // A failed send cancels the ones linked after it, only the failure itself counts
+        watch->uring_send_failed = 1;
+    }
+
+    if (watch->uring_sends > 0) {
+        return;
+    }
+    if (!watch->uring_send_failed && !iochain_empty(chain) && uring_start_write(watch) == 0) {
+        return;
+    }
+
+    int status = watch->uring_send_failed || !iochain_empty(chain) ? -1 : 0;
+    watch->out = NULL;
+    watch->on_write(watch, status);
+}
+
+static void handle_poll(io_watch_t *watch, int result) {
+    watch->uring_poll = 0;
+
+    unsigned int ready = 0;
+    if (result < 0 || (result & (POLLIN | POLLERR | POLLHUP))) {
+        ready |= IO_READABLE;
+    }
+    if (result < 0 || (result & (POLLOUT | POLLERR | POLLHUP))) {
+        ready |= IO_WRITABLE;
+    }
+    if (ready & watch->poll_events) {
+        watch->on_ready(watch, ready & watch->poll_events);
+    }
+
+    // Polls are one-shot, re-arming unless the callback already did keeps them level-triggered
+    if (watch->fd != -1) {
+        uring_update_poll(watch);
+    }
+}
+
+static void handle_completion(uring_t *ring, const struct io_uring_cqe *cqe) {
+    if (cqe->user_data == URING_IGNORE) {
+        return;
+    }
+
+    int index = (int) cqe->user_data;
+    uring_op_t *op = &ring->ops[index];
+    io_watch_t *watch = op->watch;
+    int type = op->type;
+    int cancelled = op->cancelled;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    int buffer_id = cqe->flags & IORING_CQE_F_BUFFER ? (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    char *buffer = buffer_id != -1 ? ring->buffers + (size_t) buffer_id * READ_BUFFER_SIZE : NULL;
+
+    // Retire the operation before its callback, which may start another on the same watch
+    if (!more) {
+        free_op(ring, index);
+    }
+
+    if (type == URING_OP_FILES_UPDATE && cqe->res < 0) {
+        errno = -cqe->res;
+        perror("io_uring files update");
+    }
+
+    // A receive cancelled by stop_read may still have taken data off the socket
+    if (watch && cancelled && type == URING_OP_RECV) {
+        hold_recv(watch, cqe->res, buffer);
+    }
+
+    if (watch && !cancelled) {
+        switch (type) {
+        case URING_OP_ACCEPT:
+            handle_accept(watch, cqe->res, more);
+            break;
+        case URING_OP_RECV:
+            if (watch->reading) {
+                handle_recv(ring, watch, cqe->res, more, buffer);
+            }
+            break;
+        case URING_OP_SEND:
+            handle_send(watch, cqe->res);
+            break;
+        case URING_OP_CONNECT:
+            watch->connecting = 0;
+            watch->on_connect(watch, cqe->res);
+            break;
+        case URING_OP_POLL:
+            handle_poll(watch, cqe->res);
+            break;
+        case URING_OP_REPLAY:
+            handle_replay(watch);
+            break;
+        }
+    }
+
+    // Read callbacks copy what they keep, so the buffer can go straight back
+    if (buffer_id != -1) {
+        recycle_buffer(ring, buffer_id);
+    }
+}
+
+static int map_rings(uring_t *ring, const struct io_uring_params *params) {
+    ring->sq_map_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            perror("mmap");
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned int *) (sq + params->sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params->sq_off.tail);
+    ring->sq_mask = *(unsigned int *) (sq + params->sq_off.ring_mask);
+    ring->sq_entries = params->sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned int *) (cq + params->cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params->cq_off.tail);
+    ring->cq_mask = *(unsigned int *) (cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+
+    // Entries are always queued in slot order, so the indirection array is the identity
+    unsigned int *array = (unsigned int *) (sq + params->sq_off.array);
+    for (unsigned int i = 0; i < params->sq_entries; i++) {
+        array[i] = i;
+    }
+
+    return 0;
+}
+
+static int probe_ops(uring_t *ring) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) {
+        perror("calloc");
+        return -1;
+    }
+
+    int rv = 0;
+    if (register_ring(ring->ring_fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+        perror("io_uring probe");
+        rv = -1;
+    }
+    for (size_t i = 0; rv == 0 && i < sizeof(required_ops); i++) {
+        unsigned char opcode = required_ops[i];
+        if (opcode > probe->last_op || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+            fprintf(stderr, "io_uring lacks operation %d\n", opcode);
+            rv = -1;
+        }
+    }
+
+    free(probe);
+    return rv;
+}
+
+static int setup_buffers(uring_t *ring) {
+    ring->buffer_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->buffer_ring = mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffer_ring == MAP_FAILED) {
+        ring->buffer_ring = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    ring->buffers = malloc((size_t) URING_BUFFER_COUNT * READ_BUFFER_SIZE);
+    if (!ring->buffers) {
+        perror("malloc");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) ring->buffer_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (register_ring(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring buffer ring");
+        return -1;
+    }
+
+    for (unsigned int id = 0; id < URING_BUFFER_COUNT; id++) {
+        recycle_buffer(ring, id);
+    }
+    return 0;
+}
+
+// Optional extras: a sparse registered file table and a registered ring descriptor
+static void register_extras(uring_t *ring) {
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_MAX_FILES;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (register_ring(ring->ring_fd, IORING_REGISTER_FILES2, &files, sizeof(files)) == 0) {
+        ring->files = calloc(URING_MAX_FILES, 1);
+    }
+
+    struct io_uring_rsrc_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = -1U;
+    update.data = ring->ring_fd;
+    if (register_ring(ring->ring_fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+        ring->enter_fd = update.offset;
+        ring->enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+int init_uring(uring_t *ring) {
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+    ring->free_ops = -1;
+    ring->multishot_recv = 1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->ring_fd = setup_ring(URING_ENTRIES, &params);
+
+    // Older kernels reject the newer setup flags, which are only optimizations
+    if (ring->ring_fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring->ring_fd = setup_ring(URING_ENTRIES, &params);
+    }
+    if (ring->ring_fd == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    ring->enter_fd = ring->ring_fd;
+
+    if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring lacks required features\n");
+        free_uring(ring);
+        return -1;
+    }
+
+    if (map_rings(ring, &params) == -1 || probe_ops(ring) == -1 || setup_buffers(ring) == -1 ||
+        grow_ops(ring) == -1) {
+        free_uring(ring);
+        return -1;
+    }
+    register_extras(ring);
+
+    return 0;
+}
+
+void free_uring(uring_t *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->ring_fd != -1) {
+        close(ring->ring_fd);
+    }
+    if (ring->buffer_ring) {
+        munmap(ring->buffer_ring, ring->buffer_ring_size);
+    }
+    free(ring->buffers);
+    free(ring->files);
+    free(ring->ops);
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+}
+
+int uring_start_accept(io_watch_t *watch) {
+    int index;
+    struct io_uring_sqe *sqe = queue_op(watch->loop->uring, watch, URING_OP_ACCEPT, IORING_OP_ACCEPT, &index);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    return 0;
+}
+
+int uring_start_read(io_watch_t *watch) {
+    uring_t *ring = watch->loop->uring;
+    if (find_op(ring, watch, URING_OP_RECV) != -1 || find_op(ring, watch, URING_OP_REPLAY) != -1) {
+        return 0;
+    }
+
+    // Held data goes first, from a completion so the callback never runs inside start_read
+    int index;
+    struct io_uring_sqe *sqe;
+    if (watch->uring_held.head) {
+        if (!(sqe = queue_op(ring, watch, URING_OP_REPLAY, IORING_OP_NOP, &index))) {
+            return -1;
+        }
+        sqe->flags = 0;
+        sqe->fd = -1;
+        return 0;
+    }
+
+    sqe = queue_op(ring, watch, URING_OP_RECV, IORING_OP_RECV, &index);
+    if (!sqe) {
+        return -1;
+    }
+
+    // The kernel picks a buffer from the group once data arrives, so idle sockets hold none
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    if (ring->multishot_recv) {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+    return 0;
+}
+
+void uring_stop_read(io_watch_t *watch) {
+    uring_t *ring = watch->loop->uring;
+    int index = find_op(ring, watch, URING_OP_RECV);
+    if (index != -1) {
+        cancel_op(ring, index);
+    }
+}
+
+// Splits the chain over linked sendmsg operations. MSG_WAITALL makes each one send all
+// of its iovecs or fail, and a failure cancels the rest, so bytes never go out of order.
+int uring_start_write(io_watch_t *watch) {
+    uring_t *ring = watch->loop->uring;
+    iochain_t *chain = watch->out;
+
+    int live = chain->count - chain->head;
+    int links = (live + IOCHAIN_SEND_MAX - 1) / IOCHAIN_SEND_MAX;
+    if (links == 0) {
+        links = 1;
+    } else if (links > URING_SEND_LINKS) {
+        links = URING_SEND_LINKS;
+    }
+
+    register_file(ring, watch->fd);
+
+    int indexes[URING_SEND_LINKS];
+    for (int i = 0; i < links; i++) {
+        indexes[i] = alloc_op(ring, watch, URING_OP_SEND);
+        if (indexes[i] == -1) {
+            while (--i >= 0) {
+                free_op(ring, indexes[i]);
+            }
+            return -1;
+        }
+    }
+    if (reserve_sqes(ring, links) == -1) {
+        for (int i = 0; i < links; i++) {
+            free_op(ring, indexes[i]);
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < links; i++) {
+        uring_op_t *op = &ring->ops[indexes[i]];
+        int first = chain->head + i * IOCHAIN_SEND_MAX;
+        int count = chain->count - first < IOCHAIN_SEND_MAX ? chain->count - first : IOCHAIN_SEND_MAX;
+
+        memset(&op->message, 0, sizeof(op->message));
+        op->message.msg_iov = chain->iov + first;
+        op->message.msg_iovlen = count;
+
+        struct io_uring_sqe *sqe = get_sqe(ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        set_target(ring, sqe, watch->fd);
+        sqe->addr = (uintptr_t) &op->message;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = indexes[i];
+        if (i < links - 1) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+    }
+
+    watch->uring_sends = links;
+    watch->uring_send_failed = 0;
+    return 0;
+}
+
+int uring_start_connect(io_watch_t *watch, const struct sockaddr *address, socklen_t address_length) {
+    uring_t *ring = watch->loop->uring;
+    if (address_length > sizeof(struct sockaddr_storage)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int index;
+    struct io_uring_sqe *sqe = queue_op(ring, watch, URING_OP_CONNECT, IORING_OP_CONNECT, &index);
+    if (!sqe) {
+        return -1;
+    }
+
+    // The kernel copies the address when the entry is submitted
+    memcpy(&ring->ops[index].address, address, address_length);
+    sqe->addr = (uintptr_t) &ring->ops[index].address;
+    sqe->off = address_length;
+    return 0;
+}
+
+int uring_update_poll(io_watch_t *watch) {
+    uring_t *ring = watch->loop->uring;
+    if (watch->uring_poll == watch->poll_events) {
+        return 0;
+    }
+
+    int armed = find_op(ring, watch, URING_OP_POLL);
+    if (armed != -1) {
+        cancel_op(ring, armed);
+    }
+    watch->uring_poll = 0;
+    if (watch->poll_events == 0) {
+        return 0;
+    }
+
+    int index;
+    struct io_uring_sqe *sqe = queue_op(ring, watch, URING_OP_POLL, IORING_OP_POLL_ADD, &index);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->poll32_events = ((watch->poll_events & IO_READABLE) ? POLLIN : 0) |
+                         ((watch->poll_events & IO_WRITABLE) ? POLLOUT : 0);
+    watch->uring_poll = watch->poll_events;
+    return 0;
+}
+
+void uring_close_watch(io_watch_t *watch) {
+    uring_t *ring = watch->loop->uring;
+
+    // Orphan the operations first: their completions may still arrive after the owner is freed
+    int index = watch->uring_ops;
+    while (index != -1) {
+        uring_op_t *op = &ring->ops[index];
+        int next = op->next;
+        op->watch = NULL;
+        op->prev = -1;
+        op->next = -1;
+        cancel_op(ring, index);
+        index = next;
+    }
+    watch->uring_ops = -1;
+    watch->uring_sends = 0;
+    watch->uring_poll = 0;
+    free_segment_chain(&watch->uring_held);
+
+    // The table holds its own reference, the socket only really closes once it is dropped
+    if (ring->files && watch->fd < URING_MAX_FILES && ring->files[watch->fd]) {
+        update_file(ring, watch->fd, -1);
+    }
+}
+
+void uring_wait(uring_t *ring, int timeout) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+        arg.ts = (uintptr_t) &ts;
+    }
+
+    // One system call submits everything queued last round and waits for the next completions
+    if (enter_ring(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY) {
+        perror("io_uring_enter");
+    }
+
+    // Completions posted while dispatching wait for the next round, after the timers have run
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        handle_completion(ring, &cqe);
+    }
+}
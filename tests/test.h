@@ -0,0 +1,57 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include "iochain.h"
+
+// Checks run and failed by the test binary including this header
+static int checks_run;
+static int checks_failed;
+
+/**
+ * Records one check, printing the condition and where it is if it does not hold.
+ */
+#define CHECK(condition)                                                                 \
+    do {                                                                                 \
+        checks_run++;                                                                    \
+        if (!(condition)) {                                                              \
+            checks_failed++;                                                             \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        }                                                                                \
+    } while (0)
+
+/**
+ * Copies everything queued on a chain into one NUL-terminated buffer.
+ * @param chain Pointer to the chain.
+ * @param out Buffer to write to.
+ * @param out_size Size of out.
+ * @return Number of bytes copied, or -1 if out is too small.
+ */
+static inline int flatten_iochain(const iochain_t *chain, char *out, int out_size) {
+    int written = 0;
+
+    for (int i = chain->head; i < chain->count; i++) {
+        if (written + (int) chain->iov[i].iov_len >= out_size) {
+            return -1;
+        }
+        memcpy(out + written, chain->iov[i].iov_base, chain->iov[i].iov_len);
+        written += chain->iov[i].iov_len;
+    }
+    out[written] = '\0';
+
+    return written;
+}
+
+/**
+ * Prints the totals of a test binary.
+ * @param name Name of the tested module.
+ * @return Exit status for main, 0 if every check held.
+ */
+static inline int finish_tests(const char *name) {
+    printf("%s: %d checks, %d failed\n", name, checks_run, checks_failed);
+    return checks_failed > 0;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+#include "http.h"
+#include "proxy.h"
+#include "test.h"
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Checks that request normalizes to expected, or fails to when expected is NULL
+static int key_is(const char *request, const char *expected) {
+    char key[REQUEST_SIZE + 1];
+
+    if (normalize_cache_key(request, key, sizeof(key)) == -1) {
+        return expected == NULL;
+    }
+    if (!expected || strcmp(key, expected) != 0) {
+        fprintf(stderr, "key of %.40s... is %s\n", request, key);
+        return 0;
+    }
+    return 1;
+}
+
+// ============================== TESTS ==============================
+
+// Scheme, lowercased host, explicit port and path+query make the key, headers do not
+static void test_normalize_cache_key(void) {
+    CHECK(key_is("GET http://Example.COM/a?b=1 HTTP/1.1\r\nHost: example.com\r\n\r\n",
+                 "GET http://example.com:80/a?b=1"));
+    CHECK(key_is("GET /p HTTP/1.1\r\nHost: Example.com:8080\r\nUser-Agent: one\r\n\r\n",
+                 "GET http://example.com:8080/p"));
+    CHECK(key_is("GET /p HTTP/1.1\r\nCookie: a=b\r\nUser-Agent: two\r\nHost: example.com:8080\r\n\r\n",
+                 "GET http://example.com:8080/p"));
+    CHECK(key_is("GET http://example.com/p#section HTTP/1.1\r\n\r\n", "GET http://example.com:80/p"));
+    CHECK(key_is("GET http://example.com HTTP/1.1\r\n\r\n", "GET http://example.com:80/"));
+    CHECK(key_is("GET http://example.com?q=1 HTTP/1.1\r\n\r\n", "GET http://example.com:80/?q=1"));
+    CHECK(key_is("GET http://example.com:/p HTTP/1.1\r\n\r\n", "GET http://example.com:80/p"));
+    CHECK(key_is("GET http://[::1]:8080/p HTTP/1.1\r\n\r\n", "GET http://[::1]:8080/p"));
+    CHECK(key_is("GET http://[::1]/p HTTP/1.1\r\n\r\n", "GET http://[::1]:80/p"));
+}
+
+// Other methods, missing hosts and targets that are not URLs are never cached
+static void test_uncacheable_requests(void) {
+    char key[32];
+
+    CHECK(key_is("POST http://example.com/p HTTP/1.1\r\n\r\n", NULL));
+    CHECK(key_is("HEAD /p HTTP/1.1\r\nHost: example.com\r\n\r\n", NULL));
+    CHECK(key_is("GET /p HTTP/1.1\r\nAccept: */*\r\n\r\n", NULL));
+    CHECK(key_is("GET * HTTP/1.1\r\nHost: example.com\r\n\r\n", NULL));
+    CHECK(key_is("GET http:///p HTTP/1.1\r\n\r\n", NULL));
+    CHECK(normalize_cache_key("GET http://example.com/a/rather/long/path HTTP/1.1\r\n\r\n", key, sizeof(key)) == -1);
+}
+
+// Regression: an absolute-form target and a Host header naming another origin must not
+// be cached under the target while the request goes to the Host header's origin
+static void test_absolute_form_host_mismatch(void) {
+    const char *request = "GET http://a.test:9011/x HTTP/1.1\r\nHost: b.test:9012\r\nAccept: */*\r\n\r\n";
+    char key[REQUEST_SIZE + 1], rewritten_key[REQUEST_SIZE + 1], rewritten[512];
+
+    CHECK(normalize_cache_key(request, key, sizeof(key)) == 0);
+    CHECK(strcmp(key, "GET http://a.test:9011/x") == 0);
+
+    int length;
+    const char *uri = extract_request_uri(request, &length);
+    const char *authority = uri + strlen("http://");
+    int authority_length = strcspn(authority, "/?#");
+    CHECK(replace_host_header(request, authority, authority_length, rewritten, sizeof(rewritten)) ==
+          (int) strlen(rewritten));
+    CHECK(strcmp(rewritten, "GET http://a.test:9011/x HTTP/1.1\r\nHost: a.test:9011\r\nAccept: */*\r\n\r\n") == 0);
+
+    // What is dialed and forwarded now names the origin the response is cached for
+    const char *host = extract_host(rewritten, &length);
+    CHECK(host && length == authority_length && strncmp(host, "a.test:9011", length) == 0);
+    CHECK(strstr(rewritten, "b.test") == NULL);
+    CHECK(normalize_cache_key(rewritten, rewritten_key, sizeof(rewritten_key)) == 0);
+    CHECK(strcmp(rewritten_key, key) == 0);
+}
+
+// A request without headers gains a Host line, a body after the header block is kept
+static void test_replace_host_header(void) {
+    char out[256];
+
+    CHECK(replace_host_header("GET http://a.test/ HTTP/1.1\r\n\r\n", "a.test", 6, out, sizeof(out)) != -1);
+    CHECK(strcmp(out, "GET http://a.test/ HTTP/1.1\r\nHost: a.test\r\n\r\n") == 0);
+
+    const char *post = "POST http://a.test/ HTTP/1.1\r\nhost: b\r\nContent-Length: 2\r\n\r\nhi";
+    CHECK(replace_host_header(post, "a.test", 6, out, sizeof(out)) != -1);
+    CHECK(strcmp(out, "POST http://a.test/ HTTP/1.1\r\nHost: a.test\r\nContent-Length: 2\r\n\r\nhi") == 0);
+
+    CHECK(replace_host_header("GET http://a.test/ HTTP/1.1\r\n\r\n", "a.test", 6, out, 20) == -1);
+    CHECK(replace_host_header("GET http://a.test/ HTTP/1.1\r\n", "a.test", 6, out, sizeof(out)) == -1);
+}
+
+int main(void) {
+    test_normalize_cache_key();
+    test_uncacheable_requests();
+    test_absolute_form_host_mismatch();
+    test_replace_host_header();
+    return finish_tests("cache_key");
+}
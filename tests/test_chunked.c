@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+#include "iochain.h"
+#include "segment.h"
+#include "test.h"
+
+static cache_t cache;
+static segment_chain_t scratch;
+
+static const char *origin_headers = "HTTP/1.1 200 OK\r\nContent-Length: 8\r\nAge: 3\r\n\r\n";
+
+// A reader that counts how often the fill woke it
+typedef struct {
+    cache_reader_t reader;
+    int wakeups;
+} test_reader_t;
+
+// ============================== HELPER FUNCTIONS ==============================
+
+static void on_test_chunks(cache_reader_t *reader) {
+    test_reader_t *test_reader = reader->data;
+    test_reader->wakeups++;
+}
+
+// Appends the next bytes of the fill as one chunk
+static void append_chunk(int index, const char *data) {
+    segment_t *chunk = alloc_segment();
+    chunk->length = strlen(data);
+    memcpy(chunk->data, data, chunk->length);
+    chunk->data[chunk->length] = '\0';
+
+    append_cache_chunk(&cache, index, chunk);
+}
+
+// Starts a fill of origin_headers and attaches a reader to it
+static int start_fill(const char *key, test_reader_t *reader) {
+    int index = start_chunked_entry(&cache, key, NULL, origin_headers);
+
+    reader->wakeups = 0;
+    reader->reader.index = -1;
+    reader->reader.on_chunks = on_test_chunks;
+    reader->reader.data = reader;
+    if (index != -1) {
+        add_cache_reader(&cache, index, &reader->reader);
+    }
+
+    return index;
+}
+
+// ============================== TESTS ==============================
+
+// A complete fill is served as the stored header block, a fresh Age, then the body
+static void test_fill_and_serve(void) {
+    test_reader_t reader;
+    iochain_t out;
+    char sent[512];
+
+    init_cache(&cache, CACHE_POLICY_LRU);
+    int index = start_fill("GET http://example.com:80/big", &reader);
+    CHECK(index != -1);
+    CHECK(cache.entries[index].pins == 2 && cache.entries[index].filling);
+
+    append_chunk(index, "HTTP/1.1 200 OK\r\nContent-Length: 8\r\nAge: 3\r\n\r\nabcd");
+    CHECK(reader.wakeups == 1);
+    init_iochain(&out);
+    init_segment_chain(&scratch);
+    CHECK(serve_cache_chunks(&out, &scratch, &cache, &reader.reader, -1) == 0);
+
+    append_chunk(index, "efgh");
+    finish_chunked_entry(&cache, index, 1);
+    CHECK(serve_cache_chunks(&out, &scratch, &cache, &reader.reader, -1) == 1);
+    CHECK(flatten_iochain(&out, sent, sizeof(sent)) != -1);
+    CHECK(strncmp(sent, "HTTP/1.1 200 OK\r\nContent-Length: 8\r\nAge: ", 41) == 0);
+    CHECK(strstr(strstr(sent, "Age: ") + 1, "Age: ") == NULL);
+    CHECK(strcmp(strstr(sent, "\r\n\r\n"), "\r\n\r\nabcdefgh") == 0);
+
+    remove_cache_reader(&cache, &reader.reader);
+    CHECK(cache.entries[index].valid && cache.entries[index].pins == 0);
+    CHECK(cache.stored_bytes == cache.entries[index].response_size);
+    free_iochain(&out);
+    free_segment_chain(&scratch);
+    evict_cache_entry(&cache, index);
+}
+
+// Regression: evicting an entry while it fills must keep its header block and sizes for
+// the filler and readers still using them, and free the slot only after the last pin
+static void test_evict_while_filling(void) {
+    test_reader_t reader;
+    iochain_t out;
+    char sent[512];
+
+    init_cache(&cache, CACHE_POLICY_LRU);
+    int index = start_fill("GET http://example.com:80/big", &reader);
+    append_chunk(index, "HTTP/1.1 200 OK\r\nContent-Length: 8\r\nAge: 3\r\n\r\nabcd");
+    init_iochain(&out);
+    init_segment_chain(&scratch);
+    CHECK(serve_cache_chunks(&out, &scratch, &cache, &reader.reader, -1) == 0);
+
+    int header_size = cache.entries[index].header_size;
+    int identity_header_size = cache.entries[index].identity_header_size;
+    int response_size = cache.entries[index].response_size;
+    evict_cache_entry(&cache, index);
+
+    CHECK(!cache.entries[index].valid);
+    CHECK(search_cache_hit(&cache, "GET http://example.com:80/big", NULL) == -1);
+    CHECK(cache.entries[index].header_size == header_size && header_size >= 2);
+    CHECK(cache.entries[index].identity_header_size == identity_header_size);
+    CHECK(cache.entries[index].response_size == response_size);
+    CHECK(cache.entries[index].headers[0] != '\0');
+    CHECK(cache.stored_bytes == 0 && cache.identity_bytes == 0);
+    CHECK(find_invalid_entry(&cache) != index);
+
+    // The rest of the fill still reaches the reader, but no longer counts as stored
+    append_chunk(index, "efgh");
+    CHECK(cache.entries[index].response_size == response_size + 4);
+    CHECK(cache.stored_bytes == 0);
+    finish_chunked_entry(&cache, index, 1);
+    CHECK(serve_cache_chunks(&out, &scratch, &cache, &reader.reader, -1) == 1);
+    CHECK(flatten_iochain(&out, sent, sizeof(sent)) != -1);
+    CHECK(strcmp(strstr(sent, "\r\n\r\n"), "\r\n\r\nabcdefgh") == 0);
+    free_iochain(&out);
+    free_segment_chain(&scratch);
+
+    // The reader's pin is the last, dropping it frees the response and the slot
+    remove_cache_reader(&cache, &reader.reader);
+    CHECK(cache.entries[index].pins == 0);
+    CHECK(cache.entries[index].response_size == -1 && cache.entries[index].header_size == 0);
+    CHECK(!cache.entries[index].chunked);
+    CHECK(find_invalid_entry(&cache) == index);
+}
+
+// A fill cut short evicts the entry and its readers see it fail
+static void test_failed_fill(void) {
+    test_reader_t reader;
+    iochain_t out;
+
+    init_cache(&cache, CACHE_POLICY_LRU);
+    int index = start_fill("GET http://example.com:80/big", &reader);
+    append_chunk(index, "HTTP/1.1 200 OK\r\nContent-Length: 8\r\nAge: 3\r\n\r\nab");
+    finish_chunked_entry(&cache, index, 0);
+
+    CHECK(!cache.entries[index].valid);
+    CHECK(reader.wakeups == 2);
+    init_iochain(&out);
+    init_segment_chain(&scratch);
+    CHECK(serve_cache_chunks(&out, &scratch, &cache, &reader.reader, -1) == -1);
+    remove_cache_reader(&cache, &reader.reader);
+    CHECK(find_invalid_entry(&cache) == index);
+    free_iochain(&out);
+    free_segment_chain(&scratch);
+}
+
+// Regression: a fill admitted while every window entry is pinned leaves the window over
+// capacity instead of moving a non-existent entry, the next admission catches up
+static void test_overlapping_fills(void) {
+    test_reader_t first, second, third;
+
+    init_cache(&cache, CACHE_POLICY_WTINYLFU);
+    int first_index = start_fill("GET http://example.com:80/first", &first);
+    int second_index = start_fill("GET http://example.com:80/second", &second);
+    CHECK(first_index != -1 && second_index != -1);
+    CHECK(cache.entries[first_index].segment == SEGMENT_WINDOW);
+    CHECK(cache.entries[second_index].segment == SEGMENT_WINDOW);
+
+    // Once the first fill is done and released it is the window's overflow
+    append_chunk(first_index, "HTTP/1.1 200 OK\r\nContent-Length: 8\r\nAge: 3\r\n\r\nabcdefgh");
+    finish_chunked_entry(&cache, first_index, 1);
+    remove_cache_reader(&cache, &first.reader);
+    int third_index = start_fill("GET http://example.com:80/third", &third);
+    CHECK(third_index != -1);
+    CHECK(cache.entries[first_index].segment == SEGMENT_PROBATION);
+    CHECK(cache.entries[second_index].segment == SEGMENT_WINDOW);
+    CHECK(cache.entries[third_index].segment == SEGMENT_WINDOW);
+
+    finish_chunked_entry(&cache, second_index, 0);
+    finish_chunked_entry(&cache, third_index, 0);
+    remove_cache_reader(&cache, &second.reader);
+    remove_cache_reader(&cache, &third.reader);
+    evict_cache_entry(&cache, first_index);
+}
+
+int main(void) {
+    test_fill_and_serve();
+    test_evict_while_filling();
+    test_failed_fill();
+    test_overlapping_fills();
+    return finish_tests("chunked");
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+
+#include "cluster.h"
+#include "test.h"
+
+#define KEY_COUNT 3000
+
+static cluster_t cluster;
+static cluster_t other;
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Writes the i-th test key into key
+static void test_key(int i, char *key, int key_size) {
+    snprintf(key, key_size, "GET http://example.com:80/objects/%d", i);
+}
+
+// ============================== TESTS ==============================
+
+// Every node is found, self must be one of them, malformed lists are refused
+static void test_parse_cluster(void) {
+    CHECK(parse_cluster("127.0.0.1:8001,127.0.0.1:8002,127.0.0.1:8003", "127.0.0.1:8002", &cluster) == 0);
+    CHECK(cluster.node_count == 3 && cluster.self == 1);
+    CHECK(cluster.ring_size == 3 * CLUSTER_POINTS);
+    int unsorted = 0;
+    for (int i = 1; i < cluster.ring_size; i++) {
+        unsorted += cluster.ring[i - 1].hash > cluster.ring[i].hash;
+    }
+    CHECK(unsorted == 0);
+
+    CHECK(parse_cluster("127.0.0.1:8001,127.0.0.1:8002", "127.0.0.1:8003", &cluster) == -1);
+    CHECK(parse_cluster("127.0.0.1:8001,localhost", "127.0.0.1:8001", &cluster) == -1);
+
+    char nodes[CLUSTER_MAX_NODES * 16 + 32] = "";
+    int length = 0;
+    for (int i = 0; i <= CLUSTER_MAX_NODES; i++) {
+        length += snprintf(nodes + length, sizeof(nodes) - length, "%s10.0.0.1:%d", i ? "," : "", 8000 + i);
+    }
+    CHECK(parse_cluster(nodes, "10.0.0.1:8000", &cluster) == -1);
+}
+
+// Every node agrees on the owners, and the keys are spread over all of them
+static void test_owners_agree(void) {
+    const char *nodes = "127.0.0.1:8001,127.0.0.1:8002,127.0.0.1:8003";
+    char key[64];
+    int owned[3] = {0, 0, 0};
+    int disagreements = 0;
+
+    CHECK(parse_cluster(nodes, "127.0.0.1:8001", &cluster) == 0);
+    CHECK(parse_cluster(nodes, "127.0.0.1:8003", &other) == 0);
+    for (int i = 0; i < KEY_COUNT; i++) {
+        test_key(i, key, sizeof(key));
+        int owner = cluster_owner(&cluster, key);
+        disagreements += owner != cluster_owner(&other, key);
+        if (owner >= 0 && owner < 3) {
+            owned[owner]++;
+        }
+    }
+
+    CHECK(disagreements == 0);
+    for (int node = 0; node < 3; node++) {
+        CHECK(owned[node] > KEY_COUNT / 6 && owned[node] < KEY_COUNT * 2 / 3);
+    }
+
+    CHECK(parse_cluster("127.0.0.1:8001", "127.0.0.1:8001", &cluster) == 0);
+    CHECK(cluster_owner(&cluster, "GET http://example.com:80/") == 0);
+}
+
+// A node joining only takes keys over, none move between the nodes that were there
+static void test_node_added(void) {
+    char key[64];
+    int moved = 0, misplaced = 0;
+
+    CHECK(parse_cluster("127.0.0.1:8001,127.0.0.1:8002,127.0.0.1:8003", "127.0.0.1:8001", &cluster) == 0);
+    CHECK(parse_cluster("127.0.0.1:8001,127.0.0.1:8002,127.0.0.1:8003,127.0.0.1:8004", "127.0.0.1:8001", &other) ==
+          0);
+    for (int i = 0; i < KEY_COUNT; i++) {
+        test_key(i, key, sizeof(key));
+        int before = cluster_owner(&cluster, key);
+        int after = cluster_owner(&other, key);
+        if (before != after) {
+            moved++;
+            misplaced += after != 3;
+        }
+    }
+
+    CHECK(misplaced == 0);
+    CHECK(moved > KEY_COUNT / 8 && moved < KEY_COUNT / 2);
+}
+
+// Only the other nodes' addresses count as peers, never this proxy's own
+static void test_cluster_peers(void) {
+    CHECK(parse_cluster("127.0.0.2:8001,127.0.0.3:8002,[::1]:8003", "127.0.0.2:8001", &cluster) == 0);
+    CHECK(resolve_cluster_peers(&cluster) == 0);
+    CHECK(is_cluster_peer(&cluster, "127.0.0.3") == 1);
+    CHECK(is_cluster_peer(&cluster, "::1") == 1);
+    CHECK(is_cluster_peer(&cluster, "127.0.0.2") == 0);
+    CHECK(is_cluster_peer(&cluster, "127.0.0.1") == 0);
+}
+
+int main(void) {
+    test_parse_cluster();
+    test_owners_agree();
+    test_node_added();
+    test_cluster_peers();
+    return finish_tests("cluster");
+}
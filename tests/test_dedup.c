@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+#include "http.h"
+#include "iochain.h"
+#include "test.h"
+
+static cache_t cache;
+static segment_chain_t scratch;
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Stores a 200 response with the given body and one header of its own under key
+static int add_response(const char *key, const char *body) {
+    char response[256];
+    int size = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nX-Key: %s\r\n\r\n%s",
+                        (int) strlen(body), key, body);
+    struct iovec iov = {response, size};
+
+    return add_cache_entry(&cache, key, NULL, &iov, 1, size);
+}
+
+// Bytes an entry holds besides its body
+static long header_bytes(int index) {
+    return cache.entries[index].header_size;
+}
+
+// ============================== TESTS ==============================
+
+// Identical bodies are stored once and counted once, each entry keeps its own headers
+static void test_shared_body(void) {
+    const char *body = "shared body bytes";
+    long body_size = strlen(body);
+
+    init_cache(&cache, CACHE_POLICY_LRU);
+    int first = add_response("GET http://example.com:80/a", body);
+    int second = add_response("GET http://mirror.example.com:80/a", body);
+    int third = add_response("GET http://example.com:80/c", "another body");
+    CHECK(first != -1 && second != -1 && third != -1);
+
+    int shared = cache.entries[first].body;
+    CHECK(shared != -1 && cache.entries[second].body == shared);
+    CHECK(cache.entries[third].body != shared);
+    CHECK(cache.bodies[shared].refs == 2 && cache.bodies[shared].valid_refs == 2);
+    CHECK(cache.deduped_bytes == body_size);
+    CHECK(cache.stored_bytes ==
+          header_bytes(first) + header_bytes(second) + body_size + cache.entries[third].response_size);
+    CHECK(cache.identity_bytes == cache.entries[first].identity_size + cache.entries[second].identity_size +
+                                      cache.entries[third].identity_size);
+
+    // Each hit still sends its own header block in front of the one body
+    iochain_t out;
+    char sent[512];
+    init_iochain(&out);
+    init_segment_chain(&scratch);
+    CHECK(serve_from_cache(&out, &scratch, &cache, second, 0) == 0);
+    CHECK(flatten_iochain(&out, sent, sizeof(sent)) != -1);
+
+    // The Age line between them is held in the scratch segment, not allocated
+    CHECK(out.count == 3 && out.segments[1] == scratch.tail && !out.owned[1]);
+    CHECK(strstr(sent, "X-Key: GET http://mirror.example.com:80/a\r\n") != NULL);
+    CHECK(strcmp(strstr(sent, "\r\n\r\n") + 4, body) == 0);
+    free_iochain(&out);
+    free_segment_chain(&scratch);
+    unpin_cache_entry(&cache, second);
+
+    // Evicting one sharer leaves the body to the other, now counted in full again
+    evict_cache_entry(&cache, first);
+    CHECK(cache.bodies[shared].refs == 1 && cache.bodies[shared].valid_refs == 1);
+    CHECK(cache.deduped_bytes == 0);
+    CHECK(cache.stored_bytes == cache.entries[second].response_size + cache.entries[third].response_size);
+
+    evict_cache_entry(&cache, second);
+    CHECK(cache.bodies[shared].refs == 0);
+    CHECK(cache.stored_bytes == cache.entries[third].response_size);
+}
+
+// A body kept only for a send in flight is not shared again, and is freed after the last pin
+static void test_pinned_body(void) {
+    const char *body = "body still being sent";
+
+    init_cache(&cache, CACHE_POLICY_LRU);
+    int sending = add_response("GET http://example.com:80/a", body);
+    int shared = cache.entries[sending].body;
+    pin_cache_entry(&cache, sending);
+    evict_cache_entry(&cache, sending);
+    CHECK(cache.bodies[shared].refs == 1 && cache.bodies[shared].valid_refs == 0);
+    CHECK(cache.stored_bytes == 0 && cache.identity_bytes == 0);
+    CHECK(find_invalid_entry(&cache) != sending);
+
+    int fresh = add_response("GET http://example.com:80/a", body);
+    CHECK(fresh != -1 && fresh != sending);
+    CHECK(cache.entries[fresh].body != shared);
+    CHECK(cache.deduped_bytes == 0);
+
+    unpin_cache_entry(&cache, sending);
+    CHECK(cache.bodies[shared].refs == 0);
+    CHECK(cache.entries[sending].body == -1 && cache.entries[sending].response_size == -1);
+    CHECK(cache.bodies[cache.entries[fresh].body].refs == 1);
+}
+
+// The shared FNV-1a hash matches the published vectors, and pieces hash like the whole
+static void test_hash_bytes(void) {
+    CHECK(hash_bytes(FNV_OFFSET_BASIS, "", 0) == FNV_OFFSET_BASIS);
+    CHECK(hash_bytes(FNV_OFFSET_BASIS, "a", 1) == 0xaf63dc4c8601ec8cULL);
+    CHECK(hash_bytes(FNV_OFFSET_BASIS, "foobar", 6) == 0x85944171f73967e8ULL);
+    CHECK(hash_bytes(hash_bytes(FNV_OFFSET_BASIS, "foo", 3), "bar", 3) == 0x85944171f73967e8ULL);
+}
+
+int main(void) {
+    test_hash_bytes();
+    test_shared_body();
+    test_pinned_body();
+    return finish_tests("dedup");
+}
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "admission.h"
+#include "drr.h"
+#include "test.h"
+
+static drr_scheduler_t scheduler;
+static client_table_t clients;
+
+// A waiter after a fixed amount, queueing again until it has it all
+typedef struct {
+    drr_waiter_t waiter;
+    drr_flow_t *flow;
+    long want;
+    long got;
+    long overspend; // Used on top of each grant, as a send may go a little over
+    int grants;
+} test_waiter_t;
+
+// ============================== HELPER FUNCTIONS ==============================
+
+static long on_test_grant(drr_waiter_t *waiter, long allowance) {
+    test_waiter_t *test_waiter = waiter->data;
+    long left = test_waiter->want - test_waiter->got;
+    long used = (allowance < left ? allowance : left) + test_waiter->overspend;
+
+    test_waiter->got += used;
+    test_waiter->grants++;
+    if (test_waiter->got < test_waiter->want) {
+        drr_wait(&scheduler, test_waiter->flow, waiter);
+    }
+    return used;
+}
+
+// Queues a waiter after want on flow
+static void queue_waiter(test_waiter_t *waiter, drr_flow_t *flow, long want) {
+    init_drr_waiter(&waiter->waiter, on_test_grant, waiter);
+    waiter->flow = flow;
+    waiter->want = want;
+    waiter->got = 0;
+    waiter->overspend = 0;
+    waiter->grants = 0;
+    drr_wait(&scheduler, flow, &waiter->waiter);
+}
+
+// ============================== TESTS ==============================
+
+// A flow with many waiters gets the same share per round as a flow with one
+static void test_fair_shares(void) {
+    drr_flow_t busy, single;
+    test_waiter_t many[3], one;
+
+    init_drr_scheduler(&scheduler, 100);
+    init_drr_flow(&busy);
+    init_drr_flow(&single);
+    for (int i = 0; i < 3; i++) {
+        queue_waiter(&many[i], &busy, 100);
+    }
+    queue_waiter(&one, &single, 300);
+
+    CHECK(run_drr(&scheduler, 200) == 0);
+    CHECK(many[0].got + many[1].got + many[2].got == 100);
+    CHECK(one.got == 100);
+
+    CHECK(run_drr(&scheduler, 400) == 0);
+    CHECK(many[0].got + many[1].got + many[2].got == 300);
+    CHECK(one.got == 300);
+    CHECK(!drr_backlogged(&scheduler));
+}
+
+// Fetch slots are a quantum of one: each client gets a slot in turn, whatever it queued
+static void test_fetch_slots(void) {
+    drr_flow_t greedy, modest;
+    test_waiter_t greedy_fetches[5], modest_fetch;
+
+    init_drr_scheduler(&scheduler, 1);
+    init_drr_flow(&greedy);
+    init_drr_flow(&modest);
+    for (int i = 0; i < 5; i++) {
+        queue_waiter(&greedy_fetches[i], &greedy, 1);
+    }
+    queue_waiter(&modest_fetch, &modest, 1);
+
+    CHECK(run_drr(&scheduler, 2) == 0);
+    CHECK(greedy_fetches[0].grants == 1 && greedy_fetches[1].grants == 0);
+    CHECK(modest_fetch.grants == 1);
+    CHECK(greedy.count == 4 && modest.count == 0);
+}
+
+// Budget a flow leaves unused comes back, and a flow without waiters leaves the ring
+static void test_unused_budget(void) {
+    drr_flow_t flow;
+    test_waiter_t small;
+
+    init_drr_scheduler(&scheduler, 100);
+    init_drr_flow(&flow);
+    queue_waiter(&small, &flow, 30);
+
+    CHECK(run_drr(&scheduler, 100) == 70);
+    CHECK(small.got == 30 && flow.deficit == 0);
+    CHECK(!drr_backlogged(&scheduler));
+    CHECK(run_drr(&scheduler, 100) == 100);
+}
+
+// A cancelled waiter is never granted, cancelling the last one takes its flow out
+static void test_cancel(void) {
+    drr_flow_t flow, other;
+    test_waiter_t first, second, third;
+
+    init_drr_scheduler(&scheduler, 100);
+    init_drr_flow(&flow);
+    init_drr_flow(&other);
+    queue_waiter(&first, &flow, 10);
+    queue_waiter(&second, &flow, 10);
+    queue_waiter(&third, &other, 10);
+
+    drr_cancel(&scheduler, &first.waiter);
+    drr_cancel(&scheduler, &first.waiter);
+    CHECK(flow.count == 1 && flow.head == &second.waiter);
+    drr_cancel(&scheduler, &third.waiter);
+    CHECK(!other.backlogged);
+
+    CHECK(run_drr(&scheduler, 100) == 90);
+    CHECK(first.grants == 0 && second.grants == 1 && third.grants == 0);
+}
+
+// A flow that used more than its allowance sits out until the debt is paid off
+static void test_overspend(void) {
+    drr_flow_t over, fair;
+    test_waiter_t spender, steady;
+
+    init_drr_scheduler(&scheduler, 100);
+    init_drr_flow(&over);
+    init_drr_flow(&fair);
+    queue_waiter(&spender, &over, 1000);
+    spender.overspend = 150;
+    queue_waiter(&steady, &fair, 1000);
+
+    CHECK(run_drr(&scheduler, 400) == 0);
+    CHECK(spender.grants == 1 && over.deficit == -50);
+    CHECK(steady.grants == 2 && steady.got == 200);
+}
+
+// The bucket starts full, refills at the rate and never holds more than the burst
+static void test_token_bucket(void) {
+    admission_config_t config = {.rate = 2, .burst = 4};
+
+    init_client_table(&clients);
+    client_t *client = find_client(&clients, "192.0.2.1", &config, 0);
+    CHECK(client != NULL);
+    for (int i = 0; i < 4; i++) {
+        CHECK(admit_request(client, &config, 0) == ADMIT_OK);
+    }
+    CHECK(admit_request(client, &config, 0) == ADMIT_RATE_LIMITED);
+
+    CHECK(admit_request(client, &config, 499) == ADMIT_RATE_LIMITED);
+    CHECK(admit_request(client, &config, 500) == ADMIT_OK);
+    CHECK(admit_request(client, &config, 500) == ADMIT_RATE_LIMITED);
+
+    int admitted = 0;
+    while (admit_request(client, &config, 60000) == ADMIT_OK) {
+        admitted++;
+    }
+    CHECK(admitted == 4);
+
+    // A rate below one per second still admits a request once a whole token has built up
+    admission_config_t slow = {.rate = 0.5};
+    client = find_client(&clients, "192.0.2.2", &slow, 0);
+    CHECK(admit_request(client, &slow, 0) == ADMIT_OK);
+    CHECK(admit_request(client, &slow, 1000) == ADMIT_RATE_LIMITED);
+    CHECK(admit_request(client, &slow, 2000) == ADMIT_OK);
+}
+
+// Requests in progress are capped per client, and such clients keep their slots
+static void test_request_cap(void) {
+    admission_config_t config = {.max_requests = 2};
+
+    init_client_table(&clients);
+    client_t *client = find_client(&clients, "2001:db8::1", &config, 0);
+    CHECK(admit_request(client, &config, 0) == ADMIT_OK);
+    CHECK(admit_request(client, &config, 0) == ADMIT_OK);
+    CHECK(admit_request(client, &config, 0) == ADMIT_TOO_MANY_REQUESTS);
+    finish_request(client);
+    CHECK(admit_request(client, &config, 0) == ADMIT_OK);
+    CHECK(find_client(&clients, "2001:db8::1", &config, 10) == client);
+
+    // Once every slot has a request in progress, a new client finds none
+    char address[INET6_ADDRSTRLEN];
+    int missing = 0;
+    for (int i = 1; i < CLIENT_TABLE_SIZE; i++) {
+        snprintf(address, sizeof(address), "10.0.%d.%d", i / 256, i % 256);
+        client_t *other = find_client(&clients, address, &config, i);
+        if (!other || other == client) {
+            missing++;
+            continue;
+        }
+        admit_request(other, &config, i);
+    }
+    CHECK(missing == 0);
+    CHECK(find_client(&clients, "10.1.0.1", &config, 1000) == NULL);
+}
+
+// Limits not listed stay off, bandwidth is in megabytes per second
+static void test_parse_admission(void) {
+    admission_config_t config;
+
+    memset(&config, 0, sizeof(config));
+    CHECK(!admission_enabled(&config));
+    CHECK(parse_admission("rate=20,burst=40,requests=8,fetches=32,bandwidth=1.5", &config) == 0);
+    CHECK(config.rate == 20 && config.burst == 40 && config.max_requests == 8 && config.max_fetches == 32);
+    CHECK(config.bandwidth == 1536 * 1024);
+    CHECK(admission_enabled(&config));
+
+    CHECK(parse_admission("rate=fast", &config) == -1);
+    CHECK(parse_admission("rate=-1", &config) == -1);
+    CHECK(parse_admission("speed=1", &config) == -1);
+    CHECK(parse_admission("rate", &config) == -1);
+}
+
+int main(void) {
+    test_fair_shares();
+    test_fetch_slots();
+    test_unused_budget();
+    test_cancel();
+    test_overspend();
+    test_token_bucket();
+    test_request_cap();
+    test_parse_admission();
+    return finish_tests("drr");
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+#include "sketch.h"
+#include "test.h"
+
+static cache_t cache;
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Stores a small 200 response under key, with a body of its own so nothing is shared
+static int add_response(const char *key) {
+    char response[256];
+    int size = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s",
+                        (int) strlen(key), key);
+    struct iovec iov = {response, size};
+
+    return add_cache_entry(&cache, key, NULL, &iov, 1, size);
+}
+
+// Counts accesses of key the way the proxy does on every lookup
+static void access_key(const char *key, int times) {
+    for (int i = 0; i < times; i++) {
+        record_cache_access(&cache, key);
+    }
+}
+
+// Counts the valid entries in segment
+static int segment_size(cache_segment_t segment) {
+    int count = 0;
+
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        count += cache.entries[i].valid && cache.entries[i].segment == segment;
+    }
+
+    return count;
+}
+
+// ============================== TESTS ==============================
+
+// Counts are exact for a few keys, saturate, and halve once the sample period is over
+static void test_frequency_sketch(void) {
+    frequency_sketch_t sketch;
+
+    init_sketch(&sketch, 100);
+    CHECK(estimate_frequency(&sketch, "never") == 0);
+    for (int i = 0; i < 3; i++) {
+        increment_sketch(&sketch, "three");
+    }
+    CHECK(estimate_frequency(&sketch, "three") == 3);
+    for (int i = 0; i < 40; i++) {
+        increment_sketch(&sketch, "hot");
+    }
+    CHECK(estimate_frequency(&sketch, "hot") == SKETCH_MAX_COUNT);
+
+    // A capacity of 1 ages after 10 additions
+    init_sketch(&sketch, 1);
+    for (int i = 0; i < 6; i++) {
+        increment_sketch(&sketch, "a");
+    }
+    for (int i = 0; i < 3; i++) {
+        increment_sketch(&sketch, "b");
+    }
+    CHECK(estimate_frequency(&sketch, "a") == 6);
+    increment_sketch(&sketch, "b");
+    CHECK(estimate_frequency(&sketch, "a") == 3);
+    CHECK(estimate_frequency(&sketch, "b") == 2);
+}
+
+// A rarely used newcomer loses against the probation victim, a popular one takes its place
+static void test_wtinylfu_admission(void) {
+    char key[64], evicted[REQUEST_SIZE + 1];
+
+    init_cache(&cache, CACHE_POLICY_WTINYLFU);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        snprintf(key, sizeof(key), "GET http://example.com:80/%d", i);
+        access_key(key, i == CACHE_SIZE - 1 ? 1 : 5);
+        CHECK(add_response(key) != -1);
+    }
+    CHECK(cache.valid_entries == CACHE_SIZE);
+    CHECK(find_invalid_entry(&cache) == -1);
+
+    // The last one added is the window's candidate, the first the probation victim
+    int newest = search_cache_hit(&cache, key, NULL);
+    CHECK(newest != -1 && cache.entries[newest].segment == SEGMENT_WINDOW);
+    CHECK(evict_cache_victim(&cache, evicted) == 0);
+    CHECK(strcmp(evicted, key) == 0);
+    CHECK(search_cache_hit(&cache, "GET http://example.com:80/0", NULL) != -1);
+
+    // A newcomer seen more often than the victim is admitted into probation
+    const char *popular = "GET http://example.com:80/popular";
+    access_key(popular, 8);
+    int index = add_response(popular);
+    CHECK(index != -1);
+    CHECK(evict_cache_victim(&cache, evicted) == 0);
+    CHECK(strcmp(evicted, "GET http://example.com:80/0") == 0);
+    CHECK(search_cache_hit(&cache, popular, NULL) == index);
+    CHECK(cache.entries[index].segment == SEGMENT_PROBATION);
+
+    // A hit in probation promotes the entry to the protected segment
+    promote_cache_entry(&cache, index);
+    CHECK(cache.entries[index].segment == SEGMENT_PROTECTED);
+}
+
+// Regression: a promotion while every protected entry is being sent demotes nothing,
+// the segment stays over capacity until an entry is released and the next hit promotes
+static void test_pinned_protected(void) {
+    char key[64];
+    int indexes[CACHE_SIZE];
+
+    init_cache(&cache, CACHE_POLICY_WTINYLFU);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        snprintf(key, sizeof(key), "GET http://example.com:80/%d", i);
+        indexes[i] = add_response(key);
+    }
+    for (int i = 0; i <= PROTECTED_SIZE; i++) {
+        pin_cache_entry(&cache, indexes[i]);
+        promote_cache_entry(&cache, indexes[i]);
+    }
+    CHECK(segment_size(SEGMENT_PROTECTED) == PROTECTED_SIZE + 1);
+
+    unpin_cache_entry(&cache, indexes[1]);
+    pin_cache_entry(&cache, indexes[PROTECTED_SIZE + 1]);
+    promote_cache_entry(&cache, indexes[PROTECTED_SIZE + 1]);
+    CHECK(cache.entries[indexes[1]].segment == SEGMENT_PROBATION);
+    CHECK(segment_size(SEGMENT_PROTECTED) == PROTECTED_SIZE + 1);
+}
+
+// Plain LRU evicts the least recently used entry whatever its frequency
+static void test_lru_eviction(void) {
+    char key[64], evicted[REQUEST_SIZE + 1];
+
+    init_cache(&cache, CACHE_POLICY_LRU);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        snprintf(key, sizeof(key), "GET http://example.com:80/%d", i);
+        CHECK(add_response(key) != -1);
+    }
+    promote_cache_entry(&cache, search_cache_hit(&cache, "GET http://example.com:80/0", NULL));
+    CHECK(evict_cache_victim(&cache, evicted) == 0);
+    CHECK(strcmp(evicted, "GET http://example.com:80/1") == 0);
+}
+
+int main(void) {
+    test_frequency_sketch();
+    test_wtinylfu_admission();
+    test_pinned_protected();
+    test_lru_eviction();
+    return finish_tests("sketch");
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+
+#include "timer.h"
+#include "test.h"
+
+// An odd tick to start from, so the levels wrap at different points than they would from zero
+#define START_MS 123456780LL
+
+static timer_wheel_t wheel;
+
+// A timer with the tick it is due and the tick it fired at, 0 until then
+typedef struct {
+    timer_node_t node;
+    unsigned long long due_tick;
+    unsigned long long fired_tick;
+    int fired;
+    int rearm_ms; // Re-arms itself this far ahead while set
+} test_timer_t;
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Notes when the timer fired, re-arming it if it is periodic
+static void on_test_timer(timer_node_t *node) {
+    test_timer_t *timer = node->data;
+    timer->fired_tick = wheel.current_tick;
+    timer->fired++;
+
+    if (timer->rearm_ms > 0) {
+        long long expires_ms = (long long) wheel.current_tick * WHEEL_TICK_MS + timer->rearm_ms;
+        timer->due_tick = expires_ms / WHEEL_TICK_MS;
+        arm_timer(&wheel, node, expires_ms);
+    }
+}
+
+// Arms timer to fire delay_ms after now_ms, a multiple of the tick so it is due exactly then
+static void arm_test_timer(test_timer_t *timer, long long now_ms, long long delay_ms) {
+    init_timer(&timer->node, on_test_timer, timer);
+    timer->due_tick = (now_ms + delay_ms) / WHEEL_TICK_MS;
+    timer->fired_tick = 0;
+    timer->fired = 0;
+    timer->rearm_ms = 0;
+    arm_timer(&wheel, &timer->node, now_ms + delay_ms);
+}
+
+// ============================== TESTS ==============================
+
+// Timers on every level cascade down and fire on their tick, not before and not after
+static void test_cascade(void) {
+    long long delays[] = {10, 50, 630, 640, 700, 41000, 60000, 2700000, 10800000, 86400000};
+    int count = sizeof(delays) / sizeof(delays[0]);
+    test_timer_t timers[sizeof(delays) / sizeof(delays[0])];
+
+    init_timer_wheel(&wheel, START_MS);
+    for (int i = 0; i < count; i++) {
+        arm_test_timer(&timers[i], START_MS, delays[i]);
+    }
+    CHECK(wheel.armed_count == count);
+
+    // Stop just short of each one first, then step onto it
+    for (int i = 0; i < count; i++) {
+        advance_timer_wheel(&wheel, START_MS + delays[i] - WHEEL_TICK_MS);
+        CHECK(timers[i].fired == 0);
+        advance_timer_wheel(&wheel, START_MS + delays[i]);
+        CHECK(timers[i].fired == 1);
+        CHECK(timers[i].fired_tick == timers[i].due_tick);
+    }
+    CHECK(wheel.armed_count == 0);
+}
+
+// A due time between ticks rounds up, so the timer never fires early
+static void test_rounds_up(void) {
+    test_timer_t timer;
+
+    init_timer_wheel(&wheel, START_MS);
+    arm_test_timer(&timer, START_MS, 15);
+    advance_timer_wheel(&wheel, START_MS + 10);
+    CHECK(timer.fired == 0);
+    advance_timer_wheel(&wheel, START_MS + 20);
+    CHECK(timer.fired == 1);
+}
+
+// Cancelled timers never fire, re-arming moves a timer instead of adding it twice
+static void test_cancel_and_rearm(void) {
+    test_timer_t cancelled, moved;
+
+    init_timer_wheel(&wheel, START_MS);
+    arm_test_timer(&cancelled, START_MS, 5000);
+    arm_test_timer(&moved, START_MS, 100);
+    arm_timer(&wheel, &moved.node, START_MS + 90000);
+    moved.due_tick = (START_MS + 90000) / WHEEL_TICK_MS;
+    CHECK(wheel.armed_count == 2);
+
+    cancel_timer(&wheel, &cancelled.node);
+    cancel_timer(&wheel, &cancelled.node);
+    CHECK(!timer_armed(&cancelled.node));
+    CHECK(wheel.armed_count == 1);
+
+    advance_timer_wheel(&wheel, START_MS + 10000);
+    CHECK(cancelled.fired == 0 && moved.fired == 0);
+    advance_timer_wheel(&wheel, START_MS + 90000);
+    CHECK(moved.fired == 1 && moved.fired_tick == moved.due_tick);
+    CHECK(!timer_armed(&moved.node));
+}
+
+// A callback re-arming its own timer keeps firing once per period across cascades
+static void test_periodic(void) {
+    test_timer_t periodic;
+
+    init_timer_wheel(&wheel, START_MS);
+    arm_test_timer(&periodic, START_MS, 1000);
+    periodic.rearm_ms = 1000;
+
+    advance_timer_wheel(&wheel, START_MS + 100000);
+    CHECK(periodic.fired == 100);
+    CHECK(periodic.fired_tick == (START_MS + 100000) / WHEEL_TICK_MS);
+    CHECK(timer_armed(&periodic.node));
+}
+
+// The loop sleeps until the nearest timer, or forever with none armed
+static void test_next_timeout(void) {
+    test_timer_t timer;
+
+    init_timer_wheel(&wheel, START_MS);
+    CHECK(next_timer_timeout(&wheel, START_MS) == -1);
+
+    arm_test_timer(&timer, START_MS, 50);
+    CHECK(next_timer_timeout(&wheel, START_MS) == 50);
+
+    // Far timers only wake the loop at the next cascade
+    cancel_timer(&wheel, &timer.node);
+    arm_test_timer(&timer, START_MS, 60000);
+    int timeout = next_timer_timeout(&wheel, START_MS);
+    CHECK(timeout > 0 && timeout <= WHEEL_SLOTS * WHEEL_TICK_MS);
+}
+
+int main(void) {
+    test_cascade();
+    test_rounds_up();
+    test_cancel_and_rearm();
+    test_periodic();
+    test_next_timeout();
+    return finish_tests("timer");
+}
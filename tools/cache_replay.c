@@ -0,0 +1,140 @@
+// Replays a recorded access log against each cache policy and compares hit ratios.
+//
+// Usage: cache_replay [-l] access-log
+//   By default every non-empty line of the log is one request key.
+//   With -l the input is htproxy's own stdout log, and requests are taken from
+//   its "GETting <host> <uri>" and "Serving <host> <uri> from cache" lines.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define LINE_SIZE (REQUEST_SIZE + 64)
+
+// Minimal response stored for every admitted key, only the key matters here
+static const char replay_response[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+
+// The cache holds full response slots, so keep it off the stack
+static cache_t cache;
+
+typedef struct {
+    unsigned long requests;
+    unsigned long hits;
+} replay_result_t;
+
+// Strips the trailing newline and, for htproxy logs, reduces the line to "<host> <uri>"
+// Returns 1 if the line holds a request key, 0 if it should be skipped
+static int parse_log_line(char *line, int htproxy_log) {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (!htproxy_log) {
+        return line[0] != '\0';
+    }
+
+    // A stale hit logs "Stale entry" followed by "GETting", so only these two lines count
+    const char *miss_prefix = "GETting ";
+    const char *hit_prefix = "Serving ";
+    const char *hit_suffix = " from cache";
+
+    if (strncmp(line, miss_prefix, strlen(miss_prefix)) == 0) {
+        memmove(line, line + strlen(miss_prefix), strlen(line) - strlen(miss_prefix) + 1);
+        return 1;
+    }
+
+    size_t len = strlen(line);
+    if (strncmp(line, hit_prefix, strlen(hit_prefix)) == 0 && len > strlen(hit_prefix) + strlen(hit_suffix) &&
+        strcmp(line + len - strlen(hit_suffix), hit_suffix) == 0) {
+        line[len - strlen(hit_suffix)] = '\0';
+        memmove(line, line + strlen(hit_prefix), strlen(line) - strlen(hit_prefix) + 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Runs the whole log through a fresh cache using the given policy
+static int replay_log(FILE *log, int htproxy_log, cache_policy_t policy, replay_result_t *result) {
+    char line[LINE_SIZE];
+
+    init_cache(&cache, policy);
+    result->requests = 0;
+    result->hits = 0;
+
+    rewind(log);
+    while (fgets(line, sizeof(line), log)) {
+        if (!parse_log_line(line, htproxy_log) || strlen(line) >= REQUEST_SIZE) {
+            continue;
+        }
+
+        // Same sequence as the proxy: record, look up, evict if full, then admit
+        result->requests++;
+        record_cache_access(&cache, line);
+
+        int index = search_cache_hit(&cache, line, NULL);
+        if (index != -1) {
+            promote_cache_entry(&cache, index);
+            result->hits++;
+            continue;
+        }
+
+        if (cache.valid_entries == CACHE_SIZE) {
+            evict_cache_victim(&cache, NULL);
+        }
+
+        struct iovec response = {(char *) replay_response, sizeof(replay_response) - 1};
+        if (add_cache_entry(&cache, line, NULL, &response, 1, response.iov_len) == -1) {
+            fprintf(stderr, "Failed to add %s to cache\n", line);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int htproxy_log = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l")) != -1) {
+        switch (opt) {
+        case 'l':
+            htproxy_log = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-l] access-log\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-l] access-log\n", argv[0]);
+        return 1;
+    }
+
+    FILE *log = fopen(argv[optind], "r");
+    if (!log) {
+        perror("fopen");
+        return 1;
+    }
+
+    cache_policy_t policies[] = {CACHE_POLICY_LRU, CACHE_POLICY_WTINYLFU};
+    int policy_count = sizeof(policies) / sizeof(policies[0]);
+
+    printf("%-10s %10s %10s %10s\n", "policy", "requests", "hits", "hit-ratio");
+    for (int i = 0; i < policy_count; i++) {
+        replay_result_t result;
+        if (replay_log(log, htproxy_log, policies[i], &result) == -1) {
+            fclose(log);
+            return 1;
+        }
+
+        double ratio = result.requests ? (double) result.hits / result.requests : 0.0;
+        printf("%-10s %10lu %10lu %9.2f%%\n", cache_policy_name(policies[i]), result.requests, result.hits,
+               ratio * 100);
+    }
+
+    fclose(log);
+    return 0;
+}
@@ -0,0 +1,652 @@
+// Replays a capture written by htproxy -w against a running proxy, with a stand-in origin
+// serving bodies of the recorded sizes, and reports hit ratio, throughput and latency.
+//
+// Usage: capture_replay -p proxy-port [-o origin-port] [-n clients] [-s speed] [-m max-requests]
+//                       [-b epoll|uring] capture-file
+//   Every distinct key of the capture becomes one URL on the stand-in origin, so the proxy
+//   sees the recorded key distribution. The origin answers with the status, body size and
+//   Cache-Control of the key's latest replayed record; every body is unique to its key.
+//   Requests go out in capture order over n connections at once (default 16), back to back,
+//   or with -s at their recorded spacing sped up by that factor.
+#define _GNU_SOURCE // strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "event.h"
+#include "http.h"
+#include "timer.h"
+
+#define DEFAULT_CLIENTS 16
+#define MAX_CLIENTS 1024
+#define RESPONSE_HEAD_SIZE 512
+#define ORIGIN_REQUEST_SIZE 4096
+#define PATTERN_SIZE (256 * 1024) // Shared filler the origin's bodies are sliced from
+#define REQUEST_TIMEOUT_MS 30000
+
+/**
+ * One distinct key of the capture, with the response the origin currently gives for it.
+ */
+typedef struct {
+    char *key;
+    int status;
+    long size;
+    int max_age;
+    int no_store;
+} replay_key_t;
+
+/**
+ * One captured request, by key index.
+ */
+typedef struct {
+    long long time_ms;
+    int key;
+    int status;
+    long size;
+    int max_age;
+    int no_store;
+} replay_request_t;
+
+/**
+ * A client connection to the proxy carrying one request.
+ */
+typedef struct {
+    io_watch_t watch;
+    iochain_t out;
+    timer_node_t timer;
+    long request; // Index into requests
+    long long started_us;
+    char request_text[256];
+    char head[RESPONSE_HEAD_SIZE]; // Response header block as read so far
+    int head_length;
+    int head_done;
+    long content_length;
+    long body_bytes;
+} replay_client_t;
+
+/**
+ * A connection the proxy opened to the stand-in origin.
+ */
+typedef struct {
+    io_watch_t watch;
+    iochain_t out;
+    char request[ORIGIN_REQUEST_SIZE];
+    int length;
+    char head[RESPONSE_HEAD_SIZE];
+    char prefix[32]; // Start of the body, unique to the key so the proxy cannot dedup across keys
+} origin_conn_t;
+
+static event_loop_t loop;
+static io_watch_t origin_listener;
+static int origin_port;
+static int proxy_port;
+static double speed;
+static char pattern[PATTERN_SIZE];
+
+static replay_key_t *keys;
+static long key_count;
+static long *key_table; // Open addressing over keys, -1 for an empty slot
+static long key_table_size;
+
+static replay_request_t *requests;
+static long request_count;
+static long next_request;
+static long long first_time_ms;
+static long long started_ms;
+static long long started_us;
+static timer_node_t pace_timer;
+
+static int client_count; // Requests in flight at most
+static int active_clients;
+
+static long completed;
+static long failed;
+static long origin_requests;
+static long long client_bytes;
+static long long origin_bytes;
+static long long *latencies_us;
+
+static void start_requests(void);
+static void on_client_connected(io_watch_t *watch, int status);
+static void on_client_read(io_watch_t *watch, const char *buffer, long length);
+static void on_client_timeout(timer_node_t *timer);
+static void on_origin_sent(io_watch_t *watch, int status);
+
+// ============================== HELPER FUNCTIONS ==============================
+
+// Monotonic clock in microseconds, the loop's millisecond clock is too coarse for hits
+static long long time_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Slot hash for the key table, the same FNV-1a the cache uses
+static unsigned long hash_key(const char *key) {
+    return hash_bytes(FNV_OFFSET_BASIS, key, strlen(key));
+}
+
+// Doubles the key table once it is half full, so probes stay short
+static int grow_key_table(void) {
+    long size = key_table_size ? key_table_size * 2 : 1024;
+    long *table = malloc(size * sizeof(long));
+    if (!table) {
+        perror("malloc");
+        return -1;
+    }
+    for (long i = 0; i < size; i++) {
+        table[i] = -1;
+    }
+    for (long k = 0; k < key_count; k++) {
+        unsigned long slot = hash_key(keys[k].key) & (size - 1);
+        while (table[slot] != -1) {
+            slot = (slot + 1) & (size - 1);
+        }
+        table[slot] = k;
+    }
+
+    free(key_table);
+    key_table = table;
+    key_table_size = size;
+    return 0;
+}
+
+// Index of a key, added on first sight
+static long intern_key(const char *key) {
+    if ((key_count + 1) * 2 > key_table_size && grow_key_table() == -1) {
+        return -1;
+    }
+
+    unsigned long slot = hash_key(key) & (key_table_size - 1);
+    while (key_table[slot] != -1) {
+        if (strcmp(keys[key_table[slot]].key, key) == 0) {
+            return key_table[slot];
+        }
+        slot = (slot + 1) & (key_table_size - 1);
+    }
+
+    // keys grows alongside the table, which is always at least twice as large
+    replay_key_t *grown = realloc(keys, key_table_size * sizeof(replay_key_t));
+    if (!grown) {
+        perror("realloc");
+        return -1;
+    }
+    keys = grown;
+    keys[key_count].key = strdup(key);
+    if (!keys[key_count].key) {
+        perror("strdup");
+        return -1;
+    }
+    key_table[slot] = key_count;
+    return key_count++;
+}
+
+// Reads every well-formed line of the capture, up to max_requests if that is positive
+static int load_capture(const char *path, long max_requests) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("fopen");
+        return -1;
+    }
+
+    char line[CAPTURE_LINE_SIZE];
+    long capacity = 0;
+    long skipped = 0;
+    while (fgets(line, sizeof(line), file) && (max_requests <= 0 || request_count < max_requests)) {
+        capture_record_t record;
+        if (parse_capture_record(line, &record) == -1) {
+            skipped++;
+            continue;
+        }
+
+        if (request_count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            replay_request_t *grown = realloc(requests, capacity * sizeof(replay_request_t));
+            if (!grown) {
+                perror("realloc");
+                fclose(file);
+                return -1;
+            }
+            requests = grown;
+        }
+
+        long key = intern_key(record.key);
+        if (key == -1) {
+            fclose(file);
+            return -1;
+        }
+
+        // A bodiless status would leave the proxy waiting for the recorded size, replay those as 200
+        replay_request_t *request = &requests[request_count++];
+        request->time_ms = record.time_ms;
+        request->key = key;
+        request->status = record.status < 200 || record.status == 204 || record.status == 304 ? 200 : record.status;
+        request->size = record.size;
+        request->max_age = record.max_age;
+        request->no_store = record.no_store;
+    }
+
+    fclose(file);
+    if (skipped > 0) {
+        fprintf(stderr, "Skipped %ld malformed lines\n", skipped);
+    }
+    return 0;
+}
+
+static int open_origin_listener(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(origin_port);
+    socklen_t address_length = sizeof(address);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(fd, 128) == -1 ||
+        getsockname(fd, (struct sockaddr *) &address, &address_length) == -1) {
+        perror("origin listener");
+        close(fd);
+        return -1;
+    }
+
+    origin_port = ntohs(address.sin_port);
+    return fd;
+}
+
+static int compare_us(const void *a, const void *b) {
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile_ms(const long long *sorted, long count, double fraction) {
+    long rank = (long) (fraction * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[rank - 1] / 1000.0;
+}
+
+static void print_report(void) {
+    double seconds = (time_us() - started_us) / 1000000.0;
+    long hits = completed > origin_requests ? completed - origin_requests : 0;
+    long long hit_bytes = client_bytes > origin_bytes ? client_bytes - origin_bytes : 0;
+
+    printf("requests     %ld (%ld keys), %ld completed, %ld failed\n", request_count, key_count, completed, failed);
+    printf("origin       %ld requests, %.1f MB\n", origin_requests, origin_bytes / 1048576.0);
+    printf("hit ratio    %.2f%% of requests, %.2f%% of bytes\n", completed ? 100.0 * hits / completed : 0.0,
+           client_bytes ? 100.0 * hit_bytes / client_bytes : 0.0);
+    printf("throughput   %.1f requests/s, %.1f MB/s over %.3f s\n", seconds > 0 ? completed / seconds : 0.0,
+           seconds > 0 ? client_bytes / 1048576.0 / seconds : 0.0, seconds);
+
+    if (completed > 0) {
+        qsort(latencies_us, completed, sizeof(long long), compare_us);
+        printf("latency ms   p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", percentile_ms(latencies_us, completed, 0.50),
+               percentile_ms(latencies_us, completed, 0.90), percentile_ms(latencies_us, completed, 0.99),
+               latencies_us[completed - 1] / 1000.0);
+    }
+    fflush(stdout);
+}
+
+static void free_client(void *data) {
+    replay_client_t *client = data;
+    free_iochain(&client->out);
+    free(client);
+}
+
+// Ends the client's request, counting it as completed or failed, and starts the next one
+static void finish_client(replay_client_t *client, int ok) {
+    cancel_timer(&loop.timers, &client->timer);
+    close_io_watch(&client->watch);
+    defer_release(&loop, free_client, client);
+    active_clients--;
+
+    if (ok) {
+        latencies_us[completed++] = time_us() - client->started_us;
+        client_bytes += client->body_bytes;
+    } else {
+        failed++;
+    }
+
+    if (completed + failed == request_count) {
+        print_report();
+        exit(failed > 0 ? 2 : 0);
+    }
+    start_requests();
+}
+
+// Connects a new client to the proxy for the request, the key's URL on the stand-in origin
+static void start_client(long index) {
+    replay_request_t *request = &requests[index];
+    replay_key_t *key = &keys[request->key];
+
+    // The origin answers every key with what its latest replayed record says
+    key->status = request->status;
+    key->size = request->size;
+    key->max_age = request->max_age;
+    key->no_store = request->no_store;
+
+    replay_client_t *client = calloc(1, sizeof(replay_client_t));
+    if (!client) {
+        perror("calloc");
+        exit(1);
+    }
+    client->request = index;
+    client->started_us = time_us();
+    client->content_length = -1;
+    init_iochain(&client->out);
+    init_timer(&client->timer, on_client_timeout, client);
+    init_io_watch(&client->watch, &loop, socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), client);
+    active_clients++;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(proxy_port);
+
+    int length = snprintf(client->request_text, sizeof(client->request_text),
+                          "GET http://127.0.0.1:%d/k%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\nConnection: close\r\n\r\n",
+                          origin_port, request->key, origin_port);
+    arm_timer(&loop.timers, &client->timer, current_time_ms() + REQUEST_TIMEOUT_MS);
+    if (client->watch.fd == -1 || append_iochain(&client->out, client->request_text, length) == -1 ||
+        start_connect(&client->watch, (struct sockaddr *) &address, sizeof(address), on_client_connected) == -1) {
+        perror("connect to proxy");
+        finish_client(client, 0);
+    }
+}
+
+// Starts requests up to the client limit, holding back those not yet due under -s
+static void start_requests(void) {
+    while (active_clients < client_count && next_request < request_count) {
+        if (speed > 0) {
+            long long due = started_ms + (long long) ((requests[next_request].time_ms - first_time_ms) / speed);
+            if (due > current_time_ms()) {
+                if (!timer_armed(&pace_timer)) {
+                    arm_timer(&loop.timers, &pace_timer, due);
+                }
+                return;
+            }
+        }
+
+        start_client(next_request++);
+    }
+}
+
+// Queues the response for the key named in the request line, a unique prefix then shared filler
+static int queue_origin_response(origin_conn_t *conn) {
+    // The proxy forwards the absolute form, http://host:port/k<index>
+    const char *target = strchr(conn->request, ' ');
+    if (target && strncmp(target + 1, "http://", strlen("http://")) == 0) {
+        target = strchr(target + 1 + strlen("http://"), '/');
+    } else if (target) {
+        target++;
+    }
+    int index = -1;
+    if (!target || sscanf(target, "/k%d ", &index) != 1 || index < 0 || index >= key_count) {
+        fprintf(stderr, "Origin got an unknown request\n");
+        return -1;
+    }
+    replay_key_t *key = &keys[index];
+
+    char cache_control[64] = "";
+    if (key->no_store) {
+        snprintf(cache_control, sizeof(cache_control), "Cache-Control: no-store\r\n");
+    } else if (key->max_age >= 0) {
+        snprintf(cache_control, sizeof(cache_control), "Cache-Control: max-age=%d\r\n", key->max_age);
+    }
+    int head_length = snprintf(conn->head, sizeof(conn->head),
+                               "HTTP/1.1 %d Replayed\r\nContent-Type: application/octet-stream\r\n"
+                               "Content-Length: %ld\r\n%sConnection: close\r\n\r\n",
+                               key->status, key->size, cache_control);
+    int prefix_length = snprintf(conn->prefix, sizeof(conn->prefix), "k%d\n", index);
+    if (prefix_length > key->size) {
+        prefix_length = key->size;
+    }
+
+    if (append_iochain(&conn->out, conn->head, head_length) == -1 ||
+        append_iochain(&conn->out, conn->prefix, prefix_length) == -1) {
+        return -1;
+    }
+    for (long left = key->size - prefix_length; left > 0; left -= PATTERN_SIZE) {
+        if (append_iochain(&conn->out, pattern, left < PATTERN_SIZE ? left : PATTERN_SIZE) == -1) {
+            return -1;
+        }
+    }
+
+    origin_requests++;
+    origin_bytes += key->size;
+    return 0;
+}
+
+static void free_origin_conn(void *data) {
+    origin_conn_t *conn = data;
+    free_iochain(&conn->out);
+    free(conn);
+}
+
+static void close_origin_conn(origin_conn_t *conn) {
+    close_io_watch(&conn->watch);
+    defer_release(&loop, free_origin_conn, conn);
+}
+
+// ============================== EVENT CALLBACKS ==============================
+
+static void on_pace(timer_node_t *timer) {
+    start_requests();
+}
+
+static void on_client_timeout(timer_node_t *timer) {
+    replay_client_t *client = timer->data;
+    fprintf(stderr, "Request %ld timed out\n", client->request);
+    finish_client(client, 0);
+}
+
+static void on_client_sent(io_watch_t *watch, int status) {
+    if (status < 0) {
+        finish_client(watch->data, 0);
+    }
+}
+
+static void on_client_connected(io_watch_t *watch, int status) {
+    if (status < 0 || start_write(watch, &((replay_client_t *) watch->data)->out, on_client_sent) == -1 ||
+        start_read(watch, on_client_read) == -1) {
+        finish_client(watch->data, 0);
+    }
+}
+
+// Reads the response header block, then counts body bytes until Content-Length is reached
+static void on_client_read(io_watch_t *watch, const char *buffer, long length) {
+    replay_client_t *client = watch->data;
+
+    if (length <= 0) {
+        finish_client(client, client->head_done && client->content_length == -1);
+        return;
+    }
+
+    if (!client->head_done) {
+        int room = RESPONSE_HEAD_SIZE - 1 - client->head_length;
+        int taken = length < room ? length : room;
+        memcpy(client->head + client->head_length, buffer, taken);
+        client->head_length += taken;
+        client->head[client->head_length] = '\0';
+
+        char *end = strstr(client->head, "\r\n\r\n");
+        if (!end) {
+            if (client->head_length == RESPONSE_HEAD_SIZE - 1) {
+                fprintf(stderr, "Response header block too large\n");
+                finish_client(client, 0);
+            }
+            return;
+        }
+
+        // A server error the capture did not have means the replay itself went wrong
+        int status = 0;
+        sscanf(client->head, "HTTP/%*s %d", &status);
+        if (status == 0 || (status >= 500 && status != requests[client->request].status)) {
+            fprintf(stderr, "Request %ld got status %d\n", client->request, status);
+            finish_client(client, 0);
+            return;
+        }
+
+        client->head_done = 1;
+        int head_size = end + 4 - client->head;
+        const char *content_length = strcasestr(client->head, "\r\nContent-Length:");
+        if (content_length && content_length < end) {
+            client->content_length = atol(content_length + strlen("\r\nContent-Length:"));
+        }
+        client->body_bytes = client->head_length - head_size;
+        length -= taken;
+        buffer += taken;
+    }
+    client->body_bytes += length;
+
+    if (client->content_length != -1 && client->body_bytes >= client->content_length) {
+        finish_client(client, 1);
+    }
+}
+
+// Collects the proxy's request to the origin and answers once its header block is in
+static void on_origin_read(io_watch_t *watch, const char *buffer, long length) {
+    origin_conn_t *conn = watch->data;
+
+    if (length <= 0) {
+        close_origin_conn(conn);
+        return;
+    }
+
+    int taken = length < ORIGIN_REQUEST_SIZE - 1 - conn->length ? length : ORIGIN_REQUEST_SIZE - 1 - conn->length;
+    memcpy(conn->request + conn->length, buffer, taken);
+    conn->length += taken;
+    conn->request[conn->length] = '\0';
+    if (!strstr(conn->request, "\r\n\r\n")) {
+        if (conn->length == ORIGIN_REQUEST_SIZE - 1) {
+            close_origin_conn(conn);
+        }
+        return;
+    }
+
+    stop_read(&conn->watch);
+    if (queue_origin_response(conn) == -1 || start_write(&conn->watch, &conn->out, on_origin_sent) == -1) {
+        close_origin_conn(conn);
+    }
+}
+
+// The response is out, the origin closes like an HTTP/1.0 server
+static void on_origin_sent(io_watch_t *watch, int status) {
+    close_origin_conn(watch->data);
+}
+
+static void on_origin_accept(io_watch_t *watch, int fd) {
+    origin_conn_t *conn = calloc(1, sizeof(origin_conn_t));
+    if (!conn) {
+        perror("calloc");
+        close(fd);
+        return;
+    }
+
+    init_iochain(&conn->out);
+    init_io_watch(&conn->watch, &loop, fd, conn);
+    if (start_read(&conn->watch, on_origin_read) == -1) {
+        close_origin_conn(conn);
+    }
+}
+
+// ============================== FUNCTION IMPLEMENTATIONS ==============================
+
+int main(int argc, char *argv[]) {
+    const char *usage = "Usage: %s -p proxy-port [-o origin-port] [-n clients] [-s speed] [-m max-requests] "
+                        "[-b epoll|uring] capture-file\n";
+    event_backend_t backend = EVENT_BACKEND_EPOLL;
+    long max_requests = 0;
+    int opt;
+
+    client_count = DEFAULT_CLIENTS;
+    while ((opt = getopt(argc, argv, "p:o:n:s:m:b:")) != -1) {
+        switch (opt) {
+        case 'p':
+            proxy_port = atoi(optarg);
+            break;
+        case 'o':
+            origin_port = atoi(optarg);
+            break;
+        case 'n':
+            client_count = atoi(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'm':
+            max_requests = atol(optarg);
+            break;
+        case 'b':
+            if (parse_event_backend(optarg, &backend) == -1) {
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || proxy_port <= 0 || client_count < 1 || client_count > MAX_CLIENTS || speed < 0) {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    if (load_capture(argv[optind], max_requests) == -1) {
+        return 1;
+    }
+    if (request_count == 0) {
+        fprintf(stderr, "No requests in %s\n", argv[optind]);
+        return 1;
+    }
+    latencies_us = malloc(request_count * sizeof(long long));
+    if (!latencies_us) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < PATTERN_SIZE; i++) {
+        pattern[i] = (char) ((i * 7919) % 251);
+    }
+
+    if (init_event_loop(&loop, backend) == -1) {
+        return 1;
+    }
+    int listener_fd = open_origin_listener();
+    if (listener_fd == -1) {
+        return 1;
+    }
+    init_io_watch(&origin_listener, &loop, listener_fd, NULL);
+    if (start_accept(&origin_listener, on_origin_accept) == -1) {
+        return 1;
+    }
+
+    init_timer(&pace_timer, on_pace, NULL);
+
+    printf("Replaying %ld requests over %ld keys through 127.0.0.1:%d, origin on 127.0.0.1:%d\n", request_count,
+           key_count, proxy_port, origin_port);
+    fflush(stdout);
+
+    first_time_ms = requests[0].time_ms;
+    started_ms = current_time_ms();
+    started_us = time_us();
+    start_requests();
+    run_event_loop(&loop);
+    return 0;
+}
@@ -0,0 +1,247 @@
+// Summarizes a trace file written by htproxy -x: how long sampled requests spent in each stage.
+//
+// Usage: trace_summary [-n slowest] trace-file
+//   Prints the request counts by cache result, latency percentiles per stage, and the
+//   slowest requests with the stage that took longest in each.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "trace.h"
+
+/**
+ * A span between two stages. Client-send runs from the last stage reached before the
+ * close, so it covers the send of a hit as well as the tail of a miss.
+ */
+typedef struct {
+    const char *name;
+    int from;
+    int to;
+} span_t;
+
+#define LAST_STAGE_BEFORE_CLOSE -1
+
+static const span_t spans[] = {
+    {"request", TRACE_ACCEPTED, TRACE_REQUEST_READ},
+    {"queued", TRACE_REQUEST_READ, TRACE_FETCH_STARTED},
+    {"resolve", TRACE_FETCH_STARTED, TRACE_RESOLVED},
+    {"connect", TRACE_RESOLVED, TRACE_CONNECTED},
+    {"send-request", TRACE_CONNECTED, TRACE_REQUEST_SENT},
+    {"first-byte", TRACE_REQUEST_SENT, TRACE_FIRST_BYTE},
+    {"response", TRACE_FIRST_BYTE, TRACE_RESPONSE_READ},
+    {"client-send", LAST_STAGE_BEFORE_CLOSE, TRACE_CLOSED},
+    {"total", TRACE_ACCEPTED, TRACE_CLOSED},
+};
+#define SPAN_COUNT (int) (sizeof(spans) / sizeof(spans[0]))
+#define TOTAL_SPAN (SPAN_COUNT - 1)
+
+static const char *cache_result_names[] = {"uncached", "hit", "miss", "stale"};
+
+// Reads every whole record after the header, a record cut short at the end is ignored
+static trace_record_t *read_records(int fd, long *count) {
+    long capacity = 1024;
+    trace_record_t *records = malloc(capacity * sizeof(trace_record_t));
+    if (!records) {
+        perror("malloc");
+        return NULL;
+    }
+
+    *count = 0;
+    for (;;) {
+        if (*count == capacity) {
+            capacity *= 2;
+            trace_record_t *grown = realloc(records, capacity * sizeof(trace_record_t));
+            if (!grown) {
+                perror("realloc");
+                free(records);
+                return NULL;
+            }
+            records = grown;
+        }
+
+        size_t filled = 0;
+        while (filled < sizeof(trace_record_t)) {
+            ssize_t n = read(fd, (char *) &records[*count] + filled, sizeof(trace_record_t) - filled);
+            if (n == -1) {
+                perror("read");
+                free(records);
+                return NULL;
+            }
+            if (n == 0) {
+                return records;
+            }
+            filled += n;
+        }
+        (*count)++;
+    }
+}
+
+// Length of a span in microseconds, or -1 if the request did not pass both of its stages
+static long long span_us(const trace_record_t *record, const span_t *span) {
+    int from = span->from;
+
+    if (from == LAST_STAGE_BEFORE_CLOSE) {
+        for (from = TRACE_CLOSED - 1; from >= 0 && record->stage_us[from] == TRACE_NOT_REACHED; from--) {
+        }
+        if (from < 0) {
+            return -1;
+        }
+    }
+    if (record->stage_us[from] == TRACE_NOT_REACHED || record->stage_us[span->to] == TRACE_NOT_REACHED) {
+        return -1;
+    }
+    return (long long) record->stage_us[span->to] - record->stage_us[from];
+}
+
+static int compare_us(const void *a, const void *b) {
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile_ms(const long long *sorted, long count, double fraction) {
+    long rank = (long) (fraction * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[rank - 1] / 1000.0;
+}
+
+static void print_span_table(const trace_record_t *records, long count) {
+    long long *values = malloc((count > 0 ? count : 1) * sizeof(long long));
+    if (!values) {
+        perror("malloc");
+        return;
+    }
+
+    printf("%-13s %8s %10s %10s %10s %10s   (ms)\n", "stage", "count", "p50", "p90", "p99", "max");
+    for (int s = 0; s < SPAN_COUNT; s++) {
+        long n = 0;
+        for (long i = 0; i < count; i++) {
+            long long us = span_us(&records[i], &spans[s]);
+            if (us >= 0) {
+                values[n++] = us;
+            }
+        }
+        if (n == 0) {
+            printf("%-13s %8d %10s %10s %10s %10s\n", spans[s].name, 0, "-", "-", "-", "-");
+            continue;
+        }
+
+        qsort(values, n, sizeof(long long), compare_us);
+        printf("%-13s %8ld %10.3f %10.3f %10.3f %10.3f\n", spans[s].name, n, percentile_ms(values, n, 0.50),
+               percentile_ms(values, n, 0.90), percentile_ms(values, n, 0.99), values[n - 1] / 1000.0);
+    }
+
+    free(values);
+}
+
+// Lists the requests with the longest total time, each with the stage that dominated it
+static void print_slowest(const trace_record_t *records, long count, int slowest) {
+    int *shown = calloc(count > 0 ? count : 1, sizeof(int));
+    if (!shown) {
+        perror("calloc");
+        return;
+    }
+
+    printf("\n%-10s %10s %6s %-8s %-13s %10s\n", "request", "total-ms", "status", "cache", "slowest-stage",
+           "stage-ms");
+    for (int k = 0; k < slowest; k++) {
+        long worst = -1;
+        for (long i = 0; i < count; i++) {
+            long long us = span_us(&records[i], &spans[TOTAL_SPAN]);
+            if (!shown[i] && us >= 0 && (worst == -1 || us > span_us(&records[worst], &spans[TOTAL_SPAN]))) {
+                worst = i;
+            }
+        }
+        if (worst == -1) {
+            break;
+        }
+        shown[worst] = 1;
+
+        const trace_record_t *record = &records[worst];
+        int stage = -1;
+        long long stage_max = -1;
+        for (int s = 0; s < TOTAL_SPAN; s++) {
+            long long us = span_us(record, &spans[s]);
+            if (us > stage_max) {
+                stage_max = us;
+                stage = s;
+            }
+        }
+
+        const char *cache = record->tunnel ? "tunnel" : cache_result_names[record->cache_result & 3];
+        printf("%-10llu %10.3f %6u %-8s %-13s %10.3f\n", (unsigned long long) record->request_id,
+               span_us(record, &spans[TOTAL_SPAN]) / 1000.0, record->status, cache,
+               stage == -1 ? "-" : spans[stage].name, stage_max / 1000.0);
+    }
+
+    free(shown);
+}
+
+int main(int argc, char *argv[]) {
+    int slowest = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            slowest = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n slowest] trace-file\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-n slowest] trace-file\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return 1;
+    }
+    if (read_trace_header(fd) == -1) {
+        close(fd);
+        return 1;
+    }
+
+    long count;
+    trace_record_t *records = read_records(fd, &count);
+    close(fd);
+    if (!records) {
+        return 1;
+    }
+
+    // Counts by cache result, tunnels apart
+    long by_result[4] = {0, 0, 0, 0};
+    long tunnels = 0;
+    long errors = 0;
+    for (long i = 0; i < count; i++) {
+        if (records[i].tunnel) {
+            tunnels++;
+        } else {
+            by_result[records[i].cache_result & 3]++;
+        }
+        if (records[i].status == 0 || records[i].status >= 500) {
+            errors++;
+        }
+    }
+    printf("%ld requests: %ld hits, %ld misses, %ld stale, %ld uncached, %ld tunnels, %ld failed or 5xx\n\n", count,
+           by_result[TRACE_CACHE_HIT], by_result[TRACE_CACHE_MISS], by_result[TRACE_CACHE_STALE],
+           by_result[TRACE_CACHE_NONE], tunnels, errors);
+
+    print_span_table(records, count);
+    if (slowest > 0) {
+        print_slowest(records, count, slowest);
+    }
+
+    free(records);
+    return 0;
+}